@@ -171,6 +171,12 @@ ln_addAnnotOp(ln_annot *annot, ln_annot_opcode opc, es_str_t *name, es_str_t *va
 	node->opc = opc;
 	node->name = name;
 	node->value = value;
+	/* terminate strings now, so that they are read-only at runtime */
+	if(ln_es_str2cstr(&node->name) == NULL
+	   || (value != NULL && ln_es_str2cstr(&node->value) == NULL)) {
+		free(node);
+		goto done;
+	}
 
 	if(annot->oproot != NULL) {
 		node->next = annot->oproot;
@@ -192,16 +198,20 @@ ln_annotateEventWithTag(ln_ctx ctx, struct json_object *json, es_str_t *tag)
 	ln_annot *annot;
 	ln_annot_op *op;
 	struct json_object *field;
-	char *cstr;
 
 	if (NULL == (annot = ln_findAnnot(ctx->pas, tag)))
 		goto done;
 	for(op = annot->oproot ; op != NULL ; op = op->next) {
 		if(op->opc == ln_annot_ADD) {
-			CHKN(cstr = ln_es_str2cstr(&op->value));
-			CHKN(field = json_object_new_string(cstr));
-			CHKN(cstr = ln_es_str2cstr(&op->name));
-			json_object_object_add(json, cstr, field);
+			/* strings were terminated on load, see ln_addAnnotOp() */
+			if(op->value == NULL) {
+				CHKN(field = json_object_new_string(""));
+			} else {
+				CHKN(field = json_object_new_string_len(
+					(const char*) es_getBufAddr(op->value), es_strlen(op->value)));
+			}
+			json_object_object_add(json,
+				(const char*) es_getBufAddr(op->name), field);
 		} else {
 			// TODO: implement
 		}
@@ -237,3 +247,113 @@ ln_annotate(ln_ctx ctx, struct json_object *json, struct json_object *tagbucket)
 
 done:	return r;
 }
+
+
+/* add a field to a resolved annotation under construction. As with
+ * json_object_object_add(), a field that already exists keeps its
+ * position, but gets the new value.
+ */
+static int
+compileAnnotAdd(struct ln_annot_field_s **fields, int *nfields, ln_annot_op *op)
+{
+	int r = 0;
+	struct ln_annot_field_s *f;
+	const char *const name = (const char*) es_getBufAddr(op->name);
+	int i;
+
+	for(i = 0 ; i < *nfields && strcmp((*fields)[i].name, name) ; ++i)
+		; /* just search */
+	if(i == *nfields) {
+		CHKN(f = realloc(*fields, (*nfields + 1) * sizeof(struct ln_annot_field_s)));
+		*fields = f;
+		++*nfields;
+	}
+	f = *fields + i;
+	f->name = name;
+	/* strings were terminated on load, see ln_addAnnotOp() */
+	if(op->value == NULL) {
+		f->value = "";
+		f->lenValue = 0;
+	} else {
+		f->value = (const char*) es_getBufAddr(op->value);
+		f->lenValue = es_strlen(op->value);
+	}
+done:	return r;
+}
+
+
+int
+ln_compileAnnot(ln_annotSet *as, struct json_object *tagbucket, ln_annotFields **fields)
+{
+	int r = 0;
+	struct ln_annot_field_s *tmp = NULL;
+	int ntmp = 0;
+	ln_annotFields *res = NULL;
+	ln_annot *annot;
+	ln_annot_op *op;
+	struct json_object *tagObj;
+	const char *tagCstr;
+	es_str_t *tag;
+	size_t size;
+	char *pos;
+	int i;
+
+	*fields = NULL;
+	if(as->aroot == NULL)
+		goto done;
+
+	/* same order as ln_annotate() */
+	for (i = json_object_array_length(tagbucket) - 1; i >= 0; i--) {
+		CHKN(tagObj = json_object_array_get_idx(tagbucket, i));
+		CHKN(tagCstr = json_object_get_string(tagObj));
+		CHKN(tag = es_newStrFromCStr(tagCstr, strlen(tagCstr)));
+		annot = ln_findAnnot(as, tag);
+		es_deleteStr(tag);
+		if(annot == NULL)
+			continue;
+		for(op = annot->oproot ; op != NULL ; op = op->next) {
+			if(op->opc == ln_annot_ADD)
+				CHKR(compileAnnotAdd(&tmp, &ntmp, op));
+		}
+	}
+	if(ntmp == 0)
+		goto done;
+
+	size = sizeof(ln_annotFields) + ntmp * sizeof(struct ln_annot_field_s);
+	for(i = 0 ; i < ntmp ; ++i)
+		size += strlen(tmp[i].name) + 1 + tmp[i].lenValue + 1;
+	CHKN(res = malloc(size));
+	res->nfields = ntmp;
+	pos = (char*) (res->fields + ntmp);
+	for(i = 0 ; i < ntmp ; ++i) {
+		const size_t lenName = strlen(tmp[i].name);
+		memcpy(pos, tmp[i].name, lenName + 1);
+		res->fields[i].name = pos;
+		pos += lenName + 1;
+		memcpy(pos, tmp[i].value, tmp[i].lenValue);
+		pos[tmp[i].lenValue] = '\0';
+		res->fields[i].value = pos;
+		res->fields[i].lenValue = tmp[i].lenValue;
+		pos += tmp[i].lenValue + 1;
+	}
+	*fields = res;
+
+done:
+	free(tmp);
+	return r;
+}
+
+
+int
+ln_annotateFields(struct json_object *json, const ln_annotFields *fields)
+{
+	int r = 0;
+	struct json_object *field;
+
+	for(int i = 0 ; i < fields->nfields ; ++i) {
+		CHKN(field = json_object_new_string_len(fields->fields[i].value,
+			fields->fields[i].lenValue));
+		json_object_object_add(json, fields->fields[i].name, field);
+	}
+done:	return r;
+}
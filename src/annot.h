@@ -56,9 +56,32 @@ struct ln_annot_s {
 	ln_annot_op *oproot;
 };
 
+/**
+ * A field added by annotation.
+ */
+struct ln_annot_field_s {
+	const char *name;
+	const char *value;
+	size_t lenValue;
+};
+
+/**
+ * The annotation of a terminal pdag node, resolved at load time by
+ * ln_compileAnnot(). It holds the fields to add to an event with the
+ * node's tags, in the order and with the values ln_annotate() would
+ * produce. Every name is contained only once. Strings are stored
+ * inside the same memory block, so the object is freed with free().
+ * It is never modified after creation and thus may be shared between
+ * threads.
+ */
+typedef struct ln_annotFields_s {
+	int nfields;
+	struct ln_annot_field_s fields[];
+} ln_annotFields;
+
 /**
  * annotation set object
- * 
+ *
  * Note: we do not (yet) use a hash table. However, performance should
  * be gained by pre-processing rules so that tags directly point into
  * the annotation. This is even faster than hash table access.
@@ -169,4 +192,29 @@ int ln_addAnnotOp(ln_annot *anot, ln_annot_opcode opc, es_str_t *name, es_str_t
  */
 int ln_annotate(ln_ctx ctx, struct json_object *json, struct json_object *tags);
 
+
+/**
+ * Resolve the annotations for a tag bucket.
+ * This does at load time what ln_annotate() does for each event.
+ * @memberof ln_annot
+ *
+ * @param[in] as annotation set
+ * @param[in] tagbucket tags of a terminal pdag node
+ * @param[out] fields resolved annotation, NULL if no annotation
+ * 		applies to the tags
+ * @returns 0 on success, something else otherwise
+ */
+int ln_compileAnnot(ln_annotSet *as, struct json_object *tagbucket, ln_annotFields **fields);
+
+
+/**
+ * Annotate an event with a resolved annotation.
+ * @memberof ln_annot
+ *
+ * @param[in] event event to annotate (updated with anotations on exit)
+ * @param[in] fields annotation created by ln_compileAnnot()
+ * @returns 0 on success, something else otherwise
+ */
+int ln_annotateFields(struct json_object *json, const ln_annotFields *fields);
+
 #endif /* #ifndef LOGNORM_ANNOT_H_INCLUDED */
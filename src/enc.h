@@ -36,4 +36,17 @@ int ln_fmtEventToCSV(struct json_object *json, es_str_t **str, es_str_t *extraDa
 
 int ln_fmtEventToXML(struct json_object *json, es_str_t **str);
 
+/* The *Buf variants append the encoded event to an existing string
+ * instead of creating a new one. So the caller can keep a single
+ * output buffer, empty it with es_emptyStr() after each event, and
+ * write it out directly (es_getBufAddr(), es_strlen()). This avoids
+ * two memory allocations and a copy per event.
+ * @return 0 on success, something else otherwise
+ */
+int ln_fmtEventToRFC5424Buf(struct json_object *json, es_str_t **str);
+
+int ln_fmtEventToCSVBuf(struct json_object *json, es_str_t **str, es_str_t *extraData);
+
+int ln_fmtEventToXMLBuf(struct json_object *json, es_str_t **str);
+
 #endif /* LIBLOGNORM_ENC_H_INCLUDED */
@@ -60,12 +60,22 @@ static char hexdigit[16] =
  * byte-by-byte basis, which simply is incorrect.
  * rgerhards, 2010-11-09
  */
+static inline int
+csvNeedsEscape(const unsigned char c)
+{
+	return !((c >= 0x23 && c <= 0x5b)
+		 || (c >= 0x5d /* && c <= 0x10FFFF*/)
+		 || c == 0x20 || c == 0x21);
+}
+
+/* runs of characters that need no escaping are copied as a block */
 static int
-ln_addValue_CSV(const char *buf, es_str_t **str)
+ln_addValue_CSV(const char *const buf, const size_t len, es_str_t **str)
 {
-	int r;
+	int r = 0;
 	unsigned char c;
-	es_size_t i;
+	size_t i;
+	size_t run = 0; /* start of current run of unescaped characters */
 	char numbuf[4];
 	int j;
 
@@ -73,57 +83,57 @@ ln_addValue_CSV(const char *buf, es_str_t **str)
 	assert(*str != NULL);
 	assert(buf != NULL); 
 
-	for(i = 0; i < strlen(buf); i++) {
+	for(i = 0; i < len; i++) {
 		c = buf[i];
-		if((c >= 0x23 && c <= 0x5b)
-		   || (c >= 0x5d /* && c <= 0x10FFFF*/)
-		   || c == 0x20 || c == 0x21) {
-			/* no need to escape */
-			es_addChar(str, c);
-		} else {
-			/* we must escape, try RFC4627-defined special sequences first */
-			switch(c) {
-			case '\0':
-				es_addBuf(str, "\\u0000", 6);
-				break;
-			case '\"':
-				es_addBuf(str, "\\\"", 2);
-				break;
-			case '/':
-				es_addBuf(str, "\\/", 2);
-				break;
-			case '\\':
-				es_addBuf(str, "\\\\", 2);
-				break;
-			case '\010':
-				es_addBuf(str, "\\b", 2);
-				break;
-			case '\014':
-				es_addBuf(str, "\\f", 2);
-				break;
-			case '\n':
-				es_addBuf(str, "\\n", 2);
-				break;
-			case '\r':
-				es_addBuf(str, "\\r", 2);
-				break;
-			case '\t':
-				es_addBuf(str, "\\t", 2);
-				break;
-			default:
-				/* TODO : proper Unicode encoding (see header comment) */
-				for(j = 0 ; j < 4 ; ++j) {
-					numbuf[3-j] = hexdigit[c % 16];
-					c = c / 16;
-				}
-				es_addBuf(str, "\\u", 2);
-				es_addBuf(str, numbuf, 4);
-				break;
+		if(!csvNeedsEscape(c))
+			continue;
+		if(i > run)
+			CHKR(es_addBuf(str, buf + run, i - run));
+		run = i + 1;
+		/* we must escape, try RFC4627-defined special sequences first */
+		switch(c) {
+		case '\0':
+			CHKR(es_addBuf(str, "\\u0000", 6));
+			break;
+		case '\"':
+			CHKR(es_addBuf(str, "\\\"", 2));
+			break;
+		case '/':
+			CHKR(es_addBuf(str, "\\/", 2));
+			break;
+		case '\\':
+			CHKR(es_addBuf(str, "\\\\", 2));
+			break;
+		case '\010':
+			CHKR(es_addBuf(str, "\\b", 2));
+			break;
+		case '\014':
+			CHKR(es_addBuf(str, "\\f", 2));
+			break;
+		case '\n':
+			CHKR(es_addBuf(str, "\\n", 2));
+			break;
+		case '\r':
+			CHKR(es_addBuf(str, "\\r", 2));
+			break;
+		case '\t':
+			CHKR(es_addBuf(str, "\\t", 2));
+			break;
+		default:
+			/* TODO : proper Unicode encoding (see header comment) */
+			for(j = 0 ; j < 4 ; ++j) {
+				numbuf[3-j] = hexdigit[c % 16];
+				c = c / 16;
 			}
+			CHKR(es_addBuf(str, "\\u", 2));
+			CHKR(es_addBuf(str, numbuf, 4));
+			break;
 		}
 	}
-	r = 0;
+	if(i > run)
+		CHKR(es_addBuf(str, buf + run, i - run));
 
+done:
 	return r;
 }
 
@@ -133,8 +143,9 @@ ln_addField_CSV(struct json_object *field, es_str_t **str)
 {
 	int r, i;
 	struct json_object *obj;
-	int needComma;
+	int needComma = 0;
 	const char *value;
+	size_t lenValue;
 	
 	assert(field != NULL);
 	assert(str != NULL);
@@ -144,20 +155,21 @@ ln_addField_CSV(struct json_object *field, es_str_t **str)
 	case json_type_array:
 		CHKR(es_addChar(str, '['));
 		for (i = json_object_array_length(field) - 1; i >= 0; i--) {
-			if(needComma)
-				es_addChar(str, ',');
-			else
+			if(needComma) {
+				CHKR(es_addChar(str, ','));
+			} else {
 				needComma = 1;
+			}
 			CHKN(obj = json_object_array_get_idx(field, i));
-			CHKN(value = json_object_get_string(obj));
-			CHKR(ln_addValue_CSV(value, str));
+			CHKN(value = ln_encValue(obj, &lenValue));
+			CHKR(ln_addValue_CSV(value, lenValue, str));
 		}
 		CHKR(es_addChar(str, ']'));
 		break;
 	case json_type_string:
 	case json_type_int:
-		CHKN(value = json_object_get_string(field));
-		CHKR(ln_addValue_CSV(value, str));
+		CHKN(value = ln_encValue(field, &lenValue));
+		CHKR(ln_addValue_CSV(value, lenValue, str));
 		break;
 	case json_type_null:
 	case json_type_boolean:
@@ -177,33 +189,41 @@ done:
 
 
 int
-ln_fmtEventToCSV(struct json_object *json, es_str_t **str, es_str_t *extraData)
+ln_fmtEventToCSVBuf(struct json_object *json, es_str_t **str, es_str_t *extraData)
 {
 	int r = -1;
 	int needComma = 0;
 	struct json_object *field;
-	char *namelist = NULL, *name, *nn;
+	const char *names, *namesEnd, *name, *nn;
+	char namebuf[256];
+	char *cname = NULL;
 
 	assert(json != NULL);
 	assert(json_object_is_type(json, json_type_object));
+	assert(str != NULL);
+	assert(*str != NULL);
 	
-	if((*str = es_newStr(256)) == NULL)
-		goto done;
 	if(extraData == NULL)
 		goto done;
 
-	CHKN(namelist = es_str2cstr(extraData, NULL));
-			
-	for (name = namelist; name != NULL; name = nn) {
-		for (nn = name; *nn != '\0' && *nn != ',' && *nn != ' '; nn++)
+	/* names are copied only to NUL-terminate them for the lookup */
+	names = (const char*) es_getBufAddr(extraData);
+	namesEnd = names + es_strlen(extraData);
+	for (name = names ; ; name = nn + 1) {
+		for (nn = name; nn < namesEnd && *nn != ',' && *nn != ' '; nn++)
 			{ /* do nothing */ }
-		if (*nn == '\0') {
-			nn = NULL;
+		const size_t lenName = nn - name;
+		const char *lookup;
+		if(lenName < sizeof(namebuf)) {
+			memcpy(namebuf, name, lenName);
+			namebuf[lenName] = '\0';
+			lookup = namebuf;
 		} else {
-			*nn = '\0';
-			nn++;
+			free(cname);
+			CHKN(cname = strndup(name, lenName));
+			lookup = cname;
 		}
-		json_object_object_get_ex(json, name, &field);
+		json_object_object_get_ex(json, lookup, &field);
 		if (needComma) {
 			CHKR(es_addChar(str, ','));
 		} else {
@@ -214,10 +234,20 @@ ln_fmtEventToCSV(struct json_object *json, es_str_t **str, es_str_t *extraData)
 			ln_addField_CSV(field, str);
 			CHKR(es_addChar(str, '"'));
 		}
+		if(nn == namesEnd)
+			break;
 	}
 	r = 0;
 done:
-	if (namelist != NULL)
-		free(namelist);
+	free(cname);
 	return r;
 }
+
+
+int
+ln_fmtEventToCSV(struct json_object *json, es_str_t **str, es_str_t *extraData)
+{
+	if((*str = es_newStr(256)) == NULL)
+		return -1;
+	return ln_fmtEventToCSVBuf(json, str, extraData);
+}
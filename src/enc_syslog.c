@@ -43,59 +43,53 @@
 #include "liblognorm.h"
 #include "enc.h"
 
+/* runs of characters that need no escaping are copied as a block */
 static int
-ln_addValue_Syslog(const char *value, es_str_t **str)
+ln_addValue_Syslog(const char *value, const size_t len, es_str_t **str)
 {
-	int r;
-	es_size_t i;
+	int r = 0;
+	size_t i;
+	size_t run = 0; /* start of current run of unescaped characters */
+	char esc;
 
 	assert(str != NULL);
 	assert(*str != NULL);
 	assert(value != NULL);
 
-	for(i = 0; i < strlen(value); i++) {
+	for(i = 0; i < len; i++) {
 		switch(value[i]) {
 		case '\0':
-			es_addChar(str, '\\');
-			es_addChar(str, '0');
+			esc = '0';
 			break;
 		case '\n':
-			es_addChar(str, '\\');
-			es_addChar(str, 'n');
+			esc = 'n';
 			break;
 		/* TODO : add rest of control characters here... */
 		case ',': /* comma is CEE-reserved for lists */
-			es_addChar(str, '\\');
-			es_addChar(str, ',');
-			break;
 #if 0 /* alternative encoding for discussion */
 		case '^': /* CEE-reserved for lists */
-			es_addChar(str, '\\');
-			es_addChar(str, '^');
-			break;
 #endif
 		/* at this layer ... do we need to think about transport
 		 * encoding at all? Or simply leave it to the transport agent?
 		 */
 		case '\\': /* RFC5424 reserved */
-			es_addChar(str, '\\');
-			es_addChar(str, '\\');
-			break;
 		case ']': /* RFC5424 reserved */
-			es_addChar(str, '\\');
-			es_addChar(str, ']');
-			break;
 		case '\"': /* RFC5424 reserved */
-			es_addChar(str, '\\');
-			es_addChar(str, '\"');
+			esc = value[i];
 			break;
 		default:
-			es_addChar(str, value[i]);
-			break;
+			continue;
 		}
+		if(i > run)
+			CHKR(es_addBuf(str, value + run, i - run));
+		run = i + 1;
+		CHKR(es_addChar(str, '\\'));
+		CHKR(es_addChar(str, esc));
 	}
-	r = 0;
+	if(i > run)
+		CHKR(es_addBuf(str, value + run, i - run));
 
+done:
 	return r;
 }
 
@@ -105,6 +99,7 @@ ln_addField_Syslog(char *name, struct json_object *field, es_str_t **str)
 {
 	int r;
 	const char *value;
+	size_t lenValue;
 	int needComma = 0;
 	struct json_object *obj;
 	int i;
@@ -123,14 +118,14 @@ ln_addField_Syslog(char *name, struct json_object *field, es_str_t **str)
 			else
 				needComma = 1;
 			CHKN(obj = json_object_array_get_idx(field, i));
-			CHKN(value = json_object_get_string(obj));
-			CHKR(ln_addValue_Syslog(value, str));
+			CHKN(value = ln_encValue(obj, &lenValue));
+			CHKR(ln_addValue_Syslog(value, lenValue, str));
 		}
 		break;
 	case json_type_string:
 	case json_type_int:
-		CHKN(value = json_object_get_string(field));
-		CHKR(ln_addValue_Syslog(value, str));
+		CHKN(value = ln_encValue(field, &lenValue));
+		CHKR(ln_addValue_Syslog(value, lenValue, str));
 		break;
 	case json_type_null:
 	case json_type_boolean:
@@ -177,17 +172,17 @@ done:	return r;
 
 
 int
-ln_fmtEventToRFC5424(struct json_object *json, es_str_t **str)
+ln_fmtEventToRFC5424Buf(struct json_object *json, es_str_t **str)
 {
-	int r = -1;
+	int r;
 	struct json_object *tags;
 	
 	assert(json != NULL);
 	assert(json_object_is_type(json, json_type_object));
-	if((*str = es_newStr(256)) == NULL)
-		goto done;
+	assert(str != NULL);
+	assert(*str != NULL);
 
-	es_addBuf(str, "[cee@115", 8);
+	CHKR(es_addBuf(str, "[cee@115", 8));
 	
 	if(json_object_object_get_ex(json, "event.tags", &tags)) {
 		CHKR(ln_addTags_Syslog(tags, str));
@@ -197,13 +192,22 @@ ln_fmtEventToRFC5424(struct json_object *json, es_str_t **str)
 	while (!json_object_iter_equal(&it, &itEnd)) {
 		char *const name = (char*)json_object_iter_peek_name(&it);
 		if (strcmp(name, "event.tags")) {
-			es_addChar(str, ' ');
+			CHKR(es_addChar(str, ' '));
 			ln_addField_Syslog(name, json_object_iter_peek_value(&it), str);
 		}
 		json_object_iter_next(&it);
 	}
-	es_addChar(str, ']');
+	CHKR(es_addChar(str, ']'));
 
 done:
 	return r;
 }
+
+
+int
+ln_fmtEventToRFC5424(struct json_object *json, es_str_t **str)
+{
+	if((*str = es_newStr(256)) == NULL)
+		return -1;
+	return ln_fmtEventToRFC5424Buf(json, str);
+}
@@ -56,12 +56,14 @@ static char hexdigit[16] =
  * byte-by-byte basis, which simply is incorrect.
  * rgerhards, 2010-11-09
  */
+/* runs of characters that need no escaping are copied as a block */
 static int
-ln_addValue_XML(const char *value, es_str_t **str)
+ln_addValue_XML(const char *value, const size_t len, es_str_t **str)
 {
 	int r;
 	unsigned char c;
-	es_size_t i;
+	size_t i;
+	size_t run = 0; /* start of current run of unescaped characters */
 #if 0
 	char numbuf[4];
 	int j;
@@ -71,13 +73,18 @@ ln_addValue_XML(const char *value, es_str_t **str)
 	assert(*str != NULL);
 	assert(value != NULL); 
 	// TODO: support other types!
-	es_addBuf(str, "<value>", 7);
+	CHKR(es_addBuf(str, "<value>", 7));
 
-	for(i = 0 ; i < strlen(value) ; ++i) {
+	for(i = 0 ; i < len ; ++i) {
 		c = value[i];
+		if(c != '\0' && c != '<' && c != '&')
+			continue;
+		if(i > run)
+			CHKR(es_addBuf(str, value + run, i - run));
+		run = i + 1;
 		switch(c) {
 		case '\0':
-			es_addBuf(str, "&#00;", 5);
+			CHKR(es_addBuf(str, "&#00;", 5));
 			break;
 #if 0
 		case '\n':
@@ -94,10 +101,10 @@ ln_addValue_XML(const char *value, es_str_t **str)
 			break;
 #endif
 		case '<':
-			es_addBuf(str, "&lt;", 4);
+			CHKR(es_addBuf(str, "&lt;", 4));
 			break;
 		case '&':
-			es_addBuf(str, "&amp;", 5);
+			CHKR(es_addBuf(str, "&amp;", 5));
 			break;
 #if 0
 		case ',':
@@ -106,10 +113,7 @@ ln_addValue_XML(const char *value, es_str_t **str)
 		case '\'':
 			es_addBuf(str, "&apos;", 6);
 			break;
-#endif
 		default:
-			es_addChar(str, c);
-#if 0
 			/* TODO : proper Unicode encoding (see header comment) */
 			for(j = 0 ; j < 4 ; ++j) {
 				numbuf[3-j] = hexdigit[c % 16];
@@ -121,9 +125,12 @@ ln_addValue_XML(const char *value, es_str_t **str)
 #endif
 		}
 	}
-	es_addBuf(str, "</value>", 8);
+	if(i > run)
+		CHKR(es_addBuf(str, value + run, i - run));
+	CHKR(es_addBuf(str, "</value>", 8));
 	r = 0;
 
+done:
 	return r;
 }
 
@@ -134,6 +141,7 @@ ln_addField_XML(char *name, struct json_object *field, es_str_t **str)
 	int r;
 	int i;
 	const char *value;
+	size_t lenValue;
 	struct json_object *obj;
 
 	assert(field != NULL);
@@ -148,14 +156,14 @@ ln_addField_XML(char *name, struct json_object *field, es_str_t **str)
 	case json_type_array:
 		for (i = json_object_array_length(field) - 1; i >= 0; i--) {
 			CHKN(obj = json_object_array_get_idx(field, i));
-			CHKN(value = json_object_get_string(obj));
-			CHKR(ln_addValue_XML(value, str));
+			CHKN(value = ln_encValue(obj, &lenValue));
+			CHKR(ln_addValue_XML(value, lenValue, str));
 		}
 		break;
 	case json_type_string:
 	case json_type_int:
-		CHKN(value = json_object_get_string(field));
-		CHKR(ln_addValue_XML(value, str));
+		CHKN(value = ln_encValue(field, &lenValue));
+		CHKR(ln_addValue_XML(value, lenValue, str));
 		break;
 	case json_type_null:
 	case json_type_boolean:
@@ -198,18 +206,17 @@ done:	return r;
 
 
 int
-ln_fmtEventToXML(struct json_object *json, es_str_t **str)
+ln_fmtEventToXMLBuf(struct json_object *json, es_str_t **str)
 {
-	int r = -1;
+	int r;
 	struct json_object *tags;
 
 	assert(json != NULL);
 	assert(json_object_is_type(json, json_type_object));
+	assert(str != NULL);
+	assert(*str != NULL);
 	
-	if((*str = es_newStr(256)) == NULL)
-		goto done;
-
-	es_addBuf(str, "<event>", 7);
+	CHKR(es_addBuf(str, "<event>", 7));
 	if(json_object_object_get_ex(json, "event.tags", &tags)) {
 		CHKR(ln_addTags_XML(tags, str));
 	}
@@ -223,8 +230,17 @@ ln_fmtEventToXML(struct json_object *json, es_str_t **str)
 		json_object_iter_next(&it);
 	}
 
-	es_addBuf(str, "</event>", 8);
+	CHKR(es_addBuf(str, "</event>", 8));
 
 done:
 	return r;
 }
+
+
+int
+ln_fmtEventToXML(struct json_object *json, es_str_t **str)
+{
+	if((*str = es_newStr(256)) == NULL)
+		return -1;
+	return ln_fmtEventToXMLBuf(json, str);
+}
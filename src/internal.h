@@ -58,6 +58,7 @@
 
 #include "liblognorm.h"
 
+#include <string.h>
 #include <libestr.h>
 
 /* we need to turn off this warning, as it also comes up in C99 mode, which
@@ -93,6 +94,20 @@ done:
 	return NULL;
 }
 
+/* obtain the string representation of a field value for the encoders,
+ * together with its length. Strings may contain NUL bytes.
+ */
+static inline const char *
+ln_encValue(struct json_object *const obj, size_t *const len)
+{
+	const char *const value = json_object_get_string(obj);
+	if(value != NULL) {
+		*len = json_object_is_type(obj, json_type_string)
+			? (size_t) json_object_get_string_len(obj) : strlen(value);
+	}
+	return value;
+}
+
 const char * ln_DataForDisplayCharTo(__attribute__((unused)) ln_ctx ctx, void *const pdata);
 const char * ln_DataForDisplayLiteral(__attribute__((unused)) ln_ctx ctx, void *const pdata);
 const char * ln_JsonConfLiteral(__attribute__((unused)) ln_ctx ctx, void *const pdata);
@@ -27,11 +27,15 @@
 #include "config.h"
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "liblognorm.h"
 #include "lognorm.h"
 #include "annot.h"
 #include "samp.h"
+#include "rbcache.h"
+#include "scan.h"
 #include "v1_liblognorm.h"
 #include "v1_ptree.h"
 
@@ -70,6 +74,7 @@ ln_initCtx(void)
 #ifdef HAVE_JSON_GLOBAL_SET_PRINTBUF_INITIAL_SIZE
 	json_global_set_printbuf_initial_size(2048);
 #endif
+	ln_scanInit();
 	ctx->objID = LN_ObjID_CTX;
 	ctx->dbgCB = NULL;
 	ctx->opts = 0;
@@ -89,6 +94,18 @@ ln_initCtx(void)
 		ctx = NULL;
 		goto done;
 	}
+	if(ln_pdagInitStats(ctx) != 0) {
+		ln_deleteAnnotSet(ctx->pas);
+		ln_pdagDelete(ctx->pdag);
+		free(ctx);
+		ctx = NULL;
+		goto done;
+	}
+	ctx->gen = ctx;
+	ctx->front = ctx;
+	ctx->refs = 1;
+	pthread_mutex_init(&ctx->reload_mut, NULL);
+	pthread_mutex_init(&ctx->gen_mut, NULL);
 
 done:
 	return ctx;
@@ -96,7 +113,10 @@ done:
 
 void
 ln_setCtxOpts(ln_ctx ctx, const unsigned opts) {
+	pthread_mutex_lock(&ctx->reload_mut);
 	ctx->opts |= opts;
+	ctx->gen->opts |= opts;
+	pthread_mutex_unlock(&ctx->reload_mut);
 }
 
 
@@ -109,21 +129,37 @@ ln_exitCtx(ln_ctx ctx)
 
 	ln_dbgprintf(ctx, "exitCtx %p", ctx);
 	ctx->objID = LN_ObjID_None; /* prevent double free */
+	if(ctx->front == ctx) {
+		/* free all generations created by reloads */
+		if(ctx->gen != ctx)
+			ln_exitCtx(ctx->gen);
+		while(ctx->retired != NULL) {
+			ln_ctx gen = ctx->retired;
+			ctx->retired = gen->retiredNext;
+			if(gen != ctx)
+				ln_exitCtx(gen);
+		}
+	}
 	/* support for old cruft */
 	if(ctx->ptree != NULL)
 		ln_deletePTree(ctx->ptree);
 	/* end support for old cruft */
 	if(ctx->pdag != NULL)
 		ln_pdagDelete(ctx->pdag);
-	for(int i = 0 ; i < ctx->nTypes ; ++i) {
-		free((void*)ctx->type_pdags[i].name);
-		ln_pdagDelete(ctx->type_pdags[i].pdag);
-	}
-	free(ctx->type_pdags);
+	ln_pdagDeleteTypes(ctx);
+	free(ctx->pdag_arena); /* must be done after all pdags are deleted */
+	ln_pdagExitStats(ctx);
 	if(ctx->rulePrefix != NULL)
 		es_deleteStr(ctx->rulePrefix);
 	if(ctx->pas != NULL)
 		ln_deleteAnnotSet(ctx->pas);
+	for(unsigned i = 0 ; i < ctx->nRbsrcs ; ++i) {
+		free(ctx->rbsrcs[i].name);
+		free(ctx->rbsrcs[i].path);
+	}
+	free(ctx->rbsrcs);
+	pthread_mutex_destroy(&ctx->reload_mut);
+	pthread_mutex_destroy(&ctx->gen_mut);
 	free(ctx);
 done:
 	return r;
@@ -136,8 +172,10 @@ ln_setDebugCB(ln_ctx ctx, void (*cb)(void*, const char*, size_t), void *cookie)
 	int r = 0;
 
 	CHECK_CTX;
-	ctx->dbgCB = cb;
-	ctx->dbgCookie = cookie;
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->dbgCB = ctx->gen->dbgCB = cb;
+	ctx->dbgCookie = ctx->gen->dbgCookie = cookie;
+	pthread_mutex_unlock(&ctx->reload_mut);
 done:
 	return r;
 }
@@ -149,8 +187,10 @@ ln_setErrMsgCB(ln_ctx ctx, void (*cb)(void*, const char*, size_t), void *cookie)
 	int r = 0;
 
 	CHECK_CTX;
-	ctx->errmsgCB = cb;
-	ctx->errmsgCookie = cookie;
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->errmsgCB = ctx->gen->errmsgCB = cb;
+	ctx->errmsgCookie = ctx->gen->errmsgCookie = cookie;
+	pthread_mutex_unlock(&ctx->reload_mut);
 done:
 	return r;
 }
@@ -161,6 +201,12 @@ ln_loadSamples(ln_ctx ctx, const char *file)
 	int r = 0;
 	const char *tofree;
 	CHECK_CTX;
+	if(ctx->gen != ctx) {
+		ln_errprintf(ctx, 0, "rule base has been reloaded, use "
+			"ln_reloadSamples() to change it");
+		r = LN_BADCONFIG;
+		goto done;
+	}
 	ctx->conf_file = tofree = strdup(file);
 	ctx->conf_ln_nbr = 0;
 	++ctx->include_level;
@@ -171,3 +217,280 @@ ln_loadSamples(ln_ctx ctx, const char *file)
 done:
 	return r;
 }
+
+int
+ln_loadSamplesCached(ln_ctx ctx, const char *file, const char *cachefile)
+{
+	int r = 0;
+	CHECK_CTX;
+	if(ctx->version != 0 || ctx->gen != ctx) {
+		/* a cache always holds a complete rule base, it cannot be
+		 * added to an already loaded one.
+		 */
+		r = ln_loadSamples(ctx, file);
+		goto done;
+	}
+	if(ln_rbcLoad(ctx, file, cachefile) == 0)
+		goto done;
+	if((r = ln_loadSamples(ctx, file)) != 0)
+		goto done;
+	/* failure to write the cache is reported, but the rule base has
+	 * been loaded, so we do not fail. v1 rule bases cannot be cached.
+	 */
+	if(ctx->version == 2)
+		ln_rbcWrite(ctx, cachefile);
+done:
+	return r;
+}
+
+int
+ln_writeRulebaseCache(ln_ctx ctx, const char *cachefile)
+{
+	int r = 0;
+	CHECK_CTX;
+	pthread_mutex_lock(&ctx->reload_mut);
+	r = ln_rbcWrite(ctx->gen, cachefile);
+	pthread_mutex_unlock(&ctx->reload_mut);
+done:
+	return r;
+}
+
+
+/* Hot reload.
+ *
+ * Normalizing threads do not lock or reference count the generation
+ * they use. Instead, each of them enters a read section, similar to
+ * userspace RCU: every thread has a reader record with a counter that
+ * is odd while the thread is inside a read section on any context. A
+ * reload publishes the new generation and then waits until every
+ * reader that was inside a read section has left it (grace period).
+ * After that, no thread can still use the old generation, except via
+ * span arenas, which hold a reference. The reader records are shared
+ * by all contexts, so there is only one thread-specific key for the
+ * whole library.
+ *
+ * Reader records are never freed. When a thread terminates, its
+ * record is released and can be taken over by a new thread. So the
+ * record list only ever grows at its head, and a reload can walk it
+ * without a lock. Normalizing threads thus never wait for a reload,
+ * not even when they register or terminate.
+ */
+struct ln_rcu_reader {
+	struct ln_rcu_reader *next;
+	unsigned long ctr;	/**< odd while inside a read section */
+	unsigned nest;		/**< read section nesting level (owner only) */
+	int bUsed;		/**< record is owned by a thread */
+};
+
+static pthread_once_t rcuOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t rcuKey;
+static int bRcuKey = 0;
+static struct ln_rcu_reader *rcuReaders = NULL; /* only prepended to, atomically */
+
+/* thread termination: release reader record for reuse */
+static void
+rcuReaderExit(void *const arg)
+{
+	struct ln_rcu_reader *const rd = (struct ln_rcu_reader*) arg;
+	rd->nest = 0;
+	__atomic_store_n(&rd->bUsed, 0, __ATOMIC_RELEASE);
+}
+
+static void
+rcuInit(void)
+{
+	bRcuKey = (pthread_key_create(&rcuKey, rcuReaderExit) == 0);
+}
+
+/* obtain a reader record for the calling thread, either a released
+ * one or a new one.
+ * @return record or NULL if out of memory
+ */
+static struct ln_rcu_reader *
+rcuReaderNew(void)
+{
+	struct ln_rcu_reader *rd;
+	int expected;
+
+	for(rd = __atomic_load_n(&rcuReaders, __ATOMIC_ACQUIRE) ; rd != NULL ; rd = rd->next) {
+		expected = 0;
+		if(__atomic_load_n(&rd->bUsed, __ATOMIC_RELAXED) == 0
+		   && __atomic_compare_exchange_n(&rd->bUsed, &expected, 1, 0,
+						  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return rd;
+	}
+	if((rd = calloc(1, sizeof(struct ln_rcu_reader))) == NULL)
+		return NULL;
+	rd->bUsed = 1;
+	rd->next = __atomic_load_n(&rcuReaders, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&rcuReaders, &rd->next, rd, 1,
+					   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		; /* rd->next was updated, retry */
+	return rd;
+}
+
+ln_ctx
+ln_ctxReadLock(ln_ctx ctx, struct ln_rcu_reader **const rdp)
+{
+	struct ln_rcu_reader *rd = NULL;
+
+	pthread_once(&rcuOnce, rcuInit);
+	if(!bRcuKey) /* no reloads possible, see ln_reloadSamples() */
+		goto done;
+	if((rd = pthread_getspecific(rcuKey)) == NULL) {
+		if((rd = rcuReaderNew()) == NULL) {
+			ctx = NULL;
+			goto done;
+		}
+		if(pthread_setspecific(rcuKey, rd) != 0) {
+			rcuReaderExit(rd);
+			rd = NULL;
+			ctx = NULL;
+			goto done;
+		}
+	}
+	if(rd->nest++ == 0) {
+		/* pairs with the generation store in ln_reloadSamples(): either
+		 * the reloader sees us inside the read section, or we see the
+		 * new generation.
+		 */
+		__atomic_store_n(&rd->ctr, rd->ctr + 1, __ATOMIC_SEQ_CST);
+	}
+	ctx = __atomic_load_n(&ctx->gen, __ATOMIC_SEQ_CST);
+done:
+	*rdp = rd;
+	return ctx;
+}
+
+void
+ln_ctxReadUnlock(struct ln_rcu_reader *const rd)
+{
+	if(rd != NULL && --rd->nest == 0)
+		__atomic_store_n(&rd->ctr, rd->ctr + 1, __ATOMIC_RELEASE);
+}
+
+/* wait until all threads that were inside a read section when we were
+ * called have left it. No lock is held while waiting.
+ */
+static void
+rcuSynchronize(void)
+{
+	const struct timespec pause = { 0, 100000 };
+
+	for(struct ln_rcu_reader *rd = __atomic_load_n(&rcuReaders, __ATOMIC_ACQUIRE) ;
+	    rd != NULL ; rd = rd->next) {
+		const unsigned long ctr = __atomic_load_n(&rd->ctr, __ATOMIC_SEQ_CST);
+		if((ctr & 1) == 0)
+			continue;
+		while(__atomic_load_n(&rd->ctr, __ATOMIC_ACQUIRE) == ctr)
+			nanosleep(&pause, NULL);
+	}
+}
+
+/* drop the rule base of a front context that has been replaced. The
+ * context itself stays, as it is the handle the user holds.
+ */
+static void
+ctxDropRulebase(ln_ctx ctx)
+{
+	if(ctx->ptree != NULL) {
+		ln_deletePTree(ctx->ptree);
+		ctx->ptree = NULL;
+	}
+	ln_pdagDiscard(ctx);
+	ln_deleteAnnotSet(ctx->pas);
+	ctx->pas = ln_newAnnotSet(ctx);
+	for(unsigned i = 0 ; i < ctx->nRbsrcs ; ++i) {
+		free(ctx->rbsrcs[i].name);
+		free(ctx->rbsrcs[i].path);
+	}
+	free(ctx->rbsrcs);
+	ctx->rbsrcs = NULL;
+	ctx->nRbsrcs = 0;
+}
+
+void
+ln_ctxRelease(ln_ctx gen)
+{
+	ln_ctx front;
+	ln_ctx *pp;
+
+	if(__atomic_sub_fetch(&gen->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	/* only retired generations can drop to zero, as the current
+	 * generation is referenced by its front.
+	 */
+	front = gen->front;
+	pthread_mutex_lock(&front->gen_mut);
+	for(pp = &front->retired ; *pp != NULL ; pp = &(*pp)->retiredNext) {
+		if(*pp == gen) {
+			*pp = gen->retiredNext;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&front->gen_mut);
+	if(gen == front)
+		ctxDropRulebase(gen);
+	else
+		ln_exitCtx(gen);
+}
+
+int
+ln_reloadSamples(ln_ctx ctx, const char *file, const char *cachefile)
+{
+	int r = 0;
+	ln_ctx nctx;
+	ln_ctx old;
+
+	CHECK_CTX;
+	pthread_once(&rcuOnce, rcuInit);
+	if(!bRcuKey) {
+		ln_errprintf(ctx, 0, "cannot reload rule base: no thread-specific "
+			"storage available");
+		r = LN_NOMEM;
+		goto done;
+	}
+
+	pthread_mutex_lock(&ctx->reload_mut);
+	if((nctx = ln_initCtx()) == NULL) {
+		r = LN_NOMEM;
+		goto unlock;
+	}
+	nctx->front = ctx;
+	nctx->dbgCB = ctx->dbgCB;
+	nctx->dbgCookie = ctx->dbgCookie;
+	nctx->errmsgCB = ctx->errmsgCB;
+	nctx->errmsgCookie = ctx->errmsgCookie;
+	nctx->debug = ctx->debug;
+	nctx->opts = ctx->opts;
+	nctx->ruleStatsSampling = ctx->ruleStatsSampling;
+	nctx->budgetMaxCalls = ctx->budgetMaxCalls;
+	nctx->budgetMaxUsec = ctx->budgetMaxUsec;
+	nctx->loadThreads = ctx->loadThreads;
+
+	/* build the new rule base while the old one is still in use */
+	if(cachefile == NULL)
+		r = ln_loadSamples(nctx, file);
+	else
+		r = ln_loadSamplesCached(nctx, file, cachefile);
+	if(r != 0) {
+		ln_exitCtx(nctx);
+		goto unlock;
+	}
+
+	old = ctx->gen;
+	__atomic_store_n(&ctx->gen, nctx, __ATOMIC_SEQ_CST);
+	rcuSynchronize();
+	ln_dbgprintf(ctx, "rule base reloaded from '%s'", file);
+
+	pthread_mutex_lock(&ctx->gen_mut);
+	old->retiredNext = ctx->retired;
+	ctx->retired = old;
+	pthread_mutex_unlock(&ctx->gen_mut);
+	ln_ctxRelease(old); /* freed now, unless span arenas still use it */
+
+unlock:
+	pthread_mutex_unlock(&ctx->reload_mut);
+done:
+	return r;
+}
@@ -61,6 +61,8 @@
 #ifndef LIBLOGNORM_H_INCLUDED
 #define LIBLOGNORM_H_INCLUDED
 #include <stdlib.h>	/* we need size_t */
+#include <stdint.h>
+#include <time.h>
 #include <json.h>
 
 /* error codes */
@@ -81,6 +83,34 @@
  */
 typedef struct ln_ctx_s* ln_ctx;
 
+/**
+ * A span arena for span-mode normalization, see ln_normalizeSpans().
+ */
+typedef struct ln_spans_s* ln_spans;
+
+/**
+ * Types of typed field values, see ln_spansGetValue().
+ */
+enum ln_valtype {
+	LN_VALTYPE_INT,		/**< signed 64 bit integer, member i */
+	LN_VALTYPE_DOUBLE,	/**< floating point number, member d */
+	LN_VALTYPE_TIME,	/**< seconds since the epoch, member t */
+	LN_VALTYPE_IPV4		/**< IPv4 address in host byte order, member ipv4 */
+};
+
+/**
+ * A typed field value, see ln_spansGetValue().
+ */
+struct ln_value {
+	enum ln_valtype type;
+	union {
+		int64_t i;
+		double d;
+		time_t t;
+		uint32_t ipv4;
+	} v;
+};
+
 /* API */
 /**
  * Return library version string.
@@ -145,6 +175,8 @@ int ln_exitCtx(ln_ctx ctx);
 					          (not just in error case) */
 #define LN_CTXOPT_ADD_RULE		0x08 /**< add mockup rule */
 #define LN_CTXOPT_ADD_RULE_LOCATION	0x10 /**< add rule location (file, lineno) to metadata */
+#define LN_CTXOPT_MEMOIZE		0x20 /**< remember failed (node, offset) pairs of a message,
+					          so that they are not tried again (bounds backtracking) */
 /**
  * Set options on ctx.
  *
@@ -224,6 +256,91 @@ void ln_enableDebug(ln_ctx ctx, int i);
  */
 int ln_loadSamples(ln_ctx ctx, const char *file);
 
+/**
+ * Set the number of threads used to load v2 rule bases.
+ *
+ * Large rule bases are loaded in parallel: rules are tokenized and
+ * their parsers created by multiple threads, then added to the parse
+ * DAG in rule base order. Custom types are optimized concurrently. The
+ * resulting DAG is exactly the same as with serial loading. Small rule
+ * bases are always loaded serially, as is everything in debug mode.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] nThreads max number of threads, 0 (default) = number of
+ *                     online CPUs, 1 = load serially
+ */
+void ln_setLoadThreads(ln_ctx ctx, const unsigned nThreads);
+
+/**
+ * Load a rule base, using a binary rule base cache if possible.
+ *
+ * The cache contains the rule base in the form it has after loading
+ * and optimization, so loading it is much faster than loading the
+ * rule base itself. If the cache file does not exist, was not created
+ * from this rule base file, or if the rule base or any file included
+ * by it has been modified since it was written, the rule base is
+ * loaded normally and the cache is (re)written. Failure to write the
+ * cache is reported via the error message callback, but does not make
+ * this function fail.
+ *
+ * Caches are bound to the library version and machine architecture
+ * they were created with, they are ignored otherwise. Only v2 rule
+ * bases can be cached. A cache always holds a complete rule base: if
+ * the context already contains rules, this function behaves exactly
+ * like ln_loadSamples().
+ *
+ * @param[in] ctx The library context.
+ * @param[in] file Name of rule base file to be loaded.
+ * @param[in] cachefile Name of the cache file.
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_loadSamplesCached(ln_ctx ctx, const char *file, const char *cachefile);
+
+/**
+ * Write the rule base loaded into the context to a binary rule base
+ * cache. See ln_loadSamplesCached() for how caches are used.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] cachefile Name of the cache file. An existing file is
+ *                      replaced.
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_writeRulebaseCache(ln_ctx ctx, const char *cachefile);
+
+/**
+ * Replace the rule base of a context while it is in use.
+ *
+ * The new rule base is loaded into a new generation of the context,
+ * while other threads keep normalizing with the current one. It is
+ * then published atomically: normalization calls started afterwards
+ * use the new rule base, calls already in progress complete with the
+ * old one. The old rule base is freed as soon as no thread uses it
+ * any longer. Normalization is never blocked by a reload; the call
+ * returns after the old rule base is no longer in use by normalizing
+ * threads.
+ *
+ * If loading fails, the current rule base is kept. Note that, just
+ * like with ln_loadSamples(), rule base errors that are reported via
+ * the error message callback do not necessarily make loading fail.
+ *
+ * Context options, callbacks and the rule statistics setting carry
+ * over to the new rule base; statistics start over. Once a context
+ * has been reloaded, ln_loadSamples() and ln_loadSamplesCached() can
+ * no longer be used on it. Reloads are serialized; this function must
+ * not be called from within library callbacks.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] file Name of rule base file to be loaded.
+ * @param[in] cachefile Name of a rule base cache file, see
+ *                      ln_loadSamplesCached(), or NULL to not use a
+ *                      cache.
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_reloadSamples(ln_ctx ctx, const char *file, const char *cachefile);
+
 /**
  * Normalize a message.
  *
@@ -242,6 +359,13 @@ int ln_loadSamples(ln_ctx ctx, const char *file);
  * this means the the correct messages size, \b excluding the NUL byte,
  * must be provided.
  *
+ * @note
+ * For v2 rule bases, this function is thread-safe: once the rule base
+ * has been loaded, multiple threads may concurrently normalize messages
+ * using the same context. Runtime statistics are kept per thread and
+ * merged when they are requested. Loading rule bases or destructing the
+ * context while normalizing is \b not permitted.
+ *
  * @param[in] ctx The library context to use.
  * @param[in] str The message string (see note above).
  * @param[in] strLen The length of the message in bytes.
@@ -252,4 +376,313 @@ int ln_loadSamples(ln_ctx ctx, const char *file);
  */
 int ln_normalize(ln_ctx ctx, const char *str, const size_t strLen, struct json_object **json_p);
 
+/**
+ * Normalize a batch of messages.
+ *
+ * This is equivalent to calling ln_normalize() for each message of
+ * the batch, but per-call setup is done only once for the whole
+ * batch. Also, messages are not necessarily processed in submission
+ * order: messages which start alike are processed back-to-back, so
+ * that the upper levels of the parse DAG stay in cache. Results are
+ * always stored at the index of the message they belong to and are
+ * identical to what ln_normalize() would have generated.
+ *
+ * The same thread-safety rules as for ln_normalize() apply.
+ *
+ * @param[in] ctx The library context to use.
+ * @param[in] nmsgs Number of messages in the batch.
+ * @param[in] strs Array of nmsgs message strings (see ln_normalize()).
+ * @param[in] lens Array of nmsgs message lengths in bytes.
+ * @param[in,out] json_p Array of nmsgs event records. NULL entries are
+ *                   filled with new event records, which <b>must be
+ *                   destructed if no longer needed</b>.
+ * @param[out] results Array of nmsgs return codes, each being the value
+ *                   ln_normalize() would have returned for the message.
+ *                   May be NULL if not needed.
+ *
+ * @return Returns zero if all messages were normalized, the return code
+ *         of the first (in submission order) failed message otherwise.
+ *         If the batch could not be set up at all, no message is
+ *         processed and an error code is returned.
+ */
+int ln_normalizeBatch(ln_ctx ctx, const size_t nmsgs, const char *const *strs,
+	const size_t *lens, struct json_object **json_p, int *results);
+
+/**
+ * Enable or disable per-rule statistics.
+ *
+ * When enabled, the normalizer counts for each rule how many messages
+ * it matched, plus the number of messages no rule matched. In addition,
+ * every n-th message of each thread is timed and its latency recorded
+ * in a coarse histogram of the matching rule. The overhead is an
+ * increment per message plus two clock reads per sampled message, so
+ * this is suitable for production use. Statistics can be toggled at any
+ * time, also while other threads are normalizing; counters are kept
+ * while disabled. Only supported for v2 rule bases.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] sampling time every n-th message (1 = all); 0 disables
+ *                     statistics
+ */
+void ln_setRuleStats(ln_ctx ctx, const unsigned sampling);
+
+/**
+ * Limit the work done for a single message.
+ *
+ * Some messages can make the normalizer backtrack a lot, for example
+ * with nested repeat fields or many alternatives. With a budget set,
+ * normalization of a message is aborted once it has invoked more than
+ * maxParserCalls parsers or taken longer than maxUsec microseconds. The
+ * message is then handled as unparsed, and the event carries
+ * "budget-exceeded": true inside its "metadata" object. Time is only
+ * checked every few parser calls, so the time limit may be overrun
+ * slightly. Can be changed at any time, also while other threads are
+ * normalizing. Only supported for v2 rule bases.
+ *
+ * @param[in] ctx The library context.
+ * @param[in] maxParserCalls max number of parser invocations per
+ *                           message, 0 = unlimited
+ * @param[in] maxUsec max normalization time per message in
+ *                    microseconds, 0 = unlimited
+ */
+void ln_setNormalizeBudget(ln_ctx ctx, const unsigned maxParserCalls, const unsigned maxUsec);
+
+/**
+ * Obtain the number of messages that exceeded their budget.
+ *
+ * The counter covers the whole lifetime of the context, including
+ * reloads of the rule base.
+ *
+ * @param[in] ctx The library context.
+ * @return number of messages not parsed because of the budget
+ */
+uint64_t ln_budgetExceededCount(ln_ctx ctx);
+
+/**
+ * Obtain per-rule statistics as JSON.
+ *
+ * The result has the following format:
+ *
+ *     { "sampling": 16,
+ *       "histogram_bounds_ns": [ 256, 512, ... ],
+ *       "rules": [ { "file": "x.rb", "line": 5, "count": 123,
+ *                    "sampled": 7, "avg_ns": 1433,
+ *                    "histogram": [ 0, 0, 1, 5, 1, 0, ... ] }, ... ],
+ *       "unmatched": { "count": 17, "sampled": 1, ... } }
+ *
+ * Histogram bucket i holds sampled latencies below bound i; the last
+ * bucket, which has no bound, holds all higher latencies. Rules are
+ * listed in parse DAG order, including those that never matched. The
+ * values are a snapshot, threads may continue to count while it is
+ * taken.
+ *
+ * @param[in] ctx The library context.
+ * @param[out] json_p new JSON object. <b>Must be destructed if no
+ *                   longer needed.</b>
+ *
+ * @return Returns zero on success, LN_BADCONFIG for v1 rule bases and
+ *         something else on error.
+ */
+int ln_ruleStatsToJSON(ln_ctx ctx, struct json_object **json_p);
+
+/**
+ * Create a span arena.
+ *
+ * The arena is meant to be reused for many messages. It grows as
+ * needed, but never shrinks, so after a warm-up phase span-mode
+ * normalization does not need any memory allocations. An arena must
+ * only be used by one thread at a time.
+ *
+ * @return new arena or NULL if out of memory
+ */
+ln_spans ln_newSpans(void);
+
+/**
+ * Destruct a span arena.
+ *
+ * An arena keeps the rule base it was last used with alive, even if
+ * it has been replaced by ln_reloadSamples(). So arenas must be
+ * destructed before the context they were used with.
+ *
+ * @param spans arena to destruct, may be NULL
+ */
+void ln_deleteSpans(ln_spans spans);
+
+/**
+ * Set the reference time for typed values of RFC3164 dates without a
+ * year, see ln_spansGetValue(). Applications processing messages
+ * received some time ago should set the time they were received at.
+ *
+ * @param spans arena to set the time for
+ * @param refTime reference time, 0 (the default) for the current time
+ *        at conversion
+ */
+void ln_spansSetRefTime(ln_spans spans, const time_t refTime);
+
+/**
+ * Normalize a message in span mode.
+ *
+ * Instead of building a JSON event, the normalizer only records for
+ * each field where it is located inside the message and which parser
+ * matched it. Field values can then be obtained without any memory
+ * allocation as raw text via ln_spansGetField(). If JSON is needed, it
+ * is built lazily via ln_spansFieldToJSON() or ln_spansToJSON(). The
+ * previous content of the arena is discarded.
+ *
+ * Spans refer to the message, so str must be kept unmodified until the
+ * arena is no longer accessed or reused.
+ *
+ * Span mode is only supported for v2 rule bases. The same thread-safety
+ * rules as for ln_normalize() apply.
+ *
+ * @param[in] ctx The library context to use.
+ * @param[in] str The message string (see ln_normalize()).
+ * @param[in] strLen The length of the message in bytes.
+ * @param[in] spans The arena to store the result in.
+ *
+ * @return Returns zero if the message was normalized, LN_WRONGPARSER if
+ *         no rule matched and something else on error.
+ */
+int ln_normalizeSpans(ln_ctx ctx, const char *str, const size_t strLen, ln_spans spans);
+
+/**
+ * Obtain the raw text of a top-level field from a span arena.
+ *
+ * The text is what the field's parser matched, which may differ from
+ * its JSON value (for example, quotes are included for quoted strings
+ * and the text of all subfields is included for structured fields).
+ * If a field name occurs multiple times, the first one is returned.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in] name field name as given in the rule
+ * @param[out] val pointer into the message, NOT NUL-terminated
+ * @param[out] lenVal length of the text
+ *
+ * @return Returns zero if the field was found, something else otherwise.
+ */
+int ln_spansGetField(ln_spans spans, const char *name, const char **val, size_t *lenVal);
+
+/**
+ * Return the number of top-level fields in a span arena.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @return number of fields
+ */
+unsigned ln_spansNumFields(ln_spans spans);
+
+/**
+ * Obtain name and raw text of a top-level field by its index.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in] idx field index, 0 to ln_spansNumFields()-1
+ * @param[out] name field name, owned by the rule base
+ * @param[out] val pointer into the message, NOT NUL-terminated
+ * @param[out] lenVal length of the text
+ *
+ * @return Returns zero on success, something else if idx is invalid.
+ */
+int ln_spansGetFieldByIdx(ln_spans spans, const unsigned idx,
+	const char **name, const char **val, size_t *lenVal);
+
+/**
+ * Build the JSON value of a single top-level field.
+ *
+ * The value is identical to what ln_normalize() would have stored
+ * for this field.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in] name field name as given in the rule
+ * @param[out] value new JSON value. <b>Must be destructed if no
+ *                   longer needed.</b>
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_spansFieldToJSON(ln_spans spans, const char *name, struct json_object **value);
+
+/**
+ * Build the complete event from a span arena.
+ *
+ * The event is identical to what ln_normalize() would have generated
+ * for the message, including tags, annotations and metadata. The only
+ * exception is the exec path, which is not available in span mode.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in,out] json_p event record. If NULL, a new one is created,
+ *                   which <b>must be destructed if no longer needed.</b>
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_spansToJSON(ln_spans spans, struct json_object **json_p);
+
+#define LN_JSONSTR_NO_TAGS 0x01 /**< ln_spansToJSONStr(): omit "event.tags" */
+
+/**
+ * Render the complete event from a span arena as JSON text.
+ *
+ * The text is identical to what json_object_to_json_string() produces
+ * for the event built by ln_spansToJSON(), but for most events it is
+ * written directly, without building JSON objects. Field values that
+ * are the text the parser matched are copied straight from the message.
+ * For parsers whose text never needs escaping (like number, ipv4 and
+ * the date parsers) even the escape check is skipped. Only structured
+ * values (like name-value-list or user-defined types) are still built
+ * as JSON objects. Events the JSON library would modify when building
+ * them (field names "." or colliding with annotations or metadata) are
+ * rendered via ln_spansToJSON().
+ *
+ * The output buffer works like the one of getline(3): if *buf is NULL,
+ * a new buffer is allocated, else it is grown as needed with realloc().
+ * The buffer is meant to be reused for all events; it must be freed
+ * by the caller.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in,out] buf output buffer, the text is NUL-terminated
+ * @param[in,out] size allocated size of *buf
+ * @param[out] len length of the text
+ * @param[in] flags LN_JSONSTR_* flags, or 0
+ *
+ * @return Returns zero on success, something else otherwise.
+ */
+int ln_spansToJSONStr(ln_spans spans, char **buf, size_t *size, size_t *len,
+	const unsigned flags);
+
+/**
+ * Obtain the typed value of a top-level field.
+ *
+ * The raw text of the field is converted only when this function is
+ * called; no string copy or JSON object is created. Conversion is
+ * supported for fields parsed by these parsers:
+ *
+ * - number, hexnumber: LN_VALTYPE_INT
+ * - float: LN_VALTYPE_DOUBLE
+ * - date-rfc3164, date-rfc5424, date-iso: LN_VALTYPE_TIME. RFC5424
+ *   dates are adjusted by their UTC offset, fractional seconds are
+ *   dropped. RFC3164 and ISO dates carry no timezone and are taken as
+ *   UTC. If an RFC3164 date has no year, the year of the reference
+ *   time (see ln_spansSetRefTime()) is assumed, or the previous one if
+ *   the date would otherwise be more than a month after the reference
+ *   time. ISO dates are converted to midnight.
+ * - ipv4: LN_VALTYPE_IPV4
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in] name field name as given in the rule
+ * @param[out] val typed value
+ *
+ * @return Returns zero on success, -1 if the field does not exist and
+ *         LN_WRONGPARSER if the field's parser does not support typed
+ *         values or the value does not fit into its type.
+ */
+int ln_spansGetValue(ln_spans spans, const char *name, struct ln_value *val);
+
+/**
+ * Obtain the typed value of a top-level field by its index.
+ *
+ * @param[in] spans arena filled by ln_normalizeSpans()
+ * @param[in] idx field index, 0 to ln_spansNumFields()-1
+ * @param[out] val typed value
+ *
+ * @return see ln_spansGetValue()
+ */
+int ln_spansGetValueByIdx(ln_spans spans, const unsigned idx, struct ln_value *val);
+
 #endif /* #ifndef LOGNORM_H_INCLUDED */
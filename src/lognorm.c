@@ -139,5 +139,7 @@ done:	return;
 void
 ln_enableDebug(ln_ctx ctx, int i)
 {
-	ctx->debug = i & 0x01;
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->debug = ctx->gen->debug = i & 0x01;
+	pthread_mutex_unlock(&ctx->reload_mut);
 }
@@ -27,6 +27,7 @@
 #ifndef LIBLOGNORM_LOGNORM_HINCLUDED
 #define	LIBLOGNORM_LOGNORM_HINCLUDED
 #include <stdlib.h>	/* we need size_t */
+#include <pthread.h>
 #include "liblognorm.h"
 #include "pdag.h"
 #include "annot.h"
@@ -41,6 +42,16 @@
 struct ln_type_pdag {
 	const char *name;
 	ln_pdag *pdag;
+	int bInlined;	/**< copied into callers, see ln_pdagUninlineType() */
+};
+
+/** a rulebase file that has been loaded, used to validate rulebase caches */
+struct ln_rbsrc {
+	char *name;		/**< file name as requested (rulebase or include directive) */
+	char *path;		/**< file name as opened */
+	int64_t mtime;		/**< modification time when loaded, seconds */
+	int64_t mtime_nsec;	/**< nanoseconds of it (0 if not supported) */
+	int64_t size;		/**< size when loaded */
 };
 
 struct ln_ctx_s {
@@ -61,9 +72,40 @@ struct ln_ctx_s {
 			       * building.
 			       */
 	unsigned opts; /**< specific options, see LN_CTXOPTS_* defines */
-	struct ln_type_pdag *type_pdags; /**< array of our type pdags */
+	struct ln_type_pdag **type_pdags; /**< array of our type pdags */
 	int nTypes;		 /**< number of type pdags */
+	unsigned *type_hash;	/**< type_pdags index + 1 by name hash, 0 = free slot */
+	unsigned type_hashSize;	/**< size of type_hash (power of two), 0 if none */
 	int version;		/**< 1 or 2, depending on rulebase/algo version */
+	void *pdag_arena;	/**< contiguous memory of frozen pdag nodes, NULL if none */
+	size_t pdag_arena_size;	/**< size of pdag_arena in bytes */
+	struct ln_pdag **pdag_nodes;	/**< frozen pdag nodes, indexed by stats_id - 1 */
+	unsigned nPdagNodes;		/**< number of frozen pdag nodes */
+	/* runtime statistics; the normalizer writes to per-thread blocks only */
+	pthread_key_t stats_key;	/**< this thread's statistics block */
+	int bStatsKey;			/**< is stats_key valid? */
+	pthread_mutex_t stats_mut;	/**< guards the statistics block list */
+	struct ln_pdag_tstats *tstats;	/**< statistics blocks of active threads */
+	struct ln_pdag_tstats *tstats_retired; /**< stats of terminated threads */
+	unsigned ruleStatsSampling;	/**< per-rule stats: time every n-th message, 0 = off */
+	unsigned budgetMaxCalls;	/**< max parser calls per message, 0 = unlimited */
+	unsigned budgetMaxUsec;		/**< max normalization time per message, 0 = unlimited */
+	uint64_t nBudgetExceeded;	/**< front: messages that exceeded the budget */
+	struct ln_rbsrc *rbsrcs;	/**< rulebase files loaded so far */
+	unsigned nRbsrcs;
+	/* hot reload, see ln_reloadSamples(). Each reload builds a new
+	 * generation, which is a context of its own. The context handed out
+	 * to the user (the front) forwards normalization to its current
+	 * generation. A generation is freed when it has been replaced and
+	 * no longer referenced by span arenas.
+	 */
+	struct ln_ctx_s *gen;		/**< current generation, the context itself if never reloaded */
+	struct ln_ctx_s *front;		/**< context this generation belongs to, self for the front */
+	unsigned refs;			/**< references to this generation: current + span arenas */
+	struct ln_ctx_s *retired;	/**< front: replaced generations still referenced */
+	struct ln_ctx_s *retiredNext;	/**< next in the front's retired list */
+	pthread_mutex_t reload_mut;	/**< front: serializes reloads */
+	pthread_mutex_t gen_mut;	/**< front: guards the retired list */
 
 	/* here follows stuff for the v1 subsystem -- do NOT make any changes
 	 * down here. This is strictly read-only. May also be removed some time in
@@ -75,8 +117,27 @@ struct ln_ctx_s {
 	int include_level;		/**< 1 for main rulebase file, higher for include levels */
 	const char *conf_file;		/**< currently open config file or NULL, if none */
 	unsigned int conf_ln_nbr;	/**< current config file line number */
+	unsigned loadThreads;		/**< max threads for loading, 0 = number of CPUs */
 };
 
+struct ln_rcu_reader;
+
+/**
+ * Enter a read section on a context. As long as the read section is
+ * active, the returned generation is not freed by a concurrent reload.
+ * Read sections may be nested.
+ * @param[out] rd reader record, must be passed to ln_ctxReadUnlock()
+ * @return generation to use, NULL if out of memory
+ */
+ln_ctx ln_ctxReadLock(ln_ctx ctx, struct ln_rcu_reader **rd);
+void ln_ctxReadUnlock(struct ln_rcu_reader *rd);
+
+/**
+ * Drop a reference to a generation (see ln_ctx_s.refs). The generation
+ * is freed when the last reference is gone.
+ */
+void ln_ctxRelease(ln_ctx gen);
+
 void ln_dbgprintf(ln_ctx ctx, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 void ln_errprintf(ln_ctx ctx, const int eno, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
@@ -34,7 +34,15 @@
  */
 #include "config.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
 #include <getopt.h>
 #include <libestr.h>
 
@@ -52,12 +60,15 @@ static ln_ctx ctx;
 static int verbose = 0;
 #define OUTPUT_PARSED_RECS 0x01
 #define OUTPUT_UNPARSED_RECS 0x02
+#define MAX_RULEBASES 16 /**< max number of -r options */
 static int recOutput = OUTPUT_PARSED_RECS | OUTPUT_UNPARSED_RECS; 
 				/**< controls which records to output */
 static int outputSummaryLine = 0;
 static int outputNbrUnparsed = 0;
 static int addErrLineNbr = 0;	/**< add line number info to unparsed events */
 static int flatTags = 0;	/**< print event.tags in JSON? */
+static unsigned budgetMaxCalls = 0;	/**< max parser calls per message, 0 = unlimited */
+static unsigned budgetMaxUsec = 0;	/**< max time per message, 0 = unlimited */
 static FILE *fpDOT;
 static es_str_t *encFmt = NULL; /**< a format string for encoder use */
 static es_str_t *mandatoryTag = NULL; /**< tag which must be given so that mesg will
@@ -85,35 +96,70 @@ complain(const char *errmsg)
 }
 
 
+/* where events are written to. The encoders render into buf, which
+ * is reused for all events of a thread, so that output needs no memory
+ * allocation per event.
+ */
+struct outSink {
+	FILE *fp;
+	es_str_t *buf;
+	char *jsonBuf;		/**< for JSON text rendered from spans */
+	size_t sizeJsonBuf;
+};
+
+static void
+outSinkInit(struct outSink *const out, FILE *const fp)
+{
+	out->fp = fp;
+	out->jsonBuf = NULL;
+	out->sizeJsonBuf = 0;
+	if((out->buf = es_newStr(1024)) == NULL) {
+		perror("lognormalizer: cannot allocate output buffer");
+		exit(1);
+	}
+}
+
+static void
+outSinkExit(struct outSink *const out)
+{
+	es_deleteStr(out->buf);
+	free(out->jsonBuf);
+}
+
 /* rawmsg is, as the name says, the raw message, in case we have
- * "raw" formatter requested.
+ * "raw" formatter requested. It is not NUL-terminated.
  */
 static void
-outputEvent(struct json_object *json, const char *const rawmsg)
+outputEvent(struct outSink *const out, struct json_object *json, const char *const rawmsg,
+	const size_t lenRawmsg)
 {
-	char *cstr = NULL;
-	es_str_t *str = NULL;
+	FILE *const fpOut = out->fp;
+	const char *cstr = NULL;
+	size_t len = 0;
 
 	if(outfmt == f_raw) {
-		printf("%s\n", rawmsg);
+		fwrite(rawmsg, 1, lenRawmsg, fpOut);
+		fputc('\n', fpOut);
 		return;
 	}
 
+	es_emptyStr(out->buf);
 	switch(outfmt) {
 	case f_json:
 		if(!flatTags) {
 			json_object_object_del(json, "event.tags");
 		}
-		cstr = (char*)json_object_to_json_string(json);
+		cstr = json_object_to_json_string(json);
+		len = strlen(cstr);
 		break;
 	case f_syslog:
-		ln_fmtEventToRFC5424(json, &str);
+		ln_fmtEventToRFC5424Buf(json, &out->buf);
 		break;
 	case f_xml:
-		ln_fmtEventToXML(json, &str);
+		ln_fmtEventToXMLBuf(json, &out->buf);
 		break;
 	case f_csv:
-		ln_fmtEventToCSV(json, &str, encFmt);
+		ln_fmtEventToCSVBuf(json, &out->buf, encFmt);
 		break;
 	case f_raw:
 		fprintf(stderr, "program error: f_raw should not occur "
@@ -126,13 +172,13 @@ outputEvent(struct json_object *json, const char *const rawmsg)
 		abort();
 		break;
 	}
-	if (str != NULL)
-		cstr = es_str2cstr(str, NULL);
-	if(verbose > 0) fprintf(stderr, "normalized: '%s'\n", cstr);
-	printf("%s\n", cstr);
-	if (str != NULL)
-		free(cstr);
-	es_deleteStr(str);
+	if(outfmt != f_json) {
+		cstr = (const char*) es_getBufAddr(out->buf);
+		len = es_strlen(out->buf);
+	}
+	if(verbose > 0) fprintf(stderr, "normalized: '%.*s'\n", (int) len, cstr);
+	fwrite(cstr, 1, len, fpOut);
+	fputc('\n', fpOut);
 }
 
 /* test if the tag exists */
@@ -171,37 +217,606 @@ amendLineNbr(json_object *const json, const int line_nbr)
 	}
 }
 
-#define DEFAULT_LINE_SIZE (10 * 1024)
+#define READ_BLOCK_SIZE (1024 * 1024)
+#define RULE_STATS_SAMPLING 16	/**< with -R, time every n-th message */
 
-static char *
-read_line(FILE *fp)
+/* Input line reader. Regular files given via -i are memory-mapped and
+ * lines are handed out as slices of the mapping, which stay valid until
+ * the reader is closed. Everything else (most importantly stdin) is read
+ * into a large block buffer which is reused; there, lines are only valid
+ * until the next call to lineReaderNext().
+ */
+struct lineReader {
+	int fd;
+	const char *map;	/**< mapped file, NULL if block mode */
+	size_t lenMap;
+	size_t offsMap;
+	char *lastLine;		/**< NUL-terminated copy of an unterminated final line */
+	char *blk;		/**< block buffer */
+	size_t sizeBlk;
+	size_t begBlk;		/**< start of unprocessed data */
+	size_t scannedBlk;	/**< up to here, there is no LF */
+	size_t endBlk;		/**< end of valid data */
+	int eof;
+};
+
+static int
+lineReaderOpen(struct lineReader *const rd, const char *const fn)
 {
-	size_t line_capacity = DEFAULT_LINE_SIZE;
-	char *line = NULL;
-	size_t line_len = 0;
-	char ch = 0;
-	do {
-		ch = fgetc(fp);
-		if (ch == EOF) break;
-		if (line == NULL) {
-			line = malloc(line_capacity);
-		} else if (line_len == line_capacity) {
-			line_capacity *= 2;
-			line = realloc(line, line_capacity);
+	struct stat st;
+	int r = -1;
+
+	memset(rd, 0, sizeof(*rd));
+	if(fn == NULL) {
+		rd->fd = STDIN_FILENO;
+	} else if((rd->fd = open(fn, O_RDONLY)) == -1) {
+		perror(fn);
+		goto done;
+	}
+
+	if(fn != NULL && fstat(rd->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		if(st.st_size == 0) {
+			rd->eof = 1;
+			r = 0;
+			goto done;
 		}
-		if (line == NULL) {
+		void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, rd->fd, 0);
+		if(map != MAP_FAILED) {
+#			ifdef MADV_SEQUENTIAL
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+#			endif
+			rd->map = map;
+			rd->lenMap = st.st_size;
+			r = 0;
+			goto done;
+		}
+		/* could not map, fall back to reading it */
+	}
+
+	rd->sizeBlk = READ_BLOCK_SIZE;
+	/* one more byte, so that a final line without LF can be terminated */
+	if((rd->blk = malloc(rd->sizeBlk + 1)) == NULL) {
+		fprintf(stderr, "Couldn't allocate input buffer\n");
+		goto done;
+	}
+	r = 0;
+done:	return r;
+}
+
+static void
+lineReaderClose(struct lineReader *const rd)
+{
+	if(rd->map != NULL)
+		munmap((void*) rd->map, rd->lenMap);
+	free(rd->lastLine);
+	free(rd->blk);
+	if(rd->fd != STDIN_FILENO && rd->fd != -1)
+		close(rd->fd);
+}
+
+/* read more data into the block buffer, making room if needed */
+static void
+lineReaderFill(struct lineReader *const rd)
+{
+	ssize_t n;
+
+	if(rd->begBlk > 0) {
+		memmove(rd->blk, rd->blk + rd->begBlk, rd->endBlk - rd->begBlk);
+		rd->endBlk -= rd->begBlk;
+		rd->scannedBlk -= rd->begBlk;
+		rd->begBlk = 0;
+	}
+	if(rd->endBlk == rd->sizeBlk) { /* line longer than buffer */
+		char *const newblk = realloc(rd->blk, 2 * rd->sizeBlk + 1);
+		if(newblk == NULL) {
 			fprintf(stderr, "Couldn't allocate working-buffer for log-line\n");
-			return NULL;
+			rd->eof = 1;
+			return;
 		}
-		line[line_len++] = ch;
-	} while(ch != '\n');
+		rd->blk = newblk;
+		rd->sizeBlk *= 2;
+	}
+	do {
+		n = read(rd->fd, rd->blk + rd->endBlk, rd->sizeBlk - rd->endBlk);
+	} while(n == -1 && errno == EINTR);
+	if(n <= 0) {
+		if(n == -1)
+			perror("lognormalizer: read");
+		rd->eof = 1;
+	} else {
+		rd->endBlk += n;
+	}
+}
 
-	if (line != NULL) {
-		line[--line_len] = '\0';
-		if(line_len > 0 && line[line_len - 1] == '\r')
-			line[--line_len] = '\0';
+/* obtain the next line (without LF or CRLF). Returns 0 at end of input.
+ * The final line does not need to be terminated by LF. Some parsers look
+ * a byte or two beyond the end of the message, so such a line is always
+ * followed by a NUL, just as every other line is followed by its LF.
+ */
+static int
+lineReaderNext(struct lineReader *const rd, const char **const line, size_t *const lenLine)
+{
+	const char *lf;
+	size_t len;
+
+	if(rd->map == NULL && rd->blk == NULL) /* empty file */
+		return 0;
+	if(rd->map != NULL) {
+		if(rd->offsMap >= rd->lenMap)
+			return 0;
+		*line = rd->map + rd->offsMap;
+		lf = memchr(*line, '\n', rd->lenMap - rd->offsMap);
+		len = (lf == NULL) ? rd->lenMap - rd->offsMap : (size_t) (lf - *line);
+		rd->offsMap += len + 1;
+		if(lf == NULL) {
+			/* the mapping may end right at a page boundary */
+			if((rd->lastLine = malloc(len + 1)) == NULL) {
+				fprintf(stderr, "Couldn't allocate working-buffer for log-line\n");
+				return 0;
+			}
+			memcpy(rd->lastLine, *line, len);
+			rd->lastLine[len] = '\0';
+			*line = rd->lastLine;
+		}
+	} else {
+		while((lf = memchr(rd->blk + rd->scannedBlk, '\n',
+				   rd->endBlk - rd->scannedBlk)) == NULL) {
+			rd->scannedBlk = rd->endBlk;
+			if(rd->eof)
+				break;
+			lineReaderFill(rd);
+		}
+		if(lf == NULL && rd->begBlk == rd->endBlk)
+			return 0;
+		*line = rd->blk + rd->begBlk;
+		len = (lf == NULL) ? rd->endBlk - rd->begBlk : (size_t) (lf - *line);
+		if(lf == NULL)
+			rd->blk[rd->endBlk] = '\0';
+		rd->begBlk = (lf == NULL) ? rd->endBlk : rd->begBlk + len + 1;
+		rd->scannedBlk = rd->begBlk;
+	}
+	if(len > 0 && (*line)[len - 1] == '\r')
+		--len;
+	*lenLine = len;
+	return 1;
+}
+
+/* record counters, kept per batch in multi-threaded mode */
+struct recstats {
+	long long unsigned parsed;
+	long long unsigned unparsed;
+	long long unsigned wrongTag;
+};
+
+static struct recstats totals;
+static char *mandatoryTagCstr = NULL;
+static size_t batchSize = 0;	/**< number of messages to normalize at once, 0 - default */
+static int nWorkers = 0;	/**< number of normalizer threads, 0 - no threading */
+static int bUnordered = 0;	/**< in threaded mode, output in completion order? */
+static const char *inputFile = NULL;	/**< file to read, NULL - stdin */
+static int bUseSpans = 0;	/**< normalize in span mode, build JSON lazily */
+#define DEFAULT_MT_BATCH_SIZE 256
+
+/* output a normalized event and update counters. The event is
+ * destructed.
+ */
+static void
+processEvent(struct outSink *const out, struct recstats *const stats,
+	struct json_object *const json, const char *const line, const size_t lenLine,
+	const int line_nbr)
+{
+	if(json == NULL)
+		return;
+	if(eventHasTag(json, mandatoryTagCstr)) {
+		struct json_object *dummy;
+		const int parsed = !json_object_object_get_ex(json,
+			"unparsed-data", &dummy);
+		if(parsed) {
+			stats->parsed++;
+			if(recOutput & OUTPUT_PARSED_RECS) {
+				outputEvent(out, json, line, lenLine);
+			}
+		} else {
+			stats->unparsed++;
+			amendLineNbr(json, line_nbr);
+			if(recOutput & OUTPUT_UNPARSED_RECS) {
+				outputEvent(out, json, line, lenLine);
+			}
+		}
+	} else {
+		stats->wrongTag++;
+	}
+	json_object_put(json);
+}
+
+/* output an event normalized in span mode and update counters. If
+ * possible, JSON text is written directly from the spans, without
+ * building the event. rNorm is the ln_normalizeSpans() result.
+ */
+static void
+processSpans(struct outSink *const out, struct recstats *const stats,
+	ln_spans spans, const int rNorm, struct json_object **json,
+	const char *const line, const size_t lenLine, const int line_nbr)
+{
+	size_t len;
+
+	if(outfmt != f_json || mandatoryTagCstr != NULL || (addErrLineNbr && rNorm != 0)) {
+		ln_spansToJSON(spans, json);
+		processEvent(out, stats, *json, line, lenLine, line_nbr);
+		*json = NULL;
+		return;
+	}
+	if(rNorm == 0) {
+		stats->parsed++;
+		if(!(recOutput & OUTPUT_PARSED_RECS))
+			return;
+	} else {
+		stats->unparsed++;
+		if(!(recOutput & OUTPUT_UNPARSED_RECS))
+			return;
+	}
+	if(ln_spansToJSONStr(spans, &out->jsonBuf, &out->sizeJsonBuf, &len,
+			     flatTags ? 0 : LN_JSONSTR_NO_TAGS) != 0)
+		return;
+	if(verbose > 0) fprintf(stderr, "normalized: '%s'\n", out->jsonBuf);
+	fwrite(out->jsonBuf, 1, len, out->fp);
+	fputc('\n', out->fp);
+}
+
+/* a batch of input lines, which is normalized as a whole */
+struct batch {
+	struct batch *next;
+	size_t seq;		/**< sequence number, for ordered output */
+	size_t nlines;
+	int first_line_nbr;
+	const char **lines;
+	size_t *lens;
+	char *buf;		/**< copy of the lines, if input is not mapped */
+	size_t sizeBuf;
+	struct json_object **jsons;
+	char *out;		/**< rendered output (threaded mode only) */
+	size_t lenOut;
+	struct recstats stats;
+};
+
+static struct batch *
+batchNew(void)
+{
+	struct batch *b;
+
+	if((b = calloc(1, sizeof(struct batch))) == NULL)
+		goto done;
+	b->lines = calloc(batchSize, sizeof(char*));
+	b->lens = calloc(batchSize, sizeof(size_t));
+	b->jsons = calloc(batchSize, sizeof(struct json_object*));
+	if(b->lines == NULL || b->lens == NULL || b->jsons == NULL) {
+		free(b->lines);
+		free(b->lens);
+		free(b->jsons);
+		free(b);
+		b = NULL;
+	}
+done:
+	if(b == NULL)
+		fprintf(stderr, "Couldn't allocate working-buffer for batch\n");
+	return b;
+}
+
+static void
+batchDestruct(struct batch *const b)
+{
+	free(b->lines);
+	free(b->lens);
+	free(b->jsons);
+	free(b->buf);
+	free(b->out);
+	free(b);
+}
+
+/* fill a batch from the input. Returns number of lines read, 0 at end
+ * of input. Lines from a mapped file are referenced, all others are
+ * copied into the (reused) batch buffer, as they become invalid on the
+ * next read.
+ */
+static size_t
+batchRead(struct lineReader *const rd, struct batch *const b, int *const line_nbr)
+{
+	const char *line;
+	size_t lenLine;
+	size_t lenBuf = 0;
+
+	b->first_line_nbr = *line_nbr + 1;
+	for(b->nlines = 0 ; b->nlines < batchSize ; ++b->nlines) {
+		if(!lineReaderNext(rd, &line, &lenLine))
+			break;
+		if(verbose > 0) fprintf(stderr, "To normalize: '%.*s'\n", (int) lenLine, line);
+		if(rd->map == NULL) {
+			if(lenBuf + lenLine > b->sizeBuf) {
+				size_t newsize = (b->sizeBuf == 0) ? 64 * 1024 : 2 * b->sizeBuf;
+				while(newsize < lenBuf + lenLine)
+					newsize *= 2;
+				char *const newbuf = realloc(b->buf, newsize);
+				if(newbuf == NULL) {
+					fprintf(stderr, "Couldn't allocate working-buffer for batch\n");
+					break;
+				}
+				b->buf = newbuf;
+				b->sizeBuf = newsize;
+			}
+			memcpy(b->buf + lenBuf, line, lenLine);
+			lenBuf += lenLine;
+		} else {
+			b->lines[b->nlines] = line;
+		}
+		b->lens[b->nlines] = lenLine;
+	}
+	if(rd->map == NULL) {
+		/* buffer may have moved while filling, so set pointers now */
+		lenBuf = 0;
+		for(size_t i = 0 ; i < b->nlines ; ++i) {
+			b->lines[i] = b->buf + lenBuf;
+			lenBuf += b->lens[i];
+		}
+	}
+	*line_nbr += b->nlines;
+	return b->nlines;
+}
+
+/* normalize a batch and write the resulting events to out.
+ */
+static void
+batchNormalize(struct batch *const b, struct outSink *const out)
+{
+	ln_normalizeBatch(ctx, b->nlines, b->lines, b->lens, b->jsons, NULL);
+	for(size_t i = 0 ; i < b->nlines ; ++i) {
+		processEvent(out, &b->stats, b->jsons[i], b->lines[i], b->lens[i],
+			b->first_line_nbr + (int) i);
+		b->jsons[i] = NULL;
+	}
+}
+
+/* normalize input data in batches of batchSize messages
+ */
+static void
+normalizeBatches(struct lineReader *const rd)
+{
+	struct batch *b;
+	struct outSink out;
+	int line_nbr = 0;
+
+	if((b = batchNew()) == NULL)
+		return;
+	outSinkInit(&out, stdout);
+	while(batchRead(rd, b, &line_nbr) > 0) {
+		batchNormalize(b, &out);
+	}
+	outSinkExit(&out);
+	totals = b->stats;
+	batchDestruct(b);
+}
+
+/* Multi-threaded mode. A reader thread splits the input into batches,
+ * nWorkers threads normalize them (all sharing the single context) and
+ * render their output into memory. The main thread finally writes the
+ * rendered batches, either in input order or in completion order.
+ * The number of batches in flight is limited, so memory use is bounded
+ * even if the writer is slow.
+ */
+static struct {
+	pthread_mutex_t mut;
+	pthread_cond_t condWork;	/**< work queue non-empty or eof */
+	pthread_cond_t condDone;	/**< batch finished or eof */
+	pthread_cond_t condSpace;	/**< batch in flight released */
+	struct batch *workRoot;
+	struct batch *workLast;
+	struct batch *doneRoot;
+	unsigned inflight;
+	unsigned maxInflight;
+	size_t nbatches;		/**< batches read so far */
+	int eof;
+	long long unsigned nread;
+	double readTime;
+	long long unsigned nnormalized;
+	double normTime;
+} pipeline;
+
+static double
+monotonicTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+readerThread(void *const arg)
+{
+	struct lineReader *const rd = (struct lineReader*) arg;
+	struct batch *b;
+	int line_nbr = 0;
+	double t;
+
+	while(1) {
+		if((b = batchNew()) == NULL)
+			break;
+		t = monotonicTime();
+		if(batchRead(rd, b, &line_nbr) == 0) {
+			batchDestruct(b);
+			break;
+		}
+		pipeline.readTime += monotonicTime() - t;
+		pipeline.nread += b->nlines;
+		pthread_mutex_lock(&pipeline.mut);
+		while(pipeline.inflight >= pipeline.maxInflight)
+			pthread_cond_wait(&pipeline.condSpace, &pipeline.mut);
+		b->seq = pipeline.nbatches++;
+		if(pipeline.workLast == NULL)
+			pipeline.workRoot = b;
+		else
+			pipeline.workLast->next = b;
+		pipeline.workLast = b;
+		++pipeline.inflight;
+		pthread_cond_signal(&pipeline.condWork);
+		pthread_mutex_unlock(&pipeline.mut);
+	}
+
+	pthread_mutex_lock(&pipeline.mut);
+	pipeline.eof = 1;
+	pthread_cond_broadcast(&pipeline.condWork);
+	pthread_cond_broadcast(&pipeline.condDone);
+	pthread_mutex_unlock(&pipeline.mut);
+	return NULL;
+}
+
+static void *
+workerThread(void __attribute__((unused)) *arg)
+{
+	struct batch *b;
+	struct outSink out;
+	FILE *fpOut;
+	double t;
+
+	outSinkInit(&out, NULL);
+	while(1) {
+		pthread_mutex_lock(&pipeline.mut);
+		while(pipeline.workRoot == NULL && !pipeline.eof)
+			pthread_cond_wait(&pipeline.condWork, &pipeline.mut);
+		b = pipeline.workRoot;
+		if(b != NULL) {
+			pipeline.workRoot = b->next;
+			if(pipeline.workRoot == NULL)
+				pipeline.workLast = NULL;
+		}
+		pthread_mutex_unlock(&pipeline.mut);
+		if(b == NULL)
+			break;
+
+		t = monotonicTime();
+		if((fpOut = open_memstream(&b->out, &b->lenOut)) == NULL) {
+			perror("lognormalizer: open_memstream");
+			exit(1);
+		}
+		out.fp = fpOut;
+		batchNormalize(b, &out);
+		fclose(fpOut);
+		t = monotonicTime() - t;
+
+		pthread_mutex_lock(&pipeline.mut);
+		pipeline.normTime += t;
+		pipeline.nnormalized += b->nlines;
+		b->next = pipeline.doneRoot;
+		pipeline.doneRoot = b;
+		pthread_cond_broadcast(&pipeline.condDone);
+		pthread_mutex_unlock(&pipeline.mut);
+	}
+	outSinkExit(&out);
+	return NULL;
+}
+
+/* take the next batch to be written off the done list. Must be called
+ * with the pipeline mutex locked. Returns NULL if none is ready.
+ */
+static struct batch *
+takeDoneBatch(const size_t nextSeq)
+{
+	struct batch **pb;
+	struct batch *b = NULL;
+
+	for(pb = &pipeline.doneRoot ; *pb != NULL ; pb = &(*pb)->next) {
+		if(bUnordered || (*pb)->seq == nextSeq) {
+			b = *pb;
+			*pb = b->next;
+			break;
+		}
+	}
+	return b;
+}
+
+static void
+normalizeThreaded(struct lineReader *const rd)
+{
+	pthread_t reader;
+	pthread_t *workers;
+	struct batch *b;
+	size_t nextSeq = 0;
+	long long unsigned bytesWritten = 0;
+	double writeTime = 0.0;
+	double t;
+	const double tStart = monotonicTime();
+
+	if((workers = calloc(nWorkers, sizeof(pthread_t))) == NULL) {
+		fprintf(stderr, "Couldn't allocate worker table\n");
+		exit(1);
+	}
+	pthread_mutex_init(&pipeline.mut, NULL);
+	pthread_cond_init(&pipeline.condWork, NULL);
+	pthread_cond_init(&pipeline.condDone, NULL);
+	pthread_cond_init(&pipeline.condSpace, NULL);
+	pipeline.maxInflight = 4 * nWorkers;
+	if(pthread_create(&reader, NULL, readerThread, rd) != 0) {
+		fprintf(stderr, "Couldn't create reader thread\n");
+		exit(1);
+	}
+	for(int i = 0 ; i < nWorkers ; ++i) {
+		if(pthread_create(&workers[i], NULL, workerThread, NULL) != 0) {
+			fprintf(stderr, "Couldn't create worker thread\n");
+			exit(1);
+		}
+	}
+
+	/* writer */
+	while(1) {
+		pthread_mutex_lock(&pipeline.mut);
+		while((b = takeDoneBatch(nextSeq)) == NULL
+		      && !(pipeline.eof && nextSeq == pipeline.nbatches))
+			pthread_cond_wait(&pipeline.condDone, &pipeline.mut);
+		pthread_mutex_unlock(&pipeline.mut);
+		if(b == NULL)
+			break;
+
+		t = monotonicTime();
+		fwrite(b->out, 1, b->lenOut, stdout);
+		writeTime += monotonicTime() - t;
+		bytesWritten += b->lenOut;
+		totals.parsed += b->stats.parsed;
+		totals.unparsed += b->stats.unparsed;
+		totals.wrongTag += b->stats.wrongTag;
+		batchDestruct(b);
+		++nextSeq;
+
+		pthread_mutex_lock(&pipeline.mut);
+		--pipeline.inflight;
+		pthread_cond_signal(&pipeline.condSpace);
+		pthread_mutex_unlock(&pipeline.mut);
+	}
+	t = monotonicTime();
+	fflush(stdout);
+	writeTime += monotonicTime() - t;
+
+	pthread_join(reader, NULL);
+	for(int i = 0 ; i < nWorkers ; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	pthread_cond_destroy(&pipeline.condWork);
+	pthread_cond_destroy(&pipeline.condDone);
+	pthread_cond_destroy(&pipeline.condSpace);
+	pthread_mutex_destroy(&pipeline.mut);
+
+	if(outputSummaryLine) {
+		const double tTotal = monotonicTime() - tStart;
+		fprintf(stderr, "reader: %llu records in %.3fs busy (%.0f records/s)\n",
+			pipeline.nread, pipeline.readTime,
+			pipeline.readTime > 0.0 ? pipeline.nread / pipeline.readTime : 0.0);
+		fprintf(stderr, "normalizer: %llu records in %.3fs busy on %d workers "
+			"(%.0f records/s per worker)\n",
+			pipeline.nnormalized, pipeline.normTime, nWorkers,
+			pipeline.normTime > 0.0 ? pipeline.nnormalized / pipeline.normTime : 0.0);
+		fprintf(stderr, "writer: %llu bytes in %.3fs busy (%.1f MB/s)\n",
+			bytesWritten, writeTime,
+			writeTime > 0.0 ? bytesWritten / writeTime / (1024 * 1024) : 0.0);
+		fprintf(stderr, "total: %llu records in %.3fs (%.0f records/s)\n",
+			pipeline.nread, tTotal, tTotal > 0.0 ? pipeline.nread / tTotal : 0.0);
 	}
-	return line;
 }
 
 /* normalize input data
@@ -209,55 +824,55 @@ read_line(FILE *fp)
 static void
 normalize(void)
 {
-	FILE *fp = stdin;
-	char *line = NULL;
+	struct lineReader rd;
+	const char *line;
+	size_t lenLine;
 	struct json_object *json = NULL;
-	long long unsigned numParsed = 0;
-	long long unsigned numUnparsed = 0;
-	long long unsigned numWrongTag = 0;
-	char *mandatoryTagCstr = NULL;
+	ln_spans spans = NULL;
 	int line_nbr = 0;	/* must be int to keep compatible with older json-c */
 	
+	if(lineReaderOpen(&rd, inputFile) != 0)
+		exit(1);
+	if(bUseSpans && (spans = ln_newSpans()) == NULL) {
+		fprintf(stderr, "Couldn't allocate span arena\n");
+		exit(1);
+	}
 	if (mandatoryTag != NULL) {
 		mandatoryTagCstr = es_str2cstr(mandatoryTag, NULL);
 	}
+	if(batchSize == 0)
+		batchSize = (nWorkers > 0) ? DEFAULT_MT_BATCH_SIZE : 1;
 
-	while((line = read_line(fp)) != NULL) {
-		++line_nbr;
-		if(verbose > 0) fprintf(stderr, "To normalize: '%s'\n", line);
-		ln_normalize(ctx, line, strlen(line), &json);
-		if(json != NULL) {
-			if(eventHasTag(json, mandatoryTagCstr)) {
-				struct json_object *dummy;
-				const int parsed = !json_object_object_get_ex(json,
-					"unparsed-data", &dummy);
-				if(parsed) {
-					numParsed++;
-					if(recOutput & OUTPUT_PARSED_RECS) {
-						outputEvent(json, line);
-					}
-				} else {
-					numUnparsed++;
-					amendLineNbr(json, line_nbr);
-					if(recOutput & OUTPUT_UNPARSED_RECS) {
-						outputEvent(json, line);
-					}
-				}
+	if(nWorkers > 0) {
+		normalizeThreaded(&rd);
+	} else if(batchSize > 1) {
+		normalizeBatches(&rd);
+	} else {
+		struct outSink out;
+		outSinkInit(&out, stdout);
+		while(lineReaderNext(&rd, &line, &lenLine)) {
+			++line_nbr;
+			if(verbose > 0) fprintf(stderr, "To normalize: '%.*s'\n", (int) lenLine, line);
+			if(bUseSpans) {
+				const int r = ln_normalizeSpans(ctx, line, lenLine, spans);
+				processSpans(&out, &totals, spans, r, &json, line, lenLine, line_nbr);
 			} else {
-				numWrongTag++;
+				ln_normalize(ctx, line, lenLine, &json);
+				processEvent(&out, &totals, json, line, lenLine, line_nbr);
+				json = NULL;
 			}
-			json_object_put(json);
-			json = NULL;
 		}
-        free(line);
+		outSinkExit(&out);
 	}
-	if(outputNbrUnparsed && numUnparsed > 0)
-		fprintf(stderr, "%llu unparsable entries\n", numUnparsed);
-	if(numWrongTag > 0)
-		fprintf(stderr, "%llu entries with wrong tag dropped\n", numWrongTag);
+	lineReaderClose(&rd);
+	ln_deleteSpans(spans);
+	if(outputNbrUnparsed && totals.unparsed > 0)
+		fprintf(stderr, "%llu unparsable entries\n", totals.unparsed);
+	if(totals.wrongTag > 0)
+		fprintf(stderr, "%llu entries with wrong tag dropped\n", totals.wrongTag);
 	if(outputSummaryLine) {
 		fprintf(stderr, "%llu records processed, %llu parsed, %llu unparsed\n",
-			numParsed+numUnparsed, numParsed, numUnparsed);
+			totals.parsed+totals.unparsed, totals.parsed, totals.unparsed);
 	}
 	free(mandatoryTagCstr);
 }
@@ -297,6 +912,8 @@ handle_generic_option(const char* opt) {
 		ln_setCtxOpts(ctx, LN_CTXOPT_ADD_RULE);
 	} else if (strcmp("addRuleLocation", opt) == 0) {
 		ln_setCtxOpts(ctx, LN_CTXOPT_ADD_RULE_LOCATION);
+	} else if (strcmp("memoize", opt) == 0) {
+		ln_setCtxOpts(ctx, LN_CTXOPT_MEMOIZE);
 	} else {
 		fprintf(stderr, "invalid -o option '%s'\n", opt);
 		exit(1);
@@ -307,7 +924,12 @@ static void usage(void)
 {
 fprintf(stderr,
 	"Options:\n"
-	"    -r<rulebase> Rulebase to use. This is required option\n"
+	"    -r<rulebase> Rulebase to use. This is required option. If given\n"
+	"                 multiple times, all rulebases are loaded in order\n"
+	"    -C<file>     Use binary rulebase cache file; it is (re)created if\n"
+	"                 missing or outdated\n"
+	"    -J<n>        Load rulebase with up to n threads (default: number of CPUs)\n"
+	"    -i<file>     Read messages from file instead of stdin\n"
 	"    -H           print summary line (nbr of msgs Handled)\n"
 	"    -U           print number of unparsed messages (only if non-zero)\n"
 	"    -e<json|xml|csv|cee-syslog|raw>\n"
@@ -319,12 +941,20 @@ fprintf(stderr,
 	"    -oallowRegex Allow regexp matching (read docs about performance penalty)\n"
 	"    -oaddRule    Add a mockup of the matching rule.\n"
 	"    -oaddRuleLocation Add location of matching rule to metadata\n"
+	"    -omemoize    Do not retry parse paths that already failed for a\n"
+	"                 message (bounds backtracking)\n"
 	"    -oaddExecPath Add exec_path attribute to output\n"
 	"    -oaddOriginalMsg Always add original message to output, not just in error case\n"
 	"    -p           Print back only if the message has been parsed succesfully\n"
 	"    -P           Print back only if the message has NOT been parsed succesfully\n"
 	"    -L           Add source file line number information to unparsed line output\n"
 	"    -t<tag>      Print back only messages matching the tag\n"
+	"    -m<n>        Give up on a message after n parser calls\n"
+	"    -w<usec>     Give up on a message after usec microseconds\n"
+	"    -b<n>        Normalize messages in batches of n (default 1)\n"
+	"    -j<n>        Normalize with n threads (default: single-threaded)\n"
+	"    -u           With -j, output in completion order instead of input order\n"
+	"    -l           Normalize in span mode and build JSON lazily (not with -b/-j)\n"
 	"    -v           Print debug. When used 3 times, prints parse DAG\n"
 	"    -V           Print version information\n"
 	"    -d           Print DOT file to stdout and exit\n"
@@ -332,6 +962,8 @@ fprintf(stderr,
 	"    -s<filename> Print parse dag statistics and exit\n"
 	"    -S<filename> Print extended parse dag statistics and exit (includes -s)\n"
 	"    -x<filename> Print statistics as dot file (called only)\n"
+	"    -R<filename> Collect per-rule statistics and write them as JSON\n"
+	"                 to the file at end ('-' for stdout)\n"
 	"\n"
 	);
 }
@@ -339,10 +971,13 @@ fprintf(stderr,
 int main(int argc, char *argv[])
 {
 	int opt;
-	char *repository = NULL;
+	char *repository[MAX_RULEBASES];
+	int nRepositories = 0;
+	char *cacheFile = NULL;
 	int ret = 0;
 	FILE *fpStats = NULL;
 	FILE *fpStatsDOT = NULL;
+	FILE *fpRuleStats = NULL;
 	int extendedStats = 0;
 
 	if((ctx = ln_initCtx()) == NULL) {
@@ -351,7 +986,7 @@ int main(int argc, char *argv[])
 		goto exit;
 	}
 	
-	while((opt = getopt(argc, argv, "d:s:S:e:r:E:vVpPt:To:hHULx:")) != -1) {
+	while((opt = getopt(argc, argv, "d:s:S:e:r:C:J:E:vVpPt:To:hHULx:b:j:ui:lR:m:w:")) != -1) {
 		switch (opt) {
 		case 'V':
 			printVersion();
@@ -434,7 +1069,23 @@ int main(int argc, char *argv[])
 			}
 			break;
 		case 'r': /* rule base to use */
-			repository = optarg;
+			if(nRepositories == MAX_RULEBASES) {
+				fprintf(stderr, "too many rule bases, max is %d\n", MAX_RULEBASES);
+				ret = 1;
+				goto exit;
+			}
+			repository[nRepositories++] = optarg;
+			break;
+		case 'C': /* rulebase cache to use */
+			cacheFile = optarg;
+			break;
+		case 'J': /* number of rulebase loading threads */
+			if(atoi(optarg) < 1) {
+				fprintf(stderr, "invalid number of threads '%s'\n", optarg);
+				ret = 1;
+				goto exit;
+			}
+			ln_setLoadThreads(ctx, atoi(optarg));
 			break;
 		case 't': /* if given, only messages tagged with the argument
 			     are output */
@@ -443,6 +1094,59 @@ int main(int argc, char *argv[])
 		case 'o':
 			handle_generic_option(optarg);
 			break;
+		case 'b': /* normalize in batches */
+			if(atoi(optarg) < 1) {
+				fprintf(stderr, "invalid batch size '%s'\n", optarg);
+				ret = 1;
+				goto exit;
+			}
+			batchSize = atoi(optarg);
+			break;
+		case 'j': /* number of normalizer threads */
+			if(atoi(optarg) < 1) {
+				fprintf(stderr, "invalid number of threads '%s'\n", optarg);
+				ret = 1;
+				goto exit;
+			}
+			nWorkers = atoi(optarg);
+			break;
+		case 'u':
+			bUnordered = 1;
+			break;
+		case 'm': /* max parser calls per message */
+			if(atoi(optarg) < 1) {
+				fprintf(stderr, "invalid number of parser calls '%s'\n", optarg);
+				ret = 1;
+				goto exit;
+			}
+			budgetMaxCalls = atoi(optarg);
+			break;
+		case 'w': /* max time per message */
+			if(atoi(optarg) < 1) {
+				fprintf(stderr, "invalid time limit '%s'\n", optarg);
+				ret = 1;
+				goto exit;
+			}
+			budgetMaxUsec = atoi(optarg);
+			break;
+		case 'i': /* input file */
+			inputFile = optarg;
+			break;
+		case 'l': /* span mode */
+			bUseSpans = 1;
+			break;
+		case 'R': /* per-rule statistics */
+			if(!strcmp(optarg, "-")) {
+				fpRuleStats = stdout;
+			} else {
+				if((fpRuleStats = fopen(optarg, "w")) == NULL) {
+					perror(optarg);
+					complain("Cannot open rule statistics file");
+					ret = 1;
+					goto exit;
+				}
+			}
+			break;
 		case 'h':
 		default:
 			usage();
@@ -452,7 +1156,13 @@ int main(int argc, char *argv[])
 		}
 	}
 	
-	if(repository == NULL) {
+	if(bUseSpans && (nWorkers > 0 || batchSize > 1)) {
+		complain("span mode (-l) can not be combined with -b or -j");
+		ret = 1;
+		goto exit;
+	}
+
+	if(nRepositories == 0) {
 		complain("Samples repository must be given (-r)");
 		ret = 1;
 		goto exit;
@@ -464,9 +1174,13 @@ int main(int argc, char *argv[])
 		ln_enableDebug(ctx, 1);
 	}
 
-	if(ln_loadSamples(ctx, repository)) {
-		fprintf(stderr, "fatal error: cannot load rulebase\n");
-		exit(1);
+	/* the cache, if any, is used for the first rule base only */
+	for(int i = 0 ; i < nRepositories ; ++i) {
+		if(cacheFile == NULL || i > 0 ? ln_loadSamples(ctx, repository[i])
+			     : ln_loadSamplesCached(ctx, repository[i], cacheFile)) {
+			fprintf(stderr, "fatal error: cannot load rulebase\n");
+			exit(1);
+		}
 	}
 
 	if(verbose > 0)
@@ -480,7 +1194,28 @@ int main(int argc, char *argv[])
 
 	if(verbose > 2) ln_displayPDAG(ctx);
 
+	if(fpRuleStats != NULL)
+		ln_setRuleStats(ctx, RULE_STATS_SAMPLING);
+	if(budgetMaxCalls != 0 || budgetMaxUsec != 0)
+		ln_setNormalizeBudget(ctx, budgetMaxCalls, budgetMaxUsec);
+
 	normalize();
+	if(ln_budgetExceededCount(ctx) > 0)
+		fprintf(stderr, "%llu entries exceeded the normalization budget\n",
+			(unsigned long long) ln_budgetExceededCount(ctx));
+
+	if(fpRuleStats != NULL) {
+		struct json_object *ruleStats;
+		if(ln_ruleStatsToJSON(ctx, &ruleStats) == 0) {
+			fprintf(fpRuleStats, "%s\n", json_object_to_json_string(ruleStats));
+			json_object_put(ruleStats);
+		} else {
+			complain("Cannot obtain rule statistics (v1 rulebase?)");
+			ret = 1;
+		}
+		if(fpRuleStats != stdout)
+			fclose(fpRuleStats);
+	}
 
 	if(fpStats != NULL) {
 		ln_fullPdagStats(ctx, fpStats, extendedStats);
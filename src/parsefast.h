@@ -0,0 +1,149 @@
+/**
+ * @file parsefast.h
+ * @brief Inline matchers for the most frequently used field parsers.
+ *
+ * The normalizer calls parsers via the parser lookup table, which means
+ * an indirect call with the full parser interface for each try. For
+ * the parsers that are used by almost every rule base (literal, word,
+ * number, whitespace, char-to and rest), the normalizer instead
+ * dispatches on the parser ID and calls the matchers in this file,
+ * which the compiler can inline. They only find out how far the field
+ * extends; the value, if needed, is always a string of the matched
+ * text. The regular parser functions use the same matchers, so that
+ * both ways always give the same result.
+ *//*
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#ifndef LIBLOGNORM_PARSEFAST_H_INCLUDED
+#define	LIBLOGNORM_PARSEFAST_H_INCLUDED
+#include <stddef.h>
+#include <ctype.h>
+#include "liblognorm.h"
+#include "helpers.h"
+#include "scan.h"
+
+struct data_Literal {
+	const char *lit;
+	const char *json_conf;
+};
+
+struct data_CharTo {
+	char *term_chars;
+	size_t n_term_chars;
+	char *data_for_display;
+	struct ln_scanset set;
+};
+
+/* All matchers receive
+ *
+ * @param[in] str the to-be-parsed string
+ * @param[in] strLen length of the to-be-parsed string
+ * @param[in] offs an offset into the string
+ * @param[in] pdata parser data block (NULL if the parser has none)
+ * @param[out] parsed bytes
+ *
+ * and return 0 on success and LN_WRONGPARSER otherwise.
+ */
+
+/* A literal always reports how far it got, even if it does not match. */
+static inline int
+ln_fastParseLiteral(const char *const str, const size_t strLen, const size_t offs,
+	const void *const pdata, size_t *const parsed)
+{
+	const char *const lit = ((const struct data_Literal*) pdata)->lit;
+	size_t i = offs;
+	size_t j;
+
+	for(j = 0 ; i < strLen ; ++j) {
+		if(lit[j] != str[i])
+			break;
+		++i;
+	}
+	*parsed = j;
+	return (lit[j] == '\0') ? 0 : LN_WRONGPARSER;
+}
+
+static inline int
+ln_fastParseWord(const char *const str, const size_t strLen, const size_t offs,
+	__attribute__((unused)) const void *const pdata, size_t *const parsed)
+{
+	const size_t len = ln_scanChar(' ', str + offs, strLen - offs);
+
+	*parsed = len;
+	return (len == 0) ? LN_WRONGPARSER : 0;
+}
+
+static inline int
+ln_fastParseNumber(const char *const str, const size_t strLen, const size_t offs,
+	__attribute__((unused)) const void *const pdata, size_t *const parsed)
+{
+	size_t i;
+
+	for(i = offs ; i < strLen && myisdigit(str[i]) ; ++i)
+		;
+	*parsed = i - offs;
+	return (i == offs) ? LN_WRONGPARSER : 0;
+}
+
+/* Runs of ASCII whitespace are skipped in bulk, anything else the
+ * locale considers whitespace is checked one by one.
+ */
+static inline int
+ln_fastParseWhitespace(const char *const str, const size_t strLen, const size_t offs,
+	__attribute__((unused)) const void *const pdata, size_t *const parsed)
+{
+	size_t i = offs;
+
+	*parsed = 0;
+	if(i >= strLen || !isspace(str[i]))
+		return LN_WRONGPARSER;
+	for(i++ ; i < strLen && isspace(str[i]) ; ) {
+		++i;
+		i += ln_scanSpaces(str + i, strLen - i);
+	}
+	*parsed = i - offs;
+	return 0;
+}
+
+/* The field must neither be empty nor extend to the end of the string. */
+static inline int
+ln_fastParseCharTo(const char *const str, const size_t strLen, const size_t offs,
+	const void *const pdata, size_t *const parsed)
+{
+	const struct data_CharTo *const data = (const struct data_CharTo*) pdata;
+	const size_t len = ln_scanSet(&data->set, str + offs, strLen - offs);
+
+	if(len == 0 || offs + len == strLen) {
+		*parsed = 0;
+		return LN_WRONGPARSER;
+	}
+	*parsed = len;
+	return 0;
+}
+
+static inline int
+ln_fastParseRest(__attribute__((unused)) const char *const str, const size_t strLen,
+	const size_t offs, __attribute__((unused)) const void *const pdata,
+	size_t *const parsed)
+{
+	*parsed = strLen - offs;
+	return 0;
+}
+
+#endif /* #ifndef LIBLOGNORM_PARSEFAST_H_INCLUDED */
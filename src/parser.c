@@ -33,6 +33,8 @@
 #include <strings.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <locale.h>
+#include <pthread.h>
 
 #include "liblognorm.h"
 #include "lognorm.h"
@@ -40,6 +42,8 @@
 #include "parser.h"
 #include "samp.h"
 #include "helpers.h"
+#include "scan.h"
+#include "parsefast.h"
 
 #ifdef FEATURE_REGEXP
 #include <pcre.h>
@@ -66,6 +70,34 @@ hParseInt(const unsigned char **buf, size_t *lenBuf)
 	return i;
 }
 
+/* skip one (already validated) separator character */
+static inline void
+hSkipChar(const unsigned char **buf, size_t *lenBuf)
+{
+	if(*lenBuf > 0) {
+		++(*buf);
+		--(*lenBuf);
+	}
+}
+
+/* convert a broken-down UTC time to seconds since the epoch. We do
+ * not use timegm(), as it is not portable, nor mktime(), as it
+ * depends on the local timezone. The day count follows the well-known
+ * "days from civil" algorithm for the proleptic Gregorian calendar.
+ */
+static time_t
+hEpoch(int64_t year, const int month, const int day,
+	const int hour, const int minute, const int second)
+{
+	year -= month <= 2;
+	const int64_t era = (year >= 0 ? year : year - 399) / 400;
+	const int64_t yoe = year - era * 400;
+	const int64_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	const int64_t days = era * 146097 + doe - 719468;
+	return (time_t) (days * 86400 + hour * 3600 + minute * 60 + second);
+}
+
 /* parser _parse interface
  *
  * All parsers receive 
@@ -145,6 +177,26 @@ int ln_construct##ParserName( \
 #define PARSER_Destruct(ParserName) \
 void ln_destruct##ParserName(__attribute__((unused)) ln_ctx ctx, void *const pdata)
 
+/* typed value conversion
+ * Converters are called with the text that was matched by a successful
+ * run of the respective parser, so they do not need to check syntax
+ * again.
+ * @param[in] str matched text (NOT NUL-terminated)
+ * @param[in] len length of the matched text
+ * @param[in] pdata parser data block
+ * @param[in] refTime reference time for dates without year
+ * @param[out] val typed value
+ * @return 0 on success, LN_WRONGPARSER if the value does not fit into
+ *         its type
+ */
+#define PARSER_Value(ParserName) \
+int ln_v2_value##ParserName( \
+	const char *const str, \
+	const size_t len, \
+	__attribute__((unused)) void *const pdata, \
+	__attribute__((unused)) const time_t refTime, \
+	struct ln_value *const val)
+
 
 
 /**
@@ -254,6 +306,41 @@ PARSER_Parse(RFC5424Date)
 done:
 	return r;
 }
+PARSER_Value(RFC5424Date)
+{
+	const unsigned char *p = (const unsigned char*) str;
+	size_t n = len;
+	int year, month, day, hour, minute, second;
+	int offset = 0;
+
+	year = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	month = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	day = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	hour = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	minute = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	second = hParseInt(&p, &n);
+	if(n > 0 && *p == '.') { /* fractional seconds are dropped */
+		hSkipChar(&p, &n);
+		while(n > 0 && myisdigit(*p))
+			hSkipChar(&p, &n);
+	}
+	if(n > 0 && (*p == '+' || *p == '-')) {
+		const int sign = (*p == '-') ? -1 : 1;
+		hSkipChar(&p, &n);
+		offset = hParseInt(&p, &n) * 3600;
+		hSkipChar(&p, &n);
+		offset = sign * (offset + hParseInt(&p, &n) * 60);
+	}
+
+	val->type = LN_VALTYPE_TIME;
+	val->v.t = hEpoch(year, month, day, hour, minute, second) - offset;
+	return 0;
+}
 
 
 /**
@@ -481,6 +568,51 @@ PARSER_Parse(RFC3164Date)
 done:
 	return r;
 }
+PARSER_Value(RFC3164Date)
+{
+	static const char monthNames[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+	const unsigned char *p = (const unsigned char*) str + 3;
+	size_t n = len - 3;
+	int year = 0; /* 0 means no year provided */
+	int month = 0;
+	int day, hour, minute, second;
+
+	while(month < 12 && strncasecmp(str, monthNames + 3 * month, 3))
+		++month;
+	++month;
+	hSkipChar(&p, &n);
+	if(n > 0 && *p == ' ')
+		hSkipChar(&p, &n);
+	day = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	hour = hParseInt(&p, &n);
+	if(hour > 1970 && hour < 2100) { /* Cisco format with year */
+		year = hour;
+		hSkipChar(&p, &n);
+		hour = hParseInt(&p, &n);
+	}
+	hSkipChar(&p, &n);
+	minute = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	second = hParseInt(&p, &n);
+
+	val->type = LN_VALTYPE_TIME;
+	if(year != 0) {
+		val->v.t = hEpoch(year, month, day, hour, minute, second);
+	} else {
+		/* guess the year: dates more than a month after the
+		 * reference time belong to the year before (e.g. "Dec 31"
+		 * received on Jan 1st).
+		 */
+		struct tm tm;
+		gmtime_r(&refTime, &tm);
+		year = tm.tm_year + 1900;
+		val->v.t = hEpoch(year, month, day, hour, minute, second);
+		if(val->v.t > refTime + 31 * 86400)
+			val->v.t = hEpoch(year - 1, month, day, hour, minute, second);
+	}
+	return 0;
+}
 
 
 /**
@@ -489,27 +621,30 @@ done:
  * as 64 bits (but may later change our mind if performance dictates so).
  */
 PARSER_Parse(Number)
-	const char *c;
-	size_t i;
-
 	assert(npb->str != NULL);
 	assert(offs != NULL);
 	assert(parsed != NULL);
-	c = npb->str;
 
-	for (i = *offs; i < npb->strLen && myisdigit(c[i]); i++);
-	if (i == *offs)
-		goto done;
-	
-	/* success, persist */
-	*parsed = i - *offs;
-	if(value != NULL) {
+	r = ln_fastParseNumber(npb->str, npb->strLen, *offs, pdata, parsed);
+	if(r == 0 && value != NULL) {
 		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
-	r = 0; /* success */
-done:
 	return r;
 }
+PARSER_Value(Number)
+{
+	int64_t n = 0;
+
+	for(size_t i = 0 ; i < len ; ++i) {
+		const int digit = str[i] - '0';
+		if(n > (INT64_MAX - digit) / 10)
+			return LN_WRONGPARSER; /* overflow */
+		n = n * 10 + digit;
+	}
+	val->type = LN_VALTYPE_INT;
+	val->v.i = n;
+	return 0;
+}
 
 /**
  * Parse a Real-number in floating-pt form.
@@ -550,6 +685,52 @@ done:
 	return r;
 }
 
+#ifdef HAVE_STRTOD_L
+static pthread_once_t cLocaleOnce = PTHREAD_ONCE_INIT;
+static locale_t cLocale = (locale_t) 0;
+
+static void
+cLocaleInit(void)
+{
+	cLocale = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0);
+}
+#endif
+
+/* strtod() for float fields, which always use '.' as decimal point,
+ * whatever the application's locale says. Without strtod_l(), the
+ * point is replaced by the locale's one.
+ */
+static double
+floatStrtod(char *const buf, char **const end)
+{
+#ifdef HAVE_STRTOD_L
+	pthread_once(&cLocaleOnce, cLocaleInit);
+	if(cLocale != (locale_t) 0)
+		return strtod_l(buf, end, cLocale);
+#endif
+	const char *const dp = localeconv()->decimal_point;
+	char *const point = strchr(buf, '.');
+	if(point != NULL && dp[0] != '\0' && dp[1] == '\0')
+		*point = dp[0];
+	return strtod(buf, end);
+}
+
+PARSER_Value(Float)
+{
+	char buf[64]; /* strtod() needs a NUL-terminated string */
+	char *end;
+
+	if(len >= sizeof(buf))
+		return LN_WRONGPARSER;
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+	val->v.d = floatStrtod(buf, &end);
+	if(end == buf) /* e.g. a lone "-" */
+		return LN_WRONGPARSER;
+	val->type = LN_VALTYPE_DOUBLE;
+	return 0;
+}
+
 
 struct data_HexNumber {
 	uint64_t maxval;
@@ -601,6 +782,20 @@ PARSER_Parse(HexNumber)
 done:
 	return r;
 }
+PARSER_Value(HexNumber)
+{
+	int64_t n = 0;
+
+	for(size_t i = 2 ; i < len ; ++i) { /* skip "0x" */
+		const char digit = tolower(str[i]);
+		if(n > (INT64_MAX >> 4))
+			return LN_WRONGPARSER; /* overflow */
+		n = n * 16 + ((digit >= 'a') ? digit - 'a' + 10 : digit - '0');
+	}
+	val->type = LN_VALTYPE_INT;
+	val->v.i = n;
+	return 0;
+}
 PARSER_Construct(HexNumber)
 {
 	int r = 0;
@@ -708,25 +903,14 @@ done:
  * slsa (simple log structure analyser) tool.
  */
 PARSER_Parse(Whitespace)
-	const char *c;
-	size_t i = *offs;
-
 	assert(npb->str != NULL);
 	assert(offs != NULL);
 	assert(parsed != NULL);
-	c = npb->str;
-
-	if(!isspace(c[i]))
-		goto done;
 
-	for (i++ ; i < npb->strLen && isspace(c[i]); i++);
-	/* success, persist */
-	*parsed = i - *offs;
-	if(value != NULL) {
+	r = ln_fastParseWhitespace(npb->str, npb->strLen, *offs, pdata, parsed);
+	if(r == 0 && value != NULL) {
 		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
-	r = 0; /* success */
-done:
 	return r;
 }
 
@@ -737,29 +921,14 @@ done:
  * the offset is position on a space upon entry.
  */
 PARSER_Parse(Word)
-	const char *c;
-	size_t i;
-
 	assert(npb->str != NULL);
 	assert(offs != NULL);
 	assert(parsed != NULL);
-	c = npb->str;
-	i = *offs;
-
-	/* search end of word */
-	while(i < npb->strLen && c[i] != ' ') 
-		i++;
 
-	if(i == *offs)
-		goto done;
-
-	/* success, persist */
-	*parsed = i - *offs;
-	if(value != NULL) {
+	r = ln_fastParseWord(npb->str, npb->strLen, *offs, pdata, parsed);
+	if(r == 0 && value != NULL) {
 		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
-	r = 0; /* success */
-done:
 	return r;
 }
 
@@ -774,7 +943,7 @@ struct data_StringTo {
  */
 PARSER_Parse(StringTo)
 	const char *c;
-	size_t i, j, m;
+	size_t i;
 	int chkstr;
 	struct data_StringTo *const data = (struct data_StringTo*) pdata;
 	const char *const toFind = data->toFind;
@@ -782,29 +951,25 @@ PARSER_Parse(StringTo)
 	assert(offs != NULL);
 	assert(parsed != NULL);
 	c = npb->str;
-	i = *offs;
 	chkstr = 0;
 
-	/* Total hunt for letter */
-	while(chkstr == 0 && i < npb->strLen ) {
-	    i++;
-	    if(c[i] == toFind[0]) {
-		/* Found the first letter, now find the rest of the string */
-		j = 1;
-		m = i+1;
-		while(m < npb->strLen && j < data->len ) {
-			if(c[m] != toFind[j])
-				break;
-			if(j == data->len - 1) { /* full match? */
-				chkstr = 1;
-				break;
-			}
-			j++;
-			m++;
+	/* The search starts one byte after the current position, so the
+	 * field is never empty. Search strings of less than two chars
+	 * never match (historical behaviour).
+	 */
+	if(data->len < 2)
+		goto done;
+	for(i = *offs + 1 ; i + data->len <= npb->strLen ; ++i) {
+		/* hunt for the first letter, then check the rest */
+		i += ln_scanChar(toFind[0], c + i, npb->strLen - i);
+		if(i + data->len > npb->strLen)
+			break;
+		if(!memcmp(c + i + 1, toFind + 1, data->len - 1)) {
+			chkstr = 1;
+			break;
 		}
-	    }
 	}
-	if(i == *offs || i == npb->strLen || chkstr != 1)
+	if(chkstr != 1)
 		goto done;
 
 	/* success, persist */
@@ -878,11 +1043,6 @@ done:
 }
 
 
-struct data_CharTo {
-	char *term_chars;
-	size_t n_term_chars;
-	char *data_for_display;
-};
 /**
  * Parse everything up to a specific character.
  * The character must be the only char inside extra data passed to the parser.
@@ -893,37 +1053,14 @@ struct data_CharTo {
  * other cases a string is extracted.
  */
 PARSER_Parse(CharTo)
-	size_t i;
-	struct data_CharTo *const data = (struct data_CharTo*) pdata;
-
 	assert(npb->str != NULL);
 	assert(offs != NULL);
 	assert(parsed != NULL);
-	i = *offs;
 
-	/* search end of word */
-	int found = 0;
-	while(i < npb->strLen && !found) {
-		for(size_t j = 0 ; j < data->n_term_chars ; ++j) {
-			if(npb->str[i] == data->term_chars[j]) {
-				found = 1;
-				break;
-			}
-		}
-		if(!found)
-			++i;
-	}
-
-	if(i == *offs || i == npb->strLen || !found)
-		goto done;
-
-	/* success, persist */
-	*parsed = i - *offs;
-	if(value != NULL) {
+	r = ln_fastParseCharTo(npb->str, npb->strLen, *offs, pdata, parsed);
+	if(r == 0 && value != NULL) {
 		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
-	r = 0;
-done:
 	return r;
 }
 PARSER_Construct(CharTo)
@@ -940,6 +1077,7 @@ PARSER_Construct(CharTo)
 	}
 	data->term_chars = strdup(json_object_get_string(ed));
 	data->n_term_chars = strlen(data->term_chars);
+	ln_scansetInit(&data->set, data->term_chars);
 	*pdata = data;
 done:
 	if(r != 0)
@@ -971,31 +1109,14 @@ PARSER_Destruct(CharTo)
 
 
 
-struct data_Literal {
-	const char *lit;
-	const char *json_conf;
-};
 /**
  * Parse a specific literal.
  */
 PARSER_Parse(Literal)
-	struct data_Literal *const data = (struct data_Literal*) pdata;
-	const char *const lit = data->lit;
-	size_t i = *offs;
-	size_t j;
-
-	for(j = 0 ; i < npb->strLen ; ++j) {
-		if(lit[j] != npb->str[i])
-			break;
-		++i;
-	}
-
-	*parsed = j; /* we must always return how far we parsed! */
-	if(lit[j] == '\0') {
-		if(value != NULL) {
-			*value = json_object_new_string_len(npb->str+(*offs), *parsed);
-		}
-		r = 0;
+	/* we must always return how far we parsed! */
+	r = ln_fastParseLiteral(npb->str, npb->strLen, *offs, pdata, parsed);
+	if(r == 0 && value != NULL) {
+		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
 	return r;
 }
@@ -1053,11 +1174,36 @@ ln_combineData_Literal(void *const porg, void *const padd)
 	memcpy((char*)org->lit+len, add->lit, add_len+1);
 done:	return r;
 }
+/* for prefix factoring, we need to split the first len chars off a
+ * literal data element. If pprefix is not NULL, a new data element
+ * for them is returned there, else they are simply discarded. org
+ * keeps the rest. len must be smaller than the literal length.
+ */
+int
+ln_splitData_Literal(void *const porg, const size_t len, void **const pprefix)
+{
+	struct data_Literal *const org = porg;
+	struct data_Literal *prefix = NULL;
+	int r = 0;
+	if(pprefix != NULL) {
+		CHKN(prefix = calloc(1, sizeof(struct data_Literal)));
+		if(   (prefix->lit = strndup(org->lit, len)) == NULL
+		   || (prefix->json_conf = strdup(org->json_conf)) == NULL) {
+			free((void*)prefix->lit);
+			free(prefix);
+			FAIL(LN_NOMEM);
+		}
+		*pprefix = prefix;
+	}
+	memmove((char*)org->lit, org->lit+len, strlen(org->lit+len)+1);
+done:	return r;
+}
 
 
 struct data_CharSeparated {
 	char *term_chars;
 	size_t n_term_chars;
+	struct ln_scanset set;
 };
 /**
  * Parse everything up to a specific character, or up to the end of string.
@@ -1076,17 +1222,7 @@ PARSER_Parse(CharSeparated)
 	i = *offs;
 
 	/* search end of word */
-	int found = 0;
-	while(i < npb->strLen && !found) {
-		for(size_t j = 0 ; j < data->n_term_chars ; ++j) {
-			if(npb->str[i] == data->term_chars[j]) {
-				found = 1;
-				break;
-			}
-		}
-		if(!found)
-			++i;
-	}
+	i += ln_scanSet(&data->set, npb->str + i, npb->strLen - i);
 
 	/* success, persist */
 	*parsed = i - *offs;
@@ -1110,6 +1246,7 @@ PARSER_Construct(CharSeparated)
 
 	data->term_chars = strdup(json_object_get_string(ed));
 	data->n_term_chars = strlen(data->term_chars);
+	ln_scansetInit(&data->set, data->term_chars);
 	*pdata = data;
 done:
 	if(r != 0)
@@ -1132,14 +1269,10 @@ PARSER_Parse(Rest)
 	assert(offs != NULL);
 	assert(parsed != NULL);
 
-	/* silence the warning about unused variable */
-	(void)npb->str;
-	/* success, persist */
-	*parsed = npb->strLen - *offs;
+	r = ln_fastParseRest(npb->str, npb->strLen, *offs, pdata, parsed);
 	if(value != NULL) {
 		*value = json_object_new_string_len(npb->str+(*offs), *parsed);
 	}
-	r = 0;
 	return r;
 }
 
@@ -1153,7 +1286,8 @@ PARSER_Parse(Rest)
 PARSER_Parse(OpQuotedString)
 	const char *c;
 	size_t i;
-	char *cstr = NULL;
+	size_t iVal;
+	size_t lenVal;
 
 	assert(npb->str != NULL);
 	assert(offs != NULL);
@@ -1161,7 +1295,7 @@ PARSER_Parse(OpQuotedString)
 	c = npb->str;
 	i = *offs;
 
-	if(c[i] != '"') {
+	if(i == npb->strLen || c[i] != '"') {
 		while(i < npb->strLen && c[i] != ' ') 
 			i++;
 
@@ -1170,8 +1304,8 @@ PARSER_Parse(OpQuotedString)
 
 		/* success, persist */
 		*parsed = i - *offs;
-		/* create JSON value to save quoted string contents */
-		CHKN(cstr = strndup((char*)c + *offs, *parsed));
+		iVal = *offs;
+		lenVal = *parsed;
 	} else {
 	    ++i;
 
@@ -1183,14 +1317,16 @@ PARSER_Parse(OpQuotedString)
 		    goto done;
 	    /* success, persist */
 	    *parsed = i + 1 - *offs; /* "eat" terminal double quote */
-	    /* create JSON value to save quoted string contents */
-	    CHKN(cstr = strndup((char*)c + *offs + 1, *parsed - 2));
+	    iVal = *offs + 1;
+	    lenVal = *parsed - 2;
+	}
+	/* create JSON value to save quoted string contents */
+	if(value != NULL) {
+		CHKN(*value = json_object_new_string_len(c + iVal, lenVal));
 	}
-	CHKN(*value = json_object_new_string(cstr));
 
 	r = 0; /* success */
 done:
-	free(cstr);
 	return r;
 }
 
@@ -1290,6 +1426,21 @@ PARSER_Parse(ISODate)
 done:
 	return r;
 }
+PARSER_Value(ISODate)
+{
+	const unsigned char *p = (const unsigned char*) str;
+	size_t n = len;
+	int year, month, day;
+
+	year = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	month = hParseInt(&p, &n);
+	hSkipChar(&p, &n);
+	day = hParseInt(&p, &n);
+	val->type = LN_VALTYPE_TIME;
+	val->v.t = hEpoch(year, month, day, 0, 0, 0);
+	return 0;
+}
 
 /**
  * Parse a Cisco interface spec. Sample for such a spec are:
@@ -1642,6 +1793,23 @@ PARSER_Parse(IPv4)
 done:
 	return r;
 }
+PARSER_Value(IPv4)
+{
+	uint32_t addr = 0;
+	uint32_t byte = 0;
+
+	for(size_t i = 0 ; i < len ; ++i) {
+		if(str[i] == '.') {
+			addr = (addr << 8) | byte;
+			byte = 0;
+		} else {
+			byte = byte * 10 + str[i] - '0';
+		}
+	}
+	val->type = LN_VALTYPE_IPV4;
+	val->v.ipv4 = (addr << 8) | byte;
+	return 0;
+}
 
 
 /* skip past the IPv6 address block, parse pointer is set to 
@@ -1764,12 +1932,47 @@ isValidIPTablesNameChar(const char c)
 	return ('A' <= c && c <= 'Z') ? 1 : 0;
 }
 
+/* build the JSON object from the name/value pairs a parser has
+ * recorded while checking the motif. Names are copied to the scratch
+ * buffer, as the JSON library needs them NUL-terminated.
+ */
+static int
+nvpairsToJSON(npb_t *const npb,
+	const struct ln_nvpair *const pairs,
+	const unsigned npairs,
+	struct json_object **const value)
+{
+	int r = 0;
+	char *name;
+	json_object *json;
+
+	CHKN(*value = json_object_new_object());
+	for(unsigned k = 0 ; k < npairs ; ++k) {
+		CHKN(name = ln_parseBuf(npb, pairs[k].lenName + 1));
+		memcpy(name, npb->str+pairs[k].iName, pairs[k].lenName);
+		name[pairs[k].lenName] = '\0';
+		if(pairs[k].lenVal == -1) {
+			json = NULL;
+		} else {
+			CHKN(json = json_object_new_string_len(npb->str+pairs[k].iVal,
+				pairs[k].lenVal));
+		}
+		json_object_object_add(*value, name, json);
+	}
+done:
+	if(r != 0 && *value != NULL) {
+		json_object_put(*value);
+		*value = NULL;
+	}
+	return r;
+}
+
 /* helper to iptables parser, parses out a a single name=value pair 
  */
 static int
 parseIPTablesNameValue(npb_t *const npb,
 	size_t *const __restrict__ offs,
-	struct json_object *const __restrict__ valroot)
+	struct ln_nvpair *const __restrict__ pair)
 {
 	int r = LN_WRONGPARSER;
 	size_t i = *offs;
@@ -1780,38 +1983,21 @@ parseIPTablesNameValue(npb_t *const npb,
 	if(i == iName || (i < npb->strLen && npb->str[i] != '=' && npb->str[i] != ' '))
 		goto done; /* no name at all! */
 
-	const ssize_t lenName = i - iName;
-
-	ssize_t iVal = -1;
-	size_t lenVal = i - iVal;
+	pair->iName = iName;
+	pair->lenName = i - iName;
+	pair->lenVal = -1;
 	if(i < npb->strLen && npb->str[i] != ' ') {
 		/* we have a real value (not just a flag name like "DF") */
 		++i; /* skip '=' */
-		iVal = i;
+		pair->iVal = i;
 		while(i < npb->strLen && !isspace(npb->str[i]))
 			++i;
-		lenVal = i - iVal;
+		pair->lenVal = i - pair->iVal;
 	}
 
 	/* parsing OK */
 	*offs = i;
 	r = 0;
-
-	if(valroot == NULL)
-		goto done;
-
-	char *name;
-	CHKN(name = malloc(lenName+1));
-	memcpy(name, npb->str+iName, lenName);
-	name[lenName] = '\0';
-	json_object *json;
-	if(iVal == -1) {
-		json = NULL;
-	} else {
-		CHKN(json = json_object_new_string_len(npb->str+iVal, lenVal));
-	}
-	json_object_object_add(valroot, name, json);
-	free(name);
 done:
 	return r;
 }
@@ -1821,12 +2007,12 @@ done:
  * This parser is named "v2-iptables" because of a traditional
  * parser named "iptables", which we do not want to replace, at
  * least right now (we may re-think this before the first release).
- * For performance reasons, this works in two stages. In the first
- * stage, we only detect if the motif is correct. The second stage is
- * only called when we know it is. In it, we go once again over the
- * message again and actually extract the data. This is done because
- * data extraction is relatively expensive and in most cases we will
- * have much more frequent mismatches than matches.
+ * For performance reasons, the message is scanned only once, while
+ * checking if the motif is correct. Thereby, the location of the
+ * name/value pairs is recorded. The data is only extracted from them
+ * when we know the motif is correct, because data extraction is
+ * relatively expensive and in most cases we will have much more
+ * frequent mismatches than matches.
  * Note that this motif must have at least one field, otherwise it
  * could detect things that are not iptables to be it. Further limits
  * may be imposed in the future as we see additional need.
@@ -1834,11 +2020,12 @@ done:
  */
 PARSER_Parse(v2IPTables)
 	size_t i = *offs;
-	int nfields = 0;
+	unsigned nfields = 0;
+	struct ln_nvpair *pairs = NULL;
 
-	/* stage one */
 	while(i < npb->strLen) {
-		CHKR(parseIPTablesNameValue(npb, &i, NULL));
+		CHKN(pairs = ln_parsePairs(npb, nfields + 1));
+		CHKR(parseIPTablesNameValue(npb, &i, pairs + nfields));
 		++nfields;
 		/* exactly one SP is permitted between fields */
 		if(i < npb->strLen && npb->str[i] == ' ')
@@ -1853,23 +2040,10 @@ PARSER_Parse(v2IPTables)
 	*parsed = i - *offs;
 	r = 0;
 
-	/* stage two */
-	if(value == NULL)
-		goto done;
-
-	i = *offs;
-	CHKN(*value = json_object_new_object());
-	while(i < npb->strLen) {
-		CHKR(parseIPTablesNameValue(npb, &i, *value));
-		while(i < npb->strLen && isspace(npb->str[i]))
-			++i;
-	}
+	if(value != NULL)
+		CHKR(nvpairsToJSON(npb, pairs, nfields, value));
 
 done:
-	if(r != 0 && value != NULL && *value != NULL) {
-		json_object_put(*value);
-		*value = NULL;
-	}
 	return r;
 }
 
@@ -1900,7 +2074,7 @@ PARSER_Parse(JSON)
 		goto done;
 	}
 
-	if((tokener = json_tokener_new()) == NULL)
+	if((tokener = ln_parseTokener(npb)) == NULL)
 		goto done;
 
 	struct json_object *const json
@@ -1920,8 +2094,6 @@ PARSER_Parse(JSON)
 	}
 
 done:
-	if(tokener != NULL)
-		json_tokener_free(tokener);
 	return r;
 }
 
@@ -1953,7 +2125,7 @@ isValidNameChar(const char c)
 static int
 parseNameValue(npb_t *const npb,
 	size_t *const __restrict__ offs,
-	struct json_object *const __restrict__ valroot)
+	struct ln_nvpair *const __restrict__ pair)
 {
 	int r = LN_WRONGPARSER;
 	size_t i = *offs;
@@ -1961,32 +2133,21 @@ parseNameValue(npb_t *const npb,
 	const size_t iName = i;
 	while(i < npb->strLen && isValidNameChar(npb->str[i]))
 		++i;
-	if(i == iName || npb->str[i] != '=')
+	if(i == iName || i == npb->strLen || npb->str[i] != '=')
 		goto done; /* no name at all! */
 
-	const size_t lenName = i - iName;
+	pair->iName = iName;
+	pair->lenName = i - iName;
 	++i; /* skip '=' */
 
-	const size_t iVal = i;
+	pair->iVal = i;
 	while(i < npb->strLen && !isspace(npb->str[i]))
 		++i;
-	const size_t lenVal = i - iVal;
+	pair->lenVal = i - pair->iVal;
 
 	/* parsing OK */
 	*offs = i;
 	r = 0;
-
-	if(valroot == NULL)
-		goto done;
-
-	char *name;
-	CHKN(name = malloc(lenName+1));
-	memcpy(name, npb->str+iName, lenName);
-	name[lenName] = '\0';
-	json_object *json;
-	CHKN(json = json_object_new_string_len(npb->str+iVal, lenVal));
-	json_object_object_add(valroot, name, json);
-	free(name);
 done:
 	return r;
 }
@@ -2021,7 +2182,7 @@ PARSER_Parse(CEESyslog)
 		goto done;
 		/* note: we do not permit arrays in CEE mode */
 
-	if((tokener = json_tokener_new()) == NULL)
+	if((tokener = ln_parseTokener(npb)) == NULL)
 		goto done;
 
 	json = json_tokener_parse_ex(tokener, npb->str+i, (int) (npb->strLen - i));
@@ -2033,7 +2194,7 @@ PARSER_Parse(CEESyslog)
 		goto done;
 
 	/* success, persist */
-	*parsed =  npb->strLen;
+	*parsed = npb->strLen - *offs;
 	r = 0; /* success */
 
 	if(value != NULL) {
@@ -2042,8 +2203,6 @@ PARSER_Parse(CEESyslog)
 	}
 
 done:
-	if(tokener != NULL)
-		json_tokener_free(tokener);
 	if(json != NULL)
 		json_object_put(json);
 	return r;
@@ -2053,20 +2212,23 @@ done:
  * Parser for name/value pairs.
  * On entry must point to alnum char. All following chars must be
  * name/value pairs delimited by whitespace up until the end of string.
- * For performance reasons, this works in two stages. In the first
- * stage, we only detect if the motif is correct. The second stage is
- * only called when we know it is. In it, we go once again over the
- * message again and actually extract the data. This is done because
- * data extraction is relatively expensive and in most cases we will
- * have much more frequent mismatches than matches.
+ * For performance reasons, the message is scanned only once, while
+ * checking if the motif is correct. Thereby, the location of the
+ * name/value pairs is recorded. The data is only extracted from them
+ * when we know the motif is correct, because data extraction is
+ * relatively expensive and in most cases we will have much more
+ * frequent mismatches than matches.
  * added 2015-04-25 rgerhards
  */
 PARSER_Parse(NameValue)
 	size_t i = *offs;
+	unsigned npairs = 0;
+	struct ln_nvpair *pairs = NULL;
 
-	/* stage one */
 	while(i < npb->strLen) {
-		CHKR(parseNameValue(npb, &i, NULL));
+		CHKN(pairs = ln_parsePairs(npb, npairs + 1));
+		CHKR(parseNameValue(npb, &i, pairs + npairs));
+		++npairs;
 		while(i < npb->strLen && isspace(npb->str[i]))
 			++i;
 	}
@@ -2075,19 +2237,8 @@ PARSER_Parse(NameValue)
 	*parsed = i - *offs;
 	r = 0; /* success */
 
-	/* stage two */
-	if(value == NULL)
-		goto done;
-
-	i = *offs;
-	CHKN(*value = json_object_new_object());
-	while(i < npb->strLen) {
-		CHKR(parseNameValue(npb, &i, *value));
-		while(i < npb->strLen && isspace(npb->str[i]))
-			++i;
-	}
-
-	/* TODO: fix mem leak if alloc json fails */
+	if(value != NULL)
+		CHKR(nvpairsToJSON(npb, pairs, npairs, value));
 
 done:
 	return r;
@@ -2243,8 +2394,8 @@ cefParseExtensions(npb_t *const npb,
 	size_t i = *offs;
 	size_t iName, lenName;
 	size_t iValue, lenValue;
-	char *name = NULL;
-	char *value = NULL;
+	char *name;
+	char *value;
 
 	while(i < npb->strLen) {
 		while(i < npb->strLen && npb->str[i] == ' ')
@@ -2263,10 +2414,10 @@ cefParseExtensions(npb_t *const npb,
 		++i; /* skip past value */
 
 		if(jroot != NULL) {
-			CHKN(name = malloc(sizeof(char) * (lenName + 1)));
+			CHKN(name = ln_parseBuf(npb, lenName + 1 + lenValue + 1));
 			memcpy(name, npb->str+iName, lenName);
 			name[lenName] = '\0';
-			CHKN(value = malloc(sizeof(char) * (lenValue + 1)));
+			value = name + lenName + 1;
 			/* copy value but escape it */
 			size_t iDst = 0;
 			for(size_t iSrc = 0 ; iSrc < lenValue ; ++iSrc) {
@@ -2292,16 +2443,12 @@ cefParseExtensions(npb_t *const npb,
 			json_object *json;
 			CHKN(json = json_object_new_string(value));
 			json_object_object_add(jroot, name, json);
-			free(name); name = NULL;
-			free(value); value = NULL;
 		}
 	}
 
 	*offs = npb->strLen; /* this parser consume everything or fails */
 
 done:
-	free(name);
-	free(value);
 	return r;
 }
 
@@ -2309,15 +2456,14 @@ done:
  * first char after the '|' in front of field.
  * Note that '|' may be escaped as "\|", which also means
  * we need to supprot "\\" (see CEF spec for details).
- * We return the string in *val, if val is non-null. In
- * that case we allocate memory that the caller must free.
- * This is necessary because there are potentially escape
- * sequences inside the string.
+ * If jroot is non-null, the unescaped field is added to it
+ * under the given name.
  */
 static int
 cefGetHdrField(npb_t *const npb,
 	size_t *const __restrict__ offs,
-	char **val)
+	json_object *const __restrict__ jroot,
+	const char *const name)
 {
 	int r = 0;
 	size_t i = *offs;
@@ -2338,20 +2484,24 @@ cefGetHdrField(npb_t *const npb,
 	/* success, persist */
 	*offs = i + 1;
 
-	if(val == NULL) {
+	if(jroot == NULL) {
 		r = 0;
 		goto done;
 	}
 	
 	const size_t len = i - iBegin;
-	CHKN(*val = malloc(len + 1));
+	char *val;
+	CHKN(val = ln_parseBuf(npb, len + 1));
 	size_t iDst = 0;
 	for(size_t iSrc = 0 ; iSrc < len ; ++iSrc) {
 		if(npb->str[iBegin+iSrc] == '\\')
 			++iSrc; /* we already checked above that this is OK! */
-		(*val)[iDst++] = npb->str[iBegin+iSrc];
+		val[iDst++] = npb->str[iBegin+iSrc];
 	}
-	(*val)[iDst] = 0;
+	val[iDst] = 0;
+	json_object *json;
+	CHKN(json = json_object_new_string(val));
+	json_object_object_add(jroot, name, json);
 	r = 0;
 done:
 	return r;
@@ -2363,12 +2513,8 @@ done:
  */
 PARSER_Parse(CEF)
 	size_t i = *offs;
-	char *vendor = NULL;
-	char *product = NULL;
-	char *version = NULL;
-	char *sigID = NULL;
-	char *name = NULL;
-	char *severity = NULL;
+	json_object *jroot = NULL;
+	json_object *jext = NULL;
 
 	/* minumum header: "CEF:0|x|x|x|x|x|x|" -->  17 chars */
 	if(npb->strLen < i + 17 ||
@@ -2382,68 +2528,41 @@ PARSER_Parse(CEF)
 	
 	i += 6; /* position on '|' */
 
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &vendor));
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &product));
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &version));
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &sigID));
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &name));
-	CHKR(cefGetHdrField(npb, &i, (value == NULL) ? NULL : &severity));
+	/* The JSON is built while we check the motif. This is contrary
+	 * to other parsers, but as the CEF header is pretty unique, it
+	 * is exteremely unlike we will get a no-match after the "CEF:0|"
+	 * check above. Even if so, nothing bad happens, as the extracted
+	 * data is discarded. But the regular case saves us a second pass
+	 * over the message.
+	 */
+	if(value != NULL)
+		CHKN(jroot = json_object_new_object());
+	CHKR(cefGetHdrField(npb, &i, jroot, "DeviceVendor"));
+	CHKR(cefGetHdrField(npb, &i, jroot, "DeviceProduct"));
+	CHKR(cefGetHdrField(npb, &i, jroot, "DeviceVersion"));
+	CHKR(cefGetHdrField(npb, &i, jroot, "SignatureID"));
+	CHKR(cefGetHdrField(npb, &i, jroot, "Name"));
+	CHKR(cefGetHdrField(npb, &i, jroot, "Severity"));
 	++i; /* skip over terminal '|' */
 
-	/* OK, we now know we have a good header. Now, we need
-	 * to process extensions.
-	 * This time, we do NOT pre-process the extension, but rather
-	 * persist them directly to JSON. This is contrary to other
-	 * parsers, but as the CEF header is pretty unique, this time
-	 * it is exteremely unlike we will get a no-match during
-	 * extension processing. Even if so, nothing bad happens, as
-	 * the extracted data is discarded. But the regular case saves
-	 * us processing time and complexity. The only time when we
-	 * cannot directly process it is when the caller asks us not
-	 * to persist the data. So this must be handled differently.
-	 */
-	 size_t iBeginExtensions = i;
-	 CHKR(cefParseExtensions(npb, &i, NULL));
+	if(jroot != NULL) {
+		CHKN(jext = json_object_new_object());
+		json_object_object_add(jroot, "Extensions", jext);
+	}
+	CHKR(cefParseExtensions(npb, &i, jext));
 
 	/* success, persist */
 	*parsed = i - *offs;
 	r = 0; /* success */
 
 	if(value != NULL) {
-		CHKN(*value = json_object_new_object());
-		json_object *json;
-		CHKN(json = json_object_new_string(vendor));
-		json_object_object_add(*value, "DeviceVendor", json);
-		CHKN(json = json_object_new_string(product));
-		json_object_object_add(*value, "DeviceProduct", json);
-		CHKN(json = json_object_new_string(version));
-		json_object_object_add(*value, "DeviceVersion", json);
-		CHKN(json = json_object_new_string(sigID));
-		json_object_object_add(*value, "SignatureID", json);
-		CHKN(json = json_object_new_string(name));
-		json_object_object_add(*value, "Name", json);
-		CHKN(json = json_object_new_string(severity));
-		json_object_object_add(*value, "Severity", json);
-
-		json_object *jext;
-		CHKN(jext = json_object_new_object());
-		json_object_object_add(*value, "Extensions", jext);
-
-		i = iBeginExtensions;
-		cefParseExtensions(npb, &i, jext);
+		*value = jroot;
+		jroot = NULL;
 	}
 
 done:
-	if(r != 0 && value != NULL && *value != NULL) {
-		json_object_put(*value);
-		value = NULL;
-	}
-	free(vendor);
-	free(product);
-	free(version);
-	free(sigID);
-	free(name);
-	free(severity);
+	if(jroot != NULL)
+		json_object_put(jroot);
 	return r;
 }
 
@@ -2456,8 +2575,8 @@ PARSER_Parse(CheckpointLEA)
 	size_t iName, lenName;
 	size_t iValue, lenValue;
 	int foundFields = 0;
-	char *name = NULL;
-	char *val = NULL;
+	char *name;
+	char *val;
 
 	while(i < npb->strLen) {
 		while(i < npb->strLen && npb->str[i] == ' ') /* skip leading SP */
@@ -2491,10 +2610,10 @@ PARSER_Parse(CheckpointLEA)
 		++i; /* skip ';' */
 
 		if(value != NULL) {
-			CHKN(name = malloc(sizeof(char) * (lenName + 1)));
+			CHKN(name = ln_parseBuf(npb, lenName + 1 + lenValue + 1));
 			memcpy(name, npb->str+iName, lenName);
 			name[lenName] = '\0';
-			CHKN(val = malloc(sizeof(char) * (lenValue + 1)));
+			val = name + lenName + 1;
 			memcpy(val, npb->str+iValue, lenValue);
 			val[lenValue] = '\0';
 			if(*value == NULL)
@@ -2502,8 +2621,6 @@ PARSER_Parse(CheckpointLEA)
 			json_object *json;
 			CHKN(json = json_object_new_string(val));
 			json_object_object_add(*value, name, json);
-			free(name); name = NULL;
-			free(val); val = NULL;
 		}
 	}
 
@@ -2512,11 +2629,9 @@ PARSER_Parse(CheckpointLEA)
 	r = 0; /* success */
 
 done:
-	free(name);
-	free(val);
 	if(r != 0 && value != NULL && *value != NULL) {
 		json_object_put(*value);
-		value = NULL;
+		*value = NULL;
 	}
 	return r;
 }
@@ -2565,9 +2680,15 @@ PARSER_Parse(Repeat)
 	size_t lastKnownGood = strtoffs;
 	struct json_object *json_arr = NULL;
 	const size_t parsedTo_save = npb->parsedTo;
+	/* in span mode, the repeated parsers do not record spans: the
+	 * array is built by calling us again if the value is requested.
+	 */
+	struct ln_spans_s *const spans_save = npb->spans;
+	npb->spans = NULL;
 
 	do {
 		struct json_object *parsed_value = json_object_new_object();
+		npb->parsedTo = strtoffs;
 		r = ln_normalizeRec(npb, data->parser, strtoffs, 1,
 				    parsed_value, &endNode);
 		strtoffs = npb->parsedTo;
@@ -2634,6 +2755,7 @@ success:
 	npb->parsedTo = parsedTo_save;
 	r = 0; /* success */
 done:
+	npb->spans = spans_save;
 	if(r != 0 && json_arr != NULL) {
 		json_object_put(json_arr);
 	}
@@ -2711,23 +2833,42 @@ struct data_String {
 	} flags;
 	char qchar_begin;
 	char qchar_end;
-	char perm_chars[256]; // TODO: make this bit-wise, so we need  only 32 bytes
+	struct ln_charclass perm_chars;	/**< permitted chars */
+	struct ln_charclass stop[2];	/**< chars that need to be looked at individually,
+					 *   without and with quotes, see stringPrepare() */
 };
 static inline void
 stringSetPermittedChar(struct data_String *const data, char c, int val)
 {
-#if 0
-	const int i = (unsigned) c / 8;
-	const int shft = (unsigned) c % 8;
-	const unsigned mask = ~(1 << shft);
-	perm_arr[i] = (perm_arr[i] & (0xff 
-#endif
-	data->perm_chars[(unsigned)c] = val;
+	if(val)
+		ln_charclassAdd(&data->perm_chars, c);
+	else
+		ln_charclassDel(&data->perm_chars, c);
 }
 static inline int
 stringIsPermittedChar(struct data_String *const data, char c)
 {
-	return data->perm_chars[(unsigned)c];
+	return ln_charclassHas(&data->perm_chars, c);
+}
+/* compute the chars the scan loop must stop at: those that are not
+ * permitted, the escape char and the terminator (SP if unquoted, the
+ * end quote otherwise). All others are skipped in bulk.
+ */
+static void
+stringPrepare(struct data_String *const data)
+{
+	for(int bQuoted = 0 ; bQuoted < 2 ; ++bQuoted) {
+		struct ln_charclass *const stop = &data->stop[bQuoted];
+		memset(stop, 0, sizeof(*stop));
+		for(unsigned c = 0 ; c < 256 ; ++c) {
+			if(!stringIsPermittedChar(data, c))
+				ln_charclassAdd(stop, c);
+		}
+		if(data->flags.esc_md == ST_ESC_BACKSLASH || data->flags.esc_md == ST_ESC_BOTH)
+			ln_charclassAdd(stop, '\\');
+		ln_charclassAdd(stop, bQuoted ? data->qchar_end : ' ');
+		ln_charclassPrepare(stop);
+	}
 }
 static void
 stringAddPermittedCharArr(struct data_String *const data,
@@ -2823,6 +2964,9 @@ PARSER_Parse(String)
 
 	/* scan string */
 	while(i < npb->strLen) {
+		i += ln_scanClass(&data->stop[bHaveQuotes], npb->str + i, npb->strLen - i);
+		if(i == npb->strLen)
+			break;
 		if(bHaveQuotes) {
 			if(npb->str[i] == data->qchar_end) {
 				if(data->flags.esc_md == ST_ESC_DOUBLE
@@ -2866,7 +3010,7 @@ PARSER_Parse(String)
 		goto done;
 
 	const size_t trmChkIdx = (bHaveQuotes) ? i+1 : i;
-	if(npb->str[trmChkIdx] != ' ')
+	if(trmChkIdx >= npb->strLen || npb->str[trmChkIdx] != ' ')
 		goto done;
 
 	/* success, persist */
@@ -2921,8 +3065,8 @@ PARSER_Construct(String)
 	data->flags.esc_md = ST_ESC_BOTH;
 	data->qchar_begin = '"';
 	data->qchar_end = '"';
-	memset(data->perm_chars, 0xff, sizeof(data->perm_chars));
-	
+	memset(data->perm_chars.map, 0xff, sizeof(data->perm_chars.map));
+
 	struct json_object_iterator it = json_object_iter_begin(json);
 	struct json_object_iterator itEnd = json_object_iter_end(json);
 	while (!json_object_iter_equal(&it, &itEnd)) {
@@ -2977,7 +3121,7 @@ PARSER_Construct(String)
 			}
 			data->qchar_end = *optval;
 		} else if(!strcasecmp(key, "matching.permitted")) {
-			memset(data->perm_chars, 0x00, sizeof(data->perm_chars));
+			memset(data->perm_chars.map, 0x00, sizeof(data->perm_chars.map));
 			if(json_object_is_type(val, json_type_string)) {
 				stringAddPermittedChars(data, val);
 			} else if(json_object_is_type(val, json_type_array)) {
@@ -2996,6 +3140,7 @@ PARSER_Construct(String)
 
 	if(data->quoteMode == ST_QUOTE_NONE)
 		data->flags.esc_md = ST_ESC_NONE;
+	stringPrepare(data);
 	*pdata = data;
 done:
 	return r;
@@ -46,6 +46,19 @@
 	int ln_v2_parse##parser(npb_t *npb, size_t *offs, void *const, size_t *parsed, struct json_object **value); \
 	void ln_destruct##parser(ln_ctx ctx, void *const pdata);
 
+/**
+ * Typed value interface
+ * @param[in] str text matched by the parser
+ * @param[in] len length of the text
+ * @param[in] pdata parser data block
+ * @param[in] refTime reference time for dates without year
+ * @param[out] val typed value
+ * @return 0 on success, LN_WRONGPARSER if not convertible
+ */
+#define VALUEDEF(parser) \
+	int ln_v2_value##parser(const char *str, size_t len, void *const, \
+		const time_t refTime, struct ln_value *val);
+
 PARSERDEF_NO_DATA(RFC5424Date);
 PARSERDEF_NO_DATA(RFC3164Date);
 PARSERDEF_NO_DATA(Number);
@@ -79,10 +92,20 @@ PARSERDEF_NO_DATA(CEF);
 PARSERDEF_NO_DATA(CheckpointLEA);
 PARSERDEF_NO_DATA(NameValue);
 
+VALUEDEF(RFC5424Date);
+VALUEDEF(RFC3164Date);
+VALUEDEF(Number);
+VALUEDEF(Float);
+VALUEDEF(HexNumber);
+VALUEDEF(ISODate);
+VALUEDEF(IPv4);
+
 #undef PARSERDEF_NO_DATA
+#undef VALUEDEF
 
 /* utility functions */
 int ln_combineData_Literal(void *const org, void *const add);
+int ln_splitData_Literal(void *const org, const size_t len, void **const prefix);
 
 /* definitions for friends */
 struct data_Repeat {
@@ -14,6 +14,10 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <libestr.h>
 
 #include "liblognorm.h"
@@ -25,28 +29,18 @@
 #include "annot.h"
 #include "internal.h"
 #include "parser.h"
+#include "parsefast.h"
 #include "helpers.h"
+#include "rbcache.h"
 
 void ln_displayPDAGComponentAlternative(struct ln_pdag *dag, int level);
 void ln_displayPDAGComponent(struct ln_pdag *dag, int level);
 
-#ifdef	ADVANCED_STATS
-uint64_t advstats_parsers_called = 0;
-uint64_t advstats_parsers_success = 0;
-int advstats_max_pathlen = 0;
-int advstats_pathlens[ADVSTATS_MAX_ENTITIES];
-int advstats_max_backtracked = 0;
-int advstats_backtracks[ADVSTATS_MAX_ENTITIES];
-int advstats_max_parser_calls = 0;
-int advstats_parser_calls[ADVSTATS_MAX_ENTITIES];
-int advstats_max_lit_parser_calls = 0;
-int advstats_lit_parser_calls[ADVSTATS_MAX_ENTITIES];
-#endif
-
 /* parser lookup table
  * This is a memory- and cache-optimized way of calling parsers.
- * VERY IMPORTANT: the initialization must be done EXACTLY in the
- * order of parser IDs (also see comment in pdag.h).
+ * VERY IMPORTANT: there must be an entry for EVERY parser ID, without
+ * gaps (also see comment in pdag.h). The normalizer dispatches on the
+ * IDs of the most common parsers, see tryParser().
  *
  * Rough guideline for assigning priorites:
  * 0 is highest, 255 lowest. 255 should be reserved for things that
@@ -56,53 +50,126 @@ int advstats_lit_parser_calls[ADVSTATS_MAX_ENTITIES];
  * no priorities (which is expected to be common) or user-assigned
  * priorities are equal for some parsers.
  */
-#ifdef ADVANCED_STATS
-#define PARSER_ENTRY_NO_DATA(identifier, parser, prio) \
-{ identifier, prio, NULL, ln_v2_parse##parser, NULL, 0, 0 }
-#define PARSER_ENTRY(identifier, parser, prio) \
-{ identifier, prio, ln_construct##parser, ln_v2_parse##parser, ln_destruct##parser, 0, 0 }
-#else
-#define PARSER_ENTRY_NO_DATA(identifier, parser, prio) \
-{ identifier, prio, NULL, ln_v2_parse##parser, NULL }
-#define PARSER_ENTRY(identifier, parser, prio) \
-{ identifier, prio, ln_construct##parser, ln_v2_parse##parser, ln_destruct##parser }
-#endif
+#define PARSER_ENTRY_NO_DATA(identifier, parser, prio, textval) \
+{ identifier, prio, textval, NULL, ln_v2_parse##parser, NULL, NULL }
+#define PARSER_ENTRY(identifier, parser, prio, textval) \
+{ identifier, prio, textval, ln_construct##parser, ln_v2_parse##parser, ln_destruct##parser, NULL }
+#define PARSER_ENTRY_NO_DATA_VALUE(identifier, parser, prio, textval) \
+{ identifier, prio, textval, NULL, ln_v2_parse##parser, NULL, ln_v2_value##parser }
+#define PARSER_ENTRY_VALUE(identifier, parser, prio, textval) \
+{ identifier, prio, textval, ln_construct##parser, ln_v2_parse##parser, ln_destruct##parser, \
+  ln_v2_value##parser }
 static struct ln_parser_info parser_lookup_table[] = {
-	PARSER_ENTRY("literal", Literal, 4),
-	PARSER_ENTRY("repeat", Repeat, 4),
-	PARSER_ENTRY_NO_DATA("date-rfc3164", RFC3164Date, 8),
-	PARSER_ENTRY_NO_DATA("date-rfc5424", RFC5424Date, 8),
-	PARSER_ENTRY_NO_DATA("number", Number, 16),
-	PARSER_ENTRY_NO_DATA("float", Float, 16),
-	PARSER_ENTRY("hexnumber", HexNumber, 16),
-	PARSER_ENTRY_NO_DATA("kernel-timestamp", KernelTimestamp, 16),
-	PARSER_ENTRY_NO_DATA("whitespace", Whitespace, 4),
-	PARSER_ENTRY_NO_DATA("ipv4", IPv4, 4),
-	PARSER_ENTRY_NO_DATA("ipv6", IPv6, 4),
-	PARSER_ENTRY_NO_DATA("word", Word, 32),
-	PARSER_ENTRY_NO_DATA("alpha", Alpha, 32),
-	PARSER_ENTRY_NO_DATA("rest", Rest, 255),
-	PARSER_ENTRY_NO_DATA("op-quoted-string", OpQuotedString, 64),
-	PARSER_ENTRY_NO_DATA("quoted-string", QuotedString, 64),
-	PARSER_ENTRY_NO_DATA("date-iso", ISODate, 8),
-	PARSER_ENTRY_NO_DATA("time-24hr", Time24hr, 8),
-	PARSER_ENTRY_NO_DATA("time-12hr", Time12hr, 8),
-	PARSER_ENTRY_NO_DATA("duration", Duration, 16),
-	PARSER_ENTRY_NO_DATA("cisco-interface-spec", CiscoInterfaceSpec, 4),
-	PARSER_ENTRY_NO_DATA("name-value-list", NameValue, 8),
-	PARSER_ENTRY_NO_DATA("json", JSON, 4),
-	PARSER_ENTRY_NO_DATA("cee-syslog", CEESyslog, 4),
-	PARSER_ENTRY_NO_DATA("mac48", MAC48, 16),
-	PARSER_ENTRY_NO_DATA("cef", CEF, 4),
-	PARSER_ENTRY_NO_DATA("checkpoint-lea", CheckpointLEA, 4),
-	PARSER_ENTRY_NO_DATA("v2-iptables", v2IPTables, 4),
-	PARSER_ENTRY("string-to", StringTo, 32),
-	PARSER_ENTRY("char-to", CharTo, 32),
-	PARSER_ENTRY("char-sep", CharSeparated, 32),
-	PARSER_ENTRY("string", String, 32)
+	[PRS_LITERAL] = PARSER_ENTRY("literal", Literal, 4, TEXTVAL_ESC),
+	[PRS_REPEAT] = PARSER_ENTRY("repeat", Repeat, 4, TEXTVAL_NONE),
+	[PRS_DATE_RFC3164] = PARSER_ENTRY_NO_DATA_VALUE("date-rfc3164", RFC3164Date, 8, TEXTVAL_CLEAN),
+	[PRS_DATE_RFC5424] = PARSER_ENTRY_NO_DATA_VALUE("date-rfc5424", RFC5424Date, 8, TEXTVAL_CLEAN),
+	[PRS_NUMBER] = PARSER_ENTRY_NO_DATA_VALUE("number", Number, 16, TEXTVAL_CLEAN),
+	[PRS_FLOAT] = PARSER_ENTRY_NO_DATA_VALUE("float", Float, 16, TEXTVAL_CLEAN),
+	[PRS_HEXNUMBER] = PARSER_ENTRY_VALUE("hexnumber", HexNumber, 16, TEXTVAL_CLEAN),
+	[PRS_KERNEL_TIMESTAMP] = PARSER_ENTRY_NO_DATA("kernel-timestamp", KernelTimestamp, 16, TEXTVAL_CLEAN),
+	[PRS_WHITESPACE] = PARSER_ENTRY_NO_DATA("whitespace", Whitespace, 4, TEXTVAL_ESC),
+	[PRS_IPV4] = PARSER_ENTRY_NO_DATA_VALUE("ipv4", IPv4, 4, TEXTVAL_CLEAN),
+	[PRS_IPV6] = PARSER_ENTRY_NO_DATA("ipv6", IPv6, 4, TEXTVAL_CLEAN),
+	[PRS_WORD] = PARSER_ENTRY_NO_DATA("word", Word, 32, TEXTVAL_ESC),
+	[PRS_ALPHA] = PARSER_ENTRY_NO_DATA("alpha", Alpha, 32, TEXTVAL_CLEAN),
+	[PRS_REST] = PARSER_ENTRY_NO_DATA("rest", Rest, 255, TEXTVAL_ESC),
+	[PRS_OP_QUOTED_STRING] = PARSER_ENTRY_NO_DATA("op-quoted-string", OpQuotedString, 64, TEXTVAL_NONE),
+	[PRS_QUOTED_STRING] = PARSER_ENTRY_NO_DATA("quoted-string", QuotedString, 64, TEXTVAL_ESC),
+	[PRS_DATE_ISO] = PARSER_ENTRY_NO_DATA_VALUE("date-iso", ISODate, 8, TEXTVAL_CLEAN),
+	[PRS_TIME_24HR] = PARSER_ENTRY_NO_DATA("time-24hr", Time24hr, 8, TEXTVAL_CLEAN),
+	[PRS_TIME_12HR] = PARSER_ENTRY_NO_DATA("time-12hr", Time12hr, 8, TEXTVAL_CLEAN),
+	[PRS_DURATION] = PARSER_ENTRY_NO_DATA("duration", Duration, 16, TEXTVAL_CLEAN),
+	[PRS_CISCO_INTERFACE_SPEC] = PARSER_ENTRY_NO_DATA("cisco-interface-spec", CiscoInterfaceSpec, 4, TEXTVAL_NONE),
+	[PRS_NAME_VALUE_LIST] = PARSER_ENTRY_NO_DATA("name-value-list", NameValue, 8, TEXTVAL_NONE),
+	[PRS_JSON] = PARSER_ENTRY_NO_DATA("json", JSON, 4, TEXTVAL_NONE),
+	[PRS_CEE_SYSLOG] = PARSER_ENTRY_NO_DATA("cee-syslog", CEESyslog, 4, TEXTVAL_NONE),
+	[PRS_MAC48] = PARSER_ENTRY_NO_DATA("mac48", MAC48, 16, TEXTVAL_CLEAN),
+	[PRS_CEF] = PARSER_ENTRY_NO_DATA("cef", CEF, 4, TEXTVAL_NONE),
+	[PRS_CHECKPOINT_LEA] = PARSER_ENTRY_NO_DATA("checkpoint-lea", CheckpointLEA, 4, TEXTVAL_NONE),
+	[PRS_v2_IPTABLES] = PARSER_ENTRY_NO_DATA("v2-iptables", v2IPTables, 4, TEXTVAL_NONE),
+	[PRS_STRING_TO] = PARSER_ENTRY("string-to", StringTo, 32, TEXTVAL_ESC),
+	[PRS_CHAR_TO] = PARSER_ENTRY("char-to", CharTo, 32, TEXTVAL_ESC),
+	[PRS_CHAR_SEP] = PARSER_ENTRY("char-sep", CharSeparated, 32, TEXTVAL_ESC),
+	[PRS_STRING] = PARSER_ENTRY("string", String, 32, TEXTVAL_NONE)
 };
 #define NPARSERS (sizeof(parser_lookup_table)/sizeof(struct ln_parser_info))
 #define DFLT_USR_PARSER_PRIO 30000 /**< default priority if user has not specified it */
+
+/* runtime statistics
+ * The normalizer must not write to the shared pdag, so that multiple
+ * threads can concurrently use the same context. So each thread counts
+ * into its own statistics block. Node counters are indexed by the
+ * node's stats_id, which is assigned when the pdag is frozen. Slot 0
+ * is a sink for nodes not covered by statistics (e.g. repeat parser
+ * sub-pdags). Blocks are merged on demand when statistics are requested.
+ */
+struct ln_pdag_nodestats {
+	unsigned called;
+	unsigned backtracked;
+};
+#ifdef	ADVANCED_STATS
+struct advstats_totals {
+	uint64_t parsers_called;
+	uint64_t parsers_success;
+	uint64_t prs_called[NPARSERS];
+	uint64_t prs_success[NPARSERS];
+	int max_pathlen;
+	int pathlens[ADVSTATS_MAX_ENTITIES];
+	int max_backtracked;
+	int backtracks[ADVSTATS_MAX_ENTITIES];
+	int max_parser_calls;
+	int parser_calls[ADVSTATS_MAX_ENTITIES];
+	int max_lit_parser_calls;
+	int lit_parser_calls[ADVSTATS_MAX_ENTITIES];
+};
+#endif
+/* per-rule statistics, see ln_setRuleStats(). They are kept per node
+ * slot as well, but only used for terminal nodes; slot 0 counts
+ * unmatched messages. Latencies are recorded for sampled messages only,
+ * in a histogram with power-of-two bucket bounds: bucket i holds
+ * latencies below 2^(i+8) ns, the last one everything above.
+ */
+#define RULESTATS_NBUCKETS 16
+struct ln_rulestats {
+	uint64_t count;
+	uint64_t sampled;
+	uint64_t latSum;		/**< sum of sampled latencies in ns */
+	uint64_t hist[RULESTATS_NBUCKETS];
+};
+/* backtracking memo, see LN_CTXOPT_MEMOIZE. It records which
+ * (node, offset) combinations failed while normalizing the current
+ * message, together with the parse position they reached (needed for
+ * unparsed-data). It is an open addressing hash table that is kept
+ * per thread; entries belong to the current message only if their
+ * generation matches, so it needs not to be cleared for each message.
+ */
+struct ln_memo_entry {
+	const struct ln_pdag *dag;
+	size_t key;		/**< offset << 2 | bPartialMatch << 1 | span mode */
+	size_t parsedTo;	/**< parse position reached by the failed attempt */
+	unsigned gen;
+};
+struct ln_memo {
+	struct ln_memo_entry *tab;
+	unsigned size;		/**< table size (power of two), 0 if not yet allocated */
+	unsigned used;		/**< entries of the current generation */
+	unsigned gen;		/**< current generation, 0 is never used */
+};
+#define MEMO_MIN_SIZE 256
+struct ln_pdag_tstats {
+	struct ln_pdag_tstats *next;
+	ln_ctx ctx;
+	unsigned nslots;		/**< number of node slots, 0 if outdated */
+	struct ln_pdag_nodestats *nodes;
+	struct ln_rulestats *rules;	/**< nslots entries, NULL until rule stats are used */
+	unsigned ruleSampleCnt;		/**< messages since last latency sample */
+	struct ln_memo memo;		/**< work area, not a statistic */
+	struct ln_parse_wrk wrk;	/**< work area of the parsers */
+#ifdef	ADVANCED_STATS
+	struct advstats_totals adv;
+#endif
+};
 static inline const char *
 parserName(const prsid_t id)
 {
@@ -129,6 +196,100 @@ ln_parserName2ID(const char *const __restrict__ name)
 	return PRS_INVALID;
 }
 
+/* custom types are looked up by name via an open addressing hash
+ * table, so that loading stays linear even with many types. A slot
+ * holds the index of the type in ctx->type_pdags plus one, 0 marks a
+ * free slot. The table is kept at most half full, and type_pdags is
+ * sized together with it. Type entries are allocated individually, as
+ * parsers keep pointers to them while further types are added.
+ */
+#define TYPE_HASH_MIN_SIZE 64
+
+static inline unsigned
+typeNameHash(const char *name)
+{
+	unsigned h = 2166136261u; /* FNV-1a */
+	for( ; *name != '\0' ; ++name)
+		h = (h ^ (unsigned char) *name) * 16777619u;
+	return h;
+}
+
+/* returns the slot of the named type, or the free slot where it
+ * belongs if it does not exist. The table must not be empty.
+ */
+static unsigned *
+typeHashSlot(ln_ctx ctx, const char *const __restrict__ name)
+{
+	const unsigned mask = ctx->type_hashSize - 1;
+	for(unsigned i = typeNameHash(name) & mask ; ; i = (i + 1) & mask) {
+		unsigned *const slot = ctx->type_hash + i;
+		if(*slot == 0 || !strcmp(ctx->type_pdags[*slot - 1]->name, name))
+			return slot;
+	}
+}
+
+static int
+typeHashGrow(ln_ctx ctx)
+{
+	int r = 0;
+	unsigned *newhash = NULL;
+	const unsigned newsize = (ctx->type_hashSize == 0) ? TYPE_HASH_MIN_SIZE
+							    : 2 * ctx->type_hashSize;
+	struct ln_type_pdag **const newarr = realloc(ctx->type_pdags,
+		newsize / 2 * sizeof(struct ln_type_pdag*));
+	CHKN(newarr);
+	ctx->type_pdags = newarr;
+	CHKN(newhash = calloc(newsize, sizeof(unsigned)));
+	free(ctx->type_hash);
+	ctx->type_hash = newhash;
+	ctx->type_hashSize = newsize;
+	for(int i = 0 ; i < ctx->nTypes ; ++i)
+		*typeHashSlot(ctx, ctx->type_pdags[i]->name) = i + 1;
+done:
+	return r;
+}
+
+/* add a new, empty type entry. The name must not yet exist.
+ * Returns NULL on error, ptr to type pdag entry otherwise
+ */
+static struct ln_type_pdag *
+pdagAddType(ln_ctx ctx, const char *const __restrict__ name)
+{
+	struct ln_type_pdag *td = NULL;
+
+	if(2 * ((unsigned) ctx->nTypes + 1) > ctx->type_hashSize
+	   && typeHashGrow(ctx) != 0)
+		goto fail;
+	if((td = calloc(1, sizeof(struct ln_type_pdag))) == NULL)
+		goto fail;
+	if((td->name = strdup(name)) == NULL)
+		goto fail;
+	*typeHashSlot(ctx, name) = ctx->nTypes + 1;
+	ctx->type_pdags[ctx->nTypes++] = td;
+	return td;
+fail:
+	LN_DBGPRINTF(ctx, "pdagAddType: alloc type '%s' failed", name);
+	free(td);
+	return NULL;
+}
+
+/* delete all custom types */
+void
+ln_pdagDeleteTypes(ln_ctx ctx)
+{
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		free((void*)ctx->type_pdags[i]->name);
+		ln_pdagDelete(ctx->type_pdags[i]->pdag);
+		free(ctx->type_pdags[i]);
+	}
+	free(ctx->type_pdags);
+	ctx->type_pdags = NULL;
+	ctx->nTypes = 0;
+	free(ctx->type_hash);
+	ctx->type_hash = NULL;
+	ctx->type_hashSize = 0;
+}
+
 /* find type pdag in table. If "bAdd" is set, add it if not
  * already present, a new entry will be added.
  * Returns NULL on error, ptr to type pdag entry otherwise
@@ -137,13 +298,13 @@ struct ln_type_pdag *
 ln_pdagFindType(ln_ctx ctx, const char *const __restrict__ name, const int bAdd)
 {
 	struct ln_type_pdag *td = NULL;
-	int i;
 
 	LN_DBGPRINTF(ctx, "ln_pdagFindType, name '%s', bAdd: %d, nTypes %d",
 		name, bAdd, ctx->nTypes);
-	for(i = 0 ; i < ctx->nTypes ; ++i) {
-		if(!strcmp(ctx->type_pdags[i].name, name)) {
-			td = ctx->type_pdags + i;
+	if(ctx->type_hashSize != 0) {
+		const unsigned idx = *typeHashSlot(ctx, name);
+		if(idx != 0) {
+			td = ctx->type_pdags[idx - 1];
 			goto done;
 		}
 	}
@@ -155,17 +316,8 @@ ln_pdagFindType(ln_ctx ctx, const char *const __restrict__ name, const int bAdd)
 
 	/* type does not yet exist -- create entry */
 	LN_DBGPRINTF(ctx, "custom type '%s' does not yet exist, adding...", name);
-	struct ln_type_pdag *newarr;
-	newarr = realloc(ctx->type_pdags, sizeof(struct ln_type_pdag) * (ctx->nTypes+1));
-	if(newarr == NULL) {
-		LN_DBGPRINTF(ctx, "ln_pdagFindTypeAG: alloc newarr failed");
-		goto done;
-	}
-	ctx->type_pdags = newarr;
-	td = ctx->type_pdags + ctx->nTypes;
-	++ctx->nTypes;
-	td->name = strdup(name);
-	td->pdag = ln_newPDAG(ctx);
+	if((td = pdagAddType(ctx, name)) != NULL)
+		td->pdag = ln_newPDAG(ctx);
 done:
 	return td;
 }
@@ -186,7 +338,7 @@ static void
 ln_pdagClearVisited(ln_ctx ctx)
 {
 	for(int i = 0 ; i < ctx->nTypes ; ++i)
-		ln_pdagComponentClearVisited(ctx->type_pdags[i].pdag);
+		ln_pdagComponentClearVisited(ctx->type_pdags[i]->pdag);
 	ln_pdagComponentClearVisited(ctx->pdag);
 }
 
@@ -286,7 +438,8 @@ ln_newPDAG(ln_ctx ctx)
 	
 	dag->refcnt = 1;
 	dag->ctx = ctx;
-	ctx->nNodes++;
+	/* components may be optimized concurrently */
+	__atomic_add_fetch(&ctx->nNodes, 1, __ATOMIC_RELAXED);
 done:	return dag;
 }
 
@@ -303,10 +456,42 @@ pdagDeletePrs(ln_ctx ctx, ln_parser_t *const __restrict__ prs)
 		ln_pdagDelete(prs->node);
 	free((void*)prs->name);
 	free((void*)prs->conf);
+	free((void*)prs->callName);
+	free((void*)prs->callConf);
 	if(prs->parser_data != NULL)
 		parser_lookup_table[prs->prsid].destruct(ctx, prs->parser_data);
 }
 
+/* free a parser created by ln_newParser() that was not added to a pdag */
+void
+ln_deleteParser(ln_ctx ctx, ln_parser_t *const prs)
+{
+	pdagDeletePrs(ctx, prs);
+	free(prs);
+}
+
+/* checks if a memory block is part of the frozen pdag arena. Such
+ * blocks must not be freed individually.
+ */
+static inline int
+pdagInArena(ln_ctx ctx, const void *const p)
+{
+	const uintptr_t start = (uintptr_t) ctx->pdag_arena;
+	return (uintptr_t) p >= start && (uintptr_t) p < start + ctx->pdag_arena_size;
+}
+
+static void
+pdagDeleteDispatch(struct ln_pdag *const __restrict__ pdag)
+{
+	if(pdag->dispatch == NULL)
+		return;
+	if(!pdagInArena(pdag->ctx, pdag->dispatch)) {
+		free(pdag->dispatch->cand);
+		free(pdag->dispatch);
+	}
+	pdag->dispatch = NULL;
+}
+
 void
 ln_pdagDelete(struct ln_pdag *const __restrict__ pdag)
 {
@@ -320,14 +505,19 @@ ln_pdagDelete(struct ln_pdag *const __restrict__ pdag)
 
 	if(pdag->tags != NULL)
 		json_object_put(pdag->tags);
+	free(pdag->annot);
 
 	for(int i = 0 ; i < pdag->nparsers ; ++i) {
 		pdagDeletePrs(pdag->ctx, pdag->parsers+i);
 	}
-	free(pdag->parsers);
+	if(!pdagInArena(pdag->ctx, pdag->parsers))
+		free(pdag->parsers);
+	pdagDeleteDispatch(pdag);
 	free((void*)pdag->rb_id);
 	free((void*)pdag->rb_file);
-	free(pdag);
+	free((void*)pdag->mockup);
+	if(!pdagInArena(pdag->ctx, pdag))
+		free(pdag);
 done:	return;
 }
 
@@ -338,7 +528,10 @@ done:	return;
  * We compress as much as possible and evalute the path down to
  * the first non-compressable element. Note that we must NOT
  * compact those literals that are either terminal nodes OR
- * contain names so that the literal is to be parsed out.
+ * contain names so that the literal is to be parsed out. Nodes
+ * that are reached from more than one parser (alternatives) must
+ * not be compacted either, and neither must inlined type calls,
+ * which may need to be restored (see ln_pdagUninlineType()).
  */
 static inline int
 optLitPathCompact(ln_ctx ctx, ln_parser_t *prs)
@@ -349,9 +542,12 @@ optLitPathCompact(ln_ctx ctx, ln_parser_t *prs)
 		/* note the NOT prefix in the condition below! */
 		if(!(   prs->prsid == PRS_LITERAL
 		     && prs->name == NULL
+		     && prs->callConf == NULL
 		     && prs->node->flags.isTerminal == 0
+		     && prs->node->refcnt == 1
 		     && prs->node->nparsers == 1
-		     && prs->node->parsers[0].prsid == PRS_LITERAL)
+		     && prs->node->parsers[0].prsid == PRS_LITERAL
+		     && prs->node->parsers[0].callConf == NULL)
 		  )
 			goto done;
 
@@ -370,6 +566,265 @@ done:
 }
 
 
+/* minimum number of input bytes that must be saved per unsuccessful
+ * match attempt in order to factor out a common literal prefix. Each
+ * additional level costs one recursion step, so very short prefixes
+ * are not worth it.
+ */
+#define LIT_PREFIX_MIN_SAVED 8
+
+/* checks if a parser is a literal that can be split for prefix factoring */
+static inline int
+isPlainLiteral(const ln_parser_t *const prs)
+{
+	return prs->prsid == PRS_LITERAL && prs->name == NULL && prs->callConf == NULL;
+}
+
+/* conf string of a single char literal, exactly as the rule base
+ * loader creates it. Note that after path compaction, a literal's conf
+ * describes its first char only.
+ */
+static char *
+litConf(const char c)
+{
+	char buf[] = "x";
+	char *conf = NULL;
+	struct json_object *const json = json_object_new_object();
+
+	if(json == NULL)
+		goto done;
+	buf[0] = c;
+	json_object_object_add(json, "type", json_object_new_string("literal"));
+	json_object_object_add(json, "text", json_object_new_string(buf));
+	conf = strdup(json_object_to_json_string(json));
+	json_object_put(json);
+done:	return conf;
+}
+
+/* move the literals first..last of dag that start with the same char
+ * into a new node, and replace them by a single literal containing
+ * the first len chars they have in common.
+ */
+static int
+litPrefixFactor(ln_ctx ctx,
+	struct ln_pdag *const dag,
+	const int first,
+	const int last,
+	const int n,
+	const size_t len)
+{
+	int r = 0;
+	struct ln_pdag *node = NULL;
+	char **confs = NULL;
+	ln_parser_t prefix;
+	const char c = ln_DataForDisplayLiteral(ctx, dag->parsers[first].parser_data)[0];
+
+	memset(&prefix, 0, sizeof(prefix));
+	CHKN(node = ln_newPDAG(ctx));
+	CHKN(node->parsers = malloc(n * sizeof(ln_parser_t)));
+	CHKN(confs = calloc(n, sizeof(char*)));
+	for(int j = first, k = 0 ; j <= last ; ++j) {
+		const char *const lit = ln_DataForDisplayLiteral(ctx, dag->parsers[j].parser_data);
+		if(lit[0] == c)
+			CHKN(confs[k++] = litConf(lit[len]));
+	}
+	CHKN(prefix.conf = strdup(dag->parsers[first].conf));
+	prefix.prsid = PRS_LITERAL;
+	prefix.prio = dag->parsers[first].prio;
+	prefix.node = node;
+	/* last step that can fail, nothing must be modified before it */
+	CHKR(ln_splitData_Literal(dag->parsers[first].parser_data, len, &prefix.parser_data));
+
+	int w = first;
+	for(int j = first, k = 0 ; j < dag->nparsers ; ++j) {
+		ln_parser_t *const prs = dag->parsers + j;
+		if(j == first) {
+			node->parsers[k] = *prs;
+		} else if(   j <= last
+		          && ln_DataForDisplayLiteral(ctx, prs->parser_data)[0] == c) {
+			ln_splitData_Literal(prs->parser_data, len, NULL);
+			node->parsers[k] = *prs;
+		} else {
+			dag->parsers[w++] = *prs;
+			continue;
+		}
+		free((void*)node->parsers[k].conf);
+		node->parsers[k].conf = confs[k];
+		confs[k++] = NULL;
+		if(j == first)
+			dag->parsers[w++] = prefix;
+	}
+	node->nparsers = n;
+	dag->nparsers = w;
+	LN_DBGPRINTF(ctx, "opt prefix factor: %d literals of %p moved to %p, prefix "
+		"length %zu", n, dag, node, len);
+	node = NULL;
+	prefix.conf = NULL;
+
+done:
+	if(confs != NULL) {
+		for(int k = 0 ; k < n ; ++k)
+			free(confs[k]);
+		free(confs);
+	}
+	free((void*)prefix.conf);
+	ln_pdagDelete(node);
+	return r;
+}
+
+/**
+ * pdag optimizer step: literal prefix factoring
+ *
+ * Sibling literals which start with the same text compare the same
+ * leading input bytes one after the other. We move them into a new
+ * node and branch to it via a single literal holding the common prefix.
+ * As the new node is optimized just like any other, this results in a
+ * radix tree where each input byte is compared once per level.
+ *
+ * Literals from the rule text are already merged char by char when
+ * they are added to the pdag, so this is mostly needed for literal
+ * fields (with a text of more than one char) and literals with an
+ * assigned priority.
+ *
+ * Only unnamed literals of equal priority which are neighbors in the
+ * (sorted) parser table are combined, and the prefix must be shorter
+ * than each of them. Literals with different first chars can never
+ * match at the same position, so their relative order does not matter
+ * and the same rules match as without factoring. The only visible
+ * difference is that unparsed-data may start after the prefix, just
+ * like it does for literals from the rule text.
+ */
+static int
+optLitPrefixFactor(ln_ctx ctx, struct ln_pdag *const dag)
+{
+	int r = 0;
+
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		const ln_parser_t *const prs = dag->parsers + i;
+		if(!isPlainLiteral(prs))
+			continue;
+		const char *const lit = ln_DataForDisplayLiteral(ctx, prs->parser_data);
+		size_t minlen = strlen(lit);
+		size_t len = minlen;
+		int last = i;
+		int n = 1;
+		for(int j = i + 1 ; j < dag->nparsers ; ++j) {
+			const ln_parser_t *const other = dag->parsers + j;
+			if(!isPlainLiteral(other) || other->prio != prs->prio)
+				break;
+			const char *const olit = ln_DataForDisplayLiteral(ctx, other->parser_data);
+			if(olit[0] != lit[0])
+				continue;
+			size_t k;
+			for(k = 0 ; k < len && olit[k] == lit[k] ; ++k)
+				;
+			len = k;
+			if(strlen(olit) < minlen)
+				minlen = strlen(olit);
+			last = j;
+			++n;
+		}
+		if(len >= minlen)
+			len = minlen - 1;
+		if(n < 2 || len == 0 || len * (n - 1) < LIT_PREFIX_MIN_SAVED)
+			continue;
+		CHKR(litPrefixFactor(ctx, dag, i, last, n, len));
+	}
+done:
+	return r;
+}
+
+
+/* minimum number of literal parsers inside a node for which we build
+ * a first-byte dispatch index. For smaller nodes, the linear scan is
+ * cheaper than the index memory and indirection.
+ */
+#define DISPATCH_MIN_LITERALS 4
+
+/* first char of the literal if the parser can be dispatched on it,
+ * '\0' otherwise. Empty literals always match and thus can not.
+ */
+static inline unsigned char
+dispatchChar(struct ln_pdag *const dag, const ln_parser_t *const prs)
+{
+	if(prs->prsid != PRS_LITERAL)
+		return '\0';
+	return (unsigned char) ln_DataForDisplayLiteral(dag->ctx, prs->parser_data)[0];
+}
+
+/**
+ * pdag optimizer step: build first-byte dispatch index
+ *
+ * A literal can only match if the first byte of the to-be-parsed data
+ * is the first char of the literal. So we create, for each possible
+ * first byte, the list of candidate parsers: literals starting with
+ * that byte plus all non-literals. The list starting at offset 0 holds
+ * non-literals only and is used for bytes not starting any literal (as
+ * well as for end of message). As parsers are already sorted, keeping
+ * table order inside the lists preserves priority order, so results
+ * are exactly the same as with the linear scan.
+ */
+static int
+ln_pdagComponentBuildDispatch(ln_ctx ctx, struct ln_pdag *const dag)
+{
+	int r = 0;
+	unsigned char seen[256];
+	int nlit = 0;
+	int nfirst = 0;
+	struct ln_pdag_dispatch *dispatch = NULL;
+
+	pdagDeleteDispatch(dag);
+	memset(seen, 0, sizeof(seen));
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		const unsigned char c = dispatchChar(dag, dag->parsers+i);
+		if(c == '\0')
+			continue;
+		++nlit;
+		if(!seen[c]) {
+			seen[c] = 1;
+			++nfirst;
+		}
+	}
+	if(nlit < DISPATCH_MIN_LITERALS)
+		goto done;
+
+	/* note: with max 255 parsers, the size always fits into uint16_t */
+	const int nother = dag->nparsers - nlit;
+	const size_t size = (1 + nother) * (1 + nfirst) + nlit;
+	CHKN(dispatch = calloc(1, sizeof(struct ln_pdag_dispatch)));
+	CHKN(dispatch->cand = malloc(size * sizeof(prsid_t)));
+
+	int pos = 0;
+	for(int c = -1 ; c < 256 ; ++c) {
+		if(c >= 0) {
+			if(!seen[c])
+				continue;
+			dispatch->start[c] = pos;
+		}
+		/* c == -1 is the list of non-literals only */
+		prsid_t n = 0;
+		for(int i = 0 ; i < dag->nparsers ; ++i) {
+			const unsigned char first = dispatchChar(dag, dag->parsers+i);
+			if(first == '\0' || first == c)
+				dispatch->cand[pos + 1 + n++] = i;
+		}
+		dispatch->cand[pos] = n;
+		pos += 1 + n;
+	}
+	LN_DBGPRINTF(ctx, "dispatch index for %p: %d literals, %d first bytes, %d entries",
+		dag, nlit, nfirst, pos);
+	dag->dispatch = dispatch;
+	dispatch = NULL;
+
+done:
+	if(dispatch != NULL) {
+		free(dispatch->cand);
+		free(dispatch);
+	}
+	return r;
+}
+
+
 static int
 qsort_parserCmp(const void *v1, const void *v2)
 {
@@ -378,6 +833,16 @@ qsort_parserCmp(const void *v1, const void *v2)
 	return p1->prio - p2->prio;
 }
 
+static int
+parsersSorted(const struct ln_pdag *const dag)
+{
+	for(int i = 1 ; i < dag->nparsers ; ++i) {
+		if(qsort_parserCmp(dag->parsers+i-1, dag->parsers+i) > 0)
+			return 0;
+	}
+	return 1;
+}
+
 static int
 ln_pdagComponentOptimize(ln_ctx ctx, struct ln_pdag *const dag)
 {
@@ -387,8 +852,11 @@ for(int i = 0 ; i < dag->nparsers ; ++i) { /* TODO: remove when confident enough
 	ln_parser_t *prs = dag->parsers+i;
 	LN_DBGPRINTF(ctx, "pre sort, parser %d:%s[%d]", i, prs->name, prs->prio);
 }
-	/* first sort parsers in priority order */
-	if(dag->nparsers > 1) {
+	/* first sort parsers in priority order. Note that qsort() is not
+	 * stable, so we must not touch tables which are already sorted (as
+	 * those created by prefix factoring).
+	 */
+	if(dag->nparsers > 1 && !parsersSorted(dag)) {
 		qsort(dag->parsers, dag->nparsers, sizeof(ln_parser_t), qsort_parserCmp);
 	}
 for(int i = 0 ; i < dag->nparsers ; ++i) { /* TODO: remove when confident enough */
@@ -404,9 +872,18 @@ for(int i = 0 ; i < dag->nparsers ; ++i) { /* TODO: remove when confident enough
 			(prs->prsid == PRS_LITERAL) ?  ln_DataForDisplayLiteral(dag->ctx, prs->parser_data) : "UNKNOWN");
 		
 		optLitPathCompact(ctx, prs);
+	}
 
-		ln_pdagComponentOptimize(ctx, prs->node);
+	/* prefixes can only be factored out once all literals are compacted */
+	CHKR(optLitPrefixFactor(ctx, dag));
+
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_pdagComponentOptimize(ctx, dag->parsers[i].node);
 	}
+
+	/* literals are final only after path compaction */
+	CHKR(ln_pdagComponentBuildDispatch(ctx, dag));
+done:
 	return r;
 }
 
@@ -502,484 +979,1967 @@ ln_pdagComponentSetIDs(ln_ctx ctx, struct ln_pdag *const dag, const char *prefix
 done:	return;
 }
 
-/**
- * Optimize the pdag.
- * This includes all components.
- */
-int
-ln_pdagOptimize(ln_ctx ctx)
+#ifdef	ADVANCED_STATS
+static void
+advstatsAdd(struct advstats_totals *const d, const struct advstats_totals *const a)
 {
-	int r = 0;
-
-	for(int i = 0 ; i < ctx->nTypes ; ++i) {
-		LN_DBGPRINTF(ctx, "optimizing component %s\n", ctx->type_pdags[i].name);
-		ln_pdagComponentOptimize(ctx, ctx->type_pdags[i].pdag);
-		ln_pdagComponentSetIDs(ctx, ctx->type_pdags[i].pdag, "");
+	d->parsers_called += a->parsers_called;
+	d->parsers_success += a->parsers_success;
+	for(size_t i = 0 ; i < NPARSERS ; ++i) {
+		d->prs_called[i] += a->prs_called[i];
+		d->prs_success[i] += a->prs_success[i];
 	}
-
-	LN_DBGPRINTF(ctx, "optimizing main pdag component");
-	ln_pdagComponentOptimize(ctx, ctx->pdag);
-	LN_DBGPRINTF(ctx, "finished optimizing main pdag component");
-	ln_pdagComponentSetIDs(ctx, ctx->pdag, "");
-LN_DBGPRINTF(ctx, "---AFTER OPTIMIZATION------------------");
-ln_displayPDAG(ctx);
-LN_DBGPRINTF(ctx, "=======================================");
-	return r;
+	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
+		d->pathlens[i] += a->pathlens[i];
+		d->backtracks[i] += a->backtracks[i];
+		d->parser_calls[i] += a->parser_calls[i];
+		d->lit_parser_calls[i] += a->lit_parser_calls[i];
+	}
+	if(a->max_pathlen > d->max_pathlen)
+		d->max_pathlen = a->max_pathlen;
+	if(a->max_backtracked > d->max_backtracked)
+		d->max_backtracked = a->max_backtracked;
+	if(a->max_parser_calls > d->max_parser_calls)
+		d->max_parser_calls = a->max_parser_calls;
+	if(a->max_lit_parser_calls > d->max_lit_parser_calls)
+		d->max_lit_parser_calls = a->max_lit_parser_calls;
 }
+#endif
 
+static void
+ruleStatsAdd(struct ln_rulestats *const dst, const struct ln_rulestats *const src,
+	const unsigned nslots)
+{
+	for(unsigned i = 0 ; i < nslots ; ++i) {
+		dst[i].count += src[i].count;
+		dst[i].sampled += src[i].sampled;
+		dst[i].latSum += src[i].latSum;
+		for(int b = 0 ; b < RULESTATS_NBUCKETS ; ++b)
+			dst[i].hist[b] += src[i].hist[b];
+	}
+}
 
-#define LN_INTERN_PDAG_STATS_NPARSERS 100
-/* data structure for pdag statistics */
-struct pdag_stats {
-	int nodes;
-	int term_nodes;
-	int parsers;
-	int max_nparsers;
-	int nparsers_cnt[LN_INTERN_PDAG_STATS_NPARSERS];
-	int nparsers_100plus;
-	int *prs_cnt;
-};
-
-/**
- * Recursive step of statistics gatherer.
+/* add statistics block src to dst. Node counters are only added if
+ * both blocks belong to the same frozen pdag.
  */
-static int
-ln_pdagStatsRec(ln_ctx ctx, struct ln_pdag *const dag, struct pdag_stats *const stats)
+static void
+pdagAddTStats(struct ln_pdag_tstats *const dst, const struct ln_pdag_tstats *const src)
 {
-	if(dag->flags.visited)
-		return 0;
-	dag->flags.visited = 1;
-	stats->nodes++;
-	if(dag->flags.isTerminal)
-		stats->term_nodes++;
-	if(dag->nparsers > stats->max_nparsers)
-		stats->max_nparsers = dag->nparsers;
-	if(dag->nparsers >= LN_INTERN_PDAG_STATS_NPARSERS)
-		stats->nparsers_100plus++;
-	else
-		stats->nparsers_cnt[dag->nparsers]++;
-	stats->parsers += dag->nparsers;
-	int max_path = 0;
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_parser_t *prs = dag->parsers+i;
-		if(prs->prsid != PRS_CUSTOM_TYPE)
-			stats->prs_cnt[prs->prsid]++;
-		const int path_len = ln_pdagStatsRec(ctx, prs->node, stats);
-		if(path_len > max_path)
-			max_path = path_len;
+	if(src->nslots == dst->nslots) {
+		for(unsigned i = 0 ; i < dst->nslots ; ++i) {
+			dst->nodes[i].called += src->nodes[i].called;
+			dst->nodes[i].backtracked += src->nodes[i].backtracked;
+		}
+		if(src->rules != NULL && dst->rules == NULL)
+			dst->rules = calloc(dst->nslots, sizeof(struct ln_rulestats));
+		if(src->rules != NULL && dst->rules != NULL)
+			ruleStatsAdd(dst->rules, src->rules, dst->nslots);
 	}
-	return max_path + 1;
+#ifdef	ADVANCED_STATS
+	advstatsAdd(&dst->adv, &src->adv);
+#endif
 }
 
-
 static void
-ln_pdagStatsExtended(ln_ctx ctx, struct ln_pdag *const dag, FILE *const fp, int level)
+parseWrkFree(struct ln_parse_wrk *const wrk)
 {
-	char indent[2048];
-
-	if(level > 1023)
-		level = 1023;
-	memset(indent, ' ', level * 2);
-	indent[level * 2] = '\0';
+	if(wrk->tokener != NULL)
+		json_tokener_free(wrk->tokener);
+	free(wrk->buf);
+	free(wrk->pairs);
+}
 
-	if(dag->stats.called > 0) {
-		fprintf(fp, "%u, %u, %s\n",
-			dag->stats.called,
-			dag->stats.backtracked,
-			dag->rb_id);
-	}
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_parser_t *const prs = dag->parsers+i;
-		if(prs->node->stats.called > 0) {
-			ln_pdagStatsExtended(ctx, prs->node, fp, level+1);
+/* thread-specific data destructor: a thread terminates, so we keep
+ * its counters in the retired block.
+ */
+static void
+pdagRetireTStats(void *const p)
+{
+	struct ln_pdag_tstats *const ts = (struct ln_pdag_tstats*) p;
+	ln_ctx ctx = ts->ctx;
+
+	pthread_mutex_lock(&ctx->stats_mut);
+	pdagAddTStats(ctx->tstats_retired, ts);
+	for(struct ln_pdag_tstats **pp = &ctx->tstats ; *pp != NULL ; pp = &(*pp)->next) {
+		if(*pp == ts) {
+			*pp = ts->next;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&ctx->stats_mut);
+	free(ts->nodes);
+	free(ts->rules);
+	free(ts->memo.tab);
+	parseWrkFree(&ts->wrk);
+	free(ts);
 }
 
-/**
- * Gather pdag statistics for a *specific* pdag.
- *
- * Data is sent to given file ptr.
+/* obtain the statistics block of the calling thread. If there is none
+ * yet or it belongs to an outdated pdag, it is (re)created.
+ * @return block or NULL on error
  */
-static void
-ln_pdagStats(ln_ctx ctx, struct ln_pdag *const dag, FILE *const fp, const int extendedStats)
+static struct ln_pdag_tstats *
+pdagThreadStats(ln_ctx ctx)
 {
-	struct pdag_stats *const stats = calloc(1, sizeof(struct pdag_stats));
-	stats->prs_cnt = calloc(NPARSERS, sizeof(int));
-	//ln_pdagClearVisited(ctx);
-	const int longest_path = ln_pdagStatsRec(ctx, dag, stats);
-
-	fprintf(fp, "nodes.............: %4d\n", stats->nodes);
-	fprintf(fp, "terminal nodes....: %4d\n", stats->term_nodes);
-	fprintf(fp, "parsers entries...: %4d\n", stats->parsers);
-	fprintf(fp, "longest path......: %4d\n", longest_path);
+	const unsigned nslots = ctx->nPdagNodes + 1;
+	struct ln_pdag_tstats *ts;
+
+	if(!ctx->bStatsKey) {
+		/* no thread-specific storage available, so we can only
+		 * provide statistics for single-threaded use.
+		 */
+		return ctx->tstats_retired;
+	}
+	ts = pthread_getspecific(ctx->stats_key);
+	if(ts != NULL && ts->nslots == nslots)
+		goto done;
 
-	fprintf(fp, "Parser Type Counts:\n");
-	for(prsid_t i = 0 ; i < NPARSERS ; ++i) {
-		if(stats->prs_cnt[i] != 0)
-			fprintf(fp, "\t%20s: %d\n", parserName(i), stats->prs_cnt[i]);
+	pthread_mutex_lock(&ctx->stats_mut);
+	if(ts == NULL) {
+		if((ts = calloc(1, sizeof(struct ln_pdag_tstats))) == NULL)
+			goto unlock;
+		if(pthread_setspecific(ctx->stats_key, ts) != 0) {
+			free(ts);
+			ts = NULL;
+			goto unlock;
+		}
+		ts->ctx = ctx;
+		ts->next = ctx->tstats;
+		ctx->tstats = ts;
 	}
+	free(ts->nodes);
+	free(ts->rules);
+	ts->rules = NULL;
+	ts->nslots = 0;
+	if((ts->nodes = calloc(nslots, sizeof(struct ln_pdag_nodestats))) == NULL) {
+		ts = NULL;
+		goto unlock;
+	}
+	ts->nslots = nslots;
+unlock:
+	pthread_mutex_unlock(&ctx->stats_mut);
+done:
+	return ts;
+}
 
-	int pp = 0;
-	fprintf(fp, "Parsers per Node:\n");
-	fprintf(fp, "\tmax:\t%4d\n", stats->max_nparsers);
-	for(int i = 0 ; i < 100 ; ++i) {
-		pp += stats->nparsers_cnt[i];
-		if(stats->nparsers_cnt[i] != 0)
-			fprintf(fp, "\t%d:\t%4d\n", i, stats->nparsers_cnt[i]);
+static inline uint64_t
+ruleStatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* decide if the current message is to be timed */
+static inline int
+ruleStatsSample(struct ln_pdag_tstats *const ts, const unsigned sampling)
+{
+	if(++ts->ruleSampleCnt < sampling)
+		return 0;
+	ts->ruleSampleCnt = 0;
+	return 1;
+}
+
+/* count a message for its end node (slot 0 if unmatched). If the
+ * message was sampled, tBegin is its start time, else 0.
+ */
+static void
+ruleStatsRecord(ln_ctx ctx, struct ln_pdag_tstats *const ts, const unsigned slot,
+	const uint64_t tBegin)
+{
+	if(ts->rules == NULL) {
+		/* the block may be merged concurrently, so we must not
+		 * hook in the counters without holding the lock.
+		 */
+		pthread_mutex_lock(&ctx->stats_mut);
+		if(ts->nslots > 0)
+			ts->rules = calloc(ts->nslots, sizeof(struct ln_rulestats));
+		pthread_mutex_unlock(&ctx->stats_mut);
+		if(ts->rules == NULL)
+			return;
+	}
+	struct ln_rulestats *const rs = ts->rules + slot;
+	++rs->count;
+	if(tBegin != 0) {
+		const uint64_t ns = ruleStatsNow() - tBegin;
+		uint64_t v = ns >> 8;
+		int b = 0;
+		while(v != 0 && b < RULESTATS_NBUCKETS - 1) {
+			v >>= 1;
+			++b;
+		}
+		++rs->sampled;
+		rs->latSum += ns;
+		++rs->hist[b];
 	}
+}
 
-	free(stats->prs_cnt);
-	free(stats);
-	
-	if(extendedStats) {
-		fprintf(fp, "Usage Statistics:\n"
-			    "-----------------\n");
-		fprintf(fp, "called, backtracked, rule\n");
-		ln_pdagComponentClearVisited(dag);
-		ln_pdagStatsExtended(ctx, dag, fp, 0);
+/* merge all statistics blocks into the node stats. This must be called
+ * before node stats are used. Note that active threads may continue to
+ * count while we merge, so the result is a snapshot.
+ */
+static void
+pdagStatsMerge(ln_ctx ctx)
+{
+	const struct ln_pdag_tstats *const retired = ctx->tstats_retired;
+
+	pthread_mutex_lock(&ctx->stats_mut);
+	for(unsigned i = 1 ; i < retired->nslots ; ++i) {
+		struct ln_pdag *const dag = ctx->pdag_nodes[i-1];
+		dag->stats.called = retired->nodes[i].called;
+		dag->stats.backtracked = retired->nodes[i].backtracked;
+		for(struct ln_pdag_tstats *ts = ctx->tstats ; ts != NULL ; ts = ts->next) {
+			if(ts->nslots == retired->nslots) {
+				dag->stats.called += ts->nodes[i].called;
+				dag->stats.backtracked += ts->nodes[i].backtracked;
+			}
+		}
 	}
+	pthread_mutex_unlock(&ctx->stats_mut);
 }
 
+#ifdef	ADVANCED_STATS
+static void
+pdagAdvStatsMerge(ln_ctx ctx, struct advstats_totals *const as)
+{
+	pthread_mutex_lock(&ctx->stats_mut);
+	memcpy(as, &ctx->tstats_retired->adv, sizeof(struct advstats_totals));
+	for(struct ln_pdag_tstats *ts = ctx->tstats ; ts != NULL ; ts = ts->next) {
+		advstatsAdd(as, &ts->adv);
+	}
+	pthread_mutex_unlock(&ctx->stats_mut);
+}
+#endif
 
-/**
- * Gather and output pdag statistics for the full pdag (ctx)
- * including all disconnected components (type defs).
- *
- * Data is sent to given file ptr.
+/* node slots were reassigned (pdag has been frozen). Node stats must
+ * have been merged before this is called. Must not be called while
+ * normalizing.
  */
+static int
+pdagStatsReset(ln_ctx ctx)
+{
+	int r = 0;
+	struct ln_pdag_tstats *const retired = ctx->tstats_retired;
+	struct ln_pdag_nodestats *nodes;
+
+	pthread_mutex_lock(&ctx->stats_mut);
+	for(struct ln_pdag_tstats *ts = ctx->tstats ; ts != NULL ; ts = ts->next) {
+		free(ts->nodes);
+		ts->nodes = NULL;
+		free(ts->rules);
+		ts->rules = NULL;
+		ts->nslots = 0;
+	}
+	CHKN(nodes = calloc(ctx->nPdagNodes + 1, sizeof(struct ln_pdag_nodestats)));
+	for(unsigned i = 1 ; i <= ctx->nPdagNodes ; ++i) {
+		nodes[i].called = ctx->pdag_nodes[i-1]->stats.called;
+		nodes[i].backtracked = ctx->pdag_nodes[i-1]->stats.backtracked;
+	}
+	free(retired->nodes);
+	retired->nodes = nodes;
+	free(retired->rules);
+	retired->rules = NULL;
+	retired->nslots = ctx->nPdagNodes + 1;
+done:
+	pthread_mutex_unlock(&ctx->stats_mut);
+	return r;
+}
+
+int
+ln_pdagInitStats(ln_ctx ctx)
+{
+	int r = 0;
+
+	CHKN(ctx->tstats_retired = calloc(1, sizeof(struct ln_pdag_tstats)));
+	CHKN(ctx->tstats_retired->nodes = calloc(1, sizeof(struct ln_pdag_nodestats)));
+	ctx->tstats_retired->nslots = 1;
+	ctx->tstats_retired->ctx = ctx;
+	pthread_mutex_init(&ctx->stats_mut, NULL);
+	ctx->bStatsKey = (pthread_key_create(&ctx->stats_key, pdagRetireTStats) == 0);
+done:
+	return r;
+}
+
 void
-ln_fullPdagStats(ln_ctx ctx, FILE *const fp, const int extendedStats)
+ln_pdagExitStats(ln_ctx ctx)
 {
-	if(ctx->ptree != NULL) {
-		/* we need to handle the old cruft */
-		ln_fullPTreeStats(ctx, fp, extendedStats);
+	struct ln_pdag_tstats *ts, *next;
+
+	if(ctx->tstats_retired == NULL)
 		return;
+	if(ctx->bStatsKey)
+		pthread_key_delete(ctx->stats_key);
+	for(ts = ctx->tstats ; ts != NULL ; ts = next) {
+		next = ts->next;
+		free(ts->nodes);
+		free(ts->rules);
+		free(ts->memo.tab);
+		parseWrkFree(&ts->wrk);
+		free(ts);
 	}
+	free(ctx->tstats_retired->nodes);
+	free(ctx->tstats_retired->rules);
+	free(ctx->tstats_retired->memo.tab);
+	parseWrkFree(&ctx->tstats_retired->wrk);
+	free(ctx->tstats_retired);
+	pthread_mutex_destroy(&ctx->stats_mut);
+	free(ctx->pdag_nodes);
+}
 
-	fprintf(fp, "User-Defined Types\n"
-	            "==================\n");
-	fprintf(fp, "number types: %d\n", ctx->nTypes);
-	for(int i = 0 ; i < ctx->nTypes ; ++i)
-		fprintf(fp, "type: %s\n", ctx->type_pdags[i].name);
+/* parser work area
+ *
+ * The structured-payload parsers need a JSON tokener and scratch
+ * memory. Both are kept per thread, so that they need not be
+ * allocated on each parser call. Without thread-specific storage,
+ * all threads share the retired statistics block, so the work area
+ * must then be private to the normalizer call.
+ */
+static void
+parseWrkSetup(npb_t *const npb)
+{
+	npb->wrk = npb->ctx->bStatsKey ? &npb->tstats->wrk : &npb->ownWrk;
+}
 
-	for(int i = 0 ; i < ctx->nTypes ; ++i) {
-		fprintf(fp, "\n"
-			    "type PDAG: %s\n"
-		            "----------\n", ctx->type_pdags[i].name);
-		ln_pdagStats(ctx, ctx->type_pdags[i].pdag, fp, extendedStats);
+/* obtain the JSON tokener of the calling thread, ready for a new parse.
+ * @return tokener or NULL if out of memory
+ */
+struct json_tokener *
+ln_parseTokener(npb_t *const npb)
+{
+	struct ln_parse_wrk *const wrk = npb->wrk;
+	if(wrk->tokener == NULL)
+		wrk->tokener = json_tokener_new();
+	else
+		json_tokener_reset(wrk->tokener);
+	return wrk->tokener;
+}
+
+/* obtain a scratch buffer of at least size bytes. The buffer is
+ * valid until the next call by the same thread.
+ * @return buffer or NULL if out of memory
+ */
+char *
+ln_parseBuf(npb_t *const npb, const size_t size)
+{
+	struct ln_parse_wrk *const wrk = npb->wrk;
+	if(size > wrk->sizeBuf) {
+		const size_t newSize = (size < 256) ? 256 : 2 * size;
+		char *const buf = realloc(wrk->buf, newSize);
+		if(buf == NULL)
+			return NULL;
+		wrk->buf = buf;
+		wrk->sizeBuf = newSize;
 	}
+	return wrk->buf;
+}
 
-	fprintf(fp, "\n"
-		    "Main PDAG\n"
-	            "=========\n");
-	ln_pdagStats(ctx, ctx->pdag, fp, extendedStats);
+/* obtain the name/value pair table, with room for at least n pairs.
+ * Existing entries are kept when the table needs to grow.
+ * @return table or NULL if out of memory
+ */
+struct ln_nvpair *
+ln_parsePairs(npb_t *const npb, const unsigned n)
+{
+	struct ln_parse_wrk *const wrk = npb->wrk;
+	if(n > wrk->sizePairs) {
+		const unsigned newSize = (n < 32) ? 32 : 2 * n;
+		struct ln_nvpair *const pairs = realloc(wrk->pairs,
+			newSize * sizeof(struct ln_nvpair));
+		if(pairs == NULL)
+			return NULL;
+		wrk->pairs = pairs;
+		wrk->sizePairs = newSize;
+	}
+	return wrk->pairs;
+}
 
-#ifdef	ADVANCED_STATS
-	const uint64_t parsers_failed = advstats_parsers_called - advstats_parsers_success;
-	fprintf(fp, "\n"
-		    "Advanced Runtime Stats\n"
-	            "======================\n");
-	fprintf(fp, "These are actual number from analyzing the control flow "
-		    "at runtime.\n");
-	fprintf(fp, "Note that literal matching is also done via parsers. As such, \n"
-		    "it is expected that fail rates increase with the size of the \n"
-		    "rule base.\n");
-	fprintf(fp, "\n");
-	fprintf(fp, "Parser Calls:\n");
-	fprintf(fp, "total....: %10" PRIu64 "\n", advstats_parsers_called);
-	fprintf(fp, "succesful: %10" PRIu64 "\n", advstats_parsers_success);
-	fprintf(fp, "failed...: %10" PRIu64 " [%d%%]\n",
-		parsers_failed,
-		(int) ((parsers_failed * 100) / advstats_parsers_called) );
-	fprintf(fp, "\nIndividual Parser Calls "
-		    "(never called parsers are not shown):\n");
-	for(  size_t i = 0
-	    ; i < sizeof(parser_lookup_table) / sizeof(struct ln_parser_info)
-	    ; ++i) {
-		if(parser_lookup_table[i].called > 0) {
-			const uint64_t failed = parser_lookup_table[i].called
-				- parser_lookup_table[i].success;
-			fprintf(fp, "%20s: %10" PRIu64 " [%5.2f%%] "
-				    "success: %10" PRIu64 " [%5.1f%%] "
-				    "fail: %10" PRIu64 " [%5.1f%%]"
-			            "\n",
-				parser_lookup_table[i].name,
-				parser_lookup_table[i].called,
-				(float)(parser_lookup_table[i].called * 100)
-				        / advstats_parsers_called,
-				parser_lookup_table[i].success,
-				(float)(parser_lookup_table[i].success * 100)
-				        / parser_lookup_table[i].called,
-				failed,
-				(float)(failed * 100)
-				        / parser_lookup_table[i].called
-			       );
-		}
+
+/* pdag freezing
+ *
+ * After optimization, the pdag is no longer modified. We then lay out
+ * all of its nodes inside a single memory block, each node immediately
+ * followed by its parser table and dispatch index. As nodes are placed
+ * in depth-first order, the data touched while walking down a path is
+ * mostly adjacent in memory, instead of being scattered all over the
+ * heap. The normalizer itself is unchanged, it just follows pointers
+ * into the arena.
+ * Note that parser instance data is owned by the individual parsers and
+ * stays where it is.
+ */
+#define FREEZE_ALIGN(x) (((x) + 15) & ~((size_t) 15))
+
+struct pdag_freeze {
+	struct ln_pdag **nodes;	/**< all nodes, in layout order */
+	int nnodes;
+	int maxnodes;
+	struct pdag_reloc {
+		struct ln_pdag *old;
+		struct ln_pdag *new;
+	} *reloc;		/**< old -> new node address, sorted by old */
+};
+
+static int
+freezeCollect(struct pdag_freeze *const fz, struct ln_pdag *const dag)
+{
+	int r = 0;
+	if(dag->flags.visited)
+		goto done;
+	dag->flags.visited = 1;
+	if(fz->nnodes == fz->maxnodes) {
+		const int newmax = (fz->maxnodes == 0) ? 1024 : 2 * fz->maxnodes;
+		struct ln_pdag **newnodes;
+		CHKN(newnodes = realloc(fz->nodes, newmax * sizeof(struct ln_pdag*)));
+		fz->nodes = newnodes;
+		fz->maxnodes = newmax;
+	}
+	fz->nodes[fz->nnodes++] = dag;
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		CHKR(freezeCollect(fz, dag->parsers[i].node));
 	}
+done:
+	return r;
+}
 
-	uint64_t total_len;
-	uint64_t total_cnt;
-	fprintf(fp, "\n");
-	fprintf(fp, "\n"
-	            "Path Length Statistics\n"
-	            "----------------------\n"
-	            "The regular path length is the number of nodes being visited,\n"
-		    "where each node potentially evaluates several parsers. The\n"
-		    "parser call statistic is the number of parsers called along\n"
-		    "the path. That number is higher, as multiple parsers may be\n"
-		    "called at each node. The number of literal parser calls is\n"
-		    "given explicitely, as they use almost no time to process.\n"
-		    "\n"
-		);
-	total_len = 0;
-	total_cnt = 0;
-	fprintf(fp, "Path Length\n");
-	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
-		if(advstats_pathlens[i] > 0 ) {
-			fprintf(fp, "%3d: %d\n", i, advstats_pathlens[i]);
-			total_len += i * advstats_pathlens[i];
-			total_cnt += advstats_pathlens[i];
-		}
+/* number of entries in dispatch candidate table */
+static size_t
+dispatchSize(const struct ln_pdag_dispatch *const dispatch)
+{
+	size_t size = 1 + dispatch->cand[0];
+	for(int c = 0 ; c < 256 ; ++c) {
+		const size_t end = dispatch->start[c] + 1 + dispatch->cand[dispatch->start[c]];
+		if(end > size)
+			size = end;
 	}
-	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
-	fprintf(fp, "max: %d\n", advstats_max_pathlen);
-	fprintf(fp, "\n");
+	return size;
+}
 
-	total_len = 0;
-	total_cnt = 0;
-	fprintf(fp, "Nbr Backtracked\n");
-	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
-		if(advstats_backtracks[i] > 0 ) {
-			fprintf(fp, "%3d: %d\n", i, advstats_backtracks[i]);
-			total_len += i * advstats_backtracks[i];
-			total_cnt += advstats_backtracks[i];
-		}
+static size_t
+freezeNodeSize(const struct ln_pdag *const dag)
+{
+	size_t size = FREEZE_ALIGN(sizeof(struct ln_pdag))
+		    + FREEZE_ALIGN(dag->nparsers * sizeof(ln_parser_t));
+	if(dag->dispatch != NULL) {
+		size += FREEZE_ALIGN(sizeof(struct ln_pdag_dispatch))
+		      + FREEZE_ALIGN(dispatchSize(dag->dispatch) * sizeof(prsid_t));
 	}
-	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
-	fprintf(fp, "max: %d\n", advstats_max_backtracked);
-	fprintf(fp, "\n");
+	return size;
+}
 
-	/* we calc some stats while we output */
-	total_len = 0;
-	total_cnt = 0;
-	fprintf(fp, "Parser Calls\n");
-	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
-		if(advstats_parser_calls[i] > 0 ) {
-			fprintf(fp, "%3d: %d\n", i, advstats_parser_calls[i]);
-			total_len += i * advstats_parser_calls[i];
-			total_cnt += advstats_parser_calls[i];
-		}
+static int
+qsort_relocCmp(const void *v1, const void *v2)
+{
+	const uintptr_t p1 = (uintptr_t) ((const struct pdag_reloc*) v1)->old;
+	const uintptr_t p2 = (uintptr_t) ((const struct pdag_reloc*) v2)->old;
+	return (p1 > p2) - (p1 < p2);
+}
+
+static struct ln_pdag *
+freezeRelocate(const struct pdag_freeze *const fz, struct ln_pdag *const old)
+{
+	struct pdag_reloc key;
+	key.old = old;
+	const struct pdag_reloc *const found = bsearch(&key, fz->reloc, fz->nnodes,
+		sizeof(struct pdag_reloc), qsort_relocCmp);
+	return (found == NULL) ? old : found->new;
+}
+
+/**
+ * Freeze the (optimized) pdag into a single contiguous memory block.
+ * This can be done multiple times, e.g. if a rule base is loaded on top
+ * of an already frozen one. The previous arena is released in this case.
+ */
+static int
+ln_pdagFreeze(ln_ctx ctx)
+{
+	int r = 0;
+	struct pdag_freeze fz;
+	char *arena = NULL;
+	struct ln_pdag **pdag_nodes = NULL;
+	size_t size = 0;
+
+	memset(&fz, 0, sizeof(fz));
+	pdagStatsMerge(ctx);
+	ln_pdagClearVisited(ctx);
+	CHKR(freezeCollect(&fz, ctx->pdag));
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		CHKR(freezeCollect(&fz, ctx->type_pdags[i]->pdag));
 	}
-	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
-	fprintf(fp, "max: %d\n", advstats_max_parser_calls);
-	fprintf(fp, "\n");
+	ln_pdagClearVisited(ctx);
 
-	total_len = 0;
-	total_cnt = 0;
-	fprintf(fp, "LITERAL Parser Calls\n");
-	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
-		if(advstats_lit_parser_calls[i] > 0 ) {
-			fprintf(fp, "%3d: %d\n", i, advstats_lit_parser_calls[i]);
-			total_len += i * advstats_lit_parser_calls[i];
-			total_cnt += advstats_lit_parser_calls[i];
+	for(int i = 0 ; i < fz.nnodes ; ++i) {
+		size += freezeNodeSize(fz.nodes[i]);
+	}
+	CHKN(arena = calloc(1, size));
+	CHKN(fz.reloc = malloc(fz.nnodes * sizeof(struct pdag_reloc)));
+	CHKN(pdag_nodes = malloc(fz.nnodes * sizeof(struct ln_pdag*)));
+
+	/* copy nodes into arena */
+	char *pos = arena;
+	for(int i = 0 ; i < fz.nnodes ; ++i) {
+		struct ln_pdag *const old = fz.nodes[i];
+		struct ln_pdag *const dag = (struct ln_pdag*) pos;
+		memcpy(dag, old, sizeof(struct ln_pdag));
+		pos += FREEZE_ALIGN(sizeof(struct ln_pdag));
+		if(old->nparsers > 0) {
+			dag->parsers = (ln_parser_t*) pos;
+			memcpy(dag->parsers, old->parsers, old->nparsers * sizeof(ln_parser_t));
 		}
+		pos += FREEZE_ALIGN(old->nparsers * sizeof(ln_parser_t));
+		if(old->dispatch != NULL) {
+			dag->dispatch = (struct ln_pdag_dispatch*) pos;
+			memcpy(dag->dispatch, old->dispatch, sizeof(struct ln_pdag_dispatch));
+			pos += FREEZE_ALIGN(sizeof(struct ln_pdag_dispatch));
+			const size_t ncand = dispatchSize(old->dispatch);
+			dag->dispatch->cand = (prsid_t*) pos;
+			memcpy(dag->dispatch->cand, old->dispatch->cand, ncand * sizeof(prsid_t));
+			pos += FREEZE_ALIGN(ncand * sizeof(prsid_t));
+		}
+		dag->stats_id = i + 1;
+		pdag_nodes[i] = dag;
+		fz.reloc[i].old = old;
+		fz.reloc[i].new = dag;
 	}
-	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
-	fprintf(fp, "max: %d\n", advstats_max_lit_parser_calls);
-	fprintf(fp, "\n");
-#endif
+	assert(pos == arena + size);
+
+	/* fix up node references */
+	qsort(fz.reloc, fz.nnodes, sizeof(struct pdag_reloc), qsort_relocCmp);
+	for(int i = 0 ; i < fz.nnodes ; ++i) {
+		struct ln_pdag *const dag = fz.reloc[i].new;
+		for(int j = 0 ; j < dag->nparsers ; ++j) {
+			dag->parsers[j].node = freezeRelocate(&fz, dag->parsers[j].node);
+		}
+	}
+	ctx->pdag = freezeRelocate(&fz, ctx->pdag);
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		ctx->type_pdags[i]->pdag = freezeRelocate(&fz, ctx->type_pdags[i]->pdag);
+	}
+
+	/* release old node memory; members are now owned by the frozen nodes */
+	for(int i = 0 ; i < fz.nnodes ; ++i) {
+		struct ln_pdag *const old = fz.nodes[i];
+		if(!pdagInArena(ctx, old->parsers))
+			free(old->parsers);
+		pdagDeleteDispatch(old);
+		if(!pdagInArena(ctx, old))
+			free(old);
+	}
+	free(ctx->pdag_arena);
+	ctx->pdag_arena = arena;
+	ctx->pdag_arena_size = size;
+	arena = NULL;
+	free(ctx->pdag_nodes);
+	ctx->pdag_nodes = pdag_nodes;
+	ctx->nPdagNodes = fz.nnodes;
+	pdag_nodes = NULL;
+	LN_DBGPRINTF(ctx, "pdag frozen: %d nodes, %zu bytes", fz.nnodes, size);
+	CHKR(pdagStatsReset(ctx));
+
+done:
+	free(arena);
+	free(pdag_nodes);
+	free(fz.reloc);
+	free(fz.nodes);
+	return r;
 }
 
 /**
- * Check if the provided dag is a leaf. This means that it
- * does not contain any subdags.
- * @return 1 if it is a leaf, 0 otherwise
+ * Resolve the annotations of all terminal nodes, so that events need
+ * not be annotated via the annotation set. Must be called whenever
+ * nodes or annotations have been added, after the pdag was frozen.
  */
-static inline int
-isLeaf(struct ln_pdag *dag)
+int
+ln_pdagCompileAnnots(ln_ctx ctx)
 {
-	return dag->nparsers == 0 ? 1 : 0;
+	int r = 0;
+	for(unsigned i = 0 ; i < ctx->nPdagNodes ; ++i) {
+		struct ln_pdag *const dag = ctx->pdag_nodes[i];
+		free(dag->annot);
+		dag->annot = NULL;
+		if(dag->tags != NULL)
+			CHKR(ln_compileAnnot(ctx->pas, dag->tags, &dag->annot));
+	}
+done:
+	return r;
 }
 
+/* rule mockups, see LN_CTXOPT_ADD_RULE. A mockup lists the parsers
+ * on the path to the terminal node, so if the node can be reached via
+ * one path only, it is known at load time. Only nodes reached via
+ * alternatives need to record the path taken while normalizing.
+ * Custom types and repeat parsers are shown by their call only, and
+ * only terminal nodes of the main component record their path.
+ * Mockups are built only if requested when the rule base is loaded;
+ * if they are requested later, they are recorded for all nodes.
+ */
+struct pdag_mockup {
+	char *buf;
+	size_t len;
+	size_t size;
+};
 
-/**
- * Add a parser instance to the pdag at the current position.
- *
- * @param[in] ctx
- * @param[in] prscnf json parser config *object* (no array!)
- * @param[in] pdag current pdag position (to which parser is to be added)
- * @param[in/out] nextnode contains point to the next node, either 
- *            an existing one or one newly created.
- *
- * The nextnode parameter permits to use this function to create
- * multiple parsers alternative parsers with a single run. To do so,
- * set nextnode=NULL on first call. On successive calls, keep the
- * value. If a value is present, we will not accept non-identical
- * parsers which point to different nodes - this will result in an
- * error.
- *
- * IMPORTANT: the caller is responsible to update its pdag pointer
- *            to the nextnode value when he is done adding parsers.
- *
- * If a parser of the same type with identical data already exists,
- * it is "resued", which means the function is effectively used to
- * walk the path. This is used during parser construction to
- * navigate to new parts of the pdag.
+static int
+mockupAdd(struct pdag_mockup *const mk, const char *const str)
+{
+	int r = 0;
+	const size_t len = strlen(str);
+	if(mk->len + len + 1 > mk->size) {
+		const size_t newsize = 2 * (mk->len + len + 1);
+		char *newbuf;
+		CHKN(newbuf = realloc(mk->buf, newsize));
+		mk->buf = newbuf;
+		mk->size = newsize;
+	}
+	memcpy(mk->buf + mk->len, str, len + 1);
+	mk->len += len;
+done:
+	return r;
+}
+
+/* add a parser to the mockup, just like add_rule_to_mockup() does.
+ * Inlined type calls are shown as in the rule source.
  */
 static int
-ln_pdagAddParserInstance(ln_ctx ctx,
-	json_object *const __restrict__ prscnf,
-	struct ln_pdag *const __restrict__ pdag,
-	struct ln_pdag **nextnode)
+mockupAddParser(ln_ctx ctx, struct pdag_mockup *const mk, const ln_parser_t *const prs)
 {
 	int r;
-	LN_DBGPRINTF(ctx, "ln_pdagAddParserInstance: %s", json_object_to_json_string(prscnf));
-	ln_parser_t *const parser = ln_newParser(ctx, prscnf);
-	CHKN(parser);
-	LN_DBGPRINTF(ctx, "pdag: %p, parser %p", pdag, parser);
-	/* check if we already have this parser, if so, merge
-	 */
-	int i;
-	for(i = 0 ; i < pdag->nparsers ; ++i) {
-		LN_DBGPRINTF(ctx, "parser  comparison:\n%s\n%s",  pdag->parsers[i].conf, parser->conf);
-		if(   pdag->parsers[i].prsid == parser->prsid
-		   && !strcmp(pdag->parsers[i].conf, parser->conf)) {
-		   	// FIXME: the current ->conf object is depending on
-			//        the order of json elements. We should do a JSON
-			//        comparison (a bit more complex). For now, it
-			//        works like we do it now.
-			// FIXME: if nextnode is set, check we can actually combine, 
-			//        else err out
-			*nextnode = pdag->parsers[i].node;
-			r = 0;
-			LN_DBGPRINTF(ctx, "merging with pdag %p", pdag);
-			pdagDeletePrs(ctx, parser); /* no need for data items */
-			goto done;
-		}
-	}
-	/* if we reach this point, we have a new parser type */
-	if(*nextnode == NULL) {
-		CHKN(*nextnode = ln_newPDAG(ctx)); /* we need a new node */
+	if(prs->callConf != NULL) {
+		CHKR(mockupAdd(mk, "%"));
+		CHKR(mockupAdd(mk, (prs->callName == NULL) ? "-" : prs->callName));
+		CHKR(mockupAdd(mk, ":"));
+		CHKR(mockupAdd(mk, parserName(PRS_CUSTOM_TYPE)));
+		CHKR(mockupAdd(mk, "%"));
+	} else if(prs->prsid == PRS_LITERAL) {
+		CHKR(mockupAdd(mk, ln_DataForDisplayLiteral(ctx, prs->parser_data)));
 	} else {
-		(*nextnode)->refcnt++;
+		CHKR(mockupAdd(mk, "%"));
+		CHKR(mockupAdd(mk, (prs->name == NULL) ? "-" : prs->name));
+		CHKR(mockupAdd(mk, ":"));
+		CHKR(mockupAdd(mk, parserName(prs->prsid)));
+		CHKR(mockupAdd(mk, "%"));
 	}
-	parser->node = *nextnode;
-	ln_parser_t *const newtab
-		= realloc(pdag->parsers, (pdag->nparsers+1) * sizeof(ln_parser_t));
-	CHKN(newtab);
-	pdag->parsers = newtab;
-	memcpy(pdag->parsers+pdag->nparsers, parser, sizeof(ln_parser_t));
-	pdag->nparsers++;
+done:
+	return r;
+}
 
-	r = 0;
+static int
+pdagBuildMockupsRec(ln_ctx ctx, struct ln_pdag *const dag, struct pdag_mockup *const mk,
+	const int bUnique)
+{
+	int r = 0;
 
+	/* a node reached for the second time can only be reached by several paths */
+	if(dag->flags.visited)
+		goto done;
+	dag->flags.visited = 1;
+	free((void*)dag->mockup);
+	dag->mockup = NULL;
+	if(dag->flags.isTerminal && bUnique && mk->buf != NULL)
+		CHKN(dag->mockup = strdup(mk->buf));
+	dag->flags.recordMockup = dag->flags.isTerminal && dag->mockup == NULL;
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		const ln_parser_t *const prs = dag->parsers + i;
+		const size_t len = mk->len;
+		if(mk->buf != NULL)
+			CHKR(mockupAddParser(ctx, mk, prs));
+		CHKR(pdagBuildMockupsRec(ctx, prs->node, mk, bUnique && prs->node->refcnt == 1));
+		mk->len = len;
+		if(mk->buf != NULL)
+			mk->buf[len] = '\0';
+	}
 done:
-	free(parser);
 	return r;
 }
 
-static int ln_pdagAddParserInternal(ln_ctx ctx, struct ln_pdag **pdag, const int mode, json_object *const prscnf, struct ln_pdag **nextnode);
+/* build the mockups of all terminal nodes of the main component, or
+ * remove them if they are not requested.
+ */
+static int
+pdagBuildMockups(ln_ctx ctx)
+{
+	int r = 0;
+	struct pdag_mockup mk;
+
+	memset(&mk, 0, sizeof(mk));
+	if(ctx->opts & LN_CTXOPT_ADD_RULE)
+		CHKR(mockupAdd(&mk, ""));
+	ln_pdagClearVisited(ctx);
+	CHKR(pdagBuildMockupsRec(ctx, ctx->pdag, &mk, 1));
+done:
+	free(mk.buf);
+	return r;
+}
 
 /**
- * add parsers to current pdag. This is used
- * to add parsers stored in an array. The mode specifies
- * how parsers shall be added.
+ * pdag optimizer step: inline small custom types
+ *
+ * Calling a custom type means a recursion into the type's component and
+ * a new JSON object for its fields. For a type that consists of a
+ * single parser, we can instead replace the call by a copy of that
+ * parser. As the type parser is not followed by anything, it matches
+ * exactly where the call matches, and the same part of the message is
+ * parsed. We do so only if the event stays the same, see fixJSON():
+ * - a call without field name discards the type's fields
+ * - a type parser named ".." provides the value of the call itself
+ * - a call named "." merges nothing if the type parser has no name,
+ *   and a field ".." if it is named ".."
+ * Types calling other types and repeat parsers (which contain pdags of
+ * their own) are never inlined.
+ * The inlined parser keeps the call's type, name and conf, so that the
+ * call can be restored if a rule base loaded later extends the type.
  */
-#define PRS_ADD_MODE_SEQ 0
-#define PRS_ADD_MODE_ALTERNATIVE 1
 static int
-ln_pdagAddParsers(ln_ctx ctx,
-	json_object *const prscnf,
-	const int mode,
-	struct ln_pdag **pdag,
-	struct ln_pdag **p_nextnode)
+typeInlinable(const struct ln_type_pdag *const td)
 {
-	int r = LN_BADCONFIG;
-	struct ln_pdag *dag = *pdag;
-	struct ln_pdag *nextnode = *p_nextnode;
-	
-	const int lenarr = json_object_array_length(prscnf);
-	for(int i = 0 ; i < lenarr ; ++i) {
-		struct json_object *const curr_prscnf =
-			json_object_array_get_idx(prscnf, i);
-		LN_DBGPRINTF(ctx, "parser %d: %s", i, json_object_to_json_string(curr_prscnf));
-		if(json_object_get_type(curr_prscnf) == json_type_array) {
-			struct ln_pdag *local_dag = dag;
-			CHKR(ln_pdagAddParserInternal(ctx, &local_dag, mode,
-						      curr_prscnf, &nextnode));
-			if(mode == PRS_ADD_MODE_SEQ) {
-				dag = local_dag;
-			}
-		} else {
-			CHKR(ln_pdagAddParserInstance(ctx, curr_prscnf, dag, &nextnode));
-		}
-		if(mode == PRS_ADD_MODE_SEQ) {
-			dag = nextnode;
-			*p_nextnode = nextnode;
-			nextnode = NULL;
-		}
+	const struct ln_pdag *const root = td->pdag;
+	if(root->flags.isTerminal || root->nparsers != 1)
+		return 0;
+	const ln_parser_t *const prs = root->parsers;
+	return    prs->prsid != PRS_CUSTOM_TYPE
+	       && prs->prsid != PRS_REPEAT
+	       && prs->node->flags.isTerminal
+	       && prs->node->nparsers == 0;
+}
+
+/* name the inlined parser must have, see above.
+ * @return 1 if the type can be inlined into the call, 0 otherwise
+ */
+static int
+inlineName(const char *const call, const char *const inner, const char **const name)
+{
+	const int bInnerDotDot = inner != NULL && !strcmp(inner, "..");
+
+	if(call == NULL) {
+		*name = NULL;
+	} else if(call[0] == '.' && call[1] == '\0') {
+		if(inner != NULL && !bInnerDotDot)
+			return 0;
+		*name = inner; /* a ".." field is merged as such */
+	} else if(bInnerDotDot) {
+		*name = call;
+	} else {
+		return 0;
 	}
+	return 1;
+}
+
+/* replace a custom type call by the type's parser, if possible */
+static int
+pdagInlineType(ln_ctx ctx, ln_parser_t *const prs)
+{
+	int r = 0;
+	struct json_object *json = NULL;
+	ln_parser_t *copy = NULL;
+	const char *name;
+
+	if(!typeInlinable(prs->custType))
+		goto done;
+	const ln_parser_t *const inner = prs->custType->pdag->parsers;
+	if(!inlineName(prs->name, inner->name, &name))
+		goto done;
+
+	CHKN(json = json_tokener_parse(inner->conf));
+	/* after path compaction, a literal's conf describes its first char only */
+	if(inner->prsid == PRS_LITERAL)
+		json_object_object_add(json, "text", json_object_new_string(
+			ln_DataForDisplayLiteral(ctx, inner->parser_data)));
+	if(name == NULL)
+		json_object_object_del(json, "name");
+	else
+		json_object_object_add(json, "name", json_object_new_string(name));
+	CHKN(copy = ln_newParser(ctx, json));
+	if((copy->parser_data == NULL) != (inner->parser_data == NULL))
+		goto done; /* construction failed, keep the call */
+
+	LN_DBGPRINTF(ctx, "inlining type '%s' into call '%s'", prs->custType->name, prs->name);
+	prs->custType->bInlined = 1;
+	prs->callName = prs->name;
+	prs->callConf = prs->conf;
+	prs->prsid = copy->prsid;
+	prs->parser_data = copy->parser_data;
+	prs->name = copy->name;
+	prs->conf = copy->conf;
+	free(copy);
+	copy = NULL;
 
-	if(mode != PRS_ADD_MODE_SEQ)
-		dag = nextnode;
-	*pdag = dag;
-	r = 0;
 done:
+	if(copy != NULL)
+		ln_deleteParser(ctx, copy);
+	if(json != NULL)
+		json_object_put(json);
 	return r;
 }
 
-/* add a json parser config object. Note that this object may contain
- * multiple parser instances. Additionally, moves the pdag object to
- * the next node, which is either newly created or previously existed.
- */
 static int
-ln_pdagAddParserInternal(ln_ctx ctx, struct ln_pdag **pdag, 
-	const int mode, json_object *const prscnf, struct ln_pdag **nextnode)
+pdagInlineTypes(ln_ctx ctx, struct ln_pdag *const dag)
 {
-	int r = LN_BADCONFIG;
-	struct ln_pdag *dag = *pdag;
-	
-	LN_DBGPRINTF(ctx, "ln_pdagAddParserInternal: %s", json_object_to_json_string(prscnf));
-	if(json_object_get_type(prscnf) == json_type_object) {
-		/* check for special types we need to handle here */
-		struct json_object *json;
-		json_object_object_get_ex(prscnf, "type", &json);
-		const char *const ftype = json_object_get_string(json);
-		if(!strcmp(ftype, "alternative")) {
-			json_object_object_get_ex(prscnf, "parser", &json);
-			if(json_object_get_type(json) != json_type_array) {
-				ln_errprintf(ctx, 0, "alternative type needs array of parsers. "
-					"Object: '%s', type is %s",
-					json_object_to_json_string(prscnf),
-					json_type_to_name(json_object_get_type(json)));
-				goto done;
-			}
-			CHKR(ln_pdagAddParsers(ctx, json, PRS_ADD_MODE_ALTERNATIVE, &dag, nextnode));
-		} else {
-			CHKR(ln_pdagAddParserInstance(ctx, prscnf, dag, nextnode));
-			if(mode == PRS_ADD_MODE_SEQ)
-				dag = *nextnode;
+	int r = 0;
+	int bChanged = 0;
+
+	if(dag->flags.visited)
+		goto done;
+	dag->flags.visited = 1;
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers + i;
+		if(prs->prsid == PRS_CUSTOM_TYPE) {
+			CHKR(pdagInlineType(ctx, prs));
+			bChanged |= prs->prsid != PRS_CUSTOM_TYPE;
 		}
-	} else if(json_object_get_type(prscnf) == json_type_array) {
-		CHKR(ln_pdagAddParsers(ctx, prscnf, PRS_ADD_MODE_SEQ, &dag, nextnode));
-	} else {
-		ln_errprintf(ctx, 0, "bug: prscnf object of wrong type. Object: '%s'",
-			json_object_to_json_string(prscnf));
+		CHKR(pdagInlineTypes(ctx, prs->node));
+	}
+	if(bChanged)
+		CHKR(ln_pdagComponentBuildDispatch(ctx, dag));
+done:
+	return r;
+}
+
+/* restore the calls of type td in the given component, see
+ * pdagInlineType().
+ * @return number of calls restored
+ */
+static int
+pdagUninlineCalls(ln_ctx ctx, struct ln_pdag *const dag, const struct ln_type_pdag *const td)
+{
+	int n = 0;
+	int bChanged = 0;
+
+	if(dag->flags.visited)
 		goto done;
+	dag->flags.visited = 1;
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers + i;
+		if(prs->custType == td && prs->callConf != NULL) {
+			if(prs->parser_data != NULL)
+				parser_lookup_table[prs->prsid].destruct(ctx, prs->parser_data);
+			free((void*)prs->name);
+			free((void*)prs->conf);
+			prs->prsid = PRS_CUSTOM_TYPE;
+			prs->parser_data = NULL;
+			prs->name = prs->callName;
+			prs->conf = prs->callConf;
+			prs->callName = NULL;
+			prs->callConf = NULL;
+			bChanged = 1;
+			++n;
+		}
+		n += pdagUninlineCalls(ctx, prs->node, td);
 	}
-	*pdag = dag;
+	if(bChanged)
+		pdagDeleteDispatch(dag); /* index is outdated, rebuilt by optimizer */
+done:
+	return n;
+}
+
+/**
+ * Undo the inlining of a type. This must be done before the type is
+ * extended, as the inlined parsers would otherwise no longer match
+ * what the type matches. If the type has been inlined into another
+ * type, that one has inlined a copy of the former parser, so it is
+ * restored as well. The optimizer inlines the types again if they are
+ * still small enough.
+ */
+void
+ln_pdagUninlineType(ln_ctx ctx, struct ln_type_pdag *const td)
+{
+	LN_DBGPRINTF(ctx, "restoring calls of inlined type '%s'", td->name);
+	td->bInlined = 0;
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		struct ln_type_pdag *const caller = ctx->type_pdags[i];
+		ln_pdagComponentClearVisited(caller->pdag);
+		if(pdagUninlineCalls(ctx, caller->pdag, td) > 0 && caller->bInlined)
+			ln_pdagUninlineType(ctx, caller);
+	}
+	ln_pdagComponentClearVisited(ctx->pdag);
+	pdagUninlineCalls(ctx, ctx->pdag, td);
+}
+
+/* min number of custom types per thread optimizing them */
+#define OPTIMIZE_MIN_TYPES_PER_THREAD 4
+
+/* Components do not share any nodes, so they can be optimized
+ * concurrently. The main component is optimized by the loading thread,
+ * while the type components are handed out to all threads one by one.
+ */
+struct pdag_optimize_wrk {
+	ln_ctx ctx;
+	int next;	/**< next type component to optimize */
+};
+
+static void
+pdagOptimizeTypes(struct pdag_optimize_wrk *const wrk)
+{
+	ln_ctx ctx = wrk->ctx;
+	int i;
+
+	while((i = __atomic_fetch_add(&wrk->next, 1, __ATOMIC_RELAXED)) < ctx->nTypes) {
+		LN_DBGPRINTF(ctx, "optimizing component %s\n", ctx->type_pdags[i]->name);
+		ln_pdagComponentOptimize(ctx, ctx->type_pdags[i]->pdag);
+	}
+}
+
+static void *
+pdagOptimizeThread(void *const arg)
+{
+	pdagOptimizeTypes((struct pdag_optimize_wrk *) arg);
+	return NULL;
+}
+
+/**
+ * Optimize the pdag.
+ * This includes all components.
+ */
+int
+ln_pdagOptimize(ln_ctx ctx)
+{
+	int r = 0;
+	struct pdag_optimize_wrk wrk = { ctx, 0 };
+	pthread_t *thrds = NULL;
+	unsigned nthrds = ln_loadThreads(ctx, ctx->nTypes, OPTIMIZE_MIN_TYPES_PER_THREAD) - 1;
+
+	if(nthrds > 0 && (thrds = malloc(nthrds * sizeof(pthread_t))) == NULL)
+		nthrds = 0;
+	for(unsigned i = 0 ; i < nthrds ; ++i) {
+		if(pthread_create(thrds+i, NULL, pdagOptimizeThread, &wrk) != 0) {
+			nthrds = i; /* the others do the remaining work */
+			break;
+		}
+	}
+
+	LN_DBGPRINTF(ctx, "optimizing main pdag component");
+	ln_pdagComponentOptimize(ctx, ctx->pdag);
+	LN_DBGPRINTF(ctx, "finished optimizing main pdag component");
+	pdagOptimizeTypes(&wrk);
+	for(unsigned i = 0 ; i < nthrds ; ++i)
+		pthread_join(thrds[i], NULL);
+	free(thrds);
+
+	/* types are usually used by types defined after them, so in this
+	 * order most types are final before they are inlined elsewhere.
+	 */
+	ln_pdagClearVisited(ctx);
+	for(int i = 0 ; i < ctx->nTypes ; ++i)
+		CHKR(pdagInlineTypes(ctx, ctx->type_pdags[i]->pdag));
+	CHKR(pdagInlineTypes(ctx, ctx->pdag));
+	for(int i = 0 ; i < ctx->nTypes ; ++i)
+		ln_pdagComponentSetIDs(ctx, ctx->type_pdags[i]->pdag, "");
+	ln_pdagComponentSetIDs(ctx, ctx->pdag, "");
 
+	CHKR(ln_pdagFreeze(ctx));
+	CHKR(ln_pdagCompileAnnots(ctx));
+	CHKR(pdagBuildMockups(ctx));
+LN_DBGPRINTF(ctx, "---AFTER OPTIMIZATION------------------");
+ln_displayPDAG(ctx);
+LN_DBGPRINTF(ctx, "=======================================");
 done:
 	return r;
 }
 
-/* add a json parser config object. Note that this object may contain
- * multiple parser instances. Additionally, moves the pdag object to
- * the next node, which is either newly created or previously existed.
+
+/* rulebase cache
+ *
+ * The frozen arena is written as a memory image. Inside the image,
+ * pointers to other nodes are replaced by stats_id (node index + 1),
+ * custom type pointers by type index + 1 and the dispatch pointer by
+ * the size of the candidate table. Pointers to parser tables and
+ * dispatch indexes are not stored, as the arena layout defines where
+ * they are. All other pointers are NULL inside the image. Strings,
+ * tags and parser instance data follow the image. Instance data is
+ * not written; it is constructed again from the parser config, except
+ * for literals, where the optimizer combined the text of several
+ * parsers.
+ * On load, the image is copied into a new arena and the pointers are
+ * fixed up.
+ */
+#define CACHE_IDX(p) ((uintptr_t) (p))
+
+static int
+pdagCacheImage(ln_ctx ctx, char *const img)
+{
+	const char *const arena = ctx->pdag_arena;
+	for(unsigned i = 0 ; i < ctx->nPdagNodes ; ++i) {
+		const struct ln_pdag *const dag = ctx->pdag_nodes[i];
+		/* everything must still be frozen, else we cannot create the image */
+		if(   (dag->nparsers > 0 && !pdagInArena(ctx, dag->parsers))
+		   || (dag->dispatch != NULL && !pdagInArena(ctx, dag->dispatch)))
+			return -1;
+		for(int j = 0 ; j < dag->nparsers ; ++j) {
+			const struct ln_pdag *const next = dag->parsers[j].node;
+			if(   next->stats_id == 0 || next->stats_id > ctx->nPdagNodes
+			   || ctx->pdag_nodes[next->stats_id - 1] != next)
+				return -1;
+		}
+		struct ln_pdag *const d = (struct ln_pdag*) (img + ((const char*) dag - arena));
+		d->ctx = NULL;
+		d->parsers = NULL;
+		d->tags = NULL;
+		d->annot = NULL;
+		d->flags.visited = 0;
+		memset(&d->stats, 0, sizeof(d->stats));
+		d->stats_id = 0;
+		d->rb_id = NULL;
+		d->rb_file = NULL;
+		d->mockup = NULL;
+		if(dag->dispatch != NULL) {
+			struct ln_pdag_dispatch *const dd = (struct ln_pdag_dispatch*)
+				(img + ((const char*) dag->dispatch - arena));
+			dd->cand = NULL;
+			d->dispatch = (struct ln_pdag_dispatch*) CACHE_IDX(dispatchSize(dag->dispatch));
+		}
+		if(dag->nparsers == 0)
+			continue;
+		ln_parser_t *const prs = (ln_parser_t*) (img + ((const char*) dag->parsers - arena));
+		for(int j = 0 ; j < dag->nparsers ; ++j) {
+			prs[j].node = (struct ln_pdag*) CACHE_IDX(dag->parsers[j].node->stats_id);
+			prs[j].parser_data = NULL;
+			prs[j].custType = (dag->parsers[j].custType == NULL) ? NULL :
+				(struct ln_type_pdag*) CACHE_IDX(*typeHashSlot(ctx, dag->parsers[j].custType->name));
+			prs[j].name = NULL;
+			prs[j].conf = NULL;
+			prs[j].callName = NULL;
+			prs[j].callConf = NULL;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Write the frozen pdag, including custom types, to the rulebase cache.
+ * @return 0 on success, LN_BADCONFIG if there is no frozen v2 pdag
  */
 int
-ln_pdagAddParser(ln_ctx ctx, struct ln_pdag **pdag, json_object *const prscnf)
+ln_pdagWriteCache(ln_ctx ctx, struct ln_rbc_writer *const wr)
+{
+	int r = 0;
+	char *img = NULL;
+
+	if(ctx->version != 2 || ctx->pdag_arena == NULL || ctx->pdag->stats_id == 0) {
+		ln_errprintf(ctx, 0, "rulebase cache: only loaded v2 rulebases can be cached");
+		FAIL(LN_BADCONFIG);
+	}
+
+	/* layout check, the image is only usable with exactly our structures */
+	ln_rbcPutU32(wr, NPARSERS);
+	ln_rbcPutU32(wr, sizeof(struct ln_pdag));
+	ln_rbcPutU32(wr, sizeof(ln_parser_t));
+	ln_rbcPutU32(wr, sizeof(struct ln_pdag_dispatch));
+
+	ln_rbcPutU32(wr, ctx->nTypes);
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		ln_rbcPutStr(wr, ctx->type_pdags[i]->name);
+		ln_rbcPutU32(wr, ctx->type_pdags[i]->pdag->stats_id);
+	}
+
+	CHKN(img = malloc(ctx->pdag_arena_size));
+	memcpy(img, ctx->pdag_arena, ctx->pdag_arena_size);
+	if(pdagCacheImage(ctx, img) != 0) {
+		ln_errprintf(ctx, 0, "rulebase cache: pdag is not frozen, cannot be cached");
+		FAIL(LN_BADCONFIG);
+	}
+	ln_rbcPutU32(wr, ctx->nPdagNodes);
+	ln_rbcPutU32(wr, ctx->pdag->stats_id);
+	ln_rbcPutU64(wr, ctx->pdag_arena_size);
+	ln_rbcPutBytes(wr, img, ctx->pdag_arena_size);
+
+	for(unsigned i = 0 ; i < ctx->nPdagNodes ; ++i) {
+		const struct ln_pdag *const dag = ctx->pdag_nodes[i];
+		ln_rbcPutStr(wr, dag->rb_id);
+		ln_rbcPutStr(wr, dag->rb_file);
+		ln_rbcPutStr(wr, (dag->tags == NULL) ? NULL : json_object_to_json_string(dag->tags));
+		for(int j = 0 ; j < dag->nparsers ; ++j) {
+			const ln_parser_t *const prs = dag->parsers + j;
+			ln_rbcPutStr(wr, prs->name);
+			ln_rbcPutStr(wr, prs->conf);
+			ln_rbcPutStr(wr, (prs->prsid == PRS_LITERAL && prs->parser_data != NULL) ?
+				ln_DataForDisplayLiteral(ctx, prs->parser_data) : NULL);
+			ln_rbcPutStr(wr, prs->callName);
+			ln_rbcPutStr(wr, prs->callConf);
+		}
+	}
+
+done:
+	free(img);
+	return r;
+}
+
+/* check and fix up the arena image. Nothing outside the arena is
+ * modified, so a bad image can simply be discarded.
+ * @return 0 if ok, -1 if the image is damaged
+ */
+static int
+pdagCacheFixup(ln_ctx ctx, char *const arena, const size_t size,
+	struct ln_pdag **const nodes, const unsigned nnodes, const int nTypes)
+{
+	size_t pos = 0;
+
+	for(unsigned i = 0 ; i < nnodes ; ++i) {
+		if(size - pos < FREEZE_ALIGN(sizeof(struct ln_pdag)))
+			return -1;
+		struct ln_pdag *const dag = (struct ln_pdag*) (arena + pos);
+		pos += FREEZE_ALIGN(sizeof(struct ln_pdag));
+		nodes[i] = dag;
+		dag->ctx = ctx;
+		dag->stats_id = i + 1;
+		if(dag->nparsers > 0) {
+			if(size - pos < FREEZE_ALIGN(dag->nparsers * sizeof(ln_parser_t)))
+				return -1;
+			dag->parsers = (ln_parser_t*) (arena + pos);
+			pos += FREEZE_ALIGN(dag->nparsers * sizeof(ln_parser_t));
+		}
+		const size_t ncand = CACHE_IDX(dag->dispatch);
+		if(ncand > 0) {
+			if(   size - pos < FREEZE_ALIGN(sizeof(struct ln_pdag_dispatch))
+			   || ncand > UINT16_MAX)
+				return -1;
+			dag->dispatch = (struct ln_pdag_dispatch*) (arena + pos);
+			pos += FREEZE_ALIGN(sizeof(struct ln_pdag_dispatch));
+			if(size - pos < FREEZE_ALIGN(ncand * sizeof(prsid_t)))
+				return -1;
+			dag->dispatch->cand = (prsid_t*) (arena + pos);
+			pos += FREEZE_ALIGN(ncand * sizeof(prsid_t));
+			const prsid_t *const cand = dag->dispatch->cand;
+			for(int c = 0 ; c < 256 ; ++c) {
+				const size_t start = dag->dispatch->start[c];
+				if(start >= ncand || start + 1 + cand[start] > ncand)
+					return -1;
+				for(int k = 0 ; k < cand[start] ; ++k)
+					if(cand[start + 1 + k] >= dag->nparsers)
+						return -1;
+			}
+		}
+	}
+	if(pos != size)
+		return -1;
+
+	for(unsigned i = 0 ; i < nnodes ; ++i) {
+		struct ln_pdag *const dag = nodes[i];
+		for(int j = 0 ; j < dag->nparsers ; ++j) {
+			ln_parser_t *const prs = dag->parsers + j;
+			const uintptr_t node = CACHE_IDX(prs->node);
+			const uintptr_t type = CACHE_IDX(prs->custType);
+			if(node == 0 || node > nnodes || (type > (uintptr_t) nTypes))
+				return -1;
+			if(prs->prsid == PRS_CUSTOM_TYPE ? type == 0 : prs->prsid >= NPARSERS)
+				return -1;
+			prs->node = nodes[node - 1];
+			prs->custType = (type == 0) ? NULL : ctx->type_pdags[type - 1];
+		}
+	}
+	return 0;
+}
+
+/* construct parser instance data again, just like ln_newParser() does */
+static void
+pdagCacheConstructParser(ln_ctx ctx, ln_parser_t *const prs, const char *const lit)
+{
+	struct json_object *json = NULL;
+
+	if(   prs->prsid == PRS_CUSTOM_TYPE
+	   || parser_lookup_table[prs->prsid].construct == NULL)
+		goto done;
+	if(prs->prsid == PRS_LITERAL) {
+		if(lit == NULL || (json = json_object_new_object()) == NULL)
+			goto done;
+		json_object_object_add(json, "text", json_object_new_string(lit));
+	} else {
+		if((json = json_tokener_parse(prs->conf)) == NULL)
+			goto done;
+		json_object_object_del(json, "type");
+		json_object_object_del(json, "priority");
+		if(prs->name != NULL)
+			json_object_object_del(json, "name");
+	}
+	parser_lookup_table[prs->prsid].construct(ctx, json, &prs->parser_data);
+done:
+	if(json != NULL)
+		json_object_put(json);
+}
+
+/* drop the loaded pdag and custom types, so that the context is empty
+ * again. Used if loading from the cache fails and to release the rule
+ * base of a context that has been reloaded.
+ */
+void
+ln_pdagDiscard(ln_ctx ctx)
+{
+	ln_pdagDelete(ctx->pdag);
+	ln_pdagDeleteTypes(ctx);
+	free(ctx->pdag_arena);
+	ctx->pdag_arena = NULL;
+	ctx->pdag_arena_size = 0;
+	free(ctx->pdag_nodes);
+	ctx->pdag_nodes = NULL;
+	ctx->nPdagNodes = 0;
+	ctx->nNodes = 0;
+	ctx->version = 0;
+	ctx->pdag = ln_newPDAG(ctx);
+	pdagStatsReset(ctx);
+}
+
+/**
+ * Load the pdag, including custom types, from the rulebase cache.
+ * The context must not yet contain a rulebase.
+ * @return 0 on success, LN_BADCONFIG if the cache does not fit this
+ *         library or is damaged, something else on error
+ */
+int
+ln_pdagReadCache(ln_ctx ctx, struct ln_rbc_reader *const rd)
+{
+	int r = 0;
+	const char **typeNames = NULL;
+	uint32_t *typeRoots = NULL;
+	char *arena = NULL;
+	struct ln_pdag **nodes = NULL;
+	struct json_object *tags;
+
+	if(ctx->version != 0 || ctx->nTypes != 0 || ctx->pdag->nparsers != 0) {
+		ln_errprintf(ctx, 0, "rulebase cache: context already contains a rulebase");
+		FAIL(LN_BADCONFIG);
+	}
+
+	if(   ln_rbcGetU32(rd) != NPARSERS
+	   || ln_rbcGetU32(rd) != sizeof(struct ln_pdag)
+	   || ln_rbcGetU32(rd) != sizeof(ln_parser_t)
+	   || ln_rbcGetU32(rd) != sizeof(struct ln_pdag_dispatch)) {
+		LN_DBGPRINTF(ctx, "rulebase cache: created by different library build");
+		FAIL(LN_BADCONFIG);
+	}
+
+	const uint32_t nTypes = ln_rbcGetU32(rd);
+	if(rd->err || nTypes > rd->len)
+		FAIL(LN_BADCONFIG);
+	CHKN(typeNames = calloc(nTypes + 1, sizeof(const char*)));
+	CHKN(typeRoots = calloc(nTypes + 1, sizeof(uint32_t)));
+	for(uint32_t i = 0 ; i < nTypes ; ++i) {
+		typeNames[i] = ln_rbcGetStr(rd, NULL);
+		typeRoots[i] = ln_rbcGetU32(rd);
+		if(typeNames[i] == NULL)
+			rd->err = 1;
+	}
+	const uint32_t nnodes = ln_rbcGetU32(rd);
+	const uint32_t root = ln_rbcGetU32(rd);
+	const uint64_t size = ln_rbcGetU64(rd);
+	const void *const img = ln_rbcGetBytes(rd, size);
+	if(rd->err || nnodes == 0 || root == 0 || root > nnodes || size / sizeof(struct ln_pdag) < nnodes)
+		FAIL(LN_BADCONFIG);
+	for(uint32_t i = 0 ; i < nTypes ; ++i) {
+		if(typeRoots[i] == 0 || typeRoots[i] > nnodes)
+			FAIL(LN_BADCONFIG);
+	}
+
+	CHKN(arena = malloc(size));
+	memcpy(arena, img, size);
+	CHKN(nodes = malloc(nnodes * sizeof(struct ln_pdag*)));
+	for(uint32_t i = 0 ; i < nTypes ; ++i) {
+		if(ln_pdagFindType(ctx, typeNames[i], 0) != NULL)
+			r = LN_BADCONFIG;
+		else if(pdagAddType(ctx, typeNames[i]) == NULL)
+			r = -1;
+		if(r != 0) {
+			ln_pdagDeleteTypes(ctx);
+			goto done;
+		}
+	}
+	if(pdagCacheFixup(ctx, arena, size, nodes, nnodes, nTypes) != 0) {
+		ln_pdagDeleteTypes(ctx);
+		FAIL(LN_BADCONFIG);
+	}
+
+	/* the image is consistent, now make it the context's pdag. From
+	 * here on, errors are handled by discarding the loaded pdag.
+	 */
+	ln_pdagDelete(ctx->pdag);
+	ctx->pdag = nodes[root - 1];
+	for(uint32_t i = 0 ; i < nTypes ; ++i)
+		ctx->type_pdags[i]->pdag = nodes[typeRoots[i] - 1];
+	ctx->pdag_arena = arena;
+	ctx->pdag_arena_size = size;
+	arena = NULL;
+	ctx->pdag_nodes = nodes;
+	ctx->nPdagNodes = nnodes;
+	nodes = NULL;
+	ctx->nNodes = nnodes;
+	ctx->version = 2;
+
+	for(uint32_t i = 0 ; i < nnodes && !rd->err ; ++i) {
+		struct ln_pdag *const dag = ctx->pdag_nodes[i];
+		const char *str;
+		if((str = ln_rbcGetStr(rd, NULL)) != NULL)
+			dag->rb_id = strdup(str);
+		if((str = ln_rbcGetStr(rd, NULL)) != NULL)
+			dag->rb_file = strdup(str);
+		if((str = ln_rbcGetStr(rd, NULL)) != NULL) {
+			if((tags = json_tokener_parse(str)) == NULL)
+				rd->err = 1;
+			dag->tags = tags;
+		}
+		for(int j = 0 ; j < dag->nparsers && !rd->err ; ++j) {
+			ln_parser_t *const prs = dag->parsers + j;
+			if((str = ln_rbcGetStr(rd, NULL)) != NULL)
+				prs->name = strdup(str);
+			if((str = ln_rbcGetStr(rd, NULL)) == NULL) {
+				rd->err = 1;
+				break;
+			}
+			prs->conf = strdup(str);
+			pdagCacheConstructParser(ctx, prs, ln_rbcGetStr(rd, NULL));
+			if(prs->prsid == PRS_LITERAL && prs->parser_data == NULL)
+				rd->err = 1;
+			if((str = ln_rbcGetStr(rd, NULL)) != NULL)
+				prs->callName = strdup(str);
+			if((str = ln_rbcGetStr(rd, NULL)) != NULL)
+				prs->callConf = strdup(str);
+			/* only inlined calls have a type, but are not calls */
+			if((prs->callConf != NULL) != (prs->custType != NULL && prs->prsid != PRS_CUSTOM_TYPE))
+				rd->err = 1;
+			else if(prs->callConf != NULL)
+				prs->custType->bInlined = 1;
+		}
+	}
+	if(rd->err) {
+		ln_pdagDiscard(ctx);
+		FAIL(LN_BADCONFIG);
+	}
+	CHKR(pdagStatsReset(ctx));
+	CHKR(pdagBuildMockups(ctx));
+	LN_DBGPRINTF(ctx, "pdag loaded from cache: %u nodes, %zu bytes",
+		ctx->nPdagNodes, ctx->pdag_arena_size);
+
+done:
+	free(nodes);
+	free(arena);
+	free(typeRoots);
+	free(typeNames);
+	return r;
+}
+
+
+#define LN_INTERN_PDAG_STATS_NPARSERS 100
+/* data structure for pdag statistics */
+struct pdag_stats {
+	int nodes;
+	int term_nodes;
+	int parsers;
+	int max_nparsers;
+	int nparsers_cnt[LN_INTERN_PDAG_STATS_NPARSERS];
+	int nparsers_100plus;
+	int *prs_cnt;
+};
+
+/**
+ * Recursive step of statistics gatherer.
+ */
+static int
+ln_pdagStatsRec(ln_ctx ctx, struct ln_pdag *const dag, struct pdag_stats *const stats)
+{
+	if(dag->flags.visited)
+		return 0;
+	dag->flags.visited = 1;
+	stats->nodes++;
+	if(dag->flags.isTerminal)
+		stats->term_nodes++;
+	if(dag->nparsers > stats->max_nparsers)
+		stats->max_nparsers = dag->nparsers;
+	if(dag->nparsers >= LN_INTERN_PDAG_STATS_NPARSERS)
+		stats->nparsers_100plus++;
+	else
+		stats->nparsers_cnt[dag->nparsers]++;
+	stats->parsers += dag->nparsers;
+	int max_path = 0;
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *prs = dag->parsers+i;
+		if(prs->prsid != PRS_CUSTOM_TYPE)
+			stats->prs_cnt[prs->prsid]++;
+		const int path_len = ln_pdagStatsRec(ctx, prs->node, stats);
+		if(path_len > max_path)
+			max_path = path_len;
+	}
+	return max_path + 1;
+}
+
+
+static void
+ln_pdagStatsExtended(ln_ctx ctx, struct ln_pdag *const dag, FILE *const fp, int level)
+{
+	char indent[2048];
+
+	if(level > 1023)
+		level = 1023;
+	memset(indent, ' ', level * 2);
+	indent[level * 2] = '\0';
+
+	if(dag->stats.called > 0) {
+		fprintf(fp, "%u, %u, %s\n",
+			dag->stats.called,
+			dag->stats.backtracked,
+			dag->rb_id);
+	}
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers+i;
+		if(prs->node->stats.called > 0) {
+			ln_pdagStatsExtended(ctx, prs->node, fp, level+1);
+		}
+	}
+}
+
+/**
+ * Gather pdag statistics for a *specific* pdag.
+ *
+ * Data is sent to given file ptr.
+ */
+static void
+ln_pdagStats(ln_ctx ctx, struct ln_pdag *const dag, FILE *const fp, const int extendedStats)
+{
+	struct pdag_stats *const stats = calloc(1, sizeof(struct pdag_stats));
+	stats->prs_cnt = calloc(NPARSERS, sizeof(int));
+	//ln_pdagClearVisited(ctx);
+	const int longest_path = ln_pdagStatsRec(ctx, dag, stats);
+
+	fprintf(fp, "nodes.............: %4d\n", stats->nodes);
+	fprintf(fp, "terminal nodes....: %4d\n", stats->term_nodes);
+	fprintf(fp, "parsers entries...: %4d\n", stats->parsers);
+	fprintf(fp, "longest path......: %4d\n", longest_path);
+
+	fprintf(fp, "Parser Type Counts:\n");
+	for(prsid_t i = 0 ; i < NPARSERS ; ++i) {
+		if(stats->prs_cnt[i] != 0)
+			fprintf(fp, "\t%20s: %d\n", parserName(i), stats->prs_cnt[i]);
+	}
+
+	int pp = 0;
+	fprintf(fp, "Parsers per Node:\n");
+	fprintf(fp, "\tmax:\t%4d\n", stats->max_nparsers);
+	for(int i = 0 ; i < 100 ; ++i) {
+		pp += stats->nparsers_cnt[i];
+		if(stats->nparsers_cnt[i] != 0)
+			fprintf(fp, "\t%d:\t%4d\n", i, stats->nparsers_cnt[i]);
+	}
+
+	free(stats->prs_cnt);
+	free(stats);
+	
+	if(extendedStats) {
+		fprintf(fp, "Usage Statistics:\n"
+			    "-----------------\n");
+		fprintf(fp, "called, backtracked, rule\n");
+		ln_pdagComponentClearVisited(dag);
+		ln_pdagStatsExtended(ctx, dag, fp, 0);
+	}
+}
+
+
+/**
+ * Gather and output pdag statistics for the full pdag (ctx)
+ * including all disconnected components (type defs).
+ *
+ * Data is sent to given file ptr.
+ */
+void
+ln_fullPdagStats(ln_ctx ctx, FILE *const fp, const int extendedStats)
+{
+	ctx = ctx->gen; /* not to be called concurrently with a reload */
+	if(ctx->ptree != NULL) {
+		/* we need to handle the old cruft */
+		ln_fullPTreeStats(ctx, fp, extendedStats);
+		return;
+	}
+
+	pdagStatsMerge(ctx);
+	fprintf(fp, "User-Defined Types\n"
+	            "==================\n");
+	fprintf(fp, "number types: %d\n", ctx->nTypes);
+	for(int i = 0 ; i < ctx->nTypes ; ++i)
+		fprintf(fp, "type: %s\n", ctx->type_pdags[i]->name);
+
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		fprintf(fp, "\n"
+			    "type PDAG: %s\n"
+		            "----------\n", ctx->type_pdags[i]->name);
+		ln_pdagStats(ctx, ctx->type_pdags[i]->pdag, fp, extendedStats);
+	}
+
+	fprintf(fp, "\n"
+		    "Main PDAG\n"
+	            "=========\n");
+	ln_pdagStats(ctx, ctx->pdag, fp, extendedStats);
+
+#ifdef	ADVANCED_STATS
+	struct advstats_totals as;
+	pdagAdvStatsMerge(ctx, &as);
+	const uint64_t parsers_failed = as.parsers_called - as.parsers_success;
+	fprintf(fp, "\n"
+		    "Advanced Runtime Stats\n"
+	            "======================\n");
+	fprintf(fp, "These are actual number from analyzing the control flow "
+		    "at runtime.\n");
+	fprintf(fp, "Note that literal matching is also done via parsers. As such, \n"
+		    "it is expected that fail rates increase with the size of the \n"
+		    "rule base.\n");
+	fprintf(fp, "\n");
+	fprintf(fp, "Parser Calls:\n");
+	fprintf(fp, "total....: %10" PRIu64 "\n", as.parsers_called);
+	fprintf(fp, "succesful: %10" PRIu64 "\n", as.parsers_success);
+	fprintf(fp, "failed...: %10" PRIu64 " [%d%%]\n",
+		parsers_failed,
+		(int) ((parsers_failed * 100) / as.parsers_called) );
+	fprintf(fp, "\nIndividual Parser Calls "
+		    "(never called parsers are not shown):\n");
+	for(  size_t i = 0
+	    ; i < sizeof(parser_lookup_table) / sizeof(struct ln_parser_info)
+	    ; ++i) {
+		if(as.prs_called[i] > 0) {
+			const uint64_t failed = as.prs_called[i]
+				- as.prs_success[i];
+			fprintf(fp, "%20s: %10" PRIu64 " [%5.2f%%] "
+				    "success: %10" PRIu64 " [%5.1f%%] "
+				    "fail: %10" PRIu64 " [%5.1f%%]"
+			            "\n",
+				parser_lookup_table[i].name,
+				as.prs_called[i],
+				(float)(as.prs_called[i] * 100)
+				        / as.parsers_called,
+				as.prs_success[i],
+				(float)(as.prs_success[i] * 100)
+				        / as.prs_called[i],
+				failed,
+				(float)(failed * 100)
+				        / as.prs_called[i]
+			       );
+		}
+	}
+
+	uint64_t total_len;
+	uint64_t total_cnt;
+	fprintf(fp, "\n");
+	fprintf(fp, "\n"
+	            "Path Length Statistics\n"
+	            "----------------------\n"
+	            "The regular path length is the number of nodes being visited,\n"
+		    "where each node potentially evaluates several parsers. The\n"
+		    "parser call statistic is the number of parsers called along\n"
+		    "the path. That number is higher, as multiple parsers may be\n"
+		    "called at each node. The number of literal parser calls is\n"
+		    "given explicitely, as they use almost no time to process.\n"
+		    "\n"
+		);
+	total_len = 0;
+	total_cnt = 0;
+	fprintf(fp, "Path Length\n");
+	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
+		if(as.pathlens[i] > 0 ) {
+			fprintf(fp, "%3d: %d\n", i, as.pathlens[i]);
+			total_len += i * as.pathlens[i];
+			total_cnt += as.pathlens[i];
+		}
+	}
+	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
+	fprintf(fp, "max: %d\n", as.max_pathlen);
+	fprintf(fp, "\n");
+
+	total_len = 0;
+	total_cnt = 0;
+	fprintf(fp, "Nbr Backtracked\n");
+	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
+		if(as.backtracks[i] > 0 ) {
+			fprintf(fp, "%3d: %d\n", i, as.backtracks[i]);
+			total_len += i * as.backtracks[i];
+			total_cnt += as.backtracks[i];
+		}
+	}
+	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
+	fprintf(fp, "max: %d\n", as.max_backtracked);
+	fprintf(fp, "\n");
+
+	/* we calc some stats while we output */
+	total_len = 0;
+	total_cnt = 0;
+	fprintf(fp, "Parser Calls\n");
+	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
+		if(as.parser_calls[i] > 0 ) {
+			fprintf(fp, "%3d: %d\n", i, as.parser_calls[i]);
+			total_len += i * as.parser_calls[i];
+			total_cnt += as.parser_calls[i];
+		}
+	}
+	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
+	fprintf(fp, "max: %d\n", as.max_parser_calls);
+	fprintf(fp, "\n");
+
+	total_len = 0;
+	total_cnt = 0;
+	fprintf(fp, "LITERAL Parser Calls\n");
+	for(int i = 0 ; i < ADVSTATS_MAX_ENTITIES ; ++i) {
+		if(as.lit_parser_calls[i] > 0 ) {
+			fprintf(fp, "%3d: %d\n", i, as.lit_parser_calls[i]);
+			total_len += i * as.lit_parser_calls[i];
+			total_cnt += as.lit_parser_calls[i];
+		}
+	}
+	fprintf(fp, "avg: %f\n", (double) total_len / (double) total_cnt);
+	fprintf(fp, "max: %d\n", as.max_lit_parser_calls);
+	fprintf(fp, "\n");
+#endif
+}
+
+
+void
+ln_setRuleStats(ln_ctx ctx, const unsigned sampling)
+{
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->ruleStatsSampling = sampling;
+	/* read by normalizing threads without lock */
+	__atomic_store_n(&ctx->gen->ruleStatsSampling, sampling, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->reload_mut);
+}
+
+void
+ln_setNormalizeBudget(ln_ctx ctx, const unsigned maxParserCalls, const unsigned maxUsec)
+{
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->budgetMaxCalls = maxParserCalls;
+	ctx->budgetMaxUsec = maxUsec;
+	/* read by normalizing threads without lock, see budgetStart() */
+	__atomic_store_n(&ctx->gen->budgetMaxCalls, maxParserCalls, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->gen->budgetMaxUsec, maxUsec, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->reload_mut);
+}
+
+void
+ln_setLoadThreads(ln_ctx ctx, const unsigned nThreads)
+{
+	pthread_mutex_lock(&ctx->reload_mut);
+	ctx->loadThreads = nThreads;
+	pthread_mutex_unlock(&ctx->reload_mut);
+}
+
+unsigned
+ln_loadThreads(ln_ctx ctx, const unsigned nwork, const unsigned minPerThread)
+{
+	unsigned n = ctx->loadThreads;
+
+	/* debug output must appear in rule base order */
+	if(ctx->dbgCB != NULL)
+		return 1;
+	if(n == 0) {
+		const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (ncpus < 1) ? 1 : (unsigned) ncpus;
+	}
+	if(n > nwork / minPerThread)
+		n = nwork / minPerThread;
+	return (n < 1) ? 1 : n;
+}
+
+uint64_t
+ln_budgetExceededCount(ln_ctx ctx)
+{
+	return __atomic_load_n(&ctx->nBudgetExceeded, __ATOMIC_RELAXED);
+}
+
+static void
+ruleStatsEntryToJSON(struct json_object *const json, const struct ln_rulestats *const rs)
+{
+	struct json_object *hist;
+
+	json_object_object_add(json, "count", json_object_new_int64(rs->count));
+	json_object_object_add(json, "sampled", json_object_new_int64(rs->sampled));
+	json_object_object_add(json, "avg_ns", json_object_new_int64(
+		rs->sampled == 0 ? 0 : rs->latSum / rs->sampled));
+	if((hist = json_object_new_array()) != NULL) {
+		for(int b = 0 ; b < RULESTATS_NBUCKETS ; ++b)
+			json_object_array_add(hist, json_object_new_int64(rs->hist[b]));
+		json_object_object_add(json, "histogram", hist);
+	}
+}
+
+static int
+ruleStatsToJSON(ln_ctx ctx, struct json_object **json_p)
+{
+	int r = 0;
+	struct ln_rulestats *rules = NULL;
+	struct json_object *json = NULL;
+	struct json_object *arr, *entry;
+	const struct ln_pdag_tstats *const retired = ctx->tstats_retired;
+	const unsigned nslots = retired->nslots;
+
+	*json_p = NULL;
+	if(ctx->version == 1) {
+		r = LN_BADCONFIG;
+		goto done;
+	}
+	CHKN(rules = calloc(nslots, sizeof(struct ln_rulestats)));
+	pthread_mutex_lock(&ctx->stats_mut);
+	if(retired->rules != NULL)
+		ruleStatsAdd(rules, retired->rules, nslots);
+	for(struct ln_pdag_tstats *ts = ctx->tstats ; ts != NULL ; ts = ts->next) {
+		if(ts->nslots == nslots && ts->rules != NULL)
+			ruleStatsAdd(rules, ts->rules, nslots);
+	}
+	pthread_mutex_unlock(&ctx->stats_mut);
+
+	CHKN(json = json_object_new_object());
+	json_object_object_add(json, "sampling", json_object_new_int(
+		__atomic_load_n(&ctx->ruleStatsSampling, __ATOMIC_RELAXED)));
+	CHKN(arr = json_object_new_array());
+	json_object_object_add(json, "histogram_bounds_ns", arr);
+	for(int b = 0 ; b < RULESTATS_NBUCKETS - 1 ; ++b)
+		json_object_array_add(arr, json_object_new_int64(INT64_C(256) << b));
+
+	CHKN(arr = json_object_new_array());
+	json_object_object_add(json, "rules", arr);
+	for(unsigned i = 1 ; i < nslots ; ++i) {
+		const struct ln_pdag *const dag = ctx->pdag_nodes[i-1];
+		if(!dag->flags.isTerminal)
+			continue;
+		CHKN(entry = json_object_new_object());
+		json_object_array_add(arr, entry);
+		if(dag->rb_file != NULL)
+			json_object_object_add(entry, "file", json_object_new_string(dag->rb_file));
+		json_object_object_add(entry, "line", json_object_new_int(dag->rb_lineno));
+		ruleStatsEntryToJSON(entry, rules + i);
+	}
+	CHKN(entry = json_object_new_object());
+	json_object_object_add(json, "unmatched", entry);
+	ruleStatsEntryToJSON(entry, rules);
+
+	*json_p = json;
+	json = NULL;
+done:
+	if(json != NULL)
+		json_object_put(json);
+	free(rules);
+	return r;
+}
+
+int
+ln_ruleStatsToJSON(ln_ctx ctx, struct json_object **json_p)
+{
+	int r;
+	struct ln_rcu_reader *rd;
+
+	*json_p = NULL;
+	CHKN(ctx = ln_ctxReadLock(ctx, &rd));
+	r = ruleStatsToJSON(ctx, json_p);
+done:
+	ln_ctxReadUnlock(rd);
+	return r;
+}
+
+/**
+ * Check if the provided dag is a leaf. This means that it
+ * does not contain any subdags.
+ * @return 1 if it is a leaf, 0 otherwise
+ */
+static inline int
+isLeaf(struct ln_pdag *dag)
+{
+	return dag->nparsers == 0 ? 1 : 0;
+}
+
+
+/**
+ * Add a parser instance to the pdag at the current position.
+ *
+ * @param[in] ctx
+ * @param[in] parser parser created by ln_newParser(), owned by the pdag
+ *            after the call
+ * @param[in] pdag current pdag position (to which parser is to be added)
+ * @param[in/out] nextnode contains point to the next node, either 
+ *            an existing one or one newly created.
+ *
+ * The nextnode parameter permits to use this function to create
+ * multiple parsers alternative parsers with a single run. To do so,
+ * set nextnode=NULL on first call. On successive calls, keep the
+ * value. If a value is present, we will not accept non-identical
+ * parsers which point to different nodes - this will result in an
+ * error.
+ *
+ * IMPORTANT: the caller is responsible to update its pdag pointer
+ *            to the nextnode value when he is done adding parsers.
+ *
+ * If a parser of the same type with identical data already exists,
+ * it is "resued", which means the function is effectively used to
+ * walk the path. This is used during parser construction to
+ * navigate to new parts of the pdag.
+ */
+static int
+pdagInsertParser(ln_ctx ctx,
+	ln_parser_t *const __restrict__ parser,
+	struct ln_pdag *const __restrict__ pdag,
+	struct ln_pdag **nextnode)
+{
+	int r;
+	LN_DBGPRINTF(ctx, "pdag: %p, parser %p", pdag, parser);
+	/* check if we already have this parser, if so, merge
+	 */
+	int i;
+	for(i = 0 ; i < pdag->nparsers ; ++i) {
+		/* an inlined type call is still a call of that type: it must
+		 * neither take up an equal parser, which would then become a
+		 * type call if the call is restored, nor duplicate a new call.
+		 */
+		const ln_parser_t *const prs = pdag->parsers + i;
+		const prsid_t prsid = (prs->callConf == NULL) ? prs->prsid : PRS_CUSTOM_TYPE;
+		const char *const conf = (prs->callConf == NULL) ? prs->conf : prs->callConf;
+		LN_DBGPRINTF(ctx, "parser  comparison:\n%s\n%s",  conf, parser->conf);
+		if(   prsid == parser->prsid
+		   && !strcmp(conf, parser->conf)) {
+		   	// FIXME: the current ->conf object is depending on
+			//        the order of json elements. We should do a JSON
+			//        comparison (a bit more complex). For now, it
+			//        works like we do it now.
+			// FIXME: if nextnode is set, check we can actually combine, 
+			//        else err out
+			*nextnode = pdag->parsers[i].node;
+			r = 0;
+			LN_DBGPRINTF(ctx, "merging with pdag %p", pdag);
+			pdagDeletePrs(ctx, parser); /* no need for data items */
+			goto done;
+		}
+	}
+	/* if we reach this point, we have a new parser type */
+	if(*nextnode == NULL) {
+		CHKN(*nextnode = ln_newPDAG(ctx)); /* we need a new node */
+	} else {
+		(*nextnode)->refcnt++;
+	}
+	parser->node = *nextnode;
+	ln_parser_t *newtab;
+	if(pdagInArena(ctx, pdag->parsers)) {
+		/* frozen node, table must be moved back to the heap */
+		CHKN(newtab = malloc((pdag->nparsers+1) * sizeof(ln_parser_t)));
+		memcpy(newtab, pdag->parsers, pdag->nparsers * sizeof(ln_parser_t));
+	} else {
+		CHKN(newtab = realloc(pdag->parsers, (pdag->nparsers+1) * sizeof(ln_parser_t)));
+	}
+	pdagDeleteDispatch(pdag); /* index is outdated, rebuilt by optimizer */
+	pdag->parsers = newtab;
+	memcpy(pdag->parsers+pdag->nparsers, parser, sizeof(ln_parser_t));
+	pdag->nparsers++;
+
+	r = 0;
+
+done:
+	free(parser);
+	return r;
+}
+
+/* same as pdagInsertParser(), but creates the parser from a json parser
+ * config *object* (no array!)
+ */
+static int
+ln_pdagAddParserInstance(ln_ctx ctx,
+	json_object *const __restrict__ prscnf,
+	struct ln_pdag *const __restrict__ pdag,
+	struct ln_pdag **nextnode)
+{
+	int r;
+	LN_DBGPRINTF(ctx, "ln_pdagAddParserInstance: %s", json_object_to_json_string(prscnf));
+	ln_parser_t *const parser = ln_newParser(ctx, prscnf);
+	CHKN(parser);
+	r = pdagInsertParser(ctx, parser, pdag, nextnode);
+done:
+	return r;
+}
+
+static int ln_pdagAddParserInternal(ln_ctx ctx, struct ln_pdag **pdag, const int mode, json_object *const prscnf, struct ln_pdag **nextnode);
+
+/**
+ * add parsers to current pdag. This is used
+ * to add parsers stored in an array. The mode specifies
+ * how parsers shall be added.
+ */
+#define PRS_ADD_MODE_SEQ 0
+#define PRS_ADD_MODE_ALTERNATIVE 1
+static int
+ln_pdagAddParsers(ln_ctx ctx,
+	json_object *const prscnf,
+	const int mode,
+	struct ln_pdag **pdag,
+	struct ln_pdag **p_nextnode)
+{
+	int r = LN_BADCONFIG;
+	struct ln_pdag *dag = *pdag;
+	struct ln_pdag *nextnode = *p_nextnode;
+	
+	const int lenarr = json_object_array_length(prscnf);
+	for(int i = 0 ; i < lenarr ; ++i) {
+		struct json_object *const curr_prscnf =
+			json_object_array_get_idx(prscnf, i);
+		LN_DBGPRINTF(ctx, "parser %d: %s", i, json_object_to_json_string(curr_prscnf));
+		if(json_object_get_type(curr_prscnf) == json_type_array) {
+			struct ln_pdag *local_dag = dag;
+			CHKR(ln_pdagAddParserInternal(ctx, &local_dag, mode,
+						      curr_prscnf, &nextnode));
+			if(mode == PRS_ADD_MODE_SEQ) {
+				dag = local_dag;
+			}
+		} else {
+			CHKR(ln_pdagAddParserInstance(ctx, curr_prscnf, dag, &nextnode));
+		}
+		if(mode == PRS_ADD_MODE_SEQ) {
+			dag = nextnode;
+			*p_nextnode = nextnode;
+			nextnode = NULL;
+		}
+	}
+
+	if(mode != PRS_ADD_MODE_SEQ)
+		dag = nextnode;
+	*pdag = dag;
+	r = 0;
+done:
+	return r;
+}
+
+/* add a json parser config object. Note that this object may contain
+ * multiple parser instances. Additionally, moves the pdag object to
+ * the next node, which is either newly created or previously existed.
+ */
+static int
+ln_pdagAddParserInternal(ln_ctx ctx, struct ln_pdag **pdag, 
+	const int mode, json_object *const prscnf, struct ln_pdag **nextnode)
+{
+	int r = LN_BADCONFIG;
+	struct ln_pdag *dag = *pdag;
+	
+	LN_DBGPRINTF(ctx, "ln_pdagAddParserInternal: %s", json_object_to_json_string(prscnf));
+	if(json_object_get_type(prscnf) == json_type_object) {
+		/* check for special types we need to handle here */
+		struct json_object *json;
+		json_object_object_get_ex(prscnf, "type", &json);
+		const char *const ftype = json_object_get_string(json);
+		if(!strcmp(ftype, "alternative")) {
+			json_object_object_get_ex(prscnf, "parser", &json);
+			if(json_object_get_type(json) != json_type_array) {
+				ln_errprintf(ctx, 0, "alternative type needs array of parsers. "
+					"Object: '%s', type is %s",
+					json_object_to_json_string(prscnf),
+					json_type_to_name(json_object_get_type(json)));
+				goto done;
+			}
+			CHKR(ln_pdagAddParsers(ctx, json, PRS_ADD_MODE_ALTERNATIVE, &dag, nextnode));
+		} else {
+			CHKR(ln_pdagAddParserInstance(ctx, prscnf, dag, nextnode));
+			if(mode == PRS_ADD_MODE_SEQ)
+				dag = *nextnode;
+		}
+	} else if(json_object_get_type(prscnf) == json_type_array) {
+		CHKR(ln_pdagAddParsers(ctx, prscnf, PRS_ADD_MODE_SEQ, &dag, nextnode));
+	} else {
+		ln_errprintf(ctx, 0, "bug: prscnf object of wrong type. Object: '%s'",
+			json_object_to_json_string(prscnf));
+		goto done;
+	}
+	*pdag = dag;
+
+done:
+	return r;
+}
+
+/* add a json parser config object. Note that this object may contain
+ * multiple parser instances. Additionally, moves the pdag object to
+ * the next node, which is either newly created or previously existed.
+ */
+int
+ln_pdagAddParser(ln_ctx ctx, struct ln_pdag **pdag, json_object *const prscnf)
 {
 	struct ln_pdag *nextnode = NULL;
 	int r = ln_pdagAddParserInternal(ctx, pdag, PRS_ADD_MODE_SEQ, prscnf, &nextnode);
@@ -987,723 +2947,1918 @@ ln_pdagAddParser(ln_ctx ctx, struct ln_pdag **pdag, json_object *const prscnf)
 	return r;
 }
 
-
-void
-ln_displayPDAGComponent(struct ln_pdag *dag, int level)
+int
+ln_pdagAddNewParser(ln_ctx ctx, struct ln_pdag **pdag, ln_parser_t *const prs)
+{
+	struct ln_pdag *nextnode = NULL;
+	const int r = pdagInsertParser(ctx, prs, *pdag, &nextnode);
+	if(r == 0)
+		*pdag = nextnode;
+	return r;
+}
+
+
+void
+ln_displayPDAGComponent(struct ln_pdag *dag, int level)
+{
+	char indent[2048];
+
+	if(level > 1023)
+		level = 1023;
+	memset(indent, ' ', level * 2);
+	indent[level * 2] = '\0';
+
+	LN_DBGPRINTF(dag->ctx, "%ssubDAG%s %p (children: %d parsers, ref %d) [called %u, backtracked %u]",
+		     indent, dag->flags.isTerminal ? " [TERM]" : "", dag, dag->nparsers, dag->refcnt,
+		     dag->stats.called, dag->stats.backtracked);
+
+for(int i = 0 ; i < dag->nparsers ; ++i) {
+	ln_parser_t *const prs = dag->parsers+i;
+	LN_DBGPRINTF(dag->ctx, "%sfield type '%s', name '%s': '%s': called %u", indent,
+		parserName(prs->prsid),
+		dag->parsers[i].name,
+		(prs->prsid == PRS_LITERAL) ?  ln_DataForDisplayLiteral(dag->ctx, prs->parser_data) : "UNKNOWN",
+	dag->parsers[i].node->stats.called);
+}
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers+i;
+		LN_DBGPRINTF(dag->ctx, "%sfield type '%s', name '%s': '%s':", indent,
+			parserName(prs->prsid),
+			dag->parsers[i].name,
+			(prs->prsid == PRS_LITERAL) ?  ln_DataForDisplayLiteral(dag->ctx, prs->parser_data) : "UNKNOWN");
+		if(prs->prsid == PRS_REPEAT) {
+			struct data_Repeat *const data = (struct data_Repeat*) prs->parser_data;
+			LN_DBGPRINTF(dag->ctx, "%sparser:", indent);
+			ln_displayPDAGComponent(data->parser, level + 1);
+			LN_DBGPRINTF(dag->ctx, "%swhile:", indent);
+			ln_displayPDAGComponent(data->while_cond, level + 1);
+			LN_DBGPRINTF(dag->ctx, "%send repeat def", indent);
+		}
+		ln_displayPDAGComponent(dag->parsers[i].node, level + 1);
+	}
+}
+
+
+void ln_displayPDAGComponentAlternative(struct ln_pdag *dag, int level)
+{
+	char indent[2048];
+
+	if(level > 1023)
+		level = 1023;
+	memset(indent, ' ', level * 2);
+	indent[level * 2] = '\0';
+
+	LN_DBGPRINTF(dag->ctx, "%s%p[ref %d]: %s", indent, dag, dag->refcnt, dag->rb_id);
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_displayPDAGComponentAlternative(dag->parsers[i].node, level + 1);
+	}
+}
+
+
+/* developer debug aid, to be used for example as follows:
+   LN_DBGPRINTF(dag->ctx, "---------------------------------------");
+   ln_displayPDAG(dag);
+   LN_DBGPRINTF(dag->ctx, "=======================================");
+ */
+void
+ln_displayPDAG(ln_ctx ctx)
+{
+	ln_pdagClearVisited(ctx);
+	for(int i = 0 ; i < ctx->nTypes ; ++i) {
+		LN_DBGPRINTF(ctx, "COMPONENT: %s", ctx->type_pdags[i]->name);
+		ln_displayPDAGComponent(ctx->type_pdags[i]->pdag, 0);
+	}
+
+	LN_DBGPRINTF(ctx, "MAIN COMPONENT:");
+	ln_displayPDAGComponent(ctx->pdag, 0);
+
+	LN_DBGPRINTF(ctx, "MAIN COMPONENT (alternative):");
+	ln_displayPDAGComponentAlternative(ctx->pdag, 0);
+}
+
+
+/* the following is a quick hack, which should be moved to the
+ * string class.
+ */
+static inline void dotAddPtr(es_str_t **str, void *p)
+{
+	char buf[64];
+	int i;
+	i = snprintf(buf, sizeof(buf), "l%p", p);
+	es_addBuf(str, buf, i);
+}
+/**
+ * recursive handler for DOT graph generator.
+ */
+static void
+ln_genDotPDAGGraphRec(struct ln_pdag *dag, es_str_t **str)
+{
+	char s_refcnt[16];
+	LN_DBGPRINTF(dag->ctx, "in dot: %p, visited %d", dag, (int) dag->flags.visited);
+	if(dag->flags.visited)
+		return; /* already processed this subpart */
+	dag->flags.visited = 1;
+	dotAddPtr(str, dag);
+	snprintf(s_refcnt, sizeof(s_refcnt), "%d", dag->refcnt);
+	s_refcnt[sizeof(s_refcnt)-1] = '\0';
+	es_addBufConstcstr(str, " [ label=\"");
+	es_addBuf(str, s_refcnt, strlen(s_refcnt));
+	es_addBufConstcstr(str, "\"");
+
+	if(isLeaf(dag)) {
+		es_addBufConstcstr(str, " style=\"bold\"");
+	}
+	es_addBufConstcstr(str, "]\n");
+
+	/* display field subdags */
+
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers+i;
+		dotAddPtr(str, dag);
+		es_addBufConstcstr(str, " -> ");
+		dotAddPtr(str, prs->node);
+		es_addBufConstcstr(str, " [label=\"");
+		es_addBuf(str, parserName(prs->prsid), strlen(parserName(prs->prsid)));
+		es_addBufConstcstr(str, ":");
+		//es_addStr(str, node->name);
+		if(prs->prsid == PRS_LITERAL) {
+			for(const char *p = ((struct data_Literal*)prs->parser_data)->lit ; *p ; ++p) {
+				// TODO: handle! if(*p == '\\')
+					//es_addChar(str, '\\');
+				if(*p != '\\' && *p != '"')
+					es_addChar(str, *p);
+			}
+		}
+		es_addBufConstcstr(str, "\"");
+		es_addBufConstcstr(str, " style=\"dotted\"]\n");
+		ln_genDotPDAGGraphRec(prs->node, str);
+	}
+}
+
+
+void
+ln_genDotPDAGGraph(struct ln_pdag *dag, es_str_t **str)
+{
+	ln_pdagClearVisited(dag->ctx);
+	es_addBufConstcstr(str, "digraph pdag {\n");
+	ln_genDotPDAGGraphRec(dag, str);
+	es_addBufConstcstr(str, "}\n");
+}
+
+/**
+ * recursive handler for statistics DOT graph generator.
+ */
+static void
+ln_genStatsDotPDAGGraphRec(struct ln_pdag *dag, FILE *const __restrict__ fp)
+{
+	if(dag->flags.visited)
+		return; /* already processed this subpart */
+	dag->flags.visited = 1;
+	fprintf(fp, "l%p [ label=\"%u:%u\"", dag,
+		dag->stats.called, dag->stats.backtracked);
+
+	if(isLeaf(dag)) {
+		fprintf(fp, " style=\"bold\"");
+	}
+	fprintf(fp, "]\n");
+
+	/* display field subdags */
+
+	for(int i = 0 ; i < dag->nparsers ; ++i) {
+		ln_parser_t *const prs = dag->parsers+i;
+		if(prs->node->stats.called == 0)
+			continue;
+		fprintf(fp, "l%p -> l%p [label=\"", dag, prs->node);
+		if(prs->prsid == PRS_LITERAL) {
+			for(const char *p = ((struct data_Literal*)prs->parser_data)->lit ; *p ; ++p) {
+				if(*p != '\\' && *p != '"')
+					fputc(*p, fp);
+			}
+		} else {
+			fprintf(fp, "%s", parserName(prs->prsid));
+		}
+		fprintf(fp, "\" style=\"dotted\"]\n");
+		ln_genStatsDotPDAGGraphRec(prs->node, fp);
+	}
+}
+
+
+static void
+ln_genStatsDotPDAGGraph(struct ln_pdag *dag, FILE *const fp)
+{
+	ln_pdagClearVisited(dag->ctx);
+	fprintf(fp, "digraph pdag {\n");
+	ln_genStatsDotPDAGGraphRec(dag, fp);
+	fprintf(fp, "}\n");
+}
+
+void
+ln_fullPDagStatsDOT(ln_ctx ctx, FILE *const fp)
+{
+	ctx = ctx->gen; /* not to be called concurrently with a reload */
+	pdagStatsMerge(ctx);
+	ln_genStatsDotPDAGGraph(ctx->pdag, fp);
+}
+
+
+static inline int
+addOriginalMsg(const char *str, const size_t strLen, struct json_object *const json)
+{
+	int r = 1;
+	struct json_object *value;
+
+	value = json_object_new_string_len(str, strLen);
+	if (value == NULL) {
+		goto done;
+	}
+	json_object_object_add(json, ORIGINAL_MSG_KEY, value);
+	r = 0;
+done:
+	return r;
+}
+
+static char *
+strrev(char *const __restrict__ str)
+{
+    char ch;
+    size_t i = strlen(str)-1,j=0;
+    while(i>j)
+    {
+        ch = str[i];
+        str[i]= str[j];
+        str[j] = ch;
+        i--;
+        j++;
+    }
+    return str;
+}
+
+/* note: "originalmsg" is NOT added as metadata in order to keep
+ * backwards compatible.
+ */
+static inline void
+addRuleMetadata(npb_t *const __restrict__ npb,
+	struct json_object *const json,
+	struct ln_pdag *const __restrict__ endNode)
+{
+	ln_ctx ctx = npb->ctx;
+	struct json_object *meta = NULL;
+	struct json_object *meta_rule = NULL;
+	struct json_object *value;
+
+	if(ctx->opts & LN_CTXOPT_ADD_RULE) { /* matching rule mockup */
+		if(meta_rule == NULL)
+			meta_rule = json_object_new_object();
+		if(endNode->mockup != NULL) {
+			value = json_object_new_string(endNode->mockup);
+		} else if(npb->rule != NULL) {
+			char *cstr = strrev(es_str2cstr(npb->rule, NULL));
+			value = json_object_new_string(cstr);
+			free(cstr);
+		} else { /* option set after the message was normalized */
+			value = json_object_new_string("");
+		}
+		json_object_object_add(meta_rule, RULE_MOCKUP_KEY, value);
+	}
+
+	if(ctx->opts & LN_CTXOPT_ADD_RULE_LOCATION) {
+		if(meta_rule == NULL)
+			meta_rule = json_object_new_object();
+		struct json_object *const location = json_object_new_object();
+		value = json_object_new_string(endNode->rb_file);
+		json_object_object_add(location, "file", value);
+		value = json_object_new_int((int)endNode->rb_lineno);
+		json_object_object_add(location, "line", value);
+		json_object_object_add(meta_rule, RULE_LOCATION_KEY, location);
+	}
+
+	if(meta_rule != NULL) {
+		if(meta == NULL)
+			meta = json_object_new_object();
+		json_object_object_add(meta, META_RULE_KEY, meta_rule);
+	}
+
+#ifdef	ADVANCED_STATS
+	/* complete execution path */
+	if(ctx->opts & LN_CTXOPT_ADD_EXEC_PATH) {
+		if(meta == NULL)
+			meta = json_object_new_object();
+		char hdr[128];
+		const size_t lenhdr 
+		  = snprintf(hdr, sizeof(hdr), "[PATHLEN:%d, PARSER CALLS gen:%d, literal:%d]",
+			     npb->astats.pathlen, npb->astats.parser_calls,
+			     npb->astats.lit_parser_calls);
+		es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
+		char * cstr = es_str2cstr(npb->astats.exec_path, NULL);
+		value = json_object_new_string(cstr);
+		if (value != NULL) {
+			json_object_object_add(meta, EXEC_PATH_KEY, value);
+		}
+		free(cstr);
+	}
+#endif
+
+	if(meta != NULL)
+		json_object_object_add(json, META_KEY, meta);
+}
+
+
+/**
+ * add unparsed string to event.
+ */
+static inline int
+addUnparsedField(const char *str, const size_t strLen, const size_t offs, struct json_object *json)
+{
+	int r = 1;
+	struct json_object *value;
+
+	CHKR(addOriginalMsg(str, strLen, json));
+	
+	value = json_object_new_string_len(str + offs, strLen - offs);
+	if (value == NULL) {
+		goto done;
+	}
+	json_object_object_add(json, UNPARSED_DATA_KEY, value);
+
+	r = 0;
+done:
+	return r;
+}
+
+
+/* if value is an object with the single member "..", return that
+ * member's value (which replaces the object), else NULL.
+ */
+static struct json_object *
+dotDotValue(struct json_object *const value)
+{
+	struct json_object *valDotDot = NULL;
+
+	if(json_object_get_type(value) != json_type_object)
+		goto done;
+	/* TODO: this needs to be speeded up by just checking the first
+	 * member and ensuring there is only one member. This requires
+	 * extensions to libfastjson.
+	 */
+	int nSubobj = 0;
+	struct json_object_iterator it = json_object_iter_begin(value);
+	struct json_object_iterator itEnd = json_object_iter_end(value);
+	while (!json_object_iter_equal(&it, &itEnd)) {
+		++nSubobj;
+		const char *key = json_object_iter_peek_name(&it);
+		if(key[0] == '.' && key[1] == '.' && key[2] == '\0') {
+			valDotDot = json_object_iter_peek_value(&it);
+		} else {
+			valDotDot = NULL;
+		}
+		json_object_iter_next(&it);
+	}
+	if(nSubobj != 1)
+		valDotDot = NULL;
+done:
+	return valDotDot;
+}
+
+/* Do some fixup to the json that we cannot do on a lower layer */
+static int
+fixJSON(struct ln_pdag *dag,
+	struct json_object **value,
+	struct json_object *json,
+	const ln_parser_t *const prs)
+
+{
+	int r = LN_WRONGPARSER;
+
+	if(prs->name ==  NULL) {
+		if (*value != NULL) {
+			/* Free the unneeded value */
+			json_object_put(*value);
+		}
+	} else if(prs->name[0] == '.' && prs->name[1] == '\0') {
+		if(json_object_get_type(*value) == json_type_object) {
+			struct json_object_iterator it = json_object_iter_begin(*value);
+			struct json_object_iterator itEnd = json_object_iter_end(*value);
+			while (!json_object_iter_equal(&it, &itEnd)) {
+				struct json_object *const val = json_object_iter_peek_value(&it);
+				json_object_get(val);
+				json_object_object_add(json, json_object_iter_peek_name(&it), val);
+				json_object_iter_next(&it);
+			}
+			json_object_put(*value);
+		} else {
+			LN_DBGPRINTF(dag->ctx, "field name is '.', but json type is %s",
+				json_type_to_name(json_object_get_type(*value)));
+			json_object_object_add_ex(json, prs->name, *value,
+				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
+		}
+	} else {
+		struct json_object *const valDotDot = dotDotValue(*value);
+		if(valDotDot != NULL) {
+			LN_DBGPRINTF(dag->ctx, "subordinate field name is '..', combining");
+			json_object_get(valDotDot);
+			json_object_put(*value);
+			json_object_object_add_ex(json, prs->name, valDotDot,
+				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
+		} else {
+			json_object_object_add_ex(json, prs->name, *value,
+				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
+		}
+	}
+	r = 0;
+	return r;
+}
+
+// TODO: streamline prototype when done with changes
+
+static int
+tryParser(npb_t *const __restrict__ npb,
+	struct ln_pdag *dag,
+	size_t *offs,
+	size_t *const __restrict__ pParsed,
+	struct json_object **value,
+	const ln_parser_t *const prs
+	)
+{
+	int r;
+	struct ln_pdag *endNode = NULL;
+	size_t parsedTo = npb->parsedTo;
+#	ifdef	ADVANCED_STATS
+	char hdr[16];
+	const size_t lenhdr 
+	  = snprintf(hdr, sizeof(hdr), "%d:", npb->astats.recursion_level);
+	es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
+	if(prs->prsid == PRS_LITERAL) {
+		es_addChar(&npb->astats.exec_path, '\'');
+		es_addBuf(&npb->astats.exec_path,
+			  ln_DataForDisplayLiteral(dag->ctx,
+				prs->parser_data),
+			  strlen(ln_DataForDisplayLiteral(dag->ctx,
+				prs->parser_data))
+			 );
+		es_addChar(&npb->astats.exec_path, '\'');
+	} else if(prs->prsid == PRS_CHAR_TO) {
+		es_addBuf(&npb->astats.exec_path,
+			  ln_DataForDisplayCharTo(dag->ctx,
+				prs->parser_data),
+			  strlen(ln_DataForDisplayCharTo(dag->ctx,
+				prs->parser_data))
+			 );
+	} else {
+		es_addBuf(&npb->astats.exec_path,
+			parserName(prs->prsid),
+			strlen(parserName(prs->prsid)) );
+	}
+	es_addChar(&npb->astats.exec_path, ',');
+#	endif
+
+	/* The most common parsers are called directly, without going
+	 * through the lookup table. Their value is always the matched text.
+	 */
+	int bTextValue = 1;
+	switch(prs->prsid) {
+	case PRS_LITERAL:
+		r = ln_fastParseLiteral(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_WORD:
+		r = ln_fastParseWord(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_NUMBER:
+		r = ln_fastParseNumber(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_WHITESPACE:
+		r = ln_fastParseWhitespace(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_CHAR_TO:
+		r = ln_fastParseCharTo(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_REST:
+		r = ln_fastParseRest(npb->str, npb->strLen, *offs, prs->parser_data, pParsed);
+		break;
+	case PRS_CUSTOM_TYPE:
+		bTextValue = 0;
+		if(*value == NULL && npb->spans == NULL)
+			*value = json_object_new_object();
+		LN_DBGPRINTF(dag->ctx, "calling custom parser '%s'", prs->custType->name);
+		/* what other paths parsed before must not count for the type */
+		npb->parsedTo = *offs;
+		r = ln_normalizeRec(npb, prs->custType->pdag, *offs, 1, *value, &endNode);
+		LN_DBGPRINTF(dag->ctx, "called CUSTOM PARSER '%s', result %d, "
+			"offs %zd, *pParsed %zd", prs->custType->name, r, *offs, *pParsed);
+		*pParsed = npb->parsedTo - *offs;
+		#ifdef	ADVANCED_STATS
+		es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
+		es_addBuf(&npb->astats.exec_path, "[R:USR],", 8); 
+		#endif
+		break;
+	default:
+		bTextValue = 0;
+		r = parser_lookup_table[prs->prsid].parser(npb, offs, prs->parser_data, pParsed,
+			(prs->name == NULL || npb->spans != NULL) ? NULL : value);
+		break;
+	}
+	if(bTextValue && r == 0 && prs->name != NULL && npb->spans == NULL)
+		*value = json_object_new_string_len(npb->str + *offs, *pParsed);
+	LN_DBGPRINTF(npb->ctx, "parser lookup returns %d, pParsed %zu", r, *pParsed);
+	npb->parsedTo = parsedTo;
+
+#ifdef	ADVANCED_STATS
+	struct advstats_totals *const as = &npb->tstats->adv;
+	++as->parsers_called;
+	++npb->astats.parser_calls;
+	if(prs->prsid == PRS_LITERAL)
+		++npb->astats.lit_parser_calls;
+	if(r == 0)
+		++as->parsers_success;
+	if(prs->prsid != PRS_CUSTOM_TYPE) {
+		++as->prs_called[prs->prsid];
+		if(r == 0)
+			++as->prs_success[prs->prsid];
+	}
+#endif
+	return r;
+}
+
+
+static void
+add_str_reversed(npb_t *const __restrict__ npb,
+	const char *const __restrict__ str,
+	const size_t len)
+{
+	ssize_t i;
+	for(i = len - 1 ; i >= 0 ; --i) {
+		es_addChar(&npb->rule, str[i]);
+	}
+}
+
+
+/* record a span in span mode */
+static int
+spansAdd(struct ln_spans_s *const spans,
+	const ln_parser_t *const prs,
+	const size_t offs,
+	const size_t len,
+	const unsigned firstChild,
+	const unsigned nChildren)
+{
+	int r = 0;
+	if(spans->nspans == spans->maxspans) {
+		const unsigned newmax = (spans->maxspans == 0) ? 32 : 2 * spans->maxspans;
+		struct ln_span *const newspans = realloc(spans->spans,
+			newmax * sizeof(struct ln_span));
+		CHKN(newspans);
+		spans->spans = newspans;
+		spans->maxspans = newmax;
+	}
+	struct ln_span *const span = spans->spans + spans->nspans++;
+	span->prs = prs;
+	span->offs = offs;
+	span->len = len;
+	span->firstChild = firstChild;
+	span->nChildren = nChildren;
+	span->parent = 0;
+done:	return r;
+}
+
+/* Add the current parser to the mockup rule.
+ * Note: we add reversed strings, because we can call this
+ * function effectively only when walking upwards the tree.
+ * This means deepest entries come first. We solve this somewhat
+ * elegantly by reversion strings, and then reversion the string
+ * once more when we emit it, so that we get the right order.
+ */
+static inline void
+add_rule_to_mockup(npb_t *const __restrict__ npb,
+	const ln_parser_t *const __restrict__ prs)
+{
+	/* only messages matching a rule without mockup need the buffer */
+	if(npb->rule == NULL && (npb->rule = es_newStr(256)) == NULL)
+		return;
+	if(prs->callConf != NULL) { /* inlined type call, as in the rule source */
+		const char *const type = parserName(PRS_CUSTOM_TYPE);
+		es_addChar(&npb->rule, '%');
+		add_str_reversed(npb, type, strlen(type));
+		es_addChar(&npb->rule, ':');
+		if(prs->callName == NULL) {
+			es_addChar(&npb->rule, '-');
+		} else {
+			add_str_reversed(npb, prs->callName, strlen(prs->callName));
+		}
+		es_addChar(&npb->rule, '%');
+	} else if(prs->prsid == PRS_LITERAL) {
+		const char *const val = 
+			  ln_DataForDisplayLiteral(npb->ctx,
+				prs->parser_data);
+		add_str_reversed(npb, val, strlen(val));
+	} else {
+		/* note: name/value order must also be reversed! */
+		es_addChar(&npb->rule, '%');
+		add_str_reversed(npb,
+			parserName(prs->prsid),
+			strlen(parserName(prs->prsid)) );
+		es_addChar(&npb->rule, ':');
+		if(prs->name == NULL) {
+			es_addChar(&npb->rule, '-');
+		} else {
+			add_str_reversed(npb, prs->name, strlen(prs->name));
+		}
+		es_addChar(&npb->rule, '%');
+	}
+}
+
+/* per-message budget, see ln_setNormalizeBudget(). Parser calls are
+ * counted only if a budget is set. The clock is expensive compared to
+ * a parser call, so with a time limit we look at it only every
+ * BUDGET_CLOCK_INTERVAL calls.
+ */
+#define BUDGET_CLOCK_INTERVAL 64
+
+static inline void
+budgetStart(npb_t *const npb)
+{
+	const ln_ctx ctx = npb->ctx;
+
+	/* the budget may be changed at any time: take both limits once, so
+	 * that the whole message is done with the same ones
+	 */
+	npb->budgetMaxCalls = __atomic_load_n(&ctx->budgetMaxCalls, __ATOMIC_RELAXED);
+	npb->budgetMaxUsec = __atomic_load_n(&ctx->budgetMaxUsec, __ATOMIC_RELAXED);
+	npb->parserCalls = 0;
+	npb->budgetCheck = 0;
+	npb->budgetExceeded = 0;
+	if(npb->budgetMaxUsec != 0) {
+		npb->budgetDeadline = ruleStatsNow() + (uint64_t) npb->budgetMaxUsec * 1000;
+		npb->budgetCheck = BUDGET_CLOCK_INTERVAL;
+	}
+	if(npb->budgetMaxCalls != 0
+	   && (npb->budgetCheck == 0 || npb->budgetMaxCalls < npb->budgetCheck))
+		npb->budgetCheck = (uint64_t) npb->budgetMaxCalls + 1;
+}
+
+/* called when parserCalls reached budgetCheck. Returns 1 if the budget
+ * is exhausted, else schedules the next check.
+ */
+static int
+budgetExhausted(npb_t *const npb)
+{
+	const ln_ctx ctx = npb->ctx;
+
+	if(npb->budgetExceeded)
+		return 1;
+	if((npb->budgetMaxCalls != 0 && npb->parserCalls > npb->budgetMaxCalls)
+	   || (npb->budgetMaxUsec != 0 && ruleStatsNow() >= npb->budgetDeadline)) {
+		LN_DBGPRINTF(ctx, "normalization budget exceeded after %" PRIu64 " parser calls",
+			npb->parserCalls);
+		npb->budgetExceeded = 1;
+		return 1;
+	}
+	npb->budgetCheck = npb->parserCalls + BUDGET_CLOCK_INTERVAL;
+	if(npb->budgetMaxCalls != 0 && npb->budgetCheck > (uint64_t) npb->budgetMaxCalls + 1)
+		npb->budgetCheck = (uint64_t) npb->budgetMaxCalls + 1;
+	return 0;
+}
+
+/* record a message that was not parsed because of its budget */
+static void
+budgetRecordExceeded(npb_t *const npb, struct json_object *const json)
+{
+	if(json != NULL) {
+		struct json_object *meta;
+		if(!json_object_object_get_ex(json, META_KEY, &meta)) {
+			meta = json_object_new_object();
+			json_object_object_add(json, META_KEY, meta);
+		}
+		json_object_object_add(meta, BUDGET_EXCEEDED_KEY, json_object_new_boolean(1));
+	}
+	__atomic_add_fetch(&npb->ctx->front->nBudgetExceeded, 1, __ATOMIC_RELAXED);
+}
+
+/* start a new message: all existing entries become invalid */
+static inline void
+memoReset(struct ln_memo *const memo)
+{
+	memo->used = 0;
+	if(++memo->gen == 0) {
+		if(memo->tab != NULL)
+			memset(memo->tab, 0, memo->size * sizeof(struct ln_memo_entry));
+		memo->gen = 1;
+	}
+}
+
+/* set up the memo table for the calling thread. Without thread-specific
+ * storage, all threads share the retired statistics block, so the call
+ * then gets a table of its own.
+ */
+static int
+memoSetup(npb_t *const npb)
+{
+	int r = 0;
+	if(npb->ctx->bStatsKey) {
+		npb->memo = &npb->tstats->memo;
+	} else {
+		CHKN(npb->memo = calloc(1, sizeof(struct ln_memo)));
+		npb->bOwnMemo = 1;
+		memoReset(npb->memo); /* generation 0 is never used */
+	}
+done:	return r;
+}
+
+static void
+memoTeardown(npb_t *const npb)
+{
+	if(npb->bOwnMemo) {
+		free(npb->memo->tab);
+		free(npb->memo);
+		npb->memo = NULL;
+		npb->bOwnMemo = 0;
+	}
+}
+
+static inline size_t
+memoKey(const npb_t *const npb, const size_t offs, const int bPartialMatch)
+{
+	return (offs << 2) | ((bPartialMatch != 0) << 1) | (npb->spans != NULL);
+}
+
+static inline unsigned
+memoHash(const struct ln_pdag *const dag, const size_t key)
+{
+	const uint64_t h = ((uint64_t) (uintptr_t) dag >> 3) * 0x9e3779b97f4a7c15ULL
+			 ^ (uint64_t) key * 0xc2b2ae3d27d4eb4fULL;
+	return (unsigned) (h >> 32);
+}
+
+/* @return entry of a failed attempt or NULL if there is none */
+static inline const struct ln_memo_entry *
+memoFind(const struct ln_memo *const memo, const struct ln_pdag *const dag, const size_t key)
+{
+	if(memo->used == 0)
+		return NULL;
+	const unsigned mask = memo->size - 1;
+	for(unsigned i = memoHash(dag, key) & mask ; ; i = (i + 1) & mask) {
+		const struct ln_memo_entry *const e = memo->tab + i;
+		if(e->gen != memo->gen)
+			return NULL;
+		if(e->dag == dag && e->key == key)
+			return e;
+	}
+}
+
+/* record a failed attempt. If the table cannot be grown, the attempt
+ * is simply not recorded, which only costs performance.
+ */
+static void
+memoAdd(struct ln_memo *const memo, const struct ln_pdag *const dag, const size_t key,
+	const size_t parsedTo)
+{
+	if(2 * (memo->used + 1) > memo->size) {
+		const unsigned newsize = (memo->size == 0) ? MEMO_MIN_SIZE : 2 * memo->size;
+		struct ln_memo_entry *const newtab = calloc(newsize, sizeof(struct ln_memo_entry));
+		if(newtab == NULL)
+			return;
+		for(unsigned i = 0 ; i < memo->size ; ++i) {
+			const struct ln_memo_entry *const e = memo->tab + i;
+			if(e->gen != memo->gen)
+				continue;
+			unsigned j = memoHash(e->dag, e->key) & (newsize - 1);
+			while(newtab[j].gen == memo->gen)
+				j = (j + 1) & (newsize - 1);
+			newtab[j] = *e;
+		}
+		free(memo->tab);
+		memo->tab = newtab;
+		memo->size = newsize;
+	}
+	const unsigned mask = memo->size - 1;
+	unsigned i = memoHash(dag, key) & mask;
+	while(memo->tab[i].gen == memo->gen)
+		i = (i + 1) & mask;
+	memo->tab[i].dag = dag;
+	memo->tab[i].key = key;
+	memo->tab[i].parsedTo = parsedTo;
+	memo->tab[i].gen = memo->gen;
+	++memo->used;
+}
+
+/**
+ * Recursive step of the normalizer. It walks the parse dag and calls itself
+ * recursively when this is appropriate. It also implements backtracking in
+ * those (hopefully rare) cases where it is required.
+ *
+ * @param[in] dag current tree to process
+ * @param[in] string string to be matched against (the to-be-normalized data)
+ * @param[in] strLen length of the to-be-matched string
+ * @param[in] offs start position in input data
+ * @param[out] pPrasedTo ptr to position up to which the the parsing succed in max
+ * @param[in/out] json ... that is being created during normalization
+ * @param[out] endNode if a match was found, this is the matching node (undefined otherwise)
+ *
+ * @return regular liblognorm error code (0->OK, something else->error)
+ * TODO: can we use parameter block to prevent pushing params to the stack?
+ */
+int
+ln_normalizeRec(npb_t *const __restrict__ npb,
+	struct ln_pdag *dag,
+	const size_t offs,
+	const int bPartialMatch,
+	struct json_object *json,
+	struct ln_pdag **endNode
+	)
+{
+	int r = LN_WRONGPARSER;
+	int localR;
+	size_t i;
+	size_t icand;
+	size_t ncand = dag->nparsers;
+	const prsid_t *cand = NULL;
+	size_t parsed = 0;
+	struct json_object *value;
+	size_t memoKeyVal = 0;
+	size_t outerParsedTo = 0;
+
+	/* if memoization is enabled, never explore a failed path twice */
+	if(npb->memo != NULL) {
+		memoKeyVal = memoKey(npb, offs, bPartialMatch);
+		const struct ln_memo_entry *const m = memoFind(npb->memo, dag, memoKeyVal);
+		if(m != NULL) {
+			LN_DBGPRINTF(dag->ctx, "%zu: dag node %p already failed", offs, dag);
+			if(m->parsedTo > npb->parsedTo)
+				npb->parsedTo = m->parsedTo;
+			return LN_WRONGPARSER;
+		}
+		/* we need to know how far this call alone gets */
+		outerParsedTo = npb->parsedTo;
+		npb->parsedTo = 0;
+	}
+	size_t parsedTo = npb->parsedTo;
+	
+LN_DBGPRINTF(dag->ctx, "%zu: enter parser, dag node %p, json %p", offs, dag, json);
+
+	++npb->tstats->nodes[dag->stats_id].called;
+#ifdef	ADVANCED_STATS
+	++npb->astats.pathlen;
+	++npb->astats.recursion_level;
+#endif
+
+	/* if we have a dispatch index, we try only those parsers that
+	 * can match the first byte.
+	 */
+	if(dag->dispatch != NULL) {
+		cand = dag->dispatch->cand;
+		if(offs < npb->strLen)
+			cand += dag->dispatch->start[(unsigned char) npb->str[offs]];
+		ncand = *cand++;
+	}
+
+	/* now try the parsers */
+	for(icand = 0 ; icand < ncand && r != 0 ; ++icand) {
+		if(npb->budgetCheck != 0 && ++npb->parserCalls >= npb->budgetCheck
+		   && budgetExhausted(npb))
+			break;
+		const ln_parser_t *const prs = dag->parsers + ((cand == NULL) ? icand : cand[icand]);
+		if(dag->ctx->debug) {
+			LN_DBGPRINTF(dag->ctx, "%zu/%d:trying '%s' parser for field '%s', "
+				     "data '%s'",
+					offs, bPartialMatch, parserName(prs->prsid), prs->name,
+					(prs->prsid == PRS_LITERAL)
+					 ? ln_DataForDisplayLiteral(dag->ctx, prs->parser_data)
+				 	 : "UNKNOWN");
+		}
+		i = offs;
+		value = NULL;
+		const unsigned spanMark = (npb->spans == NULL) ? 0 : npb->spans->nspans;
+		localR = tryParser(npb, dag, &i, &parsed, &value, prs);
+		if(localR == 0) {
+			const unsigned nChildren = (npb->spans == NULL) ? 0
+						   : npb->spans->nspans - spanMark;
+			parsedTo = i + parsed;
+			/* potential hit, need to verify */
+			LN_DBGPRINTF(dag->ctx, "%zu: potential hit, trying subtree %p",
+				offs, prs->node);
+			r = ln_normalizeRec(npb, prs->node, parsedTo,
+					    bPartialMatch, json, endNode);
+			LN_DBGPRINTF(dag->ctx, "%zu: subtree returns %d, parsedTo %zu", offs, r, parsedTo);
+			if(r == 0) {
+				LN_DBGPRINTF(dag->ctx, "%zu: parser matches at %zu", offs, i);
+				if(npb->spans == NULL) {
+					CHKR(fixJSON(dag, &value, json, prs));
+				} else {
+					CHKR(spansAdd(npb->spans, prs, i, parsed, spanMark, nChildren));
+				}
+				if(   (*endNode)->flags.recordMockup
+				   && (npb->ctx->opts & LN_CTXOPT_ADD_RULE)) {
+					add_rule_to_mockup(npb, prs);
+				}
+			} else {
+				++npb->tstats->nodes[dag->stats_id].backtracked;
+				#ifdef	ADVANCED_STATS
+					++npb->astats.backtracked;
+					es_addBuf(&npb->astats.exec_path, "[B]", 3);
+				#endif
+				LN_DBGPRINTF(dag->ctx, "%zu nonmatch, backtracking required, parsed to=%zu",
+						offs, parsedTo);
+				if (value != NULL) { /* Free the value if it was created */
+					json_object_put(value);
+				}
+				if(npb->spans != NULL)
+					npb->spans->nspans = spanMark;
+			}
+		} else if(value != NULL) {
+			/* a custom type creates the value before it knows if it matches */
+			json_object_put(value);
+		}
+		/* did we have a longer parser --> then update */
+		if(parsedTo > npb->parsedTo)
+			npb->parsedTo = parsedTo;
+		LN_DBGPRINTF(dag->ctx, "parsedTo %zu, *pParsedTo %zu", parsedTo, npb->parsedTo);
+	}
+
+LN_DBGPRINTF(dag->ctx, "offs %zu, strLen %zu, isTerm %d", offs, npb->strLen, dag->flags.isTerminal);
+	if(dag->flags.isTerminal && (offs == npb->strLen || bPartialMatch)) {
+		*endNode = dag;
+		r = 0;
+		goto done;
+	}
+
+done:
+	/* once the budget is exhausted, nothing matches any longer; in
+	 * particular, no partial result must be accepted by a caller.
+	 */
+	if(npb->budgetExceeded)
+		r = LN_WRONGPARSER;
+	if(npb->memo != NULL) {
+		if(r == LN_WRONGPARSER && !npb->budgetExceeded)
+			memoAdd(npb->memo, dag, memoKeyVal, npb->parsedTo);
+		if(outerParsedTo > npb->parsedTo)
+			npb->parsedTo = outerParsedTo;
+	}
+	LN_DBGPRINTF(dag->ctx, "%zu returns %d, pParsedTo %zu, parsedTo %zu",
+		offs, r, npb->parsedTo, parsedTo);
+#	ifdef	ADVANCED_STATS
+	--npb->astats.recursion_level;
+#	endif
+	return r;
+}
+
+/* create a private copy of a tag bucket */
+static struct json_object *
+copyTags(struct json_object *const tagbucket)
 {
-	char indent[2048];
-
-	if(level > 1023)
-		level = 1023;
-	memset(indent, ' ', level * 2);
-	indent[level * 2] = '\0';
-
-	LN_DBGPRINTF(dag->ctx, "%ssubDAG%s %p (children: %d parsers, ref %d) [called %u, backtracked %u]",
-		     indent, dag->flags.isTerminal ? " [TERM]" : "", dag, dag->nparsers, dag->refcnt,
-		     dag->stats.called, dag->stats.backtracked);
+	struct json_object *tags;
+	struct json_object *tag;
 
-for(int i = 0 ; i < dag->nparsers ; ++i) {
-	ln_parser_t *const prs = dag->parsers+i;
-	LN_DBGPRINTF(dag->ctx, "%sfield type '%s', name '%s': '%s': called %u", indent,
-		parserName(prs->prsid),
-		dag->parsers[i].name,
-		(prs->prsid == PRS_LITERAL) ?  ln_DataForDisplayLiteral(dag->ctx, prs->parser_data) : "UNKNOWN",
-	dag->parsers[i].node->stats.called);
-}
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_parser_t *const prs = dag->parsers+i;
-		LN_DBGPRINTF(dag->ctx, "%sfield type '%s', name '%s': '%s':", indent,
-			parserName(prs->prsid),
-			dag->parsers[i].name,
-			(prs->prsid == PRS_LITERAL) ?  ln_DataForDisplayLiteral(dag->ctx, prs->parser_data) : "UNKNOWN");
-		if(prs->prsid == PRS_REPEAT) {
-			struct data_Repeat *const data = (struct data_Repeat*) prs->parser_data;
-			LN_DBGPRINTF(dag->ctx, "%sparser:", indent);
-			ln_displayPDAGComponent(data->parser, level + 1);
-			LN_DBGPRINTF(dag->ctx, "%swhile:", indent);
-			ln_displayPDAGComponent(data->while_cond, level + 1);
-			LN_DBGPRINTF(dag->ctx, "%send repeat def", indent);
+	if((tags = json_object_new_array()) == NULL)
+		goto done;
+	const int ntags = json_object_array_length(tagbucket);
+	for(int i = 0 ; i < ntags ; ++i) {
+		struct json_object *const orgtag = json_object_array_get_idx(tagbucket, i);
+		if((tag = json_object_new_string_len(json_object_get_string(orgtag),
+			json_object_get_string_len(orgtag))) == NULL) {
+			json_object_put(tags);
+			tags = NULL;
+			goto done;
 		}
-		ln_displayPDAGComponent(dag->parsers[i].node, level + 1);
+		json_object_array_add(tags, tag);
 	}
+done:
+	return tags;
 }
 
-
-void ln_displayPDAGComponentAlternative(struct ln_pdag *dag, int level)
+/* prepare a npb for normalizing one or more messages with the
+ * current thread. All per-thread setup (statistics block, work
+ * buffers) is done here, so that batches need to do it only once.
+ */
+static int
+normalizeSetup(npb_t *const npb, ln_ctx ctx)
 {
-	char indent[2048];
-
-	if(level > 1023)
-		level = 1023;
-	memset(indent, ' ', level * 2);
-	indent[level * 2] = '\0';
-
-	LN_DBGPRINTF(dag->ctx, "%s%p[ref %d]: %s", indent, dag, dag->refcnt, dag->rb_id);
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_displayPDAGComponentAlternative(dag->parsers[i].node, level + 1);
-	}
+	int r = 0;
+	memset(npb, 0, sizeof(*npb));
+	npb->ctx = ctx;
+	CHKN(npb->tstats = pdagThreadStats(ctx));
+	parseWrkSetup(npb);
+	if(ctx->opts & LN_CTXOPT_MEMOIZE)
+		CHKR(memoSetup(npb));
+#	ifdef ADVANCED_STATS
+	CHKN(npb->astats.exec_path = es_newStr(1024));
+#	endif
+done:	return r;
 }
 
+static void
+normalizeTeardown(npb_t *const npb)
+{
+	if(npb->rule != NULL)
+		es_deleteStr(npb->rule);
+	parseWrkFree(&npb->ownWrk);
+	memoTeardown(npb);
+#	ifdef ADVANCED_STATS
+	if(npb->astats.exec_path != NULL)
+		es_deleteStr(npb->astats.exec_path);
+#	endif
+}
 
-/* developer debug aid, to be used for example as follows:
-   LN_DBGPRINTF(dag->ctx, "---------------------------------------");
-   ln_displayPDAG(dag);
-   LN_DBGPRINTF(dag->ctx, "=======================================");
- */
-void
-ln_displayPDAG(ln_ctx ctx)
+#ifdef	ADVANCED_STATS
+/* record the execution path stats of a single message */
+static void
+advstatsRecord(npb_t *const npb, const int r, struct ln_pdag *const endNode)
 {
-	ln_pdagClearVisited(ctx);
-	for(int i = 0 ; i < ctx->nTypes ; ++i) {
-		LN_DBGPRINTF(ctx, "COMPONENT: %s", ctx->type_pdags[i].name);
-		ln_displayPDAGComponent(ctx->type_pdags[i].pdag, 0);
+	struct advstats_totals *const as = &npb->tstats->adv;
+	if(r != 0)
+		es_addBuf(&npb->astats.exec_path, "[FAILED]", 8);
+	else if(!endNode->flags.isTerminal)
+		es_addBuf(&npb->astats.exec_path, "[FAILED:NON-TERMINAL]", 21);
+	if(npb->astats.pathlen < ADVSTATS_MAX_ENTITIES)
+		as->pathlens[npb->astats.pathlen]++;
+	if(npb->astats.pathlen > as->max_pathlen) {
+		as->max_pathlen = npb->astats.pathlen;
+	}
+	if(npb->astats.backtracked < ADVSTATS_MAX_ENTITIES)
+		as->backtracks[npb->astats.backtracked]++;
+	if(npb->astats.backtracked > as->max_backtracked) {
+		as->max_backtracked = npb->astats.backtracked;
 	}
 
-	LN_DBGPRINTF(ctx, "MAIN COMPONENT:");
-	ln_displayPDAGComponent(ctx->pdag, 0);
-
-	LN_DBGPRINTF(ctx, "MAIN COMPONENT (alternative):");
-	ln_displayPDAGComponentAlternative(ctx->pdag, 0);
+	/* parser calls */
+	if(npb->astats.parser_calls < ADVSTATS_MAX_ENTITIES)
+		as->parser_calls[npb->astats.parser_calls]++;
+	if(npb->astats.parser_calls > as->max_parser_calls) {
+		as->max_parser_calls = npb->astats.parser_calls;
+	}
+	if(npb->astats.lit_parser_calls < ADVSTATS_MAX_ENTITIES)
+		as->lit_parser_calls[npb->astats.lit_parser_calls]++;
+	if(npb->astats.lit_parser_calls > as->max_lit_parser_calls) {
+		as->max_lit_parser_calls = npb->astats.lit_parser_calls;
+	}
 }
+#endif
 
-
-/* the following is a quick hack, which should be moved to the
- * string class.
- */
-static inline void dotAddPtr(es_str_t **str, void *p)
-{
-	char buf[64];
-	int i;
-	i = snprintf(buf, sizeof(buf), "l%p", p);
-	es_addBuf(str, buf, i);
-}
-struct data_Literal { const char *lit; }; // TODO remove when this hack is no longe needed
-/**
- * recursive handler for DOT graph generator.
+/* normalize a single message with an already set up npb. The npb
+ * is reset to its per-message initial state, but buffers are kept.
  */
-static void
-ln_genDotPDAGGraphRec(struct ln_pdag *dag, es_str_t **str)
+static int
+normalizeMsg(npb_t *const npb, const char *const str, const size_t strLen,
+	struct json_object **json_p)
 {
-	char s_refcnt[16];
-	LN_DBGPRINTF(dag->ctx, "in dot: %p, visited %d", dag, (int) dag->flags.visited);
-	if(dag->flags.visited)
-		return; /* already processed this subpart */
-	dag->flags.visited = 1;
-	dotAddPtr(str, dag);
-	snprintf(s_refcnt, sizeof(s_refcnt), "%d", dag->refcnt);
-	s_refcnt[sizeof(s_refcnt)-1] = '\0';
-	es_addBufConstcstr(str, " [ label=\"");
-	es_addBuf(str, s_refcnt, strlen(s_refcnt));
-	es_addBufConstcstr(str, "\"");
+	int r;
+	ln_ctx ctx = npb->ctx;
+	struct ln_pdag *endNode = NULL;
+	const unsigned ruleStatsSampling = __atomic_load_n(&ctx->ruleStatsSampling, __ATOMIC_RELAXED);
+	uint64_t tBegin = 0;
+
+	if(ruleStatsSampling != 0 && ruleStatsSample(npb->tstats, ruleStatsSampling))
+		tBegin = ruleStatsNow();
+	npb->str = str;
+	npb->strLen = strLen;
+	npb->parsedTo = 0;
+	if(npb->memo != NULL)
+		memoReset(npb->memo);
+	budgetStart(npb);
+	if(npb->rule != NULL)
+		es_emptyStr(npb->rule);
+#	ifdef ADVANCED_STATS
+	es_str_t *const exec_path = npb->astats.exec_path;
+	memset(&npb->astats, 0, sizeof(npb->astats));
+	es_emptyStr(exec_path);
+	npb->astats.exec_path = exec_path;
+#	endif
 
-	if(isLeaf(dag)) {
-		es_addBufConstcstr(str, " style=\"bold\"");
+	if(*json_p == NULL) {
+		CHKN(*json_p = json_object_new_object());
 	}
-	es_addBufConstcstr(str, "]\n");
 
-	/* display field subdags */
+	r = ln_normalizeRec(npb, ctx->pdag, 0, 0, *json_p, &endNode);
 
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_parser_t *const prs = dag->parsers+i;
-		dotAddPtr(str, dag);
-		es_addBufConstcstr(str, " -> ");
-		dotAddPtr(str, prs->node);
-		es_addBufConstcstr(str, " [label=\"");
-		es_addBuf(str, parserName(prs->prsid), strlen(parserName(prs->prsid)));
-		es_addBufConstcstr(str, ":");
-		//es_addStr(str, node->name);
-		if(prs->prsid == PRS_LITERAL) {
-			for(const char *p = ((struct data_Literal*)prs->parser_data)->lit ; *p ; ++p) {
-				// TODO: handle! if(*p == '\\')
-					//es_addChar(str, '\\');
-				if(*p != '\\' && *p != '"')
-					es_addChar(str, *p);
-			}
+	if(ctx->debug) {
+		if(r == 0) {
+			LN_DBGPRINTF(ctx, "final result for normalizer: parsedTo %zu, endNode %p, "
+				     "isTerminal %d, tagbucket %p",
+				     npb->parsedTo, endNode, endNode->flags.isTerminal, endNode->tags);
+		} else {
+			LN_DBGPRINTF(ctx, "final result for normalizer: parsedTo %zu, endNode %p",
+				     npb->parsedTo, endNode);
 		}
-		es_addBufConstcstr(str, "\"");
-		es_addBufConstcstr(str, " style=\"dotted\"]\n");
-		ln_genDotPDAGGraphRec(prs->node, str);
 	}
-}
+	LN_DBGPRINTF(ctx, "DONE, final return is %d", r);
+#	ifdef ADVANCED_STATS
+	advstatsRecord(npb, r, endNode);
+#	endif
+	if(r == 0 && endNode->flags.isTerminal) {
+		/* success, finalize event */
+		if(endNode->tags != NULL) {
+			/* add tags to an event. Note that we must copy them, as
+			 * the pdag may be shared between threads.
+			 */
+			struct json_object *tags;
+			CHKN(tags = copyTags(endNode->tags));
+			json_object_object_add(*json_p, "event.tags", tags);
+			if(endNode->annot != NULL)
+				CHKR(ln_annotateFields(*json_p, endNode->annot));
+		}
+		if(ctx->opts & LN_CTXOPT_ADD_ORIGINALMSG) {
+			/* originalmsg must be kept outside of metadata for 
+			 * backward compatibility reasons.
+			 */
+			json_object_object_add(*json_p, ORIGINAL_MSG_KEY,
+				json_object_new_string_len(str, strLen));
+		}
+		addRuleMetadata(npb, *json_p, endNode);
+		r = 0;
+		if(ruleStatsSampling != 0)
+			ruleStatsRecord(ctx, npb->tstats, endNode->stats_id, tBegin);
+	} else {
+		addUnparsedField(str, strLen, npb->parsedTo, *json_p);
+		if(npb->budgetExceeded)
+			budgetRecordExceeded(npb, *json_p);
+		if(ruleStatsSampling != 0)
+			ruleStatsRecord(ctx, npb->tstats, 0, tBegin);
+	}
 
+done:	return r;
+}
 
-void
-ln_genDotPDAGGraph(struct ln_pdag *dag, es_str_t **str)
+int
+ln_normalize(ln_ctx ctx, const char *str, const size_t strLen, struct json_object **json_p)
 {
-	ln_pdagClearVisited(dag->ctx);
-	es_addBufConstcstr(str, "digraph pdag {\n");
-	ln_genDotPDAGGraphRec(dag, str);
-	es_addBufConstcstr(str, "}\n");
+	int r;
+	npb_t npb;
+	struct ln_rcu_reader *rd;
+
+	/* from here on, ctx is the current generation of the rule base */
+	if((ctx = ln_ctxReadLock(ctx, &rd)) == NULL) {
+		r = LN_NOMEM;
+		goto done;
+	}
+	/* old cruft */
+	if(ctx->version == 1) {
+		r = ln_v1_normalize(ctx, str, strLen, json_p);
+		goto done;
+	}
+	/* end old cruft */
+
+	if((r = normalizeSetup(&npb, ctx)) == 0)
+		r = normalizeMsg(&npb, str, strLen, json_p);
+	normalizeTeardown(&npb);
+done:
+	ln_ctxReadUnlock(rd);
+	return r;
 }
 
-/**
- * recursive handler for statistics DOT graph generator.
+/* Compute the order in which a batch is processed. Messages are
+ * grouped by their first byte (stable counting sort), so that
+ * messages taking the same path through the upper levels of the
+ * pdag are processed back-to-back while those nodes, their parser
+ * tables and dispatch indexes are still in cache.
+ * Returns NULL if the batch is processed in submission order.
  */
-static void
-ln_genStatsDotPDAGGraphRec(struct ln_pdag *dag, FILE *const __restrict__ fp)
+static size_t *
+batchOrder(const size_t nmsgs, const char *const *const strs, const size_t *const lens)
 {
-	if(dag->flags.visited)
-		return; /* already processed this subpart */
-	dag->flags.visited = 1;
-	fprintf(fp, "l%p [ label=\"%u:%u\"", dag,
-		dag->stats.called, dag->stats.backtracked);
+	size_t *order = NULL;
+	size_t start[257];
 
-	if(isLeaf(dag)) {
-		fprintf(fp, " style=\"bold\"");
+	if(nmsgs < 3)
+		goto done;
+	memset(start, 0, sizeof(start));
+	for(size_t i = 0 ; i < nmsgs ; ++i) {
+		const unsigned char c = (lens[i] == 0) ? 0 : (unsigned char) strs[i][0];
+		++start[c + 1];
 	}
-	fprintf(fp, "]\n");
+	for(int c = 1 ; c < 257 ; ++c)
+		start[c] += start[c - 1];
+	if((order = malloc(nmsgs * sizeof(size_t))) == NULL)
+		goto done; /* not fatal, we just loose the reordering */
+	for(size_t i = 0 ; i < nmsgs ; ++i) {
+		const unsigned char c = (lens[i] == 0) ? 0 : (unsigned char) strs[i][0];
+		order[start[c]++] = i;
+	}
+done:	return order;
+}
 
-	/* display field subdags */
+int
+ln_normalizeBatch(ln_ctx ctx, const size_t nmsgs, const char *const *strs,
+	const size_t *lens, struct json_object **json_p, int *results)
+{
+	int r = 0;
+	int rMsg;
+	size_t firstFail = nmsgs;
+	size_t *order = NULL;
+	npb_t npb;
+	int bSetup = 0;
+	struct ln_rcu_reader *rd;
+
+	/* the whole batch is processed by the same rule base generation */
+	CHKN(ctx = ln_ctxReadLock(ctx, &rd));
+	if(ctx->version != 1) {
+		bSetup = 1;
+		CHKR(normalizeSetup(&npb, ctx));
+		order = batchOrder(nmsgs, strs, lens);
+	}
 
-	for(int i = 0 ; i < dag->nparsers ; ++i) {
-		ln_parser_t *const prs = dag->parsers+i;
-		if(prs->node->stats.called == 0)
-			continue;
-		fprintf(fp, "l%p -> l%p [label=\"", dag, prs->node);
-		if(prs->prsid == PRS_LITERAL) {
-			for(const char *p = ((struct data_Literal*)prs->parser_data)->lit ; *p ; ++p) {
-				if(*p != '\\' && *p != '"')
-					fputc(*p, fp);
-			}
+	for(size_t n = 0 ; n < nmsgs ; ++n) {
+		const size_t i = (order == NULL) ? n : order[n];
+		if(ctx->version == 1) {
+			rMsg = ln_v1_normalize(ctx, strs[i], lens[i], &json_p[i]);
 		} else {
-			fprintf(fp, "%s", parserName(prs->prsid));
+			rMsg = normalizeMsg(&npb, strs[i], lens[i], &json_p[i]);
+		}
+		if(results != NULL)
+			results[i] = rMsg;
+		if(rMsg != 0 && i < firstFail) {
+			firstFail = i;
+			r = rMsg;
 		}
-		fprintf(fp, "\" style=\"dotted\"]\n");
-		ln_genStatsDotPDAGGraphRec(prs->node, fp);
 	}
-}
-
-
-static void
-ln_genStatsDotPDAGGraph(struct ln_pdag *dag, FILE *const fp)
-{
-	ln_pdagClearVisited(dag->ctx);
-	fprintf(fp, "digraph pdag {\n");
-	ln_genStatsDotPDAGGraphRec(dag, fp);
-	fprintf(fp, "}\n");
-}
 
-void
-ln_fullPDagStatsDOT(ln_ctx ctx, FILE *const fp)
-{
-	ln_genStatsDotPDAGGraph(ctx->pdag, fp);
+done:
+	if(bSetup)
+		normalizeTeardown(&npb);
+	ln_ctxReadUnlock(rd);
+	free(order);
+	return r;
 }
 
 
-static inline int
-addOriginalMsg(const char *str, const size_t strLen, struct json_object *const json)
-{
-	int r = 1;
-	struct json_object *value;
+/* span mode */
 
-	value = json_object_new_string_len(str, strLen);
-	if (value == NULL) {
-		goto done;
-	}
-	json_object_object_add(json, ORIGINAL_MSG_KEY, value);
-	r = 0;
-done:
-	return r;
+ln_spans
+ln_newSpans(void)
+{
+	return calloc(1, sizeof(struct ln_spans_s));
 }
 
-static char *
-strrev(char *const __restrict__ str)
+void
+ln_spansSetRefTime(ln_spans spans, const time_t refTime)
 {
-    char ch;
-    size_t i = strlen(str)-1,j=0;
-    while(i>j)
-    {
-        ch = str[i];
-        str[i]= str[j];
-        str[j] = ch;
-        i--;
-        j++;
-    }
-    return str;
+	spans->refTime = refTime;
 }
 
-/* note: "originalmsg" is NOT added as metadata in order to keep
- * backwards compatible.
+void
+ln_deleteSpans(ln_spans spans)
+{
+	if(spans == NULL)
+		return;
+	free(spans->spans);
+	free(spans->fields);
+	if(spans->rule != NULL)
+		es_deleteStr(spans->rule);
+	if(spans->ctx != NULL)
+		ln_ctxRelease(spans->ctx);
+	free(spans);
+}
+
+/* compute the parent of each span and build the index of top-level
+ * named fields. Custom types record their spans before their own one,
+ * so nested types have claimed their children before the outer type
+ * is processed.
  */
-static inline void
-addRuleMetadata(npb_t *const __restrict__ npb,
-	struct json_object *const json,
-	struct ln_pdag *const __restrict__ endNode)
+static int
+spansIndexFields(struct ln_spans_s *const spans)
 {
-	ln_ctx ctx = npb->ctx;
-	struct json_object *meta = NULL;
-	struct json_object *meta_rule = NULL;
-	struct json_object *value;
+	int r = 0;
+	unsigned i, j;
 
-	if(ctx->opts & LN_CTXOPT_ADD_RULE) { /* matching rule mockup */
-		if(meta_rule == NULL)
-			meta_rule = json_object_new_object();
-		char *cstr = strrev(es_str2cstr(npb->rule, NULL));
-		json_object_object_add(meta_rule, RULE_MOCKUP_KEY,
-			json_object_new_string(cstr));
-		free(cstr);
+	for(i = 0 ; i < spans->nspans ; ++i) {
+		const struct ln_span *const span = spans->spans + i;
+		for(j = span->firstChild ; j < span->firstChild + span->nChildren ; ++j) {
+			if(spans->spans[j].parent == 0)
+				spans->spans[j].parent = i + 1;
+		}
 	}
 
-	if(ctx->opts & LN_CTXOPT_ADD_RULE_LOCATION) {
-		if(meta_rule == NULL)
-			meta_rule = json_object_new_object();
-		struct json_object *const location = json_object_new_object();
-		value = json_object_new_string(endNode->rb_file);
-		json_object_object_add(location, "file", value);
-		value = json_object_new_int((int)endNode->rb_lineno);
-		json_object_object_add(location, "line", value);
-		json_object_object_add(meta_rule, RULE_LOCATION_KEY, location);
+	spans->nfields = 0;
+	for(i = 0 ; i < spans->nspans ; ++i) {
+		const struct ln_span *const span = spans->spans + i;
+		if(span->parent != 0 || span->prs->name == NULL)
+			continue;
+		if(spans->nfields == spans->maxfields) {
+			const unsigned newmax = (spans->maxfields == 0) ? 16 : 2 * spans->maxfields;
+			unsigned *const newfields = realloc(spans->fields,
+				newmax * sizeof(unsigned));
+			CHKN(newfields);
+			spans->fields = newfields;
+			spans->maxfields = newmax;
+		}
+		spans->fields[spans->nfields++] = i;
 	}
+done:	return r;
+}
 
-	if(meta_rule != NULL) {
-		if(meta == NULL)
-			meta = json_object_new_object();
-		json_object_object_add(meta, META_RULE_KEY, meta_rule);
+int
+ln_normalizeSpans(ln_ctx ctx, const char *str, const size_t strLen, ln_spans spans)
+{
+	int r;
+	npb_t npb;
+	struct ln_pdag *endNode = NULL;
+	unsigned ruleStatsSampling;
+	uint64_t tBegin = 0;
+	struct ln_rcu_reader *rd;
+
+	memset(&npb, 0, sizeof(npb));
+	CHKN(ctx = ln_ctxReadLock(ctx, &rd));
+	if(spans->ctx != ctx) {
+		/* the spans refer to the pdag, so the arena keeps its
+		 * generation alive until it is reused or deleted.
+		 */
+		__atomic_add_fetch(&ctx->refs, 1, __ATOMIC_RELAXED);
+		if(spans->ctx != NULL)
+			ln_ctxRelease(spans->ctx);
+		spans->ctx = ctx;
+	}
+	ruleStatsSampling = __atomic_load_n(&ctx->ruleStatsSampling, __ATOMIC_RELAXED);
+	spans->str = str;
+	spans->strLen = strLen;
+	spans->parsedTo = 0;
+	spans->endNode = NULL;
+	spans->budgetExceeded = 0;
+	spans->nspans = 0;
+	spans->nfields = 0;
+	if(ctx->version == 1) {
+		r = LN_BADCONFIG; /* not supported by old engine */
+		goto done;
 	}
 
-#ifdef	ADVANCED_STATS
-	/* complete execution path */
-	if(ctx->opts & LN_CTXOPT_ADD_EXEC_PATH) {
-		if(meta == NULL)
-			meta = json_object_new_object();
-		char hdr[128];
-		const size_t lenhdr 
-		  = snprintf(hdr, sizeof(hdr), "[PATHLEN:%d, PARSER CALLS gen:%d, literal:%d]",
-			     npb->astats.pathlen, npb->astats.parser_calls,
-			     npb->astats.lit_parser_calls);
-		es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
-		char * cstr = es_str2cstr(npb->astats.exec_path, NULL);
-		value = json_object_new_string(cstr);
-		if (value != NULL) {
-			json_object_object_add(meta, EXEC_PATH_KEY, value);
+	npb.ctx = ctx;
+	npb.str = str;
+	npb.strLen = strLen;
+	npb.spans = spans;
+	CHKN(npb.tstats = pdagThreadStats(ctx));
+	parseWrkSetup(&npb);
+	if(ctx->opts & LN_CTXOPT_MEMOIZE) {
+		CHKR(memoSetup(&npb));
+		memoReset(npb.memo);
+	}
+	budgetStart(&npb);
+	if(ruleStatsSampling != 0 && ruleStatsSample(npb.tstats, ruleStatsSampling))
+		tBegin = ruleStatsNow();
+	if(spans->rule != NULL)
+		es_emptyStr(spans->rule);
+	npb.rule = spans->rule; /* allocated on first use */
+#	ifdef ADVANCED_STATS
+	CHKN(npb.astats.exec_path = es_newStr(1024));
+#	endif
+
+	r = ln_normalizeRec(&npb, ctx->pdag, 0, 0, NULL, &endNode);
+	spans->rule = npb.rule;
+#	ifdef ADVANCED_STATS
+	advstatsRecord(&npb, r, endNode);
+#	endif
+
+	if(r == 0) {
+		spans->endNode = endNode;
+		CHKR(spansIndexFields(spans));
+	} else {
+		spans->parsedTo = npb.parsedTo;
+		spans->nspans = 0;
+		if(npb.budgetExceeded) {
+			spans->budgetExceeded = 1;
+			budgetRecordExceeded(&npb, NULL);
 		}
-		free(cstr);
 	}
-#endif
+	if(ruleStatsSampling != 0) {
+		ruleStatsRecord(ctx, npb.tstats, (r == 0 && endNode->flags.isTerminal)
+			? endNode->stats_id : 0, tBegin);
+	}
 
-	if(meta != NULL)
-		json_object_object_add(json, META_KEY, meta);
+done:
+	parseWrkFree(&npb.ownWrk);
+	memoTeardown(&npb);
+#	ifdef ADVANCED_STATS
+	if(npb.astats.exec_path != NULL)
+		es_deleteStr(npb.astats.exec_path);
+#	endif
+	ln_ctxReadUnlock(rd);
+	return r;
 }
 
-
-/**
- * add unparsed string to event.
+/* build the JSON value of a span, exactly as ln_normalize() would
+ * have done it: by calling the parser again (or, for custom types,
+ * by building the value from the children).
  */
-static inline int
-addUnparsedField(const char *str, const size_t strLen, const size_t offs, struct json_object *json)
+static int
+spanValue(npb_t *const npb,
+	struct ln_spans_s *const spans,
+	const unsigned idx,
+	struct json_object **value)
 {
-	int r = 1;
-	struct json_object *value;
+	int r = 0;
+	const struct ln_span *const span = spans->spans + idx;
+	const ln_parser_t *const prs = span->prs;
+	struct json_object *child;
 
-	CHKR(addOriginalMsg(str, strLen, json));
-	
-	value = json_object_new_string(str + offs);
-	if (value == NULL) {
-		goto done;
+	*value = NULL;
+	if(prs->prsid == PRS_CUSTOM_TYPE) {
+		CHKN(*value = json_object_new_object());
+		for(unsigned i = span->firstChild ; i < span->firstChild + span->nChildren ; ++i) {
+			if(spans->spans[i].parent != idx + 1 || spans->spans[i].prs->name == NULL)
+				continue;
+			CHKR(spanValue(npb, spans, i, &child));
+			CHKR(fixJSON(spans->ctx->pdag, &child, *value, spans->spans[i].prs));
+		}
+	} else {
+		size_t offs = span->offs;
+		size_t parsed;
+		r = parser_lookup_table[prs->prsid].parser(npb, &offs,
+			prs->parser_data, &parsed, value);
 	}
-	json_object_object_add(json, UNPARSED_DATA_KEY, value);
 
-	r = 0;
 done:
+	if(r != 0 && *value != NULL) {
+		json_object_put(*value);
+		*value = NULL;
+	}
 	return r;
 }
 
+/* set up a npb for building values from spans */
+static int
+spansReplaySetup(npb_t *const npb, struct ln_spans_s *const spans)
+{
+	int r;
+	CHKR(normalizeSetup(npb, spans->ctx));
+	npb->str = spans->str;
+	npb->strLen = spans->strLen;
+done:	return r;
+}
 
-/* Do some fixup to the json that we cannot do on a lower layer */
+/* find a top-level field by name, returns span index or -1 */
 static int
-fixJSON(struct ln_pdag *dag,
-	struct json_object **value,
-	struct json_object *json,
-	const ln_parser_t *const prs)
+spansFindField(struct ln_spans_s *const spans, const char *const name)
+{
+	for(unsigned i = 0 ; i < spans->nfields ; ++i) {
+		if(!strcmp(spans->spans[spans->fields[i]].prs->name, name))
+			return (int) spans->fields[i];
+	}
+	return -1;
+}
 
+unsigned
+ln_spansNumFields(ln_spans spans)
 {
-	int r = LN_WRONGPARSER;
+	return spans->nfields;
+}
 
-	if(prs->name ==  NULL) {
-		if (*value != NULL) {
-			/* Free the unneeded value */
-			json_object_put(*value);
-		}
-	} else if(prs->name[0] == '.' && prs->name[1] == '\0') {
-		if(json_object_get_type(*value) == json_type_object) {
-			struct json_object_iterator it = json_object_iter_begin(*value);
-			struct json_object_iterator itEnd = json_object_iter_end(*value);
-			while (!json_object_iter_equal(&it, &itEnd)) {
-				struct json_object *const val = json_object_iter_peek_value(&it);
-				json_object_get(val);
-				json_object_object_add(json, json_object_iter_peek_name(&it), val);
-				json_object_iter_next(&it);
-			}
-			json_object_put(*value);
-		} else {
-			LN_DBGPRINTF(dag->ctx, "field name is '.', but json type is %s",
-				json_type_to_name(json_object_get_type(*value)));
-			json_object_object_add_ex(json, prs->name, *value,
-				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
-		}
-	} else {
-		int isDotDot = 0;
-		struct json_object *valDotDot = NULL;
-		if(json_object_get_type(*value) == json_type_object) {
-			/* TODO: this needs to be speeded up by just checking the first
-			 * member and ensuring there is only one member. This requires
-			 * extensions to libfastjson.
-			 */
-			int nSubobj = 0;
-			struct json_object_iterator it = json_object_iter_begin(*value);
-			struct json_object_iterator itEnd = json_object_iter_end(*value);
-			while (!json_object_iter_equal(&it, &itEnd)) {
-				++nSubobj;
-				const char *key = json_object_iter_peek_name(&it);
-				if(key[0] == '.' && key[1] == '.' && key[2] == '\0') {
-					isDotDot = 1;
-					valDotDot = json_object_iter_peek_value(&it);
-				} else {
-					isDotDot = 0;
-				}
-				json_object_iter_next(&it);
-			}
-			if(nSubobj != 1)
-				isDotDot = 0;
-		}
-		if(isDotDot) {
-			LN_DBGPRINTF(dag->ctx, "subordinate field name is '..', combining");
-			json_object_get(valDotDot);
-			json_object_put(*value);
-			json_object_object_add_ex(json, prs->name, valDotDot,
-				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
-		} else {
-			json_object_object_add_ex(json, prs->name, *value,
-				JSON_C_OBJECT_ADD_KEY_IS_NEW|JSON_C_OBJECT_KEY_IS_CONSTANT);
-		}
+int
+ln_spansGetFieldByIdx(ln_spans spans, const unsigned idx,
+	const char **name, const char **val, size_t *lenVal)
+{
+	if(idx >= spans->nfields)
+		return -1;
+	const struct ln_span *const span = spans->spans + spans->fields[idx];
+	*name = span->prs->name;
+	*val = spans->str + span->offs;
+	*lenVal = span->len;
+	return 0;
+}
+
+int
+ln_spansGetField(ln_spans spans, const char *name, const char **val, size_t *lenVal)
+{
+	const int i = spansFindField(spans, name);
+	if(i == -1)
+		return -1;
+	*val = spans->str + spans->spans[i].offs;
+	*lenVal = spans->spans[i].len;
+	return 0;
+}
+
+int
+ln_spansFieldToJSON(ln_spans spans, const char *name, struct json_object **value)
+{
+	int r;
+	npb_t npb;
+	const int i = spansFindField(spans, name);
+
+	memset(&npb, 0, sizeof(npb));
+	if(i == -1) {
+		r = -1;
+		goto done;
 	}
-	r = 0;
+	CHKR(spansReplaySetup(&npb, spans));
+	r = spanValue(&npb, spans, (unsigned) i, value);
+done:
+	normalizeTeardown(&npb);
 	return r;
 }
 
-// TODO: streamline prototype when done with changes
-
+/* convert a span to its typed value, if the parser supports it */
 static int
-tryParser(npb_t *const __restrict__ npb,
-	struct ln_pdag *dag,
-	size_t *offs,
-	size_t *const __restrict__ pParsed,
-	struct json_object **value,
-	const ln_parser_t *const prs
-	)
+spanTypedValue(struct ln_spans_s *const spans, const unsigned idx,
+	struct ln_value *const val)
+{
+	const struct ln_span *const span = spans->spans + idx;
+	const ln_parser_t *const prs = span->prs;
+
+	if(prs->prsid == PRS_CUSTOM_TYPE || parser_lookup_table[prs->prsid].value == NULL)
+		return LN_WRONGPARSER;
+	return parser_lookup_table[prs->prsid].value(spans->str + span->offs,
+		span->len, prs->parser_data,
+		(spans->refTime == 0) ? time(NULL) : spans->refTime, val);
+}
+
+int
+ln_spansGetValue(ln_spans spans, const char *name, struct ln_value *val)
+{
+	const int i = spansFindField(spans, name);
+	if(i == -1)
+		return -1;
+	return spanTypedValue(spans, (unsigned) i, val);
+}
+
+int
+ln_spansGetValueByIdx(ln_spans spans, const unsigned idx, struct ln_value *val)
+{
+	if(idx >= spans->nfields)
+		return -1;
+	return spanTypedValue(spans, spans->fields[idx], val);
+}
+
+int
+ln_spansToJSON(ln_spans spans, struct json_object **json_p)
 {
 	int r;
-	struct ln_pdag *endNode = NULL;
-	size_t parsedTo = npb->parsedTo;
-#	ifdef	ADVANCED_STATS
-	char hdr[16];
-	const size_t lenhdr 
-	  = snprintf(hdr, sizeof(hdr), "%d:", npb->astats.recursion_level);
-	es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
-	if(prs->prsid == PRS_LITERAL) {
-		es_addChar(&npb->astats.exec_path, '\'');
-		es_addBuf(&npb->astats.exec_path,
-			  ln_DataForDisplayLiteral(dag->ctx,
-				prs->parser_data),
-			  strlen(ln_DataForDisplayLiteral(dag->ctx,
-				prs->parser_data))
-			 );
-		es_addChar(&npb->astats.exec_path, '\'');
-	} else if(parser_lookup_table[prs->prsid].parser
-			== ln_v2_parseCharTo) {
-		es_addBuf(&npb->astats.exec_path,
-			  ln_DataForDisplayCharTo(dag->ctx,
-				prs->parser_data),
-			  strlen(ln_DataForDisplayCharTo(dag->ctx,
-				prs->parser_data))
-			 );
-	} else {
-		es_addBuf(&npb->astats.exec_path,
-			parserName(prs->prsid),
-			strlen(parserName(prs->prsid)) );
-	}
-	es_addChar(&npb->astats.exec_path, ',');
-#	endif
+	npb_t npb;
+	struct json_object *value;
+	ln_ctx ctx = spans->ctx;
+	struct ln_pdag *const endNode = spans->endNode;
 
-	if(prs->prsid == PRS_CUSTOM_TYPE) {
-		if(*value == NULL)
-			*value = json_object_new_object();
-		LN_DBGPRINTF(dag->ctx, "calling custom parser '%s'", prs->custType->name);
-		r = ln_normalizeRec(npb, prs->custType->pdag, *offs, 1, *value, &endNode);
-		LN_DBGPRINTF(dag->ctx, "called CUSTOM PARSER '%s', result %d, "
-			"offs %zd, *pParsed %zd", prs->custType->name, r, *offs, *pParsed);
-		*pParsed = npb->parsedTo - *offs;
-		#ifdef	ADVANCED_STATS
-		es_addBuf(&npb->astats.exec_path, hdr, lenhdr);
-		es_addBuf(&npb->astats.exec_path, "[R:USR],", 8); 
-		#endif
-	} else {
-		r = parser_lookup_table[prs->prsid].parser(npb,
-			offs, prs->parser_data, pParsed, (prs->name == NULL) ? NULL : value);
+	memset(&npb, 0, sizeof(npb));
+	if(ctx == NULL) { /* nothing normalized yet */
+		r = -1;
+		goto done;
+	}
+	CHKR(spansReplaySetup(&npb, spans));
+	if(*json_p == NULL) {
+		CHKN(*json_p = json_object_new_object());
 	}
-	LN_DBGPRINTF(npb->ctx, "parser lookup returns %d, pParsed %zu", r, *pParsed);
-	npb->parsedTo = parsedTo;
 
-#ifdef	ADVANCED_STATS
-	++advstats_parsers_called;
-	++npb->astats.parser_calls;
-	if(prs->prsid == PRS_LITERAL)
-		++npb->astats.lit_parser_calls;
-	if(r == 0)
-		++advstats_parsers_success;
-	if(prs->prsid != PRS_CUSTOM_TYPE) {
-		++parser_lookup_table[prs->prsid].called;
-		if(r == 0)
-			++parser_lookup_table[prs->prsid].success;
+	if(endNode == NULL) {
+		r = addUnparsedField(spans->str, spans->strLen, spans->parsedTo, *json_p);
+		if(r == 0 && spans->budgetExceeded) {
+			struct json_object *const meta = json_object_new_object();
+			json_object_object_add(meta, BUDGET_EXCEEDED_KEY, json_object_new_boolean(1));
+			json_object_object_add(*json_p, META_KEY, meta);
+		}
+		goto done;
 	}
-#endif
+
+	for(unsigned i = 0 ; i < spans->nfields ; ++i) {
+		const struct ln_span *const span = spans->spans + spans->fields[i];
+		CHKR(spanValue(&npb, spans, spans->fields[i], &value));
+		CHKR(fixJSON(ctx->pdag, &value, *json_p, span->prs));
+	}
+
+	if(endNode->tags != NULL) {
+		struct json_object *tags;
+		CHKN(tags = copyTags(endNode->tags));
+		json_object_object_add(*json_p, "event.tags", tags);
+		if(endNode->annot != NULL)
+			CHKR(ln_annotateFields(*json_p, endNode->annot));
+	}
+	if(ctx->opts & LN_CTXOPT_ADD_ORIGINALMSG) {
+		json_object_object_add(*json_p, ORIGINAL_MSG_KEY,
+			json_object_new_string_len(spans->str, spans->strLen));
+	}
+	/* the mockup was recorded while normalizing */
+	es_str_t *const scratch = npb.rule;
+	npb.rule = spans->rule;
+	addRuleMetadata(&npb, *json_p, endNode);
+	npb.rule = scratch;
+
+done:
+	normalizeTeardown(&npb);
 	return r;
 }
 
+/* Direct JSON text output, see ln_spansToJSONStr(). The text must be
+ * exactly what json_object_to_json_string() generates for the event
+ * ln_spansToJSON() builds. Fields whose parser value is the matched
+ * text (TEXTVAL_*) are copied straight from the message; all others
+ * are built as JSON object and serialized by the JSON library.
+ */
+struct jsonw {
+	char *buf;
+	size_t size;
+	size_t len;
+};
 
-static void
-add_str_reversed(npb_t *const __restrict__ npb,
-	const char *const __restrict__ str,
-	const size_t len)
+static int
+jsonwGrow(struct jsonw *const w, const size_t needed)
 {
-	ssize_t i;
-	for(i = len - 1 ; i >= 0 ; --i) {
-		es_addChar(&npb->rule, str[i]);
-	}
+	size_t newSize = (w->size == 0) ? 1024 : w->size;
+	char *newBuf;
+
+	while(newSize < w->len + needed)
+		newSize *= 2;
+	if((newBuf = realloc(w->buf, newSize)) == NULL)
+		return LN_NOMEM;
+	w->buf = newBuf;
+	w->size = newSize;
+	return 0;
+}
+
+static inline int
+jsonwAdd(struct jsonw *const w, const char *const buf, const size_t len)
+{
+	int r = 0;
+	if(w->len + len >= w->size) /* keep room for the terminating NUL */
+		CHKR(jsonwGrow(w, len + 1));
+	memcpy(w->buf + w->len, buf, len);
+	w->len += len;
+done:	return r;
 }
 
+#define jsonwAddConst(w, str) jsonwAdd(w, str, sizeof(str)-1)
 
-/* Add the current parser to the mockup rule.
- * Note: we add reversed strings, because we can call this
- * function effectively only when walking upwards the tree.
- * This means deepest entries come first. We solve this somewhat
- * elegantly by reversion strings, and then reversion the string
- * once more when we emit it, so that we get the right order.
+/* characters that need escaping in JSON strings (as libfastjson does it) */
+static const unsigned char jsonEscTab[256] = {
+	['\0'] = 1, [0x01] = 1, [0x02] = 1, [0x03] = 1, [0x04] = 1, [0x05] = 1,
+	[0x06] = 1, [0x07] = 1, ['\b'] = 1, ['\t'] = 1, ['\n'] = 1, [0x0b] = 1,
+	['\f'] = 1, ['\r'] = 1, [0x0e] = 1, [0x0f] = 1, [0x10] = 1, [0x11] = 1,
+	[0x12] = 1, [0x13] = 1, [0x14] = 1, [0x15] = 1, [0x16] = 1, [0x17] = 1,
+	[0x18] = 1, [0x19] = 1, [0x1a] = 1, [0x1b] = 1, [0x1c] = 1, [0x1d] = 1,
+	[0x1e] = 1, [0x1f] = 1, ['"'] = 1, ['\\'] = 1, ['/'] = 1
+};
+
+/* add a JSON string (including quotes). Runs of characters that need
+ * no escaping are copied as a block.
  */
-static inline void
-add_rule_to_mockup(npb_t *const __restrict__ npb,
-	const ln_parser_t *const __restrict__ prs)
+static int
+jsonwAddString(struct jsonw *const w, const char *const str, const size_t len)
 {
-	if(prs->prsid == PRS_LITERAL) {
-		const char *const val = 
-			  ln_DataForDisplayLiteral(npb->ctx,
-				prs->parser_data);
-		add_str_reversed(npb, val, strlen(val));
-	} else {
-		/* note: name/value order must also be reversed! */
-		es_addChar(&npb->rule, '%');
-		add_str_reversed(npb,
-			parserName(prs->prsid),
-			strlen(parserName(prs->prsid)) );
-		es_addChar(&npb->rule, ':');
-		if(prs->name == NULL) {
-			es_addChar(&npb->rule, '-');
-		} else {
-			add_str_reversed(npb, prs->name, strlen(prs->name));
+	int r;
+	size_t run = 0;
+	char esc[7];
+
+	CHKR(jsonwAddConst(w, "\""));
+	for(size_t i = 0 ; i < len ; ++i) {
+		const unsigned char c = str[i];
+		if(!jsonEscTab[c])
+			continue;
+		CHKR(jsonwAdd(w, str + run, i - run));
+		run = i + 1;
+		switch(c) {
+		case '\b': CHKR(jsonwAddConst(w, "\\b")); break;
+		case '\t': CHKR(jsonwAddConst(w, "\\t")); break;
+		case '\n': CHKR(jsonwAddConst(w, "\\n")); break;
+		case '\f': CHKR(jsonwAddConst(w, "\\f")); break;
+		case '\r': CHKR(jsonwAddConst(w, "\\r")); break;
+		case '"':  CHKR(jsonwAddConst(w, "\\\"")); break;
+		case '\\': CHKR(jsonwAddConst(w, "\\\\")); break;
+		case '/':  CHKR(jsonwAddConst(w, "\\/")); break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			CHKR(jsonwAdd(w, esc, 6));
+			break;
 		}
-		es_addChar(&npb->rule, '%');
 	}
+	CHKR(jsonwAdd(w, str + run, len - run));
+	CHKR(jsonwAddConst(w, "\""));
+done:	return r;
 }
 
-/**
- * Recursive step of the normalizer. It walks the parse dag and calls itself
- * recursively when this is appropriate. It also implements backtracking in
- * those (hopefully rare) cases where it is required.
- *
- * @param[in] dag current tree to process
- * @param[in] string string to be matched against (the to-be-normalized data)
- * @param[in] strLen length of the to-be-matched string
- * @param[in] offs start position in input data
- * @param[out] pPrasedTo ptr to position up to which the the parsing succed in max
- * @param[in/out] json ... that is being created during normalization
- * @param[out] endNode if a match was found, this is the matching node (undefined otherwise)
- *
- * @return regular liblognorm error code (0->OK, something else->error)
- * TODO: can we use parameter block to prevent pushing params to the stack?
- */
-int
-ln_normalizeRec(npb_t *const __restrict__ npb,
-	struct ln_pdag *dag,
-	const size_t offs,
-	const int bPartialMatch,
-	struct json_object *json,
-	struct ln_pdag **endNode
-	)
+/* add "name": as member name */
+static inline int
+jsonwAddName(struct jsonw *const w, const char *const name, const int bFirst)
 {
-	int r = LN_WRONGPARSER;
-	int localR;
-	size_t i;
-	size_t iprs;
-	size_t parsedTo = npb->parsedTo;
-	size_t parsed = 0;
-	struct json_object *value;
-	
-LN_DBGPRINTF(dag->ctx, "%zu: enter parser, dag node %p, json %p", offs, dag, json);
+	int r;
+	if(!bFirst)
+		CHKR(jsonwAddConst(w, ","));
+	CHKR(jsonwAddConst(w, " "));
+	CHKR(jsonwAddString(w, name, strlen(name)));
+	CHKR(jsonwAddConst(w, ": "));
+done:	return r;
+}
 
-	++dag->stats.called;
-#ifdef	ADVANCED_STATS
-	++npb->astats.pathlen;
-	++npb->astats.recursion_level;
-#endif
+/* add an object built by the JSON library */
+static inline int
+jsonwAddObject(struct jsonw *const w, struct json_object *const json)
+{
+	const char *const str = json_object_to_json_string(json);
+	return (str == NULL) ? LN_NOMEM : jsonwAdd(w, str, strlen(str));
+}
 
-	/* now try the parsers */
-	for(iprs = 0 ; iprs < dag->nparsers && r != 0 ; ++iprs) {
-		const ln_parser_t *const prs = dag->parsers + iprs;
-		if(dag->ctx->debug) {
-			LN_DBGPRINTF(dag->ctx, "%zu/%d:trying '%s' parser for field '%s', "
-				     "data '%s'",
-					offs, bPartialMatch, parserName(prs->prsid), prs->name,
-					(prs->prsid == PRS_LITERAL)
-					 ? ln_DataForDisplayLiteral(dag->ctx, prs->parser_data)
-				 	 : "UNKNOWN");
+/* can the event be written directly? Else the JSON object must be
+ * built, because the library would merge or replace members.
+ */
+static int
+spansDirectJSONStr(struct ln_spans_s *const spans)
+{
+	const ln_ctx ctx = spans->ctx;
+	struct ln_pdag *const endNode = spans->endNode;
+
+#	ifdef ADVANCED_STATS
+	if(ctx->opts & LN_CTXOPT_ADD_EXEC_PATH)
+		return 0;
+#	endif
+	if(endNode == NULL)
+		return 1;
+	if((ctx->opts & LN_CTXOPT_ADD_RULE_LOCATION) && endNode->rb_file == NULL)
+		return 0;
+	for(unsigned i = 0 ; i < spans->nfields ; ++i) {
+		const char *const name = spans->spans[spans->fields[i]].prs->name;
+		if(   (name[0] == '.' && name[1] == '\0')
+		   || !strcmp(name, "event.tags")
+		   || !strcmp(name, ORIGINAL_MSG_KEY)
+		   || !strcmp(name, META_KEY))
+			return 0;
+		if(endNode->annot == NULL)
+			continue;
+		for(int j = 0 ; j < endNode->annot->nfields ; ++j) {
+			if(!strcmp(name, endNode->annot->fields[j].name))
+				return 0;
 		}
-		i = offs;
-		value = NULL;
-		localR = tryParser(npb, dag, &i, &parsed, &value, prs);
-		if(localR == 0) {
-			parsedTo = i + parsed;
-			/* potential hit, need to verify */
-			LN_DBGPRINTF(dag->ctx, "%zu: potential hit, trying subtree %p",
-				offs, prs->node);
-			r = ln_normalizeRec(npb, prs->node, parsedTo,
-					    bPartialMatch, json, endNode);
-			LN_DBGPRINTF(dag->ctx, "%zu: subtree returns %d, parsedTo %zu", offs, r, parsedTo);
-			if(r == 0) {
-				LN_DBGPRINTF(dag->ctx, "%zu: parser matches at %zu", offs, i);
-				CHKR(fixJSON(dag, &value, json, prs));
-				if(npb->ctx->opts & LN_CTXOPT_ADD_RULE) {
-					add_rule_to_mockup(npb, prs);
-				}
-			} else {
-				++dag->stats.backtracked;
-				#ifdef	ADVANCED_STATS
-					++npb->astats.backtracked;
-					es_addBuf(&npb->astats.exec_path, "[B]", 3);
-				#endif
-				LN_DBGPRINTF(dag->ctx, "%zu nonmatch, backtracking required, parsed to=%zu",
-						offs, parsedTo);
-				if (value != NULL) { /* Free the value if it was created */
-					json_object_put(value);
-				}
-			}
+	}
+	if(endNode->annot != NULL) {
+		for(int j = 0 ; j < endNode->annot->nfields ; ++j) {
+			const char *const name = endNode->annot->fields[j].name;
+			if(   !strcmp(name, "event.tags")
+			   || !strcmp(name, ORIGINAL_MSG_KEY)
+			   || !strcmp(name, META_KEY))
+				return 0;
 		}
-		/* did we have a longer parser --> then update */
-		if(parsedTo > npb->parsedTo)
-			npb->parsedTo = parsedTo;
-		LN_DBGPRINTF(dag->ctx, "parsedTo %zu, *pParsedTo %zu", parsedTo, npb->parsedTo);
 	}
+	return 1;
+}
 
-LN_DBGPRINTF(dag->ctx, "offs %zu, strLen %zu, isTerm %d", offs, npb->strLen, dag->flags.isTerminal);
-	if(dag->flags.isTerminal && (offs == npb->strLen || bPartialMatch)) {
-		*endNode = dag;
-		r = 0;
+/* write the rule metadata, exactly as addRuleMetadata() creates it */
+static int
+jsonwAddRuleMetadata(struct jsonw *const w, struct ln_spans_s *const spans, const int bFirst)
+{
+	int r = 0;
+	const ln_ctx ctx = spans->ctx;
+	struct ln_pdag *const endNode = spans->endNode;
+	char numbuf[16];
+
+	if(!(ctx->opts & (LN_CTXOPT_ADD_RULE|LN_CTXOPT_ADD_RULE_LOCATION)))
 		goto done;
+	CHKR(jsonwAddName(w, META_KEY, bFirst));
+	CHKR(jsonwAddConst(w, "{"));
+	CHKR(jsonwAddName(w, META_RULE_KEY, 1));
+	CHKR(jsonwAddConst(w, "{"));
+	if(ctx->opts & LN_CTXOPT_ADD_RULE) {
+		CHKR(jsonwAddName(w, RULE_MOCKUP_KEY, 1));
+		if(endNode->mockup != NULL) {
+			CHKR(jsonwAddString(w, endNode->mockup, strlen(endNode->mockup)));
+		} else {
+			/* the mockup is recorded in reverse order */
+			const char *const rule = (spans->rule == NULL) ? ""
+					       : (const char*) es_getBufAddr(spans->rule);
+			const size_t lenRule = (spans->rule == NULL) ? 0 : es_strlen(spans->rule);
+			char *rev;
+			CHKN(rev = malloc(lenRule + 1));
+			for(size_t i = 0 ; i < lenRule ; ++i)
+				rev[i] = rule[lenRule - 1 - i];
+			rev[lenRule] = '\0';
+			/* addRuleMetadata() stops at the first NUL */
+			r = jsonwAddString(w, rev, strlen(rev));
+			free(rev);
+			if(r != 0)
+				goto done;
+		}
 	}
-
-done:
-	LN_DBGPRINTF(dag->ctx, "%zu returns %d, pParsedTo %zu, parsedTo %zu",
-		offs, r, npb->parsedTo, parsedTo);
-#	ifdef	ADVANCED_STATS
-	--npb->astats.recursion_level;
-#	endif
-	return r;
+	if(ctx->opts & LN_CTXOPT_ADD_RULE_LOCATION) {
+		CHKR(jsonwAddName(w, RULE_LOCATION_KEY, !(ctx->opts & LN_CTXOPT_ADD_RULE)));
+		CHKR(jsonwAddConst(w, "{"));
+		CHKR(jsonwAddName(w, "file", 1));
+		CHKR(jsonwAddString(w, endNode->rb_file, strlen(endNode->rb_file)));
+		CHKR(jsonwAddName(w, "line", 0));
+		snprintf(numbuf, sizeof(numbuf), "%d", (int) endNode->rb_lineno);
+		CHKR(jsonwAdd(w, numbuf, strlen(numbuf)));
+		CHKR(jsonwAddConst(w, " }"));
+	}
+	CHKR(jsonwAddConst(w, " } }"));
+done:	return r;
 }
 
-int
-ln_normalize(ln_ctx ctx, const char *str, const size_t strLen, struct json_object **json_p)
+static int
+spansToJSONStrDirect(struct ln_spans_s *const spans, struct jsonw *const w,
+	const unsigned flags)
 {
 	int r;
-	/* old cruft */
-	if(ctx->version == 1) {
-		r = ln_v1_normalize(ctx, str, strLen, json_p);
-		goto done;
-	}
-	/* end old cruft */
-
-	struct ln_pdag *endNode = NULL;
 	npb_t npb;
+	const ln_ctx ctx = spans->ctx;
+	struct ln_pdag *const endNode = spans->endNode;
+	struct json_object *value = NULL;
+	int bFirst = 1;
+
 	memset(&npb, 0, sizeof(npb));
-	npb.ctx = ctx;
-	npb.str = str;
-	npb.strLen = strLen;
-	if(ctx->opts & LN_CTXOPT_ADD_RULE) {
-		npb.rule = es_newStr(1024);
+	CHKR(jsonwAddConst(w, "{"));
+	if(endNode == NULL) {
+		CHKR(jsonwAddName(w, ORIGINAL_MSG_KEY, 1));
+		CHKR(jsonwAddString(w, spans->str, spans->strLen));
+		CHKR(jsonwAddName(w, UNPARSED_DATA_KEY, 0));
+		CHKR(jsonwAddString(w, spans->str + spans->parsedTo,
+			spans->strLen - spans->parsedTo));
+		if(spans->budgetExceeded) {
+			CHKR(jsonwAddName(w, META_KEY, 0));
+			CHKR(jsonwAddConst(w, "{"));
+			CHKR(jsonwAddName(w, BUDGET_EXCEEDED_KEY, 1));
+			CHKR(jsonwAddConst(w, "true }"));
+		}
+		CHKR(jsonwAddConst(w, " }"));
+		goto done;
 	}
-#	ifdef ADVANCED_STATS
-	npb.astats.exec_path = es_newStr(1024);
-#	endif
 
-	if(*json_p == NULL) {
-		CHKN(*json_p = json_object_new_object());
+	for(unsigned i = 0 ; i < spans->nfields ; ++i) {
+		const struct ln_span *const span = spans->spans + spans->fields[i];
+		const ln_parser_t *const prs = span->prs;
+		CHKR(jsonwAddName(w, prs->name, bFirst));
+		bFirst = 0;
+		if(prs->prsid != PRS_CUSTOM_TYPE
+		   && parser_lookup_table[prs->prsid].textval == TEXTVAL_CLEAN) {
+			CHKR(jsonwAddConst(w, "\""));
+			CHKR(jsonwAdd(w, spans->str + span->offs, span->len));
+			CHKR(jsonwAddConst(w, "\""));
+		} else if(prs->prsid != PRS_CUSTOM_TYPE
+		   && parser_lookup_table[prs->prsid].textval == TEXTVAL_ESC) {
+			CHKR(jsonwAddString(w, spans->str + span->offs, span->len));
+		} else {
+			if(npb.ctx == NULL)
+				CHKR(spansReplaySetup(&npb, spans));
+			CHKR(spanValue(&npb, spans, spans->fields[i], &value));
+			struct json_object *const valDotDot = dotDotValue(value);
+			CHKR(jsonwAddObject(w, (valDotDot == NULL) ? value : valDotDot));
+			json_object_put(value);
+			value = NULL;
+		}
 	}
 
-	r = ln_normalizeRec(&npb, ctx->pdag, 0, 0, *json_p, &endNode);
-
-	if(ctx->debug) {
-		if(r == 0) {
-			LN_DBGPRINTF(ctx, "final result for normalizer: parsedTo %zu, endNode %p, "
-				     "isTerminal %d, tagbucket %p",
-				     npb.parsedTo, endNode, endNode->flags.isTerminal, endNode->tags);
+	if(endNode->tags != NULL && !(flags & LN_JSONSTR_NO_TAGS)) {
+		CHKR(jsonwAddName(w, "event.tags", bFirst));
+		bFirst = 0;
+		const int ntags = json_object_array_length(endNode->tags);
+		if(ntags == 0) {
+			CHKR(jsonwAddConst(w, "[ ]"));
 		} else {
-			LN_DBGPRINTF(ctx, "final result for normalizer: parsedTo %zu, endNode %p",
-				     npb.parsedTo, endNode);
+			CHKR(jsonwAddConst(w, "["));
+			for(int i = 0 ; i < ntags ; ++i) {
+				struct json_object *const tag = json_object_array_get_idx(endNode->tags, i);
+				if(i == 0) {
+					CHKR(jsonwAddConst(w, " "));
+				} else {
+					CHKR(jsonwAddConst(w, ", "));
+				}
+				CHKR(jsonwAddString(w, json_object_get_string(tag),
+					json_object_get_string_len(tag)));
+			}
+			CHKR(jsonwAddConst(w, " ]"));
 		}
 	}
-	LN_DBGPRINTF(ctx, "DONE, final return is %d", r);
-	if(r == 0 && endNode->flags.isTerminal) {
-		/* success, finalize event */
-		if(endNode->tags != NULL) {
-			/* add tags to an event */
-			json_object_get(endNode->tags);
-			json_object_object_add(*json_p, "event.tags", endNode->tags);
-			CHKR(ln_annotate(ctx, *json_p, endNode->tags));
-		}
-		if(ctx->opts & LN_CTXOPT_ADD_ORIGINALMSG) {
-			/* originalmsg must be kept outside of metadata for 
-			 * backward compatibility reasons.
-			 */
-			json_object_object_add(*json_p, ORIGINAL_MSG_KEY,
-				json_object_new_string_len(str, strLen));
+	if(endNode->annot != NULL) {
+		for(int i = 0 ; i < endNode->annot->nfields ; ++i) {
+			CHKR(jsonwAddName(w, endNode->annot->fields[i].name, bFirst));
+			bFirst = 0;
+			CHKR(jsonwAddString(w, endNode->annot->fields[i].value,
+				endNode->annot->fields[i].lenValue));
 		}
-		addRuleMetadata(&npb, *json_p, endNode);
-		r = 0;
-	} else {
-		addUnparsedField(str, strLen, npb.parsedTo, *json_p);
 	}
-
-	if(ctx->opts & LN_CTXOPT_ADD_RULE) {
-		es_deleteStr(npb.rule);
+	if(ctx->opts & LN_CTXOPT_ADD_ORIGINALMSG) {
+		CHKR(jsonwAddName(w, ORIGINAL_MSG_KEY, bFirst));
+		bFirst = 0;
+		CHKR(jsonwAddString(w, spans->str, spans->strLen));
 	}
+	CHKR(jsonwAddRuleMetadata(w, spans, bFirst));
+	CHKR(jsonwAddConst(w, " }"));
 
-#ifdef	ADVANCED_STATS
-	if(r != 0)
-		es_addBuf(&npb.astats.exec_path, "[FAILED]", 8);
-	else if(!endNode->flags.isTerminal)
-		es_addBuf(&npb.astats.exec_path, "[FAILED:NON-TERMINAL]", 21);
-	if(npb.astats.pathlen < ADVSTATS_MAX_ENTITIES)
-		advstats_pathlens[npb.astats.pathlen]++;
-	if(npb.astats.pathlen > advstats_max_pathlen) {
-		advstats_max_pathlen = npb.astats.pathlen;
-	}
-	if(npb.astats.backtracked < ADVSTATS_MAX_ENTITIES)
-		advstats_backtracks[npb.astats.backtracked]++;
-	if(npb.astats.backtracked > advstats_max_backtracked) {
-		advstats_max_backtracked = npb.astats.backtracked;
-	}
+done:
+	if(value != NULL)
+		json_object_put(value);
+	if(npb.ctx != NULL)
+		normalizeTeardown(&npb);
+	return r;
+}
 
-	/* parser calls */
-	if(npb.astats.parser_calls < ADVSTATS_MAX_ENTITIES)
-		advstats_parser_calls[npb.astats.parser_calls]++;
-	if(npb.astats.parser_calls > advstats_max_parser_calls) {
-		advstats_max_parser_calls = npb.astats.parser_calls;
+int
+ln_spansToJSONStr(ln_spans spans, char **buf, size_t *size, size_t *len,
+	const unsigned flags)
+{
+	int r;
+	struct jsonw w;
+	struct json_object *json = NULL;
+
+	w.buf = *buf;
+	w.size = (*buf == NULL) ? 0 : *size;
+	w.len = 0;
+	if(spans->ctx == NULL) { /* nothing normalized yet */
+		r = -1;
+		goto done;
 	}
-	if(npb.astats.lit_parser_calls < ADVSTATS_MAX_ENTITIES)
-		advstats_lit_parser_calls[npb.astats.lit_parser_calls]++;
-	if(npb.astats.lit_parser_calls > advstats_max_lit_parser_calls) {
-		advstats_max_lit_parser_calls = npb.astats.lit_parser_calls;
+	if(spansDirectJSONStr(spans)) {
+		CHKR(spansToJSONStrDirect(spans, &w, flags));
+	} else {
+		CHKR(ln_spansToJSON(spans, &json));
+		if(flags & LN_JSONSTR_NO_TAGS)
+			json_object_object_del(json, "event.tags");
+		CHKR(jsonwAddObject(&w, json));
 	}
+	if(w.len >= w.size)
+		CHKR(jsonwGrow(&w, 1));
+	w.buf[w.len] = '\0';
+	*len = w.len;
 
-	es_deleteStr(npb.astats.exec_path);
-#endif
-done:	return r;
+done:
+	*buf = w.buf;
+	*size = w.size;
+	if(json != NULL)
+		json_object_put(json);
+	return r;
 }
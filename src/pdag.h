@@ -20,6 +20,7 @@
 #define META_RULE_KEY "rule"
 #define RULE_MOCKUP_KEY "mockup"
 #define RULE_LOCATION_KEY "location"
+#define BUDGET_EXCEEDED_KEY "budget-exceeded"
 
 typedef struct ln_pdag ln_pdag; /**< the parse DAG object */
 typedef struct ln_parser_s ln_parser_t;
@@ -27,6 +28,11 @@ typedef struct npb npb_t;
 typedef uint8_t prsid_t;
 
 struct ln_type_pdag;
+struct ln_pdag_tstats;
+struct ln_memo;
+struct ln_value;
+struct ln_rbc_writer;
+struct ln_rbc_reader;
 
 /** 
  * parser IDs.
@@ -37,37 +43,36 @@ struct ln_type_pdag;
  */
 #define PRS_LITERAL			0
 #define PRS_REPEAT			1
-#if 0
-#define PRS_DATE_RFC3164		1
-#define PRS_DATE_RFC5424		2
-#define PRS_NUMBER			3
-#define PRS_FLOAT			4
-#define PRS_HEXNUMBER			5
-#define PRS_KERNEL_TIMESTAMP		6
-#define PRS_WHITESPACE			7
-#define PRS_IPV4			8
-#define PRS_IPV6			9
-#define PRS_WORD			10
-#define PRS_ALPHA			11
-#define PRS_REST			12
-#define PRS_OP_QUOTED_STRING		13
-#define PRS_QUOTED_STRING		14
-#define PRS_DATE_ISO			15
-#define PRS_TIME_24HR			16
-#define PRS_TIME_12HR			17
-#define PRS_DURATION			18
-#define PRS_CISCO_INTERFACE_SPEC	19
-#define PRS_NAME_VALUE_LIST		20
-#define PRS_JSON			21
-#define PRS_CEE_SYSLOG			22
-#define PRS_MAC48			23
-#define PRS_CEF				24
-#define PRS_CHECKPOINT_LEA		25
-#define PRS_v2_IPTABLES			26
-#define PRS_STRING_TO			27
-#define PRS_CHAR_TO			28
-#define PRS_CHAR_SEP			29
-#endif
+#define PRS_DATE_RFC3164		2
+#define PRS_DATE_RFC5424		3
+#define PRS_NUMBER			4
+#define PRS_FLOAT			5
+#define PRS_HEXNUMBER			6
+#define PRS_KERNEL_TIMESTAMP		7
+#define PRS_WHITESPACE			8
+#define PRS_IPV4			9
+#define PRS_IPV6			10
+#define PRS_WORD			11
+#define PRS_ALPHA			12
+#define PRS_REST			13
+#define PRS_OP_QUOTED_STRING		14
+#define PRS_QUOTED_STRING		15
+#define PRS_DATE_ISO			16
+#define PRS_TIME_24HR			17
+#define PRS_TIME_12HR			18
+#define PRS_DURATION			19
+#define PRS_CISCO_INTERFACE_SPEC	20
+#define PRS_NAME_VALUE_LIST		21
+#define PRS_JSON			22
+#define PRS_CEE_SYSLOG			23
+#define PRS_MAC48			24
+#define PRS_CEF				25
+#define PRS_CHECKPOINT_LEA		26
+#define PRS_v2_IPTABLES			27
+#define PRS_STRING_TO			28
+#define PRS_CHAR_TO			29
+#define PRS_CHAR_SEP			30
+#define PRS_STRING			31
 
 #define PRS_CUSTOM_TYPE			254
 #define PRS_INVALID			255
@@ -82,48 +87,107 @@ struct ln_parser_s {
 	prsid_t prsid;		/**< parser ID (for lookup table) */
 	ln_pdag *node;		/**< node to branch to if parser succeeded */
 	void *parser_data;	/**< opaque data that the field-parser understands */
-	struct ln_type_pdag *custType;	/**< points to custom type, if such is used */
+	struct ln_type_pdag *custType;	/**< points to custom type, if such is used or inlined */
 	int prio;		/**< priority (combination of user- and parser-specific parts) */
 	const char *name;	/**< field name */
 	const char *conf;	/**< configuration as printable json for comparison reasons */
+	const char *callName;	/**< field name of the type call, if inlined */
+	const char *callConf;	/**< conf of the type call, if inlined (NULL otherwise) */
 };
 
+/* how the JSON value of a parser relates to the text it matched */
+#define TEXTVAL_NONE	0	/**< value must be built by the parser */
+#define TEXTVAL_ESC	1	/**< value is a string of the matched text */
+#define TEXTVAL_CLEAN	2	/**< same, and the text never needs JSON escaping */
+
 struct ln_parser_info {
 	const char *name;	/**< parser name as used in rule base */
 	int prio;		/**< parser specific prio in range 0..255 */
+	int textval;		/**< TEXTVAL_*, for direct JSON text output */
 	int (*construct)(ln_ctx ctx, json_object *const json, void **);
 	int (*parser)(npb_t *npb, size_t*, void *const,
 				  size_t*, struct json_object **); /**< parser to use */
 	void (*destruct)(ln_ctx, void *const); /* note: destructor is only needed if parser data exists */
-#ifdef ADVANCED_STATS
-	uint64_t called;
-	uint64_t success;
-#endif
+	int (*value)(const char *, size_t, void *const, const time_t,
+				  struct ln_value *); /**< typed value conversion, NULL if not supported */
 };
 
 
+/**
+ * first-byte dispatch index of a pdag node.
+ * Built by the optimizer for nodes with many literal branches. For each
+ * possible first input byte, it holds the indexes of all parsers that can
+ * potentially match there: the literals starting with that byte plus all
+ * non-literal parsers. Lists keep priority (= parser table) order.
+ */
+struct ln_pdag_dispatch {
+	uint16_t start[256];	/**< first byte -> offset of candidate list in cand */
+	prsid_t *cand;		/**< candidate lists, each one is count followed by indexes */
+};
+
 /* parse DAG object
  */
 struct ln_pdag {
 	ln_ctx ctx;			/**< our context */ // TODO: why do we need it?
 	ln_parser_t *parsers;		/* array of parsers to try */
 	prsid_t nparsers;		/**< current table size (prsid_t slighly abused) */
+	struct ln_pdag_dispatch *dispatch; /**< first-byte index, NULL if not built */
 	struct {
 		unsigned isTerminal:1;	/**< designates this node a terminal sequence */
 		unsigned visited:1;	/**< work var for recursive procedures */
+		unsigned recordMockup:1; /**< main component terminal without mockup */
 	} flags;
 	struct json_object *tags;	/**< tags to assign to events of this type */
+	struct ln_annotFields_s *annot;	/**< annotation for the tags, resolved at load time */
 	int refcnt;			/**< reference count for deleting tracking */
 	struct {
 		unsigned called;
 		unsigned backtracked;	/**< incremented when backtracking was initiated */
 		unsigned terminated;
-	} stats;	/**< usage statistics */
+	} stats;	/**< usage statistics (merged from per-thread counters on demand) */
+	unsigned stats_id;		/**< slot in per-thread statistics, 0 if not counted */
 	const char *rb_id;		/**< human-readable rulebase identifier, for stats etc */
 	
 	// experimental, move outside later
 	const char *rb_file;
 	unsigned int rb_lineno;
+	const char *mockup;		/**< rule mockup of a terminal node, NULL if it is
+					     recorded while normalizing, see pdagBuildMockups() */
+};
+
+/** a field recorded by span-mode normalization (see ln_normalizeSpans()).
+ * Instead of a JSON value, only the location of the matched text and
+ * the parser that matched are kept. The value is built from this on
+ * request, by calling the parser again.
+ */
+struct ln_span {
+	const ln_parser_t *prs;	/**< the parser that matched */
+	size_t offs;		/**< start of matched text inside message */
+	size_t len;		/**< length of matched text */
+	unsigned firstChild;	/**< custom types: first span recorded by the type */
+	unsigned nChildren;	/**< custom types: number of spans recorded by the type */
+	unsigned parent;	/**< index+1 of containing custom type span, 0 for top level */
+};
+
+/** the span arena. It is reused for all messages, so after the first
+ * few messages, span-mode normalization does not need to allocate
+ * memory at all.
+ */
+struct ln_spans_s {
+	ln_ctx ctx;
+	const char *str;		/**< message the spans refer to (not owned) */
+	size_t strLen;
+	size_t parsedTo;		/**< for unparsed messages */
+	struct ln_pdag *endNode;	/**< NULL if message could not be parsed */
+	int budgetExceeded;		/**< not parsed because the budget was exceeded */
+	struct ln_span *spans;
+	unsigned nspans;
+	unsigned maxspans;
+	unsigned *fields;		/**< indexes of top-level named spans */
+	unsigned nfields;
+	unsigned maxfields;
+	es_str_t *rule;			/**< rule mockup, if requested by ctx options */
+	time_t refTime;			/**< see ln_spansSetRefTime(), 0 for current time */
 };
 
 #ifdef ADVANCED_STATS
@@ -136,12 +200,32 @@ struct advstats {
 	es_str_t *exec_path;
 };
 #define ADVSTATS_MAX_ENTITIES 100
-extern int advstats_max_pathlen;
-extern int advstats_pathlens[ADVSTATS_MAX_ENTITIES];
-extern int advstats_max_backtracked;
-extern int advstats_backtracks[ADVSTATS_MAX_ENTITIES];
 #endif
 
+/** a name/value pair found by a structured-payload parser. Pairs
+ * are recorded while the motif is checked, so that the JSON can be
+ * built without scanning the message again.
+ */
+struct ln_nvpair {
+	size_t iName;
+	size_t lenName;
+	size_t iVal;
+	ssize_t lenVal;		/**< -1 if the name has no value (iptables flags) */
+};
+
+/** per-thread work area of the structured-payload parsers. It is
+ * kept with the statistics block of the thread and reused for all
+ * messages, see ln_parseTokener() and friends. If there is no
+ * thread-specific storage, each normalizer call uses its own.
+ */
+struct ln_parse_wrk {
+	struct json_tokener *tokener;	/**< NULL until first needed */
+	char *buf;			/**< scratch buffer for names and unescaped values */
+	size_t sizeBuf;
+	struct ln_nvpair *pairs;
+	unsigned sizePairs;
+};
+
 /** the "normalization paramater block" (npb)
  * This structure is passed to all normalization routines including
  * parsers. It contains data that commonly needs to be passed,
@@ -161,6 +245,19 @@ struct npb {
 	size_t parsedTo;		/**< up to which byte could this be parsed? */
 	es_str_t *rule;			/**< a mock-up of the rule used to parse */
 	es_str_t *exec_path;
+	struct ln_pdag_tstats *tstats;	/**< statistics counters of the calling thread */
+	struct ln_parse_wrk *wrk;	/**< parser work area, see ln_parseTokener() */
+	struct ln_parse_wrk ownWrk;	/**< work area of this call if there is no thread-specific one */
+	struct ln_spans_s *spans;	/**< span mode: record spans instead of building JSON */
+	struct ln_memo *memo;		/**< failed (node, offset) pairs, NULL if not memoizing */
+	int bOwnMemo;			/**< memo belongs to this call, not to the thread */
+	/* per-message budget, see ln_setNormalizeBudget() */
+	unsigned budgetMaxCalls;	/**< limits of this message, taken at its start */
+	unsigned budgetMaxUsec;
+	uint64_t parserCalls;		/**< parser calls so far, only counted with a budget */
+	uint64_t budgetCheck;		/**< check budget when parserCalls reaches this, 0 = no budget */
+	uint64_t budgetDeadline;	/**< monotonic time (ns) the message must be done by */
+	int budgetExceeded;
 #ifdef ADVANCED_STATS
 	int pathlen;
 	int backtracked;
@@ -204,6 +301,30 @@ void ln_pdagDelete(struct ln_pdag *DAG);
 int ln_pdagAddParser(ln_ctx ctx, struct ln_pdag **pdag, json_object *);
 
 
+/**
+ * Add a parser created by ln_newParser() to dag node.
+ * This is the same as ln_pdagAddParser() with the config the parser
+ * was created from, so parser creation can be done in advance (and
+ * by another thread). Works on unoptimzed dag.
+ *
+ * @param[in] pdag pointer to pdag to modify, moved to the parser's
+ * 		   node on exit
+ * @param[in] prs parser, owned by the pdag after the call
+ * @returns 0 on success, something else otherwise
+ */
+int ln_pdagAddNewParser(ln_ctx ctx, struct ln_pdag **pdag, ln_parser_t *prs);
+
+
+/**
+ * Number of threads to use for a rule base loading step.
+ *
+ * @param[in] nwork number of work items of the step
+ * @param[in] minPerThread min number of work items per thread
+ * @returns number of threads, 1 if the step is to be done serially
+ */
+unsigned ln_loadThreads(ln_ctx ctx, const unsigned nwork, const unsigned minPerThread);
+
+
 /**
  * Display the content of a pdag (debug function).
  * This is a debug aid that spits out a textual representation
@@ -249,11 +370,23 @@ struct ln_pdag * ln_buildPDAG(struct ln_pdag *DAG, es_str_t *str, size_t offs);
 
 prsid_t ln_parserName2ID(const char *const __restrict__ name);
 int ln_pdagOptimize(ln_ctx ctx);
+int ln_pdagCompileAnnots(ln_ctx ctx);
 void ln_fullPdagStats(ln_ctx ctx, FILE *const fp, const int);
 ln_parser_t * ln_newLiteralParser(ln_ctx ctx, char lit);
 ln_parser_t* ln_newParser(ln_ctx ctx, json_object *const prscnf);
+void ln_deleteParser(ln_ctx ctx, ln_parser_t *const prs);
 struct ln_type_pdag * ln_pdagFindType(ln_ctx ctx, const char *const __restrict__ name, const int bAdd);
+void ln_pdagUninlineType(ln_ctx ctx, struct ln_type_pdag *const td);
 void ln_fullPDagStatsDOT(ln_ctx ctx, FILE *const fp);
+int ln_pdagInitStats(ln_ctx ctx);
+int ln_pdagWriteCache(ln_ctx ctx, struct ln_rbc_writer *wr);
+int ln_pdagReadCache(ln_ctx ctx, struct ln_rbc_reader *rd);
+void ln_pdagDiscard(ln_ctx ctx);
+void ln_pdagDeleteTypes(ln_ctx ctx);
+void ln_pdagExitStats(ln_ctx ctx);
+struct json_tokener * ln_parseTokener(npb_t *const npb);
+char * ln_parseBuf(npb_t *const npb, const size_t size);
+struct ln_nvpair * ln_parsePairs(npb_t *const npb, const unsigned n);
 
 /* friends */
 int
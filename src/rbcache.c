@@ -0,0 +1,467 @@
+/**
+ * @file rbcache.c
+ * @brief Implementation of the binary rulebase cache.
+ *
+ * Cache file layout (all integers in native byte order):
+ *   - header: magic, format version, byte order mark, pointer size and
+ *     library version
+ *   - the rule base files the cache was created from, with their
+ *     modification time (seconds and nanoseconds) and size
+ *   - the annotation set
+ *   - the pdag, see ln_pdagWriteCache()
+ *//*
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libestr.h>
+
+#include "liblognorm.h"
+#include "lognorm.h"
+#include "annot.h"
+#include "pdag.h"
+#include "internal.h"
+#include "rbcache.h"
+
+#define RBC_MAGIC "LNRBCACH"
+#define RBC_MAGIC_LEN 8
+#define RBC_FORMAT_VERSION 1
+#define RBC_BOM 0x01020304
+#define RBC_NULLSTR UINT32_MAX
+#define RBC_TMP_TRIES 100	/**< max attempts to find an unused temporary name */
+
+static unsigned rbcTmpSeq = 0;	/**< for unique temporary names */
+
+/* writer primitives; errors are remembered and checked when done */
+
+void
+ln_rbcPutBytes(struct ln_rbc_writer *const wr, const void *const buf, const size_t len)
+{
+	if(len > 0 && fwrite(buf, len, 1, wr->fp) != 1)
+		wr->err = 1;
+}
+
+void
+ln_rbcPutU32(struct ln_rbc_writer *const wr, const uint32_t val)
+{
+	ln_rbcPutBytes(wr, &val, sizeof(val));
+}
+
+void
+ln_rbcPutU64(struct ln_rbc_writer *const wr, const uint64_t val)
+{
+	ln_rbcPutBytes(wr, &val, sizeof(val));
+}
+
+void
+ln_rbcPutStrLen(struct ln_rbc_writer *const wr, const char *const str, const size_t len)
+{
+	if(str == NULL) {
+		ln_rbcPutU32(wr, RBC_NULLSTR);
+		return;
+	}
+	if(len >= RBC_NULLSTR) {
+		wr->err = 1;
+		return;
+	}
+	ln_rbcPutU32(wr, len);
+	ln_rbcPutBytes(wr, str, len);
+	ln_rbcPutBytes(wr, "", 1);
+}
+
+void
+ln_rbcPutStr(struct ln_rbc_writer *const wr, const char *const str)
+{
+	ln_rbcPutStrLen(wr, str, (str == NULL) ? 0 : strlen(str));
+}
+
+/* reader primitives */
+
+const void *
+ln_rbcGetBytes(struct ln_rbc_reader *const rd, const size_t len)
+{
+	if(rd->err || rd->len - rd->pos < len) {
+		rd->err = 1;
+		return NULL;
+	}
+	const void *const p = rd->buf + rd->pos;
+	rd->pos += len;
+	return p;
+}
+
+uint32_t
+ln_rbcGetU32(struct ln_rbc_reader *const rd)
+{
+	uint32_t val = 0;
+	const void *const p = ln_rbcGetBytes(rd, sizeof(val));
+	if(p != NULL)
+		memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+uint64_t
+ln_rbcGetU64(struct ln_rbc_reader *const rd)
+{
+	uint64_t val = 0;
+	const void *const p = ln_rbcGetBytes(rd, sizeof(val));
+	if(p != NULL)
+		memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+const char *
+ln_rbcGetStr(struct ln_rbc_reader *const rd, size_t *const len)
+{
+	const uint32_t slen = ln_rbcGetU32(rd);
+	if(rd->err || slen == RBC_NULLSTR)
+		return NULL;
+	const char *const str = ln_rbcGetBytes(rd, (size_t) slen + 1);
+	if(str == NULL || str[slen] != '\0') {
+		rd->err = 1;
+		return NULL;
+	}
+	if(len != NULL)
+		*len = slen;
+	return str;
+}
+
+
+void
+ln_rbcSetSourceStat(struct ln_rbsrc *const src, const struct stat *const st)
+{
+	src->mtime = st->st_mtime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+	src->mtime_nsec = st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+	src->mtime_nsec = st->st_mtimespec.tv_nsec;
+#else
+	src->mtime_nsec = 0;
+#endif
+	src->size = st->st_size;
+}
+
+static void
+rbcWriteSources(ln_ctx ctx, struct ln_rbc_writer *const wr)
+{
+	ln_rbcPutU32(wr, ctx->nRbsrcs);
+	for(unsigned i = 0 ; i < ctx->nRbsrcs ; ++i) {
+		ln_rbcPutStr(wr, ctx->rbsrcs[i].name);
+		ln_rbcPutStr(wr, ctx->rbsrcs[i].path);
+		ln_rbcPutU64(wr, ctx->rbsrcs[i].mtime);
+		ln_rbcPutU64(wr, ctx->rbsrcs[i].mtime_nsec);
+		ln_rbcPutU64(wr, ctx->rbsrcs[i].size);
+	}
+}
+
+/* annotations and their operations are kept in lists which are built by
+ * prepending. So we write them in reverse order, which makes loading
+ * reproduce the original order.
+ */
+static void
+rbcWriteAnnotOps(struct ln_rbc_writer *const wr, ln_annot_op *const op)
+{
+	if(op == NULL)
+		return;
+	rbcWriteAnnotOps(wr, op->next);
+	ln_rbcPutU32(wr, 1);
+	ln_rbcPutU32(wr, op->opc);
+	ln_rbcPutStrLen(wr, (char*) es_getBufAddr(op->name), es_strlen(op->name));
+	if(op->value == NULL)
+		ln_rbcPutStr(wr, NULL);
+	else
+		ln_rbcPutStrLen(wr, (char*) es_getBufAddr(op->value), es_strlen(op->value));
+}
+
+static void
+rbcWriteAnnots(struct ln_rbc_writer *const wr, ln_annot *const annot)
+{
+	if(annot == NULL)
+		return;
+	rbcWriteAnnots(wr, annot->next);
+	ln_rbcPutU32(wr, 1);
+	ln_rbcPutStrLen(wr, (char*) es_getBufAddr(annot->tag), es_strlen(annot->tag));
+	rbcWriteAnnotOps(wr, annot->oproot);
+	ln_rbcPutU32(wr, 0);
+}
+
+int
+ln_rbcWrite(ln_ctx ctx, const char *const cachefile)
+{
+	int r = 0;
+	int fd = -1;
+	char *tmpname = NULL;
+	int bTmpExists = 0;
+	struct ln_rbc_writer wr;
+
+	wr.fp = NULL;
+	wr.err = 0;
+	/* not mkstemp(), as the cache gets the permissions of a regular
+	 * file (subject to umask), just like the rule base. The name is
+	 * unique within the process, a file left over by a crashed process
+	 * with the same pid is skipped.
+	 */
+	for(int i = 0 ; fd == -1 ; ++i) {
+		free(tmpname);
+		if(asprintf(&tmpname, "%s.%ld.%u", cachefile, (long) getpid(),
+			__atomic_fetch_add(&rbcTmpSeq, 1, __ATOMIC_RELAXED)) == -1) {
+			tmpname = NULL;
+			FAIL(LN_NOMEM);
+		}
+		fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if(fd == -1 && (errno != EEXIST || i == RBC_TMP_TRIES)) {
+			ln_errprintf(ctx, errno, "cannot create rulebase cache '%s'", tmpname);
+			FAIL(-1);
+		}
+	}
+	bTmpExists = 1;
+	if((wr.fp = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		FAIL(LN_NOMEM);
+	}
+
+	ln_rbcPutBytes(&wr, RBC_MAGIC, RBC_MAGIC_LEN);
+	ln_rbcPutU32(&wr, RBC_FORMAT_VERSION);
+	ln_rbcPutU32(&wr, RBC_BOM);
+	ln_rbcPutU32(&wr, sizeof(void*));
+	ln_rbcPutStr(&wr, VERSION);
+	rbcWriteSources(ctx, &wr);
+	rbcWriteAnnots(&wr, ctx->pas->aroot);
+	ln_rbcPutU32(&wr, 0);
+	CHKR(ln_pdagWriteCache(ctx, &wr));
+
+	const int eno = errno;
+	if(fclose(wr.fp) != 0)
+		wr.err = 1;
+	wr.fp = NULL;
+	if(wr.err) {
+		ln_errprintf(ctx, eno, "error writing rulebase cache '%s'", tmpname);
+		FAIL(-1);
+	}
+	if(rename(tmpname, cachefile) != 0) {
+		ln_errprintf(ctx, errno, "cannot rename '%s' to rulebase cache '%s'",
+			tmpname, cachefile);
+		FAIL(-1);
+	}
+	bTmpExists = 0;
+	LN_DBGPRINTF(ctx, "rulebase cache '%s' written", cachefile);
+
+done:
+	if(wr.fp != NULL)
+		fclose(wr.fp);
+	if(bTmpExists)
+		unlink(tmpname);
+	free(tmpname);
+	return r;
+}
+
+
+/* check the rule base files recorded in the cache. The cache is current
+ * if it was created for the requested rule base and none of its files
+ * has changed since. Recorded files are added to the context, so that
+ * the cache can be rewritten later on.
+ * @return 0 if cache is current, something else otherwise
+ */
+static int
+rbcCheckSources(ln_ctx ctx, struct ln_rbc_reader *const rd, const char *const file)
+{
+	int r = 0;
+	struct stat st;
+	struct ln_rbsrc cur;
+	const uint32_t nsrcs = ln_rbcGetU32(rd);
+
+	if(rd->err || nsrcs == 0 || nsrcs > rd->len)
+		FAIL(LN_BADCONFIG);
+	CHKN(ctx->rbsrcs = calloc(nsrcs, sizeof(struct ln_rbsrc)));
+	for(uint32_t i = 0 ; i < nsrcs ; ++i) {
+		const char *const name = ln_rbcGetStr(rd, NULL);
+		const char *const path = ln_rbcGetStr(rd, NULL);
+		const int64_t mtime = ln_rbcGetU64(rd);
+		const int64_t mtime_nsec = ln_rbcGetU64(rd);
+		const int64_t size = ln_rbcGetU64(rd);
+		if(name == NULL || path == NULL)
+			FAIL(LN_BADCONFIG);
+		if(i == 0 && strcmp(name, file)) {
+			LN_DBGPRINTF(ctx, "rulebase cache was created for '%s', not '%s'",
+				name, file);
+			FAIL(LN_BADCONFIG);
+		}
+		if(stat(path, &st) != 0) {
+			LN_DBGPRINTF(ctx, "rulebase cache is outdated, '%s' is gone", path);
+			FAIL(LN_BADCONFIG);
+		}
+		ln_rbcSetSourceStat(&cur, &st);
+		if(cur.mtime != mtime || cur.mtime_nsec != mtime_nsec || cur.size != size) {
+			LN_DBGPRINTF(ctx, "rulebase cache is outdated, '%s' has changed", path);
+			FAIL(LN_BADCONFIG);
+		}
+		struct ln_rbsrc *const src = ctx->rbsrcs + ctx->nRbsrcs;
+		CHKN(src->name = strdup(name));
+		++ctx->nRbsrcs;
+		CHKN(src->path = strdup(path));
+		ln_rbcSetSourceStat(src, &st);
+	}
+
+done:
+	return r;
+}
+
+static int
+rbcReadAnnots(ln_annotSet *const as, struct ln_rbc_reader *const rd)
+{
+	int r = 0;
+	ln_annot *annot = NULL;
+	const char *str;
+	size_t len;
+
+	while(ln_rbcGetU32(rd) == 1) {
+		if((str = ln_rbcGetStr(rd, &len)) == NULL)
+			FAIL(LN_BADCONFIG);
+		es_str_t *tag;
+		CHKN(tag = es_newStrFromCStr(str, len));
+		if((annot = ln_newAnnot(tag)) == NULL) {
+			es_deleteStr(tag);
+			FAIL(LN_NOMEM);
+		}
+		while(ln_rbcGetU32(rd) == 1) {
+			const uint32_t opc = ln_rbcGetU32(rd);
+			es_str_t *name, *value = NULL;
+			if((str = ln_rbcGetStr(rd, &len)) == NULL || opc > ln_annot_RM)
+				FAIL(LN_BADCONFIG);
+			CHKN(name = es_newStrFromCStr(str, len));
+			if((str = ln_rbcGetStr(rd, &len)) != NULL
+			   && (value = es_newStrFromCStr(str, len)) == NULL) {
+				es_deleteStr(name);
+				FAIL(LN_NOMEM);
+			}
+			if(ln_addAnnotOp(annot, opc, name, value) != 0) {
+				es_deleteStr(name);
+				if(value != NULL)
+					es_deleteStr(value);
+				FAIL(LN_NOMEM);
+			}
+		}
+		if(rd->err)
+			FAIL(LN_BADCONFIG);
+		CHKR(ln_addAnnotToSet(as, annot));
+		annot = NULL;
+	}
+	if(rd->err)
+		r = LN_BADCONFIG;
+
+done:
+	if(annot != NULL)
+		ln_deleteAnnot(annot);
+	return r;
+}
+
+/* undo a partial load, the context is empty afterwards */
+static void
+rbcDiscardSources(ln_ctx ctx)
+{
+	for(unsigned i = 0 ; i < ctx->nRbsrcs ; ++i) {
+		free(ctx->rbsrcs[i].name);
+		free(ctx->rbsrcs[i].path);
+	}
+	free(ctx->rbsrcs);
+	ctx->rbsrcs = NULL;
+	ctx->nRbsrcs = 0;
+}
+
+int
+ln_rbcLoad(ln_ctx ctx, const char *const file, const char *const cachefile)
+{
+	int r = 0;
+	int fd = -1;
+	struct stat st;
+	struct ln_rbc_reader rd;
+	void *map = MAP_FAILED;
+	ln_annotSet *as = NULL;
+
+	memset(&rd, 0, sizeof(rd));
+	if((fd = open(cachefile, O_RDONLY)) == -1 || fstat(fd, &st) != 0) {
+		LN_DBGPRINTF(ctx, "rulebase cache '%s' not present", cachefile);
+		FAIL(-1);
+	}
+	if(st.st_size == 0
+	   || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		LN_DBGPRINTF(ctx, "rulebase cache '%s' cannot be mapped", cachefile);
+		FAIL(-1);
+	}
+	rd.buf = map;
+	rd.len = st.st_size;
+
+	const char *const magic = ln_rbcGetBytes(&rd, RBC_MAGIC_LEN);
+	if(   magic == NULL || memcmp(magic, RBC_MAGIC, RBC_MAGIC_LEN)
+	   || ln_rbcGetU32(&rd) != RBC_FORMAT_VERSION
+	   || ln_rbcGetU32(&rd) != RBC_BOM
+	   || ln_rbcGetU32(&rd) != sizeof(void*)) {
+		LN_DBGPRINTF(ctx, "'%s' is not a rulebase cache of this format", cachefile);
+		FAIL(LN_BADCONFIG);
+	}
+	const char *const version = ln_rbcGetStr(&rd, NULL);
+	if(version == NULL || strcmp(version, VERSION)) {
+		LN_DBGPRINTF(ctx, "rulebase cache '%s' was created by a different version",
+			cachefile);
+		FAIL(LN_BADCONFIG);
+	}
+	if((r = rbcCheckSources(ctx, &rd, file)) != 0) {
+		rbcDiscardSources(ctx);
+		goto done;
+	}
+
+	/* annotations are loaded into a set of their own, which replaces
+	 * the context's (empty) one only if the pdag could be loaded.
+	 */
+	CHKN(as = ln_newAnnotSet(ctx));
+	if((r = rbcReadAnnots(as, &rd)) == 0)
+		r = ln_pdagReadCache(ctx, &rd);
+	if(r != 0) {
+		if(rd.err || r == LN_BADCONFIG)
+			LN_DBGPRINTF(ctx, "rulebase cache '%s' is damaged or unusable", cachefile);
+		rbcDiscardSources(ctx);
+		goto done;
+	}
+	ln_annotSet *const empty = ctx->pas;
+	ctx->pas = as;
+	if((r = ln_pdagCompileAnnots(ctx)) != 0) {
+		ctx->pas = empty;
+		ln_pdagDiscard(ctx);
+		rbcDiscardSources(ctx);
+		goto done;
+	}
+	ln_deleteAnnotSet(empty);
+	as = NULL;
+	LN_DBGPRINTF(ctx, "rulebase loaded from cache '%s'", cachefile);
+
+done:
+	if(as != NULL)
+		ln_deleteAnnotSet(as);
+	if(map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if(fd != -1)
+		close(fd);
+	return r;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file rbcache.h
+ * @brief Binary rulebase cache.
+ *
+ * A rulebase cache is a binary image of a loaded and optimized v2
+ * rulebase. Loading it skips rulebase parsing and optimization. The
+ * image is only valid for the library build that created it, on the
+ * same machine architecture.
+ *
+ * This file contains the primitives used by the individual objects to
+ * write and read their part of the cache. Reading is done from a memory
+ * mapping of the cache file; all read functions check bounds and set
+ * the reader's error flag if data is missing, so callers need to check
+ * for errors only after reading a group of items.
+ *//*
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#ifndef LIBLOGNORM_RBCACHE_H_INCLUDED
+#define	LIBLOGNORM_RBCACHE_H_INCLUDED
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "liblognorm.h"
+
+struct ln_rbsrc;
+
+struct ln_rbc_writer {
+	FILE *fp;
+	int err;	/**< set if any write failed */
+};
+
+struct ln_rbc_reader {
+	const char *buf;	/**< mapped cache file */
+	size_t len;
+	size_t pos;		/**< current read position */
+	int err;		/**< set if reading beyond the end was attempted */
+};
+
+/**
+ * Write the rule base loaded into the context to a cache file. The file
+ * is written under a temporary name and then renamed, so readers never
+ * see a partially written cache.
+ * @return 0 on success, something else otherwise
+ */
+int ln_rbcWrite(ln_ctx ctx, const char *cachefile);
+
+/**
+ * Load a rule base from a cache file. This fails if the cache does not
+ * exist, was created by a different library build, was not created for
+ * this rule base or if any of the rule base files has changed since the
+ * cache was written. The context must not yet contain a rule base.
+ * @return 0 on success, something else otherwise
+ */
+int ln_rbcLoad(ln_ctx ctx, const char *file, const char *cachefile);
+
+/**
+ * Set modification time and size of a rule base file from its stat
+ * data. The time includes nanoseconds where supported, so that changes
+ * within the same second are detected.
+ */
+void ln_rbcSetSourceStat(struct ln_rbsrc *src, const struct stat *st);
+
+void ln_rbcPutU32(struct ln_rbc_writer *wr, uint32_t val);
+void ln_rbcPutU64(struct ln_rbc_writer *wr, uint64_t val);
+void ln_rbcPutBytes(struct ln_rbc_writer *wr, const void *buf, size_t len);
+/** write a string of known length; str may be NULL */
+void ln_rbcPutStrLen(struct ln_rbc_writer *wr, const char *str, size_t len);
+/** write a NUL-terminated string; str may be NULL */
+void ln_rbcPutStr(struct ln_rbc_writer *wr, const char *str);
+
+uint32_t ln_rbcGetU32(struct ln_rbc_reader *rd);
+uint64_t ln_rbcGetU64(struct ln_rbc_reader *rd);
+/** returns a pointer into the mapped file, NULL on error */
+const void * ln_rbcGetBytes(struct ln_rbc_reader *rd, size_t len);
+/**
+ * Read a string. The returned string points into the mapped file
+ * and is NUL-terminated. If the length pointer is not NULL, the length
+ * is stored there.
+ * @return string, or NULL if a NULL string was written (or on error)
+ */
+const char * ln_rbcGetStr(struct ln_rbc_reader *rd, size_t *len);
+
+#endif /* #ifndef LIBLOGNORM_RBCACHE_H_INCLUDED */
@@ -32,6 +32,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "liblognorm.h"
 #include "lognorm.h"
@@ -39,9 +41,55 @@
 #include "internal.h"
 #include "parser.h"
 #include "pdag.h"
+#include "rbcache.h"
 #include "v1_liblognorm.h"
 #include "v1_ptree.h"
 
+/* Parallel rule base loading
+ *
+ * With multiple threads, rule lines are not added to the pdag when
+ * they are read, but collected in a batch. When the batch is flushed,
+ * the rules are tokenized and their parsers created by all threads
+ * ("prepared"). Then the loading thread adds the prepared parsers to
+ * the pdag in rule base order, so that the pdag is exactly the same
+ * as if each rule had been added when read. A batch holds consecutive
+ * rule lines of one file only; it is flushed when it is full, at end
+ * of file and before any other line is processed, so everything else
+ * (including error messages) happens in rule base order.
+ *
+ * Threads must not report errors, as these would appear out of order
+ * and without line number. So they work on a copy of the context which
+ * just counts error messages. Rules which could not be prepared are
+ * processed by the loading thread as usual, which reports the errors.
+ */
+#define RB_BATCH_MAX 2048	/* max rules per batch, limits memory for prepared rules */
+#define RB_MIN_RULES_PER_THREAD 32
+
+/* a parser of a prepared rule, in rule order */
+struct ln_rb_step {
+	ln_parser_t *prs;		/**< prepared parser, or NULL if */
+	struct json_object *prscnf;	/**< ...config must be added by the loading thread */
+};
+
+struct ln_rb_rule {
+	char *line;		/**< rule line after "rule=" */
+	es_size_t lenLine;
+	unsigned lineno;	/**< rule base line number */
+	int bPrepared;		/**< were parsers created successfully? */
+	struct json_object *tags;
+	struct ln_rb_step *steps;
+	unsigned nsteps;
+	unsigned sizeSteps;
+};
+
+struct ln_rb_batch {
+	ln_ctx ctx;
+	int bEnabled;		/**< batching enabled? else rules are added when read */
+	struct ln_rb_rule *rules;	/**< RB_BATCH_MAX entries, allocated on first use */
+	unsigned nrules;
+	unsigned next;		/**< next rule to prepare, shared by threads */
+};
+
 
 void
 ln_sampFree(ln_ctx __attribute__((unused)) ctx, struct ln_samp *samp)
@@ -187,6 +235,58 @@ done:
 	return r;
 }
 
+/* add a parser to a rule being prepared. Parsers of alternatives and
+ * repeat create pdag nodes, so they are created by the loading thread.
+ * The rule owns prscnf after the call.
+ */
+static int
+prepAddParser(ln_ctx ctx, struct ln_rb_rule *const prep, json_object *const prscnf)
+{
+	int r = 0;
+	struct json_object *json;
+	struct ln_rb_step *step;
+
+	if(prep->nsteps == prep->sizeSteps) {
+		const unsigned newsize = (prep->sizeSteps == 0) ? 32 : 2 * prep->sizeSteps;
+		struct ln_rb_step *const newsteps =
+			realloc(prep->steps, newsize * sizeof(struct ln_rb_step));
+		if(newsteps == NULL) {
+			json_object_put(prscnf);
+			FAIL(LN_NOMEM);
+		}
+		prep->steps = newsteps;
+		prep->sizeSteps = newsize;
+	}
+	step = prep->steps + prep->nsteps++;
+	step->prs = NULL;
+	step->prscnf = NULL;
+	if(   json_object_get_type(prscnf) == json_type_object
+	   && json_object_object_get_ex(prscnf, "type", &json)
+	   && strcmp(json_object_get_string(json), "alternative")
+	   && strcmp(json_object_get_string(json), "repeat")) {
+		step->prs = ln_newParser(ctx, prscnf);
+		json_object_put(prscnf);
+		if(step->prs == NULL)
+			r = -1;
+	} else {
+		step->prscnf = prscnf;
+	}
+done:
+	return r;
+}
+
+/* add a parser to the pdag or, if prep is not NULL, to a rule
+ * being prepared
+ */
+static inline int
+addParser(ln_ctx ctx, struct ln_pdag **pdag, struct ln_rb_rule *const prep,
+	json_object *const prscnf)
+{
+	if(prep != NULL)
+		return prepAddParser(ctx, prep, prscnf);
+	return ln_pdagAddParser(ctx, pdag, prscnf);
+}
+
 /**
  * Extract a field description from a sample.
  * The field description is added to the tail of the current
@@ -198,13 +298,15 @@ done:
  * directly. Let's consider us a friend of ptree. This is necessary
  * to optimize the structure for a high-speed parsing process.
  *
+ * @param[in] prep if not NULL, the rule being prepared, which receives
+ * 		   the parser instead of the pdag
  * @param[in] str a temporary work string. This is passed in to save the
  * 		  creation overhead
  * @returns 0 on success, something else otherwise
  */
 static int
-addFieldDescr(ln_ctx ctx, struct ln_pdag **pdag, es_str_t *rule,
-	        size_t *bufOffs, es_str_t **str)
+addFieldDescr(ln_ctx ctx, struct ln_pdag **pdag, struct ln_rb_rule *const prep,
+	es_str_t *rule, size_t *bufOffs, es_str_t **str)
 {
 	int r = 0;
 	es_size_t i = *bufOffs;
@@ -238,7 +340,7 @@ addFieldDescr(ln_ctx ctx, struct ln_pdag **pdag, es_str_t *rule,
 		CHKR(ln_parseLegacyFieldDescr(ctx, buf, lenBuf, bufOffs, str, &prs_config));
 	}
 
-	CHKR(ln_pdagAddParser(ctx, pdag, prs_config));
+	CHKR(addParser(ctx, pdag, prep, prs_config));
 
 done:
 	free(ftype);
@@ -280,6 +382,8 @@ newLiteralParserJSONConf(char lit)
  * @param[in] ctx the context
  * @param[in/out] subtree on entry, current subtree, on exist newest
  *    		deepest subtree
+ * @param[in] prep if not NULL, the rule being prepared, which receives
+ * 		the parsers instead of the pdag
  * @param[in] rule string with current rule
  * @param[in/out] bufOffs parse pointer, up to which offset is parsed
  * 		(is updated so that it points to first char after consumed
@@ -288,8 +392,8 @@ newLiteralParserJSONConf(char lit)
  * @return 0 on success, something else otherwise
  */
 static int
-parseLiteral(ln_ctx ctx, struct ln_pdag **pdag, es_str_t *rule,
-	     size_t *const __restrict__ bufOffs, es_str_t **str)
+parseLiteral(ln_ctx ctx, struct ln_pdag **pdag, struct ln_rb_rule *const prep,
+	es_str_t *rule, size_t *const __restrict__ bufOffs, es_str_t **str)
 {
 	int r = 0;
 	size_t i = *bufOffs;
@@ -322,7 +426,7 @@ parseLiteral(ln_ctx ctx, struct ln_pdag **pdag, es_str_t *rule,
 		struct json_object *const prscnf = 
 			newLiteralParserJSONConf(cstr[i]);
 		CHKN(prscnf);
-		CHKR(ln_pdagAddParser(ctx, pdag, prscnf));
+		CHKR(addParser(ctx, pdag, prep, prscnf));
 	}
 
 	r = 0;
@@ -333,6 +437,17 @@ done:
 }
 
 
+/* we are at the end of rule processing, so this node is a terminal */
+static void
+setRuleEnd(ln_ctx ctx, ln_pdag *const dag, struct json_object *const tagBucket)
+{
+	dag->flags.isTerminal = 1;
+	dag->tags = tagBucket;
+	dag->rb_file = strdup(ctx->conf_file);
+	dag->rb_lineno = ctx->conf_ln_nbr;
+}
+
+
 /* Implementation note:
  * We read in the sample, and split it into chunks of literal text and
  * fields. Each literal text is added as whole to the tree, as is each
@@ -345,13 +460,17 @@ done:
  *
  * format: literal1%field:type:extra-data%literal2
  *
+ * If prep is not NULL, the parsers are not added to the tree but to
+ * the rule being prepared (dag and tagBucket are unused then).
+ *
  * @returns the new dag root (or NULL in case of error)
  */
 static int
 addSampToTree(ln_ctx ctx,
 	es_str_t *rule,
 	ln_pdag *dag,
-	struct json_object *tagBucket)
+	struct json_object *tagBucket,
+	struct ln_rb_rule *const prep)
 {
 	int r = -1;
 	es_str_t *str = NULL;
@@ -361,23 +480,20 @@ addSampToTree(ln_ctx ctx,
 	i = 0;
 	while(i < es_strlen(rule)) {
 		LN_DBGPRINTF(ctx, "addSampToTree %zu of %d", i, es_strlen(rule));
-		CHKR(parseLiteral(ctx, &dag, rule, &i, &str));
+		CHKR(parseLiteral(ctx, &dag, prep, rule, &i, &str));
 		/* After the literal there can be field only*/
 		if (i < es_strlen(rule)) {
-			CHKR(addFieldDescr(ctx, &dag, rule, &i, &str));
+			CHKR(addFieldDescr(ctx, &dag, prep, rule, &i, &str));
 			if (i == es_strlen(rule)) {
 				/* finish the tree with empty literal to avoid false merging*/
-				CHKR(parseLiteral(ctx, &dag, rule, &i, &str));
+				CHKR(parseLiteral(ctx, &dag, prep, rule, &i, &str));
 			}
 		}
 	}
 
 	LN_DBGPRINTF(ctx, "end addSampToTree %zu of %d", i, es_strlen(rule));
-	/* we are at the end of rule processing, so this node is a terminal */
-	dag->flags.isTerminal = 1;
-	dag->tags = tagBucket;
-	dag->rb_file = strdup(ctx->conf_file);
-	dag->rb_lineno = ctx->conf_ln_nbr;
+	if(prep == NULL)
+		setRuleEnd(ctx, dag, tagBucket);
 
 done:
 	if(str != NULL)
@@ -541,8 +657,30 @@ done:	return r;
 
 
 
+/* obtain the tags and the rule text (including prefix) of a rule line */
+static int
+getRule(ln_ctx ctx, const char *buf, es_size_t lenBuf, es_size_t offs,
+	struct json_object **tagBucket, es_str_t **str)
+{
+	int r;
+
+	CHKR(processTags(ctx, buf, lenBuf, &offs, tagBucket));
+	if(offs == lenBuf) {
+		ln_errprintf(ctx, 0, "error: actual message sample part is missing");
+		FAIL(-1);
+	}
+	if(ctx->rulePrefix == NULL) {
+		CHKN(*str = es_newStr(lenBuf));
+	} else {
+		CHKN(*str = es_strdup(ctx->rulePrefix));
+	}
+	CHKR(es_addBuf(str, (char*)buf + offs, lenBuf - offs));
+done:	return r;
+}
+
+
 /**
- * Process a new rule and add it to pdag.
+ * Add a rule to pdag.
  *
  * @param[in] ctx current context
  * @param[in] buf line buffer
@@ -551,28 +689,217 @@ done:	return r;
  * @returns 0 on success, something else otherwise
  */
 static int
-processRule(ln_ctx ctx, const char *buf, es_size_t lenBuf, es_size_t offs)
+addRule(ln_ctx ctx, const char *buf, es_size_t lenBuf, es_size_t offs)
 {
-	int r = -1;
-	es_str_t *str;
+	int r;
+	es_str_t *str = NULL;
 	struct json_object *tagBucket = NULL;
 
 	ln_dbgprintf(ctx, "rule line to add: '%s'", buf+offs);
-	CHKR(processTags(ctx, buf, lenBuf, &offs, &tagBucket));
-
-	if(offs == lenBuf) {
-		ln_errprintf(ctx, 0, "error: actual message sample part is missing");
+	if((r = getRule(ctx, buf, lenBuf, offs, &tagBucket, &str)) != 0) {
+		if(tagBucket != NULL)
+			json_object_put(tagBucket);
 		goto done;
 	}
-	if(ctx->rulePrefix == NULL) {
-		CHKN(str = es_newStr(lenBuf));
-	} else {
-		CHKN(str = es_strdup(ctx->rulePrefix));
+	if(addSampToTree(ctx, str, ctx->pdag, tagBucket, NULL) != 0 && tagBucket != NULL)
+		json_object_put(tagBucket); /* not taken over by the pdag */
+done:
+	if(str != NULL)
+		es_deleteStr(str);
+	return r;
+}
+
+
+/* free what has been prepared for a rule */
+static void
+prepDiscard(ln_ctx ctx, struct ln_rb_rule *const rule)
+{
+	for(unsigned i = 0 ; i < rule->nsteps ; ++i) {
+		if(rule->steps[i].prs != NULL)
+			ln_deleteParser(ctx, rule->steps[i].prs);
+		if(rule->steps[i].prscnf != NULL)
+			json_object_put(rule->steps[i].prscnf);
 	}
-	CHKR(es_addBuf(&str, (char*)buf + offs, lenBuf - offs));
-	addSampToTree(ctx, str, ctx->pdag, tagBucket);
-	es_deleteStr(str);
-	r = 0;
+	free(rule->steps);
+	rule->steps = NULL;
+	rule->nsteps = rule->sizeSteps = 0;
+	if(rule->tags != NULL) {
+		json_object_put(rule->tags);
+		rule->tags = NULL;
+	}
+}
+
+/* tokenize a rule and create its parsers */
+static int
+prepRule(ln_ctx ctx, struct ln_rb_rule *const rule)
+{
+	int r;
+	es_str_t *str = NULL;
+
+	CHKR(getRule(ctx, rule->line, rule->lenLine, 0, &rule->tags, &str));
+	CHKR(addSampToTree(ctx, str, NULL, NULL, rule));
+done:
+	if(str != NULL)
+		es_deleteStr(str);
+	return r;
+}
+
+/* error message callback of the threads' context copies */
+static void
+prepCountErr(void *const cookie, const char __attribute__((unused)) *msg,
+	size_t __attribute__((unused)) lenMsg)
+{
+	++*(unsigned*) cookie;
+}
+
+/* prepare rules of the batch until none is left */
+static void
+prepRules(struct ln_rb_batch *const batch)
+{
+	struct ln_ctx_s pctx = *batch->ctx;
+	unsigned nerrs;
+	unsigned i;
+
+	pctx.dbgCB = NULL;
+	pctx.debug = 0;
+	pctx.errmsgCB = prepCountErr;
+	/* note: ln_errprintf() passes the debug cookie */
+	pctx.errmsgCookie = pctx.dbgCookie = &nerrs;
+	pctx.conf_file = NULL;
+	while((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->nrules) {
+		struct ln_rb_rule *const rule = batch->rules + i;
+		nerrs = 0;
+		if(prepRule(&pctx, rule) == 0 && nerrs == 0)
+			rule->bPrepared = 1;
+		else
+			prepDiscard(&pctx, rule);
+	}
+}
+
+static void *
+prepThread(void *const arg)
+{
+	prepRules((struct ln_rb_batch *) arg);
+	return NULL;
+}
+
+/* add a prepared rule to the pdag, just like addRule() does */
+static int
+addPreparedRule(ln_ctx ctx, struct ln_rb_rule *const rule)
+{
+	int r = 0;
+	ln_pdag *dag = ctx->pdag;
+
+	for(unsigned i = 0 ; i < rule->nsteps ; ++i) {
+		struct ln_rb_step *const step = rule->steps + i;
+		if(step->prs != NULL) {
+			r = ln_pdagAddNewParser(ctx, &dag, step->prs);
+			step->prs = NULL;
+		} else {
+			r = ln_pdagAddParser(ctx, &dag, step->prscnf);
+			step->prscnf = NULL;
+		}
+		if(r != 0)
+			goto done;
+	}
+	setRuleEnd(ctx, dag, rule->tags);
+	rule->tags = NULL;
+done:
+	return r;
+}
+
+/* prepare the rules of the batch in parallel, then add them in order */
+static void
+rbBatchFlush(struct ln_rb_batch *const batch)
+{
+	ln_ctx ctx = batch->ctx;
+	const unsigned conf_ln_nbr_save = ctx->conf_ln_nbr;
+	pthread_t *thrds;
+	unsigned nthrds;
+
+	if(batch->nrules == 0)
+		return;
+	nthrds = ln_loadThreads(ctx, batch->nrules, RB_MIN_RULES_PER_THREAD) - 1;
+	if(nthrds > 0 && (thrds = malloc(nthrds * sizeof(pthread_t))) != NULL) {
+		batch->next = 0;
+		for(unsigned i = 0 ; i < nthrds ; ++i) {
+			if(pthread_create(thrds+i, NULL, prepThread, batch) != 0) {
+				nthrds = i; /* the others do the remaining work */
+				break;
+			}
+		}
+		prepRules(batch);
+		for(unsigned i = 0 ; i < nthrds ; ++i)
+			pthread_join(thrds[i], NULL);
+		free(thrds);
+	}
+
+	for(unsigned i = 0 ; i < batch->nrules ; ++i) {
+		struct ln_rb_rule *const rule = batch->rules + i;
+		ctx->conf_ln_nbr = rule->lineno;
+		if(rule->bPrepared)
+			addPreparedRule(ctx, rule);
+		else
+			addRule(ctx, rule->line, rule->lenLine, 0);
+		prepDiscard(ctx, rule);
+		free(rule->line);
+	}
+	batch->nrules = 0;
+	ctx->conf_ln_nbr = conf_ln_nbr_save;
+}
+
+static void
+rbBatchInit(ln_ctx ctx, struct ln_rb_batch *const batch)
+{
+	memset(batch, 0, sizeof(struct ln_rb_batch));
+	batch->ctx = ctx;
+	batch->bEnabled = ln_loadThreads(ctx, RB_BATCH_MAX, RB_MIN_RULES_PER_THREAD) > 1;
+}
+
+static void
+rbBatchExit(struct ln_rb_batch *const batch)
+{
+	rbBatchFlush(batch);
+	free(batch->rules);
+}
+
+
+/**
+ * Process a new rule and add it to pdag.
+ * If batching is enabled, the rule is added when the batch is flushed.
+ *
+ * @param[in] ctx current context
+ * @param[in] batch current batch
+ * @param[in] buf line buffer
+ * @param[in] len length of buffer
+ * @param[in] offs offset where rule starts
+ * @returns 0 on success, something else otherwise
+ */
+static int
+processRule(ln_ctx ctx, struct ln_rb_batch *const batch,
+	const char *buf, es_size_t lenBuf, es_size_t offs)
+{
+	int r = 0;
+	char *line;
+
+	if(batch->bEnabled) {
+		if(batch->rules == NULL)
+			batch->rules = malloc(RB_BATCH_MAX * sizeof(struct ln_rb_rule));
+		if(batch->rules != NULL && (line = malloc(lenBuf - offs + 1)) != NULL) {
+			struct ln_rb_rule *const rule = batch->rules + batch->nrules;
+			memcpy(line, buf + offs, lenBuf - offs);
+			line[lenBuf - offs] = '\0';
+			memset(rule, 0, sizeof(struct ln_rb_rule));
+			rule->line = line;
+			rule->lenLine = lenBuf - offs;
+			rule->lineno = ctx->conf_ln_nbr;
+			if(++batch->nrules == RB_BATCH_MAX)
+				rbBatchFlush(batch);
+			goto done;
+		}
+		rbBatchFlush(batch); /* out of memory, keep rule base order */
+	}
+	r = addRule(ctx, buf, lenBuf, offs);
 done:	return r;
 }
 
@@ -647,7 +974,9 @@ processType(ln_ctx ctx,
 	CHKR(es_addBuf(&str, (char*)buf + offs, lenBuf - offs));
 	struct ln_type_pdag *const td = ln_pdagFindType(ctx, typename, 1);
 	CHKN(td);
-	addSampToTree(ctx, str, td->pdag, NULL);
+	if(td->bInlined)
+		ln_pdagUninlineType(ctx, td);
+	addSampToTree(ctx, str, td->pdag, NULL, NULL);
 	es_deleteStr(str);
 	r = 0;
 done:	return r;
@@ -855,12 +1184,13 @@ done:
  * out of it, which it adds to the pdag (if required).
  *
  * @param[ctx] ctx current library context
+ * @param[batch] batch rules are collected in
  * @param[buf] cstr buffer containing the string contents of the sample
  * @param[lenBuf] length of the sample contained within buf
  * @return standard error code
  */
 static int
-ln_processSamp(ln_ctx ctx, const char *buf, const size_t lenBuf)
+ln_processSamp(ln_ctx ctx, struct ln_rb_batch *const batch, const char *buf, const size_t lenBuf)
 {
 	int r = 0;
 	es_str_t *typeStr = NULL;
@@ -869,12 +1199,14 @@ ln_processSamp(ln_ctx ctx, const char *buf, const size_t lenBuf)
 	if(getLineType(buf, lenBuf, &offs, &typeStr) != 0)
 		goto done;
 
+	if(es_strconstcmp(typeStr, "rule"))
+		rbBatchFlush(batch);
 	if(!es_strconstcmp(typeStr, "prefix")) {
 		if(getPrefix(buf, lenBuf, offs, &ctx->rulePrefix) != 0) goto done;
 	} else if(!es_strconstcmp(typeStr, "extendprefix")) {
 		if(extendPrefix(ctx, buf, lenBuf, offs) != 0) goto done;
 	} else if(!es_strconstcmp(typeStr, "rule")) {
-		if(processRule(ctx, buf, lenBuf, offs) != 0) goto done;
+		if(processRule(ctx, batch, buf, lenBuf, offs) != 0) goto done;
 	} else if(!es_strconstcmp(typeStr, "type")) {
 		if(processType(ctx, buf, lenBuf, offs) != 0) goto done;
 	} else if(!es_strconstcmp(typeStr, "annotate")) {
@@ -971,12 +1303,14 @@ done:
  * pdag.
  *
  * @param[in] ctx current library context
+ * @param[in] batch batch rules are collected in
  * @param[in] repo repository descriptor
  * @param[out] isEof must be set to 0 on entry and is switched to 1 if EOF occured.
  * @return standard error code
  */
 static int
-ln_sampRead(ln_ctx ctx, FILE *const __restrict__ repo, int *const __restrict__ isEof)
+ln_sampRead(ln_ctx ctx, struct ln_rb_batch *const batch, FILE *const __restrict__ repo,
+	int *const __restrict__ isEof)
 {
 	int r = 0;
 	char buf[64*1024]; /**< max size of rule - TODO: make configurable */
@@ -1019,7 +1353,7 @@ ln_sampRead(ln_ctx ctx, FILE *const __restrict__ repo, int *const __restrict__ i
 	buf[i] = '\0';
 
 	ln_dbgprintf(ctx, "read rulebase line[~%d]: '%s'", ctx->conf_ln_nbr, buf);
-	CHKR(ln_processSamp(ctx, buf, i));
+	CHKR(ln_processSamp(ctx, batch, buf, i));
 
 done:
 	return r;
@@ -1059,6 +1393,37 @@ done:
 	return r;
 }
 
+/* remember a rulebase file that we opened, so that rulebase caches
+ * can later check if it has changed.
+ * @returns 0 on success, something else otherwise
+ */
+static int
+recordRBFile(ln_ctx ctx, const char *const file, const char *const path, FILE *const repo)
+{
+	int r = 0;
+	struct stat st;
+	struct ln_rbsrc *newsrcs;
+
+	if(fstat(fileno(repo), &st) != 0) {
+		ln_errprintf(ctx, errno, "cannot stat rulebase '%s'", path);
+		FAIL(-1);
+	}
+	CHKN(newsrcs = realloc(ctx->rbsrcs, (ctx->nRbsrcs+1) * sizeof(struct ln_rbsrc)));
+	ctx->rbsrcs = newsrcs;
+	struct ln_rbsrc *const src = ctx->rbsrcs + ctx->nRbsrcs;
+	src->name = strdup(file);
+	src->path = strdup(path);
+	if(src->name == NULL || src->path == NULL) {
+		free(src->name);
+		free(src->path);
+		FAIL(LN_NOMEM);
+	}
+	ln_rbcSetSourceStat(src, &st);
+	++ctx->nRbsrcs;
+done:
+	return r;
+}
+
 /* try to open a rulebase file. This also tries to see if we need to
  * load it from some pre-configured alternative location.
  * @returns open file pointer or NULL in case of error
@@ -1067,6 +1432,7 @@ static FILE *
 tryOpenRBFile(ln_ctx ctx, const char *const file)
 {
 	FILE *repo = NULL;
+	char *fname = NULL;
 
 	if((repo = fopen(file, "r")) != NULL)
 		goto done;
@@ -1078,7 +1444,6 @@ tryOpenRBFile(ln_ctx ctx, const char *const file)
 		goto done;
 	}
 
-	char *fname = NULL;
 	asprintf(&fname, (rb_lib[strlen(rb_lib)-1] == '/') ? "%s%s" : "%s/%s", rb_lib, file);
 	if((repo = fopen(fname, "r")) == NULL) {
 		const int eno2 = errno;
@@ -1087,9 +1452,13 @@ tryOpenRBFile(ln_ctx ctx, const char *const file)
 			"rulebase directory without success. Expanded "
 			"name was '%s'", file, fname);
 	}
-	free(fname);
 
 done:
+	if(repo != NULL && recordRBFile(ctx, file, (fname == NULL) ? file : fname, repo) != 0) {
+		fclose(repo);
+		repo = NULL;
+	}
+	free(fname);
 	return repo;
 }
 
@@ -1100,7 +1469,9 @@ ln_sampLoad(ln_ctx ctx, const char *file)
 	int r = 1;
 	FILE *repo;
 	int isEof = 0;
+	struct ln_rb_batch batch;
 
+	rbBatchInit(ctx, &batch);
 	ln_dbgprintf(ctx, "loading rulebase file '%s'", file);
 	if(file == NULL) goto done;
 	if((repo = tryOpenRBFile(ctx, file)) == NULL)
@@ -1126,14 +1497,16 @@ ln_sampLoad(ln_ctx ctx, const char *file)
 	/* now we are in our native code */
 	++ctx->conf_ln_nbr; /* "version=2" is line 1! */
 	while(!isEof) {
-		CHKR(ln_sampRead(ctx, repo, &isEof));
+		CHKR(ln_sampRead(ctx, &batch, repo, &isEof));
 	}
 	fclose(repo);
+	rbBatchFlush(&batch);
 	r = 0;
 
 	if(ctx->include_level == 1)
 		ln_pdagOptimize(ctx);
 done:
+	rbBatchExit(&batch);
 	return r;
 }
 
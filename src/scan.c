@@ -0,0 +1,304 @@
+/**
+ * @file scan.c
+ * @brief Implementation of the byte scanning kernels.
+ *
+ * The vector kernels use unaligned loads and never read beyond the end
+ * of the buffer; the remaining bytes are handled by the scalar code.
+ *//*
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) \
+	&& ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#	define SCAN_X86 1
+#	include <immintrin.h>
+#endif
+
+static inline int
+isASCIISpace(const unsigned char c)
+{
+	return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+static size_t
+scanClassScalar(const struct ln_charclass *const cc, const char *const str, const size_t len)
+{
+	size_t i;
+	for(i = 0 ; i < len && !ln_charclassHas(cc, str[i]) ; ++i)
+		/* just scan */;
+	return i;
+}
+
+static size_t
+scanSetScalar(const struct ln_scanset *const set, const char *const str, const size_t len)
+{
+	return scanClassScalar(&set->cls, str, len);
+}
+
+static size_t
+scanSpacesScalar(const char *const str, const size_t len)
+{
+	size_t i;
+	for(i = 0 ; i < len && isASCIISpace(str[i]) ; ++i)
+		/* just scan */;
+	return i;
+}
+
+
+#ifdef SCAN_X86
+/* class membership of 16 bytes at once: the low nibble selects the
+ * table entry (pshufb), the high nibble the table and the bit in it.
+ */
+__attribute__((target("ssse3"))) static size_t
+scanClassSSSE3(const struct ln_charclass *const cc, const char *const str, const size_t len)
+{
+	size_t i = 0;
+	const __m128i tbl0 = _mm_loadu_si128((const __m128i*) cc->tbl[0]);
+	const __m128i tbl1 = _mm_loadu_si128((const __m128i*) cc->tbl[1]);
+	const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					   1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i seven = _mm_set1_epi8(7);
+
+	for( ; i + 16 <= len ; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i*) (str + i));
+		const __m128i lo = _mm_and_si128(x, nibble);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+		const __m128i upper = _mm_cmpgt_epi8(hi, seven);
+		const __m128i row = _mm_or_si128(
+			_mm_andnot_si128(upper, _mm_shuffle_epi8(tbl0, lo)),
+			_mm_and_si128(upper, _mm_shuffle_epi8(tbl1, lo)));
+		const __m128i bit = _mm_shuffle_epi8(bits, hi);
+		const __m128i m = _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+		const unsigned mask = (unsigned) _mm_movemask_epi8(m);
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scanClassScalar(cc, str + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+scanClassAVX2(const struct ln_charclass *const cc, const char *const str, const size_t len)
+{
+	size_t i = 0;
+	const __m256i tbl0 = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i*) cc->tbl[0]));
+	const __m256i tbl1 = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i*) cc->tbl[1]));
+	const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					      1, 2, 4, 8, 16, 32, 64, -128,
+					      1, 2, 4, 8, 16, 32, 64, -128,
+					      1, 2, 4, 8, 16, 32, 64, -128);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i seven = _mm256_set1_epi8(7);
+
+	for( ; i + 32 <= len ; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i*) (str + i));
+		const __m256i lo = _mm256_and_si256(x, nibble);
+		const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble);
+		const __m256i upper = _mm256_cmpgt_epi8(hi, seven);
+		const __m256i row = _mm256_or_si256(
+			_mm256_andnot_si256(upper, _mm256_shuffle_epi8(tbl0, lo)),
+			_mm256_and_si256(upper, _mm256_shuffle_epi8(tbl1, lo)));
+		const __m256i bit = _mm256_shuffle_epi8(bits, hi);
+		const __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+		const unsigned mask = (unsigned) _mm256_movemask_epi8(m);
+		if(mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scanClassSSSE3(cc, str + i, len - i);
+}
+__attribute__((target("sse2"))) static size_t
+scanSetSSE2(const struct ln_scanset *const set, const char *const str, const size_t len)
+{
+	size_t i = 0;
+	__m128i c[LN_SCANSET_MAX_SIMD];
+
+	for(unsigned k = 0 ; k < set->n ; ++k)
+		c[k] = _mm_set1_epi8(set->chars[k]);
+	for( ; i + 16 <= len ; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i*) (str + i));
+		__m128i m = _mm_cmpeq_epi8(x, c[0]);
+		for(unsigned k = 1 ; k < set->n ; ++k)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(x, c[k]));
+		const unsigned bits = (unsigned) _mm_movemask_epi8(m);
+		if(bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scanSetScalar(set, str + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+scanSetAVX2(const struct ln_scanset *const set, const char *const str, const size_t len)
+{
+	size_t i = 0;
+	__m256i c[LN_SCANSET_MAX_SIMD];
+
+	for(unsigned k = 0 ; k < set->n ; ++k)
+		c[k] = _mm256_set1_epi8(set->chars[k]);
+	for( ; i + 32 <= len ; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i*) (str + i));
+		__m256i m = _mm256_cmpeq_epi8(x, c[0]);
+		for(unsigned k = 1 ; k < set->n ; ++k)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, c[k]));
+		const unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+		if(bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scanSetSSE2(set, str + i, len - i);
+}
+
+/* ASCII whitespace is SP or 0x09..0x0d; the latter is checked as
+ * (c - 9) <= 4, unsigned, via min(c - 9, 4) == c - 9.
+ */
+__attribute__((target("sse2"))) static size_t
+scanSpacesSSE2(const char *const str, const size_t len)
+{
+	size_t i = 0;
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i ht = _mm_set1_epi8('\t');
+	const __m128i range = _mm_set1_epi8('\r' - '\t');
+
+	for( ; i + 16 <= len ; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i*) (str + i));
+		const __m128i t = _mm_sub_epi8(x, ht);
+		const __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, sp),
+			_mm_cmpeq_epi8(_mm_min_epu8(t, range), t));
+		const unsigned bits = ~(unsigned) _mm_movemask_epi8(m) & 0xffff;
+		if(bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scanSpacesScalar(str + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t
+scanSpacesAVX2(const char *const str, const size_t len)
+{
+	size_t i = 0;
+	const __m256i sp = _mm256_set1_epi8(' ');
+	const __m256i ht = _mm256_set1_epi8('\t');
+	const __m256i range = _mm256_set1_epi8('\r' - '\t');
+
+	for( ; i + 32 <= len ; i += 32) {
+		const __m256i x = _mm256_loadu_si256((const __m256i*) (str + i));
+		const __m256i t = _mm256_sub_epi8(x, ht);
+		const __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, sp),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(t, range), t));
+		const unsigned bits = ~(unsigned) _mm256_movemask_epi8(m);
+		if(bits != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scanSpacesSSE2(str + i, len - i);
+}
+
+#endif /* #ifdef SCAN_X86 */
+
+
+static size_t (*scanSetImpl)(const struct ln_scanset*, const char*, size_t) = scanSetScalar;
+static size_t (*scanSpacesImpl)(const char*, size_t) = scanSpacesScalar;
+static size_t (*scanClassImpl)(const struct ln_charclass*, const char*, size_t) = scanClassScalar;
+static pthread_once_t scanOnce = PTHREAD_ONCE_INIT;
+
+static void
+scanSelect(void)
+{
+#ifdef SCAN_X86
+	const char *const limit = getenv("LIBLOGNORM_SCAN");
+	int level = 2; /* 0 - scalar, 1 - sse2, 2 - avx2 */
+
+	if(limit != NULL) {
+		if(!strcmp(limit, "scalar"))
+			level = 0;
+		else if(!strcmp(limit, "sse2"))
+			level = 1;
+	}
+	__builtin_cpu_init();
+	if(level >= 2 && __builtin_cpu_supports("avx2")) {
+		scanSetImpl = scanSetAVX2;
+		scanSpacesImpl = scanSpacesAVX2;
+		scanClassImpl = scanClassAVX2;
+	} else if(level >= 1 && __builtin_cpu_supports("sse2")) {
+		scanSetImpl = scanSetSSE2;
+		scanSpacesImpl = scanSpacesSSE2;
+		if(__builtin_cpu_supports("ssse3"))
+			scanClassImpl = scanClassSSSE3;
+	}
+#endif
+}
+
+void
+ln_scanInit(void)
+{
+	pthread_once(&scanOnce, scanSelect);
+}
+
+void
+ln_scansetInit(struct ln_scanset *const set, const char *const chars)
+{
+	memset(set, 0, sizeof(*set));
+	for(const unsigned char *c = (const unsigned char*) chars ; *c != '\0' ; ++c) {
+		if(ln_charclassHas(&set->cls, *c))
+			continue;
+		if(set->n < LN_SCANSET_MAX_SIMD)
+			set->chars[set->n] = (char) *c;
+		++set->n;
+		ln_charclassAdd(&set->cls, *c);
+	}
+	ln_charclassPrepare(&set->cls);
+}
+
+void
+ln_charclassPrepare(struct ln_charclass *const cc)
+{
+	memset(cc->tbl, 0, sizeof(cc->tbl));
+	for(unsigned c = 0 ; c < 256 ; ++c) {
+		if(ln_charclassHas(cc, c))
+			cc->tbl[c >> 7][c & 0x0f] |= 1 << ((c >> 4) & 7);
+	}
+}
+
+size_t
+ln_scanClass(const struct ln_charclass *const cc, const char *const str, const size_t len)
+{
+	return scanClassImpl(cc, str, len);
+}
+
+size_t
+ln_scanSet(const struct ln_scanset *const set, const char *const str, const size_t len)
+{
+	if(set->n == 1)
+		return ln_scanChar(set->chars[0], str, len);
+	if(set->n == 0)
+		return len;
+	if(set->n > LN_SCANSET_MAX_SIMD)
+		return scanClassImpl(&set->cls, str, len);
+	return scanSetImpl(set, str, len);
+}
+
+size_t
+ln_scanSpaces(const char *const str, const size_t len)
+{
+	return scanSpacesImpl(str, len);
+}
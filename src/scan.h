@@ -0,0 +1,126 @@
+/**
+ * @file scan.h
+ * @brief Byte scanning kernels used by the field parsers.
+ *
+ * Parsers that search for a terminator spend most of their time looking
+ * at one byte after the other. The kernels in this file check 16 (SSE2)
+ * or 32 (AVX2) bytes at once if the CPU supports it, and fall back to
+ * plain C otherwise. The implementation is selected at runtime by
+ * ln_scanInit(). The environment variable LIBLOGNORM_SCAN can be set to
+ * "scalar", "sse2" (128 bit vectors: SSE2 and SSSE3) or "avx2" to limit
+ * the instruction set used, which is mostly useful for testing.
+ *//*
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#ifndef LIBLOGNORM_SCAN_H_INCLUDED
+#define	LIBLOGNORM_SCAN_H_INCLUDED
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * A character class: an arbitrary set of byte values. Members are
+ * kept in a 256 bit bitmap. For the vector kernels, the bitmap is also
+ * kept as two 16 byte tables indexed by the low nibble of a byte: bit
+ * h of tbl[0][lo] is set if (h << 4 | lo) is a member, tbl[1] does the
+ * same for the upper eight high nibble values.
+ */
+struct ln_charclass {
+	uint8_t map[32];	/**< bit (c & 7) of map[c >> 3] is set for members */
+	uint8_t tbl[2][16];	/**< nibble lookup tables, see ln_charclassPrepare() */
+};
+
+static inline void
+ln_charclassAdd(struct ln_charclass *const cc, const unsigned char c)
+{
+	cc->map[c >> 3] |= 1 << (c & 7);
+}
+
+static inline void
+ln_charclassDel(struct ln_charclass *const cc, const unsigned char c)
+{
+	cc->map[c >> 3] &= ~(1 << (c & 7));
+}
+
+static inline int
+ln_charclassHas(const struct ln_charclass *const cc, const unsigned char c)
+{
+	return cc->map[c >> 3] & (1 << (c & 7));
+}
+
+/**
+ * Build the lookup tables of a class. Must be called after the last
+ * modification and before the class is used by ln_scanClass().
+ */
+void ln_charclassPrepare(struct ln_charclass *cc);
+
+/**
+ * Find the first byte that is a member of a character class.
+ * @return its index, or len if there is none
+ */
+size_t ln_scanClass(const struct ln_charclass *cc, const char *str, size_t len);
+
+/* larger terminator sets are scanned as character class */
+#define LN_SCANSET_MAX_SIMD 8
+
+/** a set of terminator characters, prepared for scanning */
+struct ln_scanset {
+	unsigned n;				/**< number of chars in set */
+	char chars[LN_SCANSET_MAX_SIMD];	/**< the chars, if n <= LN_SCANSET_MAX_SIMD */
+	struct ln_charclass cls;		/**< all chars */
+};
+
+/**
+ * Select the scanning kernels for this CPU. Called by ln_initCtx(),
+ * may be called any number of times.
+ */
+void ln_scanInit(void);
+
+/**
+ * Prepare a set of terminator characters.
+ * @param chars NUL-terminated string of characters, may be empty
+ */
+void ln_scansetInit(struct ln_scanset *set, const char *chars);
+
+/**
+ * Find the first byte that is a member of a set.
+ * @return its index, or len if there is none
+ */
+size_t ln_scanSet(const struct ln_scanset *set, const char *str, size_t len);
+
+/**
+ * Find the first byte that is not ASCII whitespace (SP, HT, LF, VT,
+ * FF, CR).
+ * @return its index, or len if there is none
+ */
+size_t ln_scanSpaces(const char *str, size_t len);
+
+/**
+ * Find the first occurrence of a char. The C library's memchr() is
+ * vectorized on all relevant platforms, so it is used directly.
+ * @return its index, or len if there is none
+ */
+static inline size_t
+ln_scanChar(const char c, const char *const str, const size_t len)
+{
+	const char *const p = memchr(str, c, len);
+	return (p == NULL) ? len : (size_t) (p - str);
+}
+
+#endif /* #ifndef LIBLOGNORM_SCAN_H_INCLUDED */
@@ -2557,7 +2557,7 @@ parseNameValue(const char *const __restrict__ str,
 	const size_t iName = i;
 	while(i < strLen && isValidNameChar(str[i]))
 		++i;
-	if(i == iName || str[i] != '=')
+	if(i == iName || i == strLen || str[i] != '=')
 		goto done; /* no name at all! */
 
 	const size_t lenName = i - iName;
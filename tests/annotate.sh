@@ -0,0 +1,40 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "annotations"
+add_rule 'version=2'
+add_rule 'rule=t1,t2:a %x:word%'
+add_rule 'rule=t2:b %x:word%'
+add_rule 'rule=t3,t1:c %x:word%'
+add_rule 'rule=t4:d %x:word%'
+add_rule 'rule=:e %x:word%'
+add_rule 'annotate=t1:+k1="v1"'
+add_rule 'annotate=t1:+k2="v2"'
+add_rule 'annotate=t2:+k1="w1"'
+add_rule 'annotate=t2:+k3=""'
+add_rule 'annotate=t4:+x="over"'
+
+export ln_opts='-T'
+execute 'a 1'
+assert_output_json_eq '{ "x": "1", "event.tags": [ "t1", "t2" ], "k3": "", "k1": "v1", "k2": "v2" }'
+
+execute 'b 2'
+assert_output_json_eq '{ "x": "2", "event.tags": [ "t2" ], "k3": "", "k1": "w1" }'
+
+execute 'c 3'
+assert_output_json_eq '{ "x": "3", "event.tags": [ "t3", "t1" ], "k2": "v2", "k1": "v1" }'
+
+execute 'd 4'
+assert_output_json_eq '{ "x": "over", "event.tags": [ "t4" ] }'
+
+execute 'e 5'
+assert_output_json_eq '{ "x": "5" }'
+
+# span mode writes annotations directly; the text must not differ
+printf 'a 1\nb 2\nc 3\nd 4\ne 5\n' > annotate.in
+$cmd -r tmp.rulebase -e json -T -oaddRule < annotate.in > annotate.expected
+$cmd -r tmp.rulebase -e json -T -oaddRule -l < annotate.in > test.out
+cmp annotate.expected test.out || exit 1
+
+rm -f annotate.in annotate.expected
+cleanup_tmp_files
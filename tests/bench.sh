@@ -0,0 +1,22 @@
+#!/bin/sh
+# Normalization benchmark suites, run via "make bench". Each suite is a
+# rule base plus a corpus; the syslog suite is also run with fixed
+# matching/non-matching mixes. BENCH_PASSES sets the number of passes
+# over each corpus.
+# This file is part of the liblognorm project, released under ASL 2.0
+srcdir=${srcdir:-.}
+passes=${BENCH_PASSES:-2000}
+rulebases=$srcdir/../rulebases
+corpora=$srcdir/bench
+
+run() {
+    echo ===============================================================================
+    ./lnbench -n $passes "$@" || exit 1
+}
+
+run -r $rulebases/cisco.rulebase -i $corpora/cisco.log
+run -r $rulebases/messages.rulebase -i $corpora/messages.log
+run -r $rulebases/syslog.rulebase -i $corpora/syslog.log
+for mix in 0 50 100; do
+    run -r $rulebases/syslog.rulebase -i $corpora/syslog.log -m $mix
+done
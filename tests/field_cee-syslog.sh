@@ -24,6 +24,12 @@ assert_output_json_eq '{ "field": { "f1": "1", "f2": 2 } }'
 execute '@cee: {"f1": "1", "f2": 2} data'
 assert_output_json_eq '{ "originalmsg": "@cee: {\"f1\": \"1\", \"f2\": 2} data", "unparsed-data": "@cee: {\"f1\": \"1\", \"f2\": 2} data" }'
 
+# cee-syslog not at the start of the message
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:prefix %field:cee-syslog%'
+execute 'prefix @cee:{"f1": "1"}'
+assert_output_json_eq '{ "field": { "f1": "1" } }'
 
 cleanup_tmp_files
 
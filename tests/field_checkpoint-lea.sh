@@ -9,6 +9,11 @@ add_rule 'rule=:%f:checkpoint-lea%'
 execute 'tcp_flags: RST-ACK; src: 192.168.0.1;'
 assert_output_json_eq '{ "f": { "tcp_flags": "RST-ACK", "src": "192.168.0.1" } }'
 
+#
+# Things that MUST NOT work
+#
+execute 'tcp_flags: RST-ACK; src: 192.168.0.1; x'
+assert_output_json_eq '{ "originalmsg": "tcp_flags: RST-ACK; src: 192.168.0.1; x", "unparsed-data": "tcp_flags: RST-ACK; src: 192.168.0.1; x" }'
 
 cleanup_tmp_files
 
@@ -23,6 +23,9 @@ assert_output_json_eq '{ "f": "test with \" double escape" }'
 execute 'a "test with \" backslash escape" b'
 assert_output_json_eq '{ "f": "test with \" backslash escape" }'
 
+execute 'a äöü b'
+assert_output_json_eq '{"f": "äöü"}'
+
 echo test quoting.mode
 reset_rules
 add_rule 'version=2'
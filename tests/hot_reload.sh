@@ -0,0 +1,19 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "rule base hot reload"
+add_rule 'version=2'
+add_rule 'rule=a:msg %f:number%'
+add_rule 'rule=other:other %f:word%'
+
+cat > reload_b.rulebase <<RB
+version=2
+type=@val:%f:word%
+rule=b:msg %f:word%
+rule=other:other %.:@val%
+RB
+
+./reload tmp.rulebase reload_b.rulebase 200
+
+rm -f reload_b.rulebase
+cleanup_tmp_files
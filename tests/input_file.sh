@@ -0,0 +1,44 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "reading messages from file (-i)"
+add_rule 'version=2'
+add_rule 'rule=:alpha %a:word%'
+add_rule 'rule=:%n:number% items'
+
+# CRLF line ending and last line without LF
+printf 'alpha 1\r\n12 items\nalpha 3' > input.txt
+$cmd -r tmp.rulebase -e json -i input.txt > test.out
+cat test.out
+./json_eq '{"a": "1"}' "$(sed -n 1p test.out)"
+./json_eq '{"n": "12"}' "$(sed -n 2p test.out)"
+./json_eq '{"a": "3"}' "$(sed -n 3p test.out)"
+test $(wc -l < test.out) -eq 3
+
+# same via stdin, batched and threaded
+$cmd -r tmp.rulebase -e json < input.txt | cmp - test.out
+$cmd -r tmp.rulebase -e json -b2 < input.txt | cmp - test.out
+$cmd -r tmp.rulebase -e json -b2 -i input.txt | cmp - test.out
+$cmd -r tmp.rulebase -e json -j2 -b2 -i input.txt | cmp - test.out
+
+# raw output must be exactly the input (minus line endings)
+$cmd -r tmp.rulebase -e raw -i input.txt > test.out
+printf 'alpha 1\n12 items\nalpha 3\n' | cmp - test.out
+
+# last line without LF ending right at a page boundary: parsers that
+# look beyond the end of the message must not read past the mapping
+add_rule 'rule=:hex %h:hexnumber%'
+yes 'alpha 1' | head -n 8190 > input.txt
+printf 'alpha 1234\nhex 0' >> input.txt
+test $(wc -c < input.txt) -eq 65536
+$cmd -r tmp.rulebase -e json -i input.txt > test.out
+./json_eq '{"originalmsg": "hex 0", "unparsed-data": "0"}' "$(tail -n 1 test.out)"
+test $(wc -l < test.out) -eq 8192
+
+# empty file
+: > input.txt
+$cmd -r tmp.rulebase -e json -i input.txt > test.out
+test ! -s test.out
+
+rm -f input.txt
+cleanup_tmp_files
@@ -0,0 +1,36 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "direct JSON text rendering in span mode"
+add_rule 'version=2'
+add_rule 'type=@ep:%ip:ipv4%:%port:number%'
+add_rule 'rule=esc:esc %a:word% %b:quoted-string% %c:rest%'
+add_rule 'rule=num:num %n:number% %h:hexnumber% %f:float% %d:date-rfc5424%'
+add_rule 'rule=ep:ep %e:@ep% %-:word%'
+add_rule 'rule=ipt:ipt %fw:v2-iptables%'
+add_rule 'rule=dot:dot %.:word% %x:number%'
+add_rule 'rule=js:js %j:json%'
+add_rule 'annotate=ep:+annot="yes"'
+
+export ln_opts='-l -T'
+execute 'esc a\b "q\x" tail/	end'
+assert_output_json_eq '{ "c": "tail\/\tend", "b": "\"q\\x\"", "a": "a\\b", "event.tags": [ "esc" ] }'
+
+execute 'num 42 0x1f 1.5 2016-08-20T10:20:30Z'
+assert_output_json_eq '{ "d": "2016-08-20T10:20:30Z", "f": "1.5", "h": "0x1f", "n": "42", "event.tags": [ "num" ] }'
+
+execute 'nomatch "\'
+assert_output_json_eq '{ "originalmsg": "nomatch \"\\", "unparsed-data": "nomatch \"\\" }'
+
+# the text must be byte-identical to what the JSON library produces
+# in regular mode, including for events that are rendered via the
+# JSON tree (annotations, "." fields)
+printf 'esc a\\b "q\\x\t\001" tail/\x7f"\nnum 1 0x2 3.5 2016-08-20T10:20:30Z\nep 1.2.3.4:80 x\nipt IN=eth0 OUT= DF SRC=1.2.3.4\ndot abc 12\njs {"a":[1,{"b":null}]}\nnomatch \001\\"\n' > json_str.in
+for opts in "" "-T" "-oaddRule -oaddRuleLocation -oaddOriginalMsg"; do
+	$cmd -r tmp.rulebase -e json $opts < json_str.in > json_str.expected
+	$cmd -r tmp.rulebase -e json $opts -l < json_str.in > test.out
+	cmp json_str.expected test.out || exit 1
+done
+
+rm -f json_str.in json_str.expected
+cleanup_tmp_files
@@ -0,0 +1,60 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "prefix factoring of literal fields"
+add_rule 'version=2'
+add_rule 'rule=:%%%{"type":"literal", "text":"ASA-6-302013:"}% built %id:number%'
+add_rule 'rule=:%%%{"type":"literal", "text":"ASA-6-302014:"}% teardown %id:number%'
+add_rule 'rule=:%%%{"type":"literal", "text":"ASA-6-302015:"}% %rest:rest%'
+add_rule 'rule=:%%%{"type":"literal", "text":"ASA-6-302020:"}% icmp %id:number%'
+add_rule 'rule=:%%%{"type":"literal", "text":"ASA-4-106023:"}% deny %id:number%'
+
+execute '%ASA-6-302013: built 1'
+assert_output_json_eq '{"id": "1"}'
+
+execute '%ASA-6-302014: teardown 2'
+assert_output_json_eq '{"id": "2"}'
+
+execute '%ASA-6-302015: anything else'
+assert_output_json_eq '{"rest": "anything else"}'
+
+execute '%ASA-6-302020: icmp 3'
+assert_output_json_eq '{"id": "3"}'
+
+execute '%ASA-4-106023: deny 4'
+assert_output_json_eq '{"id": "4"}'
+
+execute '%ASA-6-302016: built 5'
+assert_output_json_eq '{"originalmsg": "%ASA-6-302016: built 5", "unparsed-data": "16: built 5" }'
+
+# literals that are a prefix of each other must be tried in rule order
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:%{"type":"literal", "text":"connection"}%%r:rest%'
+add_rule 'rule=:%{"type":"literal", "text":"connection closed"}% %w:word%'
+add_rule 'rule=:%{"type":"literal", "text":"connection closed by"}% %p:word%'
+add_rule 'rule=:%{"type":"literal", "text":"connection opened"}% %w:word%'
+
+execute 'connection closed by peer'
+assert_output_json_eq '{"r": " closed by peer"}'
+
+execute 'connection opened x'
+assert_output_json_eq '{"r": " opened x"}'
+
+# named literals are not factored
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:%{"type":"literal", "text":"session-start", "name":"ev"}% %id:number%'
+add_rule 'rule=:%{"type":"literal", "text":"session-stop", "name":"ev"}% %id:number%'
+add_rule 'rule=:%{"type":"literal", "text":"session-state"}% %id:number%'
+
+execute 'session-start 1'
+assert_output_json_eq '{"ev": "session-start", "id": "1"}'
+
+execute 'session-stop 2'
+assert_output_json_eq '{"ev": "session-stop", "id": "2"}'
+
+execute 'session-state 3'
+assert_output_json_eq '{"id": "3"}'
+
+cleanup_tmp_files
@@ -0,0 +1,441 @@
+/**
+ * @file lnbench.c
+ * @brief Normalization benchmark driver.
+ *
+ * Loads a rule base and a corpus of messages and runs ln_normalize()
+ * over the corpus repeatedly. Reports throughput (messages/sec,
+ * ns/message), heap allocations per message and latency percentiles
+ * per matching rule, with unmatched messages in a class of their own.
+ * Used by "make bench", see bench.sh.
+ *//*
+ * liblognorm - a fast samples-based log normalization library
+ * Copyright 2016 by Rainer Gerhards and Adiscon GmbH.
+ *
+ * This file is part of liblognorm.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * A copy of the LGPL v2.1 can be found in the file "COPYING" in this distribution.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <json.h>
+
+#include "liblognorm.h"
+
+#define UNMATCHED_CLASS "(unmatched)"
+#define MATCHED_CLASS "(matched, no location)"
+
+/* Allocation counting. With glibc, we interpose the allocator entry
+ * points and forward to the real implementation, so that all
+ * allocations done by liblognorm, libestr and libfastjson are seen.
+ * realloc() is counted as well, as it usually means a new block.
+ */
+static uint64_t nAllocs = 0;
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+void *malloc(size_t size) { ++nAllocs; return __libc_malloc(size); }
+void *calloc(size_t nmemb, size_t size) { ++nAllocs; return __libc_calloc(nmemb, size); }
+void *realloc(void *ptr, size_t size) { ++nAllocs; return __libc_realloc(ptr, size); }
+#else
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+struct msg {
+	char *str;
+	size_t len;
+	unsigned cls;	/**< index into classes */
+};
+
+/* a latency class, i.e. a rule (or "unmatched") */
+struct latclass {
+	char *name;
+	uint64_t *lat;		/**< per-call latencies in ns */
+	size_t nlat;
+	size_t maxlat;
+};
+
+static struct msg *msgs = NULL;
+static unsigned nmsgs = 0;
+static struct latclass *classes = NULL;
+static unsigned nclasses = 0;
+
+static void
+errCallBack(void __attribute__((unused)) *cookie, const char *msg,
+	    size_t __attribute__((unused)) lenMsg)
+{
+	fprintf(stderr, "liblognorm error: %s\n", msg);
+}
+
+static inline uint64_t
+nsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+loadCorpus(const char *const fn)
+{
+	int r = 1;
+	FILE *fp;
+	char *line = NULL;
+	size_t lenLine = 0;
+	ssize_t len;
+	unsigned maxmsgs = 0;
+
+	if((fp = fopen(fn, "r")) == NULL) {
+		perror(fn);
+		goto done;
+	}
+	while((len = getline(&line, &lenLine, fp)) != -1) {
+		if(len > 0 && line[len-1] == '\n')
+			--len;
+		if(len == 0)
+			continue;
+		if(nmsgs == maxmsgs) {
+			maxmsgs = maxmsgs ? 2 * maxmsgs : 1024;
+			if((msgs = realloc(msgs, maxmsgs * sizeof(struct msg))) == NULL)
+				goto done;
+		}
+		if((msgs[nmsgs].str = malloc(len + 1)) == NULL)
+			goto done;
+		memcpy(msgs[nmsgs].str, line, len);
+		msgs[nmsgs].str[len] = '\0';
+		msgs[nmsgs].len = len;
+		++nmsgs;
+	}
+	if(nmsgs == 0) {
+		fprintf(stderr, "corpus %s is empty\n", fn);
+		goto done;
+	}
+	r = 0;
+done:
+	free(line);
+	if(fp != NULL)
+		fclose(fp);
+	return r;
+}
+
+static unsigned
+getClass(const char *const name)
+{
+	for(unsigned i = 0 ; i < nclasses ; ++i) {
+		if(!strcmp(classes[i].name, name))
+			return i;
+	}
+	classes = realloc(classes, (nclasses + 1) * sizeof(struct latclass));
+	memset(classes + nclasses, 0, sizeof(struct latclass));
+	classes[nclasses].name = strdup(name);
+	return nclasses++;
+}
+
+/* assign each corpus message to the rule it matches. This is done
+ * on a separate context with rule location metadata enabled, so
+ * that the measured context runs with the user-requested options
+ * only. Rule locations are available for v2 rule bases; for v1, all
+ * matching messages end up in one class.
+ */
+static int
+classifyCorpus(const char *const rulebase)
+{
+	int r = 1;
+	ln_ctx cctx;
+	char name[1024];
+
+	if((cctx = ln_initCtx()) == NULL)
+		goto done;
+	ln_setCtxOpts(cctx, LN_CTXOPT_ADD_RULE_LOCATION);
+	if(ln_loadSamples(cctx, rulebase) != 0)
+		goto done;
+	for(unsigned i = 0 ; i < nmsgs ; ++i) {
+		struct json_object *json = NULL, *meta, *rule, *loc, *file, *line;
+		ln_normalize(cctx, msgs[i].str, msgs[i].len, &json);
+		if(json_object_object_get_ex(json, "unparsed-data", NULL)) {
+			snprintf(name, sizeof(name), "%s", UNMATCHED_CLASS);
+		} else if(json_object_object_get_ex(json, "metadata", &meta)
+		   && json_object_object_get_ex(meta, "rule", &rule)
+		   && json_object_object_get_ex(rule, "location", &loc)
+		   && json_object_object_get_ex(loc, "file", &file)
+		   && json_object_object_get_ex(loc, "line", &line)) {
+			const char *fn = json_object_get_string(file);
+			const char *base = strrchr(fn, '/');
+			snprintf(name, sizeof(name), "%s:%d",
+				base == NULL ? fn : base + 1, json_object_get_int(line));
+		} else {
+			snprintf(name, sizeof(name), "%s", MATCHED_CLASS);
+		}
+		json_object_put(json);
+		msgs[i].cls = getClass(name);
+	}
+	r = 0;
+done:
+	if(cctx != NULL)
+		ln_exitCtx(cctx);
+	return r;
+}
+
+/* reorder the corpus so that the given percentage of messages is
+ * unmatched. Messages are spread evenly, cycling through both groups
+ * as often as needed; the corpus size stays the same.
+ */
+static int
+mixCorpus(const int pctUnmatched)
+{
+	int r = 1;
+	struct msg *mixed = NULL;
+	unsigned *matched = NULL, *unmatched = NULL;
+	unsigned nMatched = 0, nUnmatched = 0;
+	unsigned iMatched = 0, iUnmatched = 0;
+	unsigned long acc = 0;
+
+	if((matched = malloc(nmsgs * sizeof(unsigned))) == NULL
+	   || (unmatched = malloc(nmsgs * sizeof(unsigned))) == NULL
+	   || (mixed = malloc(nmsgs * sizeof(struct msg))) == NULL)
+		goto done;
+	for(unsigned i = 0 ; i < nmsgs ; ++i) {
+		if(!strcmp(classes[msgs[i].cls].name, UNMATCHED_CLASS))
+			unmatched[nUnmatched++] = i;
+		else
+			matched[nMatched++] = i;
+	}
+	if((pctUnmatched > 0 && nUnmatched == 0) || (pctUnmatched < 100 && nMatched == 0)) {
+		fprintf(stderr, "corpus does not contain both matching and "
+			"non-matching messages, cannot mix\n");
+		goto done;
+	}
+	for(unsigned i = 0 ; i < nmsgs ; ++i) {
+		acc += pctUnmatched;
+		if(acc >= 100) {
+			acc -= 100;
+			mixed[i] = msgs[unmatched[iUnmatched++ % nUnmatched]];
+		} else {
+			mixed[i] = msgs[matched[iMatched++ % nMatched]];
+		}
+		mixed[i].str = strdup(mixed[i].str);
+	}
+	for(unsigned i = 0 ; i < nmsgs ; ++i)
+		free(msgs[i].str);
+	free(msgs);
+	msgs = mixed;
+	mixed = NULL;
+	r = 0;
+done:
+	free(mixed);
+	free(matched);
+	free(unmatched);
+	return r;
+}
+
+static int
+cmpU64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t*) a;
+	const uint64_t y = *(const uint64_t*) b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t *const lat, const size_t n, const unsigned pct)
+{
+	size_t i = (n * pct + 99) / 100;
+	return lat[i == 0 ? 0 : i - 1];
+}
+
+static void
+recordLatency(struct latclass *const cls, const uint64_t ns)
+{
+	if(cls->nlat == cls->maxlat) {
+		cls->maxlat = cls->maxlat ? 2 * cls->maxlat : 1024;
+		cls->lat = realloc(cls->lat, cls->maxlat * sizeof(uint64_t));
+	}
+	cls->lat[cls->nlat++] = ns;
+}
+
+static void
+normalizeOne(ln_ctx ctx, const struct msg *const m)
+{
+	struct json_object *json = NULL;
+	ln_normalize(ctx, m->str, m->len, &json);
+	json_object_put(json);
+}
+
+static void usage(void)
+{
+fprintf(stderr,
+	"Usage: lnbench -r<rulebase> -i<corpus> [options]\n"
+	"Options:\n"
+	"    -r<rulebase> Rulebase to use. This is required option\n"
+	"    -i<file>     Corpus, one message per line. This is required option\n"
+	"    -n<n>        Number of timed passes over the corpus (default 100)\n"
+	"    -w<n>        Number of untimed warm-up passes (default 1)\n"
+	"    -m<pct>      Rebuild the corpus with pct percent non-matching\n"
+	"                 messages (default: use the corpus as is)\n"
+	"    -o<opt>      Context option, as for lognormalizer (e.g. addRule)\n"
+	"\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	int ret = 1;
+	ln_ctx ctx = NULL;
+	char *rulebase = NULL;
+	char *corpus = NULL;
+	unsigned passes = 100;
+	unsigned warmup = 1;
+	int pctUnmatched = -1;
+	unsigned ctxOpts = 0;
+
+	while((opt = getopt(argc, argv, "r:i:n:w:m:o:")) != -1) {
+		switch (opt) {
+		case 'r':
+			rulebase = optarg;
+			break;
+		case 'i':
+			corpus = optarg;
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'm':
+			pctUnmatched = atoi(optarg);
+			if(pctUnmatched < 0 || pctUnmatched > 100) {
+				fprintf(stderr, "-m must be in range 0..100\n");
+				goto exit;
+			}
+			break;
+		case 'o':
+			if(!strcmp(optarg, "allowRegex")) {
+				ctxOpts |= LN_CTXOPT_ALLOW_REGEX;
+			} else if(!strcmp(optarg, "addExecPath")) {
+				ctxOpts |= LN_CTXOPT_ADD_EXEC_PATH;
+			} else if(!strcmp(optarg, "addOriginalMsg")) {
+				ctxOpts |= LN_CTXOPT_ADD_ORIGINALMSG;
+			} else if(!strcmp(optarg, "addRule")) {
+				ctxOpts |= LN_CTXOPT_ADD_RULE;
+			} else if(!strcmp(optarg, "addRuleLocation")) {
+				ctxOpts |= LN_CTXOPT_ADD_RULE_LOCATION;
+			} else {
+				fprintf(stderr, "invalid -o option '%s'\n", optarg);
+				goto exit;
+			}
+			break;
+		default:
+			usage();
+			goto exit;
+		}
+	}
+	if(rulebase == NULL || corpus == NULL || passes == 0) {
+		usage();
+		goto exit;
+	}
+
+	if(loadCorpus(corpus) != 0 || classifyCorpus(rulebase) != 0) {
+		fprintf(stderr, "could not set up benchmark\n");
+		goto exit;
+	}
+	if(pctUnmatched != -1 && mixCorpus(pctUnmatched) != 0)
+		goto exit;
+
+	if((ctx = ln_initCtx()) == NULL) {
+		fprintf(stderr, "Could not initialize liblognorm context\n");
+		goto exit;
+	}
+	ln_setErrMsgCB(ctx, errCallBack, NULL);
+	ln_setCtxOpts(ctx, ctxOpts);
+	if(ln_loadSamples(ctx, rulebase) != 0) {
+		fprintf(stderr, "fatal error: cannot load rulebase\n");
+		goto exit;
+	}
+
+	for(unsigned p = 0 ; p < warmup ; ++p)
+		for(unsigned i = 0 ; i < nmsgs ; ++i)
+			normalizeOne(ctx, msgs + i);
+
+	/* throughput: one untimed loop, so that timer overhead does not count */
+	const uint64_t allocsBefore = nAllocs;
+	const uint64_t tBegin = nsNow();
+	for(unsigned p = 0 ; p < passes ; ++p)
+		for(unsigned i = 0 ; i < nmsgs ; ++i)
+			normalizeOne(ctx, msgs + i);
+	const uint64_t tTotal = nsNow() - tBegin;
+	const uint64_t allocs = nAllocs - allocsBefore;
+	const double nTotal = (double) passes * nmsgs;
+
+	/* latency: every call timed individually */
+	for(unsigned p = 0 ; p < passes ; ++p) {
+		for(unsigned i = 0 ; i < nmsgs ; ++i) {
+			const uint64_t t = nsNow();
+			normalizeOne(ctx, msgs + i);
+			recordLatency(classes + msgs[i].cls, nsNow() - t);
+		}
+	}
+
+	unsigned nUnmatched = 0;
+	for(unsigned i = 0 ; i < nmsgs ; ++i)
+		if(!strcmp(classes[msgs[i].cls].name, UNMATCHED_CLASS))
+			++nUnmatched;
+	printf("rulebase:    %s\n", rulebase);
+	printf("corpus:      %s, %u messages (%u matching, %u non-matching), %u passes\n",
+		corpus, nmsgs, nmsgs - nUnmatched, nUnmatched, passes);
+	printf("throughput:  %.0f msgs/sec, %.1f ns/msg\n",
+		nTotal / (tTotal / 1e9), tTotal / nTotal);
+	if(HAVE_ALLOC_COUNT)
+		printf("allocations: %.2f per msg\n", allocs / nTotal);
+	else
+		printf("allocations: not available on this platform\n");
+	printf("%-32s %8s %8s %8s %8s %8s\n", "latency [ns]", "calls",
+		"p50", "p90", "p99", "max");
+	for(unsigned c = 0 ; c < nclasses ; ++c) {
+		struct latclass *const cls = classes + c;
+		if(cls->nlat == 0)
+			continue;
+		qsort(cls->lat, cls->nlat, sizeof(uint64_t), cmpU64);
+		printf("%-32s %8zu %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+			cls->name, cls->nlat,
+			percentile(cls->lat, cls->nlat, 50),
+			percentile(cls->lat, cls->nlat, 90),
+			percentile(cls->lat, cls->nlat, 99),
+			cls->lat[cls->nlat - 1]);
+	}
+	ret = 0;
+
+exit:
+	if(ctx != NULL)
+		ln_exitCtx(ctx);
+	for(unsigned i = 0 ; i < nmsgs ; ++i)
+		free(msgs[i].str);
+	free(msgs);
+	for(unsigned c = 0 ; c < nclasses ; ++c) {
+		free(classes[c].name);
+		free(classes[c].lat);
+	}
+	free(classes);
+	return ret;
+}
@@ -0,0 +1,100 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "memoization of failed parse paths"
+for opts in "" "-omemoize"; do
+	export ln_opts=$opts
+
+	reset_rules
+	add_rule 'version=2'
+	add_rule 'type=@host:%h:word% host'
+	add_rule 'type=@host:%h:ipv4% ip'
+	add_rule 'rule=:from %a:@host% to %b:@host% port %p:number%'
+	add_rule 'rule=:from %{"name":"x", "type":"word", "priority":1}% %a:@host% via %c:@host%'
+	add_rule 'rule=:from %{"name":"y", "type":"word", "priority":2}% %a:@host% over %c:@host%'
+	add_rule 'rule=:from %z:rest%'
+
+	execute 'from a host to 1.2.3.4 ip port 80'
+	assert_output_json_eq '{"a": {"h": "a"}, "b": {"h": "1.2.3.4"}, "p": "80"}'
+
+	execute 'from x a host via b host'
+	assert_output_json_eq '{"x": "x", "a": {"h": "a"}, "c": {"h": "b"}}'
+
+	execute 'from y a host over b host'
+	assert_output_json_eq '{"y": "y", "a": {"h": "a"}, "c": {"h": "b"}}'
+
+	# all paths through @host fail, most of them more than once
+	execute 'from y a host under b host'
+	assert_output_json_eq '{"z": "y a host under b host"}'
+
+	reset_rules
+	add_rule 'version=2'
+	add_rule 'type=@host:%h:word% host'
+	add_rule 'rule=:from %a:@host% to %b:@host% port %p:number%'
+	execute 'from a host to b host port x'
+	assert_output_json_eq '{"originalmsg": "from a host to b host port x", "unparsed-data": "x"}'
+
+	# what other paths parsed before must not change what a user-defined
+	# type or repeat parser parses
+	reset_rules
+	add_rule 'version=2'
+	add_rule 'type=@t:%a:word%'
+	add_rule 'rule=:x %{"name":"b", "type":"number", "priority":1}% %d:word% zzz'
+	add_rule 'rule=:x %c:@t% foo'
+	add_rule 'rule=:y %{"name":"b", "type":"number", "priority":1}% %d:word% zzz'
+	add_rule 'rule=:y %{"name":"r", "type":"repeat", "parser":{"name":"n", "type":"number"}, "while":{"type":"literal", "text":","}}% foo'
+
+	execute 'x 123 foo'
+	assert_output_json_eq '{"c": {"a": "123"}}'
+
+	execute 'y 123 foo'
+	assert_output_json_eq '{"r": [{"n": "123"}]}'
+
+	execute 'y 1,2 foo'
+	assert_output_json_eq '{"r": [{"n": "1"}, {"n": "2"}]}'
+
+	# alternatives lead to the same node from different paths
+	reset_rules
+	add_rule 'version=2'
+	add_rule 'rule=:%{"type":"alternative", "parser":[{"type":"literal", "text":"a"}, {"type":"literal", "text":"aa"}]}%%{"type":"alternative", "parser":[{"type":"literal", "text":"a"}, {"type":"literal", "text":"aa"}]}%b %w:word%'
+
+	execute 'aab x'
+	assert_output_json_eq '{"w": "x"}'
+
+	execute 'aaab x'
+	assert_output_json_eq '{"w": "x"}'
+
+	execute 'aaaaab x'
+	assert_output_json_eq '{"originalmsg": "aaaaab x", "unparsed-data": "ab x"}'
+done
+
+# memoization must bound backtracking: without it, the nine alternatives
+# below are tried in all combinations before the message is rejected.
+# With it, no pdag node may be entered more often than there are
+# message positions.
+alt='%{"type":"alternative", "parser":[{"type":"literal", "text":"a"}, {"type":"literal", "text":"aa"}]}%'
+reset_rules
+add_rule 'version=2'
+add_rule "rule=:$alt$alt$alt$alt$alt$alt$alt$alt${alt}b"
+msg='aaaaaaaaaaaaaaaaac'
+max_called() {
+	sed -n '/^called, backtracked, rule$/,$p' memoize.stats \
+		| awk -F', ' '/^[0-9]+, [0-9]+, / && $1 + 0 > max { max = $1 + 0 } END { print max + 0 }'
+}
+echo "$msg" | $cmd -r tmp.rulebase -e json -S memoize.stats > /dev/null
+called=$(max_called)
+echo "max node calls without memoization: $called"
+if [ $called -le ${#msg} ]; then
+	echo "FAIL: rule base does not backtrack as expected"
+	exit 1
+fi
+echo "$msg" | $cmd -omemoize -r tmp.rulebase -e json -S memoize.stats > /dev/null
+called=$(max_called)
+echo "max node calls with memoization: $called"
+if [ $called -gt $((${#msg} + 1)) ]; then
+	echo "FAIL: memoization does not bound backtracking"
+	exit 1
+fi
+rm -f memoize.stats
+
+cleanup_tmp_files
@@ -0,0 +1,25 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "batch normalization"
+add_rule 'version=2'
+add_rule 'rule=:alpha %a:word%'
+add_rule 'rule=:beta %b:word%'
+add_rule 'rule=:%n:number% items'
+
+export ln_opts='-b3 -L'
+# note: batch is larger than messages, plus partial trailing batch
+execute 'beta 1
+alpha 2
+zeta
+12 items
+alpha 3'
+# output must be in input order, even though the batch is processed
+# grouped by first byte
+./json_eq '{"b": "1"}' "$(sed -n 1p test.out)"
+./json_eq '{"a": "2"}' "$(sed -n 2p test.out)"
+./json_eq '{ "originalmsg": "zeta", "unparsed-data": "zeta", "lognormalizer.line_nbr": 3 }' "$(sed -n 3p test.out)"
+./json_eq '{"n": "12"}' "$(sed -n 4p test.out)"
+./json_eq '{"a": "3"}' "$(sed -n 5p test.out)"
+
+cleanup_tmp_files
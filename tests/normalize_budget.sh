@@ -0,0 +1,42 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "per-message normalization budget"
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:%a:word% %b:word% %c:word%'
+add_rule 'rule=:%a:word% %b:word% %c:number% end'
+
+for opts in "" "-omemoize"; do
+	export ln_opts="$opts -m10"
+	execute 'x y 1 end'
+	assert_output_json_eq '{"a": "x", "b": "y", "c": "1"}'
+
+	export ln_opts="$opts -m3"
+	execute 'x y 1 end'
+	assert_output_json_eq '{"originalmsg": "x y 1 end", "unparsed-data": " 1 end", "metadata": {"budget-exceeded": true}}'
+
+	export ln_opts="$opts -m3 -l"
+	execute 'x y z'
+	assert_output_json_eq '{"originalmsg": "x y z", "unparsed-data": " z", "metadata": {"budget-exceeded": true}}'
+
+	export ln_opts="$opts -w1000000"
+	execute 'x y z'
+	assert_output_json_eq '{"a": "x", "b": "y", "c": "z"}'
+done
+
+# a repeat field cut short by the budget must not produce a match
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:list %{"name":"arr", "type":"repeat",
+			"parser":[ {"type":"number", "name":"n"} ],
+			"while":[ {"type":"literal", "text":", "} ]
+		     }%'
+export ln_opts="-m20"
+execute 'list 1, 2, 3, 4'
+assert_output_json_eq '{"arr": [ {"n": "1"}, {"n": "2"}, {"n": "3"}, {"n": "4"} ]}'
+export ln_opts="-m5"
+execute 'list 1, 2, 3, 4'
+assert_output_json_eq '{"originalmsg": "list 1, 2, 3, 4", "unparsed-data": ", 3, 4", "metadata": {"budget-exceeded": true}}'
+
+cleanup_tmp_files
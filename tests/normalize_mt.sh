@@ -0,0 +1,38 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "ln_normalize() from multiple threads on one context"
+add_rule 'version=2'
+add_rule 'type=@host:%h:ipv4%'
+add_rule 'type=@host:%h:word%'
+add_rule 'rule=:from %src:@host% to %dst:@host% port %p:number%'
+add_rule 'rule=:from %src:@host% to %dst:@host% proto %q:word%'
+add_rule 'rule=:kv %nv:name-value-list%'
+add_rule 'rule=:list %{"name":"l", "type":"repeat", "parser":{"name":"n", "type":"number"}, "while":{"type":"literal", "text":","}}% end'
+add_rule 'rule=:%n:number% items'
+
+i=0
+rm -f mt.in
+while [ $i -lt 300 ]; do
+	echo "from 10.0.0.$((i % 256)) to host$i port $i" >> mt.in
+	echo "from host$i to 10.1.0.$((i % 256)) proto udp" >> mt.in
+	echo "kv a=$i b=x$i" >> mt.in
+	echo "list $i,$((i + 1)),$((i + 2)) end" >> mt.in
+	echo "$i items" >> mt.in
+	echo "from host$i to host port x" >> mt.in
+	i=$((i + 1))
+done
+
+# all threads must produce the same events as a single thread does
+./threads tmp.rulebase 1 mt1.stats < mt.in > mt.expected
+./threads tmp.rulebase 4 mt4.stats < mt.in > test.out
+cmp mt.expected test.out
+
+# the merged statistics of four threads must be those of a single
+# thread processing the input four times
+cat mt.in mt.in mt.in mt.in > mt4.in
+./threads tmp.rulebase 1 mt.expstats < mt4.in > /dev/null
+cmp mt.expstats mt4.stats
+
+rm -f mt.in mt4.in mt.expected mt1.stats mt4.stats mt.expstats
+cleanup_tmp_files
@@ -0,0 +1,38 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "span mode normalization"
+add_rule 'version=2'
+add_rule 'type=@port:%port:number%'
+add_rule 'type=@endpoint:%ip:ipv4%:%.:@port%'
+add_rule 'rule=conn:connect from %src:@endpoint% to %dst:@endpoint% user %u:word%'
+add_rule 'rule=list:list %{"name":"arr", "type":"repeat", "parser":{"name":"n", "type":"number"}, "while":{"type":"literal", "text":", "}}% end'
+add_rule 'rule=dot:dot %.:@endpoint%'
+add_rule 'rule=q:quote %-:op-quoted-string% %nv:name-value-list%'
+add_rule 'annotate=conn:+annot="yes"'
+
+export ln_opts='-l -T'
+execute 'connect from 1.2.3.4:80 to 5.6.7.8:443 user bob'
+assert_output_json_eq '{ "u": "bob", "dst": { "port": "443", "ip": "5.6.7.8" }, "src": { "port": "80", "ip": "1.2.3.4" }, "event.tags": [ "conn" ], "annot": "yes" }'
+
+execute 'list 1, 2, 3 end'
+assert_output_json_eq '{ "arr": [ { "n": "1" }, { "n": "2" }, { "n": "3" } ], "event.tags": [ "list" ] }'
+
+execute 'dot 9.9.9.9:1'
+assert_output_json_eq '{ "port": "1", "ip": "9.9.9.9", "event.tags": [ "dot" ] }'
+
+execute 'quote "x y" a=b c=d'
+assert_output_json_eq '{ "nv": { "a": "b", "c": "d" }, "event.tags": [ "q" ] }'
+
+execute 'connect from 1.2.3.4:80 to 5.6.7.8:x user bob'
+assert_output_json_eq '{ "originalmsg": "connect from 1.2.3.4:80 to 5.6.7.8:x user bob", "unparsed-data": "5.6.7.8:x user bob" }'
+
+# span mode must give exactly the same results as regular mode,
+# including metadata
+printf 'connect from 1.2.3.4:80 to 5.6.7.8:443 user bob\nlist 4, 5 end\nnomatch\ndot 1.1.1.1:2\n' > spans.in
+$cmd -r tmp.rulebase -e json -T -oaddRule -oaddRuleLocation -oaddOriginalMsg < spans.in > spans.expected
+$cmd -r tmp.rulebase -e json -T -oaddRule -oaddRuleLocation -oaddOriginalMsg -l < spans.in > test.out
+cmp spans.expected test.out
+
+rm -f spans.in spans.expected
+cleanup_tmp_files
@@ -0,0 +1,36 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "multi-threaded normalization"
+add_rule 'version=2'
+add_rule 'rule=:alpha %a:word%'
+add_rule 'rule=:beta %b:word%'
+add_rule 'rule=:%n:number% items'
+
+# we use small batches, so that many of them are in flight
+i=0
+rm -f threaded.in
+while [ $i -lt 500 ]; do
+	echo "alpha $i" >> threaded.in
+	echo "$i items" >> threaded.in
+	echo "zeta $i" >> threaded.in
+	echo "beta $i" >> threaded.in
+	i=$((i + 1))
+done
+
+$cmd -r tmp.rulebase -e json -L < threaded.in > threaded.expected
+$cmd -r tmp.rulebase -e json -L -j4 -b7 < threaded.in > test.out
+cmp threaded.expected test.out
+
+# unordered output must contain the same records
+$cmd -r tmp.rulebase -e json -L -j4 -b7 -u < threaded.in | sort > test.out
+sort threaded.expected | cmp - test.out
+
+# summary line must count records of all workers
+$cmd -r tmp.rulebase -e json -j3 -H < threaded.in 2> test.out > /dev/null
+cat test.out
+assert_output_contains "2000 records processed, 1500 parsed, 500 unparsed"
+assert_output_contains "normalizer: 2000 records"
+
+rm -f threaded.in threaded.expected
+cleanup_tmp_files
@@ -0,0 +1,43 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "csv, xml and cee-syslog output encoders"
+add_rule 'version=2'
+add_rule 'rule=t1,t2:x %a:word% %b:rest%'
+
+printf 'x he"l<l>o& a,b\\c]d "q" <t> &amp;\ttab/\nno match\n' > input.txt
+
+$cmd -r tmp.rulebase -e xml -T -i input.txt > test.out
+cat test.out
+cat > expected.txt <<'EXPECTED'
+<event><event.tags><tag>t2</tag><tag>t1</tag></event.tags><field name="b"><value>a,b\c]d "q" &lt;t> &amp;amp;	tab/</value></field><field name="a"><value>he"l&lt;l>o&amp;</value></field></event>
+<event><field name="originalmsg"><value>no match</value></field><field name="unparsed-data"><value>no match</value></field></event>
+EXPECTED
+cmp expected.txt test.out
+
+$cmd -r tmp.rulebase -e cee-syslog -T -i input.txt > test.out
+cat test.out
+cat > expected.txt <<'EXPECTED'
+[cee@115 event.tags="t2,t1" b="a\,b\\c\]d \"q\" <t> &amp;	tab/" a="he\"l<l>o&"]
+[cee@115 originalmsg="no match" unparsed-data="no match"]
+EXPECTED
+cmp expected.txt test.out
+
+$cmd -r tmp.rulebase -e csv -E 'a,b,missing,unparsed-data' -i input.txt > test.out
+cat test.out
+cat > expected.txt <<'EXPECTED'
+"he\"l<l>o&","a,b\\c]d \"q\" <t> &amp;\ttab/",,
+,,,"no match"
+EXPECTED
+cmp expected.txt test.out
+
+# the output buffer is reused, also per thread
+$cmd -r tmp.rulebase -e csv -E 'a,b,missing,unparsed-data' -j2 -b1 -i input.txt | cmp expected.txt -
+
+# long values must be encoded in linear time
+printf 'x a %020000d\n' 0 > input.txt
+$cmd -r tmp.rulebase -e csv -E 'b' -i input.txt > test.out
+test $(wc -c < test.out) -eq 20003
+
+rm -f input.txt expected.txt
+cleanup_tmp_files
@@ -0,0 +1,46 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "parallel rule base loading"
+# the rule base must be large enough to be loaded in parallel and
+# contain everything that is processed in rule base order
+add_rule 'version=2'
+for i in 0 1 2 3 4 5 6 7 8 9; do
+	add_rule "type=@t$i:%ip:ipv4%:%port$i:number%"
+done
+for i in $(seq 1 150); do
+	add_rule "rule=r$i,all:msg$i %a:word% id %n:number% ep %e:@t$((i % 10))% %r:rest%"
+done
+add_rule 'rule=bad:bad %a:@undefined%'
+add_rule 'rule=alt:alt %{"type":"alternative","parser":[{"name":"n","type":"number"},{"name":"w","type":"word"}]}%'
+add_rule 'rule=rep:rep %{"name":"l","type":"repeat","parser":{"name":"v","type":"number"},"while":{"type":"literal","text":","}}%'
+add_rule 'annotate=all:+annot="yes"'
+printf 'prefix=host %%h:word%% \n' >> tmp.rulebase
+for i in $(seq 1 150); do
+	add_rule "rule=p$i:pfx$i %a:word% %q:quoted-string%"
+done
+add_rule 'include=inc.rulebase'
+add_rule 'version=2' inc
+for i in $(seq 1 100); do
+	add_rule "rule=i$i:inc$i %m:mac48%" inc
+done
+
+printf 'msg7 abc id 42 ep 1.2.3.4:80 some rest\nmsg150 x id 1 ep 5.6.7.8:443 r\nalt 12\nalt abc\nrep 1,2,3\nhost h1 pfx99 w "q s"\nhost h2 inc100 f0:f6:1c:5f:cc:a2\nbad x\nmsg8 abc\n' > parallel_load.in
+$cmd -J1 -r tmp.rulebase -e json -T -oaddRule -oaddRuleLocation < parallel_load.in > parallel_load.expected 2> parallel_load.experr
+$cmd -J1 -r tmp.rulebase -S parallel_load.expstats < /dev/null 2> /dev/null || true
+cat parallel_load.expected parallel_load.experr
+grep -q '"annot": "yes"' parallel_load.expected
+grep -q 'tmp.rulebase\[162\]: unknown user-defined type' parallel_load.experr
+
+# the result must not depend on the number of threads, including
+# error messages and statistics
+for j in 2 4; do
+	$cmd -J$j -r tmp.rulebase -e json -T -oaddRule -oaddRuleLocation < parallel_load.in > test.out 2> parallel_load.err
+	cmp parallel_load.expected test.out
+	cmp parallel_load.experr parallel_load.err
+	$cmd -J$j -r tmp.rulebase -S parallel_load.stats < /dev/null 2> /dev/null || true
+	cmp parallel_load.expstats parallel_load.stats
+done
+
+rm -f parallel_load.in parallel_load.expected parallel_load.experr parallel_load.err parallel_load.expstats parallel_load.stats
+cleanup_tmp_files
@@ -0,0 +1,49 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "first-byte dispatch of literal parsers"
+add_rule 'version=2'
+add_rule 'rule=:alpha %a:word%'
+add_rule 'rule=:apple %p:word%'
+add_rule 'rule=:beta %b:word%'
+add_rule 'rule=:gamma %g:word%'
+add_rule 'rule=:delta %d:word%'
+add_rule 'rule=:%n:number% items'
+add_rule 'rule=:%r:rest%'
+
+execute 'alpha x'
+assert_output_json_eq '{"a": "x"}'
+
+execute 'apple y'
+assert_output_json_eq '{"p": "y"}'
+
+execute 'delta z'
+assert_output_json_eq '{"d": "z"}'
+
+execute '12 items'
+assert_output_json_eq '{"n": "12"}'
+
+# things that need to match rest
+execute 'zeta'
+assert_output_json_eq '{"r": "zeta"}'
+
+execute 'alphabet'
+assert_output_json_eq '{"r": "alphabet"}'
+
+# a non-literal with higher priority must still be tried first
+reset_rules
+add_rule 'version=2'
+add_rule 'rule=:alpha %a:word%'
+add_rule 'rule=:apple %p:word%'
+add_rule 'rule=:beta %b:word%'
+add_rule 'rule=:gamma %g:word%'
+add_rule 'rule=:delta %d:word%'
+add_rule 'rule=:%{"name":"r", "type":"rest", "priority":10}%'
+
+execute 'alpha x'
+assert_output_json_eq '{"r": "alpha x"}'
+
+execute 'zeta'
+assert_output_json_eq '{"r": "zeta"}'
+
+cleanup_tmp_files
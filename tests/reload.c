@@ -0,0 +1,157 @@
+/* test helper for rule base hot reload: a number of threads keep
+ * normalizing while the rule base is reloaded over and over again,
+ * alternating between two rule bases. Both contain a rule for
+ * "msg 42" that extracts field "f", but with different tags.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <json.h>
+#include "liblognorm.h"
+
+#define NTHREADS 4
+static const char msg[] = "msg 42";
+
+static ln_ctx ctx;
+static int stop = 0;
+static int nerrs = 0;
+
+static void
+error(const char *what, const char *detail)
+{
+	fprintf(stderr, "reload: %s: %s\n", what, detail);
+	__atomic_add_fetch(&nerrs, 1, __ATOMIC_RELAXED);
+}
+
+/* returns the tag of the event, or NULL if the event is not the
+ * expected one.
+ */
+static const char *
+checkEvent(struct json_object *json)
+{
+	struct json_object *tags, *f;
+	const char *tag;
+
+	if(json == NULL
+	   || !json_object_object_get_ex(json, "f", &f)
+	   || strcmp(json_object_get_string(f), "42")
+	   || !json_object_object_get_ex(json, "event.tags", &tags)
+	   || json_object_array_length(tags) != 1)
+		return NULL;
+	tag = json_object_get_string(json_object_array_get_idx(tags, 0));
+	if(strcmp(tag, "a") && strcmp(tag, "b"))
+		return NULL;
+	return tag;
+}
+
+static void *
+worker(void __attribute__((unused)) *arg)
+{
+	struct json_object *json;
+	ln_spans spans;
+	const char *val;
+	size_t len;
+
+	if((spans = ln_newSpans()) == NULL) {
+		error("worker", "out of memory");
+		return NULL;
+	}
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		json = NULL;
+		if(ln_normalize(ctx, msg, sizeof(msg) - 1, &json) != 0
+		   || checkEvent(json) == NULL)
+			error("normalize", json == NULL ? "no event" : json_object_to_json_string(json));
+		if(json != NULL)
+			json_object_put(json);
+		if(ln_normalizeSpans(ctx, msg, sizeof(msg) - 1, spans) != 0
+		   || ln_spansGetField(spans, "f", &val, &len) != 0
+		   || len != 2 || strncmp(val, "42", 2))
+			error("normalizeSpans", "field f not found");
+	}
+	ln_deleteSpans(spans);
+	return NULL;
+}
+
+static const char *
+normalizeTag(ln_ctx c)
+{
+	static char tag[8];
+	struct json_object *json = NULL;
+	const char *t;
+
+	tag[0] = '\0';
+	ln_normalize(c, msg, sizeof(msg) - 1, &json);
+	if((t = checkEvent(json)) != NULL)
+		snprintf(tag, sizeof(tag), "%s", t);
+	if(json != NULL)
+		json_object_put(json);
+	return tag;
+}
+
+/* a span arena keeps its rule base alive across reloads */
+static void
+checkHeldSpans(ln_spans spans, const char *expected)
+{
+	struct json_object *json = NULL;
+	const char *tag;
+
+	if(ln_spansToJSON(spans, &json) != 0 || (tag = checkEvent(json)) == NULL)
+		error("held spans", "invalid event");
+	else if(strcmp(tag, expected))
+		error("held spans", tag);
+	if(json != NULL)
+		json_object_put(json);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t thrd[NTHREADS];
+	ln_spans held;
+	int nreloads;
+
+	if(argc != 4) {
+		fprintf(stderr, "usage: reload rulebase-a rulebase-b nreloads\n");
+		exit(100);
+	}
+	nreloads = atoi(argv[3]);
+	if((ctx = ln_initCtx()) == NULL || (held = ln_newSpans()) == NULL) {
+		fprintf(stderr, "could not initialize liblognorm\n");
+		exit(1);
+	}
+	ln_setCtxOpts(ctx, LN_CTXOPT_ADD_RULE);
+	if(ln_loadSamples(ctx, argv[1]) != 0) {
+		fprintf(stderr, "could not load rulebase %s\n", argv[1]);
+		exit(1);
+	}
+	for(int i = 0 ; i < NTHREADS ; ++i)
+		pthread_create(&thrd[i], NULL, worker, NULL);
+
+	for(int i = 0 ; i < nreloads ; ++i) {
+		const char *const prev = (i % 2) ? "b" : "a";
+		const char *const next = (i % 2) ? "a" : "b";
+		ln_normalizeSpans(ctx, msg, sizeof(msg) - 1, held);
+		if(ln_reloadSamples(ctx, argv[(i % 2) ? 1 : 2], NULL) != 0)
+			error("reload", "failed");
+		if(strcmp(normalizeTag(ctx), next))
+			error("after reload", "old rule base still active");
+		checkHeldSpans(held, prev);
+	}
+
+	/* a failed reload keeps the current rule base */
+	if(ln_reloadSamples(ctx, "/nonexistent/rulebase", NULL) == 0)
+		error("reload", "nonexistent rule base loaded");
+	if(strcmp(normalizeTag(ctx), (nreloads % 2) ? "b" : "a"))
+		error("failed reload", "rule base changed");
+	if(ln_loadSamples(ctx, argv[1]) == 0)
+		error("loadSamples", "permitted after reload");
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for(int i = 0 ; i < NTHREADS ; ++i)
+		pthread_join(thrd[i], NULL);
+	ln_deleteSpans(held);
+	ln_exitCtx(ctx);
+	printf("%d reloads, %d errors\n", nreloads, nerrs);
+	return nerrs == 0 ? 0 : 1;
+}
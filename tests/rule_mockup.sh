@@ -0,0 +1,31 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "rule mockup metadata"
+add_rule 'version=2'
+add_rule 'type=@num:%n:number%'
+add_rule 'rule=:a %x:word% b'
+add_rule 'rule=:c %{"type":"alternative", "parser":[{"name":"v", "type":"number"}, {"name":"w", "type":"word"}]}% d'
+add_rule 'rule=:e %y:@num% f'
+add_rule 'rule=:g %{"name":"r", "type":"repeat", "parser":{"name":"n", "type":"number"}, "while":{"type":"literal", "text":","}}% h'
+
+# span and batch mode record the mockup the same way
+for mode in "" "-l" "-b2"; do
+	export ln_opts="-oaddRule $mode"
+	execute 'a foo b'
+	assert_output_json_eq '{ "x": "foo", "metadata": { "rule": { "mockup": "a %x:word% b" } } }'
+
+	# alternatives share a terminal, the mockup follows the matching path
+	execute 'c 12 d'
+	assert_output_json_eq '{ "v": "12", "metadata": { "rule": { "mockup": "c %v:number% d" } } }'
+	execute 'c xy d'
+	assert_output_json_eq '{ "w": "xy", "metadata": { "rule": { "mockup": "c %w:word% d" } } }'
+
+	# user-defined types and repeat do not show their internals
+	execute 'e 7 f'
+	assert_output_json_eq '{ "y": { "n": "7" }, "metadata": { "rule": { "mockup": "e %y:USER-DEFINED% f" } } }'
+	execute 'g 1,2 h'
+	assert_output_json_eq '{ "r": [ { "n": "1" }, { "n": "2" } ], "metadata": { "rule": { "mockup": "g %r:repeat% h" } } }'
+done
+
+cleanup_tmp_files
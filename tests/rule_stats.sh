@@ -0,0 +1,29 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "per-rule statistics"
+add_rule 'version=2'
+add_rule 'rule=a:a %n:number%'
+add_rule 'rule=b:b %w:word%'
+add_rule 'rule=c:c %w:word%'
+
+printf 'a 1\na 2\nb x\na 3\nnomatch\n' > rule_stats.in
+$cmd -r tmp.rulebase -e json -R rule_stats.out < rule_stats.in > /dev/null
+cat rule_stats.out
+./json_eq '{ "sampling": 16, "rules": [ { "file": "tmp.rulebase", "line": 2, "count": 3 }, { "file": "tmp.rulebase", "line": 3, "count": 1 }, { "file": "tmp.rulebase", "line": 4, "count": 0 } ], "unmatched": { "count": 1 } }' "$(cat rule_stats.out)"
+
+# counts must not depend on the number of threads
+$cmd -r tmp.rulebase -e json -j3 -b1 -R rule_stats.out < rule_stats.in > /dev/null
+cat rule_stats.out
+./json_eq '{ "rules": [ { "count": 3 }, { "count": 1 }, { "count": 0 } ], "unmatched": { "count": 1 } }' "$(cat rule_stats.out)"
+
+# v1 rule bases are not supported
+reset_rules
+add_rule 'rule=a:a %n:number%'
+if $cmd -r tmp.rulebase -e json -R rule_stats.out < rule_stats.in > /dev/null; then
+    echo "rule stats must fail for v1 rulebase"
+    exit 1
+fi
+
+rm -f rule_stats.in rule_stats.out
+cleanup_tmp_files
@@ -0,0 +1,103 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "binary rulebase cache"
+add_rule 'version=2'
+add_rule 'include=cache_inc.rulebase'
+add_rule 'type=@port:%port:number%'
+add_rule 'type=@endpoint:%ip:ipv4%:%.:@port%'
+add_rule 'rule=conn,net:connect from %src:@endpoint% to %dst:@endpoint% user %u:word%'
+add_rule 'rule=list:list %{"name":"arr", "type":"repeat", "parser":{"name":"p", "type":"@port"}, "while":{"type":"literal", "text":", "}}% end'
+add_rule 'rule=a:alpha %n:number%'
+add_rule 'rule=b:beta %w:word%'
+add_rule 'rule=c:gamma %f:float%'
+add_rule 'rule=d:delta %-:op-quoted-string% %nv:name-value-list%'
+add_rule 'rule=e:epsilon %d:date-rfc3164% %rest:rest%'
+add_rule 'annotate=conn:+annot="yes"'
+add_rule 'annotate=conn:+second="2"'
+add_rule 'annotate=a:+x="1" +y="2"'
+
+reset_rules cache_inc
+add_rule 'version=2' cache_inc
+add_rule 'rule=inc:included %m:mac48%' cache_inc
+
+cat > rulebase_cache.in <<'MSGS'
+connect from 1.2.3.4:80 to 5.6.7.8:443 user bob
+list 1, 2, 3 end
+alpha 17
+beta word
+gamma 1.5
+delta "x y" a=b c=d
+epsilon Aug 17 10:20:30 some rest
+included f0:f6:1c:5f:cc:a2
+alpha x
+no match at all
+MSGS
+
+opts="-e json -T -oaddRule -oaddRuleLocation -i rulebase_cache.in"
+rm -f rulebase_cache.bin
+$cmd -r tmp.rulebase $opts > rulebase_cache.expected
+
+# first run creates the cache, the second one must use it
+$cmd -r tmp.rulebase -C rulebase_cache.bin $opts > test.out
+cmp rulebase_cache.expected test.out
+test -s rulebase_cache.bin
+$cmd -v -r tmp.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+cmp rulebase_cache.expected test.out
+grep -q "rulebase loaded from cache" rulebase_cache.dbg
+cat test.out
+
+# a modified include file must be detected
+add_rule 'rule=inc2:included twice %m:mac48%' cache_inc
+echo 'included twice f0:f6:1c:5f:cc:a2' >> rulebase_cache.in
+$cmd -r tmp.rulebase $opts > rulebase_cache.expected
+$cmd -v -r tmp.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+cmp rulebase_cache.expected test.out
+grep -q "rulebase cache is outdated" rulebase_cache.dbg
+$cmd -v -r tmp.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+cmp rulebase_cache.expected test.out
+grep -q "rulebase loaded from cache" rulebase_cache.dbg
+
+# ... even if it has the same size and was modified within the same second
+touch -d '2016-08-17 10:20:30.100000000' cache_inc.rulebase
+$cmd -r tmp.rulebase -C rulebase_cache.bin $opts > /dev/null
+reset_rules cache_inc
+add_rule 'version=2' cache_inc
+add_rule 'rule=inc:included %m:mac48%' cache_inc
+add_rule 'rule=in3:included twice %m:mac48%' cache_inc
+touch -d '2016-08-17 10:20:30.200000000' cache_inc.rulebase
+$cmd -r tmp.rulebase $opts > rulebase_cache.expected
+$cmd -v -r tmp.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+cmp rulebase_cache.expected test.out
+grep -q "rulebase cache is outdated" rulebase_cache.dbg
+
+# the cache file is created subject to umask
+rm -f rulebase_cache.bin
+(umask 077 && $cmd -r tmp.rulebase -C rulebase_cache.bin $opts > /dev/null)
+ls -l rulebase_cache.bin | grep -q '^-rw-------'
+rm -f rulebase_cache.bin
+(umask 022 && $cmd -r tmp.rulebase -C rulebase_cache.bin $opts > /dev/null)
+ls -l rulebase_cache.bin | grep -q '^-rw-r--r--'
+ls rulebase_cache.bin.* 2> /dev/null && exit 1
+
+# the cache must not be used for a different rulebase
+cp tmp.rulebase other.rulebase
+$cmd -v -r other.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+if grep -q "rulebase loaded from cache" rulebase_cache.dbg; then
+    echo "cache of tmp.rulebase used for other.rulebase"
+    exit 1
+fi
+
+# a damaged cache must not be used, the rulebase is loaded instead
+$cmd -r tmp.rulebase -C rulebase_cache.bin $opts > /dev/null
+head -c 2000 rulebase_cache.bin > rulebase_cache.tmp
+mv rulebase_cache.tmp rulebase_cache.bin
+$cmd -v -r tmp.rulebase -C rulebase_cache.bin $opts > test.out 2> rulebase_cache.dbg
+cmp rulebase_cache.expected test.out
+if grep -q "rulebase loaded from cache" rulebase_cache.dbg; then
+    echo "damaged cache used"
+    exit 1
+fi
+
+rm -f rulebase_cache.in rulebase_cache.expected rulebase_cache.bin rulebase_cache.dbg
+cleanup_tmp_files
@@ -0,0 +1,65 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "vectorized scanning kernels"
+add_rule 'version=2'
+add_rule 'rule=:A%f:char-to:;%;%r:rest%'
+add_rule 'rule=:B%{"name":"f", "type":"char-to", "extradata":";|#"}%%r:rest%'
+add_rule 'rule=:C%{"name":"f", "type":"char-sep", "extradata":";|"}%%r:rest%'
+add_rule 'rule=:D%f:word% %r:rest%'
+add_rule 'rule=:E%{"name":"f", "type":"string-to", "extradata":"|;"}%%r:rest%'
+add_rule 'rule=:F%-:whitespace%%r:rest%'
+add_rule 'rule=:G%{"name":"f", "type":"char-to", "extradata":"0123456789"}%%r:rest%'
+add_rule 'rule=:H%f:string% %r:rest%'
+add_rule 'rule=:I%{"name":"f", "type":"string", "matching.permitted":[{"class":"alpha"}, {"chars":",:"}]}% %r:rest%'
+
+# build field values that end around the vector sizes (16 and 32 bytes),
+# so that the terminator is found by the vector loop as well as by the
+# scalar tail
+field=''
+for i in $(seq 1 70); do
+    field="${field}a,b:"
+done
+
+for kernel in scalar sse2 avx2; do
+    export LIBLOGNORM_SCAN=$kernel
+    echo "kernel: $kernel"
+    for len in 1 15 16 17 31 32 33 63 64 65 100 250; do
+	f=$(echo "$field" | cut -c1-$len)
+	execute "A${f};end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"end\" }"
+	execute "B${f}#end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"#end\" }"
+	execute "C${f}|end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"|end\" }"
+	execute "C${f}"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"\" }"
+	execute "D${f} end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"end\" }"
+	execute "Ex${f}|;end"
+	assert_output_json_eq "{ \"f\": \"x$f\", \"r\": \"|;end\" }"
+	execute "G${f}5end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"5end\" }"
+	s=$(echo "$f" | tr -c ' ' ' ')
+	execute "F ${s}end"
+	assert_output_json_eq "{ \"r\": \"end\" }"
+	execute "H${f} end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"end\" }"
+	execute "H\"${f} ${f}\" end"
+	assert_output_json_eq "{ \"f\": \"$f $f\", \"r\": \"end\" }"
+	execute "H\"${f}\\\"${f}\" end"
+	assert_output_json_eq "{ \"f\": \"$f\\\"$f\", \"r\": \"end\" }"
+	execute "I${f} end"
+	assert_output_json_eq "{ \"f\": \"$f\", \"r\": \"end\" }"
+	execute "I${f}1 end"
+	assert_output_contains '"unparsed-data"'
+    done
+
+    # no terminator: char-to must not match
+    execute "A${field}"
+    assert_output_contains '"unparsed-data"'
+    execute "B${field}"
+    assert_output_contains '"unparsed-data"'
+done
+
+cleanup_tmp_files
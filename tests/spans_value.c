@@ -0,0 +1,83 @@
+/* test helper for typed span values: normalizes each line from
+ * stdin in span mode and prints a JSON object with the typed values
+ * of all top-level fields that support them. The locale is set from
+ * the environment, and the reference time for dates without year may
+ * be given.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <json.h>
+#include "liblognorm.h"
+
+static struct json_object *
+typedValues(ln_spans spans)
+{
+	struct json_object *json = json_object_new_object();
+	struct ln_value val;
+	const char *name, *str;
+	size_t len;
+
+	for(unsigned i = 0 ; i < ln_spansNumFields(spans) ; ++i) {
+		ln_spansGetFieldByIdx(spans, i, &name, &str, &len);
+		if(ln_spansGetValueByIdx(spans, i, &val) != 0)
+			continue;
+		switch(val.type) {
+		case LN_VALTYPE_INT:
+			json_object_object_add(json, name, json_object_new_int64(val.v.i));
+			break;
+		case LN_VALTYPE_DOUBLE:
+			json_object_object_add(json, name, json_object_new_double(val.v.d));
+			break;
+		case LN_VALTYPE_TIME:
+			json_object_object_add(json, name, json_object_new_int64(val.v.t));
+			break;
+		case LN_VALTYPE_IPV4:
+			json_object_object_add(json, name, json_object_new_int64(val.v.ipv4));
+			break;
+		}
+	}
+	return json;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[10*1024];
+	ln_ctx ctx;
+	ln_spans spans;
+
+	if(argc != 2 && argc != 3) {
+		fprintf(stderr, "usage: spans_value rulebase [reftime] < messages\n");
+		exit(100);
+	}
+	setlocale(LC_ALL, "");
+	if((ctx = ln_initCtx()) == NULL || (spans = ln_newSpans()) == NULL) {
+		fprintf(stderr, "could not initialize liblognorm\n");
+		exit(1);
+	}
+	if(argc == 3)
+		ln_spansSetRefTime(spans, (time_t) atoll(argv[2]));
+	if(ln_loadSamples(ctx, argv[1]) != 0) {
+		fprintf(stderr, "could not load rulebase %s\n", argv[1]);
+		exit(1);
+	}
+
+	while(fgets(buf, sizeof(buf), stdin) != NULL) {
+		size_t len = strlen(buf);
+		if(len > 0 && buf[len-1] == '\n')
+			buf[--len] = '\0';
+		if(ln_normalizeSpans(ctx, buf, len, spans) != 0) {
+			printf("{ }\n");
+			continue;
+		}
+		struct json_object *json = typedValues(spans);
+		printf("%s\n", json_object_to_json_string(json));
+		json_object_put(json);
+	}
+
+	ln_deleteSpans(spans);
+	ln_exitCtx(ctx);
+	return 0;
+}
@@ -0,0 +1,57 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+. $srcdir/exec.sh
+
+test_def $0 "typed values in span mode"
+add_rule 'version=2'
+add_rule 'rule=num:n %n:number% f %f:float% h %h:hexnumber% ip %ip:ipv4% w %w:word%'
+add_rule 'rule=date:d %d1:date-rfc5424% %d2:date-rfc3164% %d3:date-iso%'
+
+execute_values() {
+    echo "$1" | ./spans_value tmp.rulebase $2 > test.out
+    echo "Out:"
+    cat test.out
+}
+
+execute_values 'n 12345 f -3.5 h 0x1F ip 10.0.0.1 w word'
+assert_output_json_eq '{ "n": 12345, "f": -3.5, "h": 31, "ip": 167772161 }'
+
+# values that do not fit are not converted, but still parsed
+execute_values 'n 99999999999999999999 f 1. h 0xffffffffffffffff ip 255.255.255.255 w x'
+assert_output_json_eq '{ "f": 1.0, "ip": 4294967295 }'
+if grep -q -e '"n"' -e '"h"' -e '"w"' test.out; then
+    echo "non-convertible value present"
+    exit 1
+fi
+
+execute_values 'd 2016-08-15T10:20:30.123+02:00 Aug 15 2016 10:20:30: 2016-08-15'
+assert_output_json_eq '{ "d1": 1471249230, "d2": 1471256430, "d3": 1471219200 }'
+
+execute_values 'd 1970-01-01T00:00:00-01:00 jan  1 1971 00:00:00 1969-12-31'
+assert_output_json_eq '{ "d1": 3600, "d2": 31536000, "d3": -86400 }'
+
+# RFC3164 dates without year are in the year of the reference time
+# (2016-08-15 10:20:30 here), or the one before if they would be more
+# than a month after it
+add_rule 'rule=date2:y %d:date-rfc3164%'
+execute_values 'y Aug 15 10:20:30' 1471256430
+assert_output_json_eq '{ "d": 1471256430 }'
+execute_values 'y Sep 14 10:20:30' 1471256430
+assert_output_json_eq '{ "d": 1473848430 }'
+execute_values 'y Sep 16 10:20:30' 1471256430
+assert_output_json_eq '{ "d": 1442398830 }'
+# "Dec 31" received on Jan 1st 2017, 00:10:00
+execute_values 'y Dec 31 23:59:00' 1483229400
+assert_output_json_eq '{ "d": 1483228740 }'
+
+# float values do not depend on the locale's decimal point
+for loc in de_DE.UTF-8 de_DE.utf8 fr_FR.UTF-8 fr_FR.utf8; do
+    if [ "$(LC_ALL=$loc locale decimal_point 2>/dev/null)" = "," ]; then
+        export LC_ALL=$loc
+        execute_values 'n 1 f -3.5 h 0x1 ip 10.0.0.1 w word'
+        unset LC_ALL
+        assert_output_json_eq '{ "n": 1, "f": -3.5, "h": 1, "ip": 167772161 }'
+        break
+    fi
+done
+
+cleanup_tmp_files
@@ -0,0 +1,126 @@
+/* test helper for multi-threaded normalization: a number of threads
+ * normalize all messages read from stdin with ln_normalize() on the
+ * same context. Every thread must produce the same events. The events
+ * of the first thread are written to stdout, the merged usage
+ * statistics of all threads to the given file.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <json.h>
+#include <libestr.h>
+#include "liblognorm.h"
+#include "lognorm.h"
+
+#define MAXTHREADS 16
+
+static ln_ctx ctx;
+static char **msgs;
+static int nmsgs;
+
+struct thrd_data {
+	pthread_t tid;
+	char **events;		/**< JSON text of the event for each message */
+	int nerrs;
+};
+
+static void *
+worker(void *arg)
+{
+	struct thrd_data *const td = (struct thrd_data*) arg;
+	struct json_object *json;
+
+	for(int i = 0 ; i < nmsgs ; ++i) {
+		json = NULL;
+		ln_normalize(ctx, msgs[i], strlen(msgs[i]), &json);
+		if(json == NULL
+		   || (td->events[i] = strdup(json_object_to_json_string(json))) == NULL)
+			++td->nerrs;
+		if(json != NULL)
+			json_object_put(json);
+	}
+	return NULL;
+}
+
+static void
+readMsgs(void)
+{
+	char line[4096];
+	int maxmsgs = 0;
+
+	while(fgets(line, sizeof(line), stdin) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if(nmsgs == maxmsgs) {
+			maxmsgs = (maxmsgs == 0) ? 64 : 2 * maxmsgs;
+			if((msgs = realloc(msgs, maxmsgs * sizeof(char*))) == NULL)
+				exit(1);
+		}
+		if((msgs[nmsgs++] = strdup(line)) == NULL)
+			exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct thrd_data thrd[MAXTHREADS];
+	int nthreads;
+	int nerrs = 0;
+	FILE *fpStats;
+
+	if(argc != 4 || (nthreads = atoi(argv[2])) < 1 || nthreads > MAXTHREADS) {
+		fprintf(stderr, "usage: threads rulebase nthreads statsfile\n");
+		exit(100);
+	}
+	if((ctx = ln_initCtx()) == NULL) {
+		fprintf(stderr, "could not initialize liblognorm\n");
+		exit(1);
+	}
+	if(ln_loadSamples(ctx, argv[1]) != 0) {
+		fprintf(stderr, "could not load rulebase %s\n", argv[1]);
+		exit(1);
+	}
+	readMsgs();
+
+	for(int i = 0 ; i < nthreads ; ++i) {
+		thrd[i].nerrs = 0;
+		if((thrd[i].events = calloc(nmsgs + 1, sizeof(char*))) == NULL)
+			exit(1);
+		pthread_create(&thrd[i].tid, NULL, worker, thrd + i);
+	}
+	for(int i = 0 ; i < nthreads ; ++i) {
+		pthread_join(thrd[i].tid, NULL);
+		nerrs += thrd[i].nerrs;
+	}
+
+	for(int i = 0 ; i < nmsgs ; ++i) {
+		for(int j = 1 ; j < nthreads ; ++j) {
+			if(thrd[0].events[i] == NULL || thrd[j].events[i] == NULL
+			   || strcmp(thrd[0].events[i], thrd[j].events[i])) {
+				fprintf(stderr, "threads: thread %d: event for '%s' differs\n",
+					j, msgs[i]);
+				++nerrs;
+			}
+		}
+		printf("%s\n", thrd[0].events[i] == NULL ? "" : thrd[0].events[i]);
+	}
+
+	if((fpStats = fopen(argv[3], "w")) == NULL) {
+		perror(argv[3]);
+		exit(1);
+	}
+	ln_fullPdagStats(ctx, fpStats, 1);
+	fclose(fpStats);
+
+	for(int i = 0 ; i < nthreads ; ++i) {
+		for(int j = 0 ; j < nmsgs ; ++j)
+			free(thrd[i].events[j]);
+		free(thrd[i].events);
+	}
+	for(int i = 0 ; i < nmsgs ; ++i)
+		free(msgs[i]);
+	free(msgs);
+	ln_exitCtx(ctx);
+	return nerrs == 0 ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+# This file is part of the liblognorm project, released under ASL 2.0
+
+. $srcdir/exec.sh
+
+test_def $0 "inlining of small user-defined types"
+add_rule 'version=2'
+add_rule 'type=@num:%..:number%'
+add_rule 'type=@word:%w:word%'
+add_rule 'type=@sep:--'
+add_rule 'type=@lit:%..:literal{"text":"abc"}%'
+add_rule 'type=@nested:%..:@num%'
+add_rule 'type=@two:%..:number%-%..:number%'
+add_rule 'rule=:A %a:@num% %b:@word% %-:@num% %.:@num% %.:@word%'
+add_rule 'rule=:B %a:@num%%-:@sep%%b:@num%%.:@sep%rest'
+add_rule 'rule=:C %a:@lit% %b:@nested% %c:@two%'
+# further types make the type table grow while it is in use
+for i in $(seq 1 50); do
+	add_rule "type=@t$i:%..:word%"
+done
+add_rule 'rule=:D %a:@nested% %b:@t1% %c:@t50%'
+
+execute 'A 1 w1 2 3 w2'
+assert_output_json_eq '{ "w": "w2", "..": "3", "b": { "w": "w1" }, "a": "1" }'
+
+execute 'B 5--6--rest'
+assert_output_json_eq '{ "b": "6", "a": "5" }'
+
+execute 'B 5 6--rest'
+assert_output_json_eq '{ "originalmsg": "B 5 6--rest", "unparsed-data": " 6--rest" }'
+
+execute 'C abc 7 1-2'
+assert_output_json_eq '{ "c": "1", "b": "7", "a": "abc" }'
+
+execute 'C abd 7 1-2'
+assert_output_json_eq '{ "originalmsg": "C abd 7 1-2", "unparsed-data": "abd 7 1-2" }'
+
+execute 'D 1 x y'
+assert_output_json_eq '{ "c": "y", "b": "x", "a": "1" }'
+
+# inlined calls still show up as type calls in the rule mockup
+export ln_opts=-oaddRule
+execute 'C abc 7 1-2'
+assert_output_contains '"mockup": "C %a:USER-DEFINED% %b:USER-DEFINED% %c:USER-DEFINED%"'
+export ln_opts=
+
+# a rule base loaded later may extend inlined types, even if they
+# have been inlined into other types (@nested). It must not matter
+# whether the first rule base comes from a cache.
+reset_rules usrdef_ext
+add_rule 'version=2' usrdef_ext
+add_rule 'type=@num:%..:ipv4%' usrdef_ext
+add_rule 'rule=:E %a:@num%' usrdef_ext
+rm -f usrdef_inline.cache
+for i in 1 2 3; do
+	echo 'C abc 1.2.3.4 1-2' | $cmd -oaddRule -C usrdef_inline.cache \
+		-r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+	echo "Out:"
+	cat test.out
+	assert_output_json_eq '{ "c": "1", "b": "1.2.3.4", "a": "abc", "metadata": { "rule": { "mockup": "C %a:USER-DEFINED% %b:USER-DEFINED% %c:USER-DEFINED%" } } }'
+done
+
+echo 'A 1.2.3.4 w1 2 3 w2' | $cmd -r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+assert_output_json_eq '{ "w": "w2", "..": "3", "b": { "w": "w1" }, "a": "1.2.3.4" }'
+
+echo 'E 5' | $cmd -r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+assert_output_json_eq '{ "a": "5" }'
+
+# without it, the types are still inlined
+execute 'C abc 1.2.3.4 1-2'
+assert_output_json_eq '{ "originalmsg": "C abc 1.2.3.4 1-2", "unparsed-data": ".2.3.4 1-2" }'
+rm -f usrdef_inline.cache
+
+# a parser equal to an inlined call must not be merged with it, else it
+# would become a call of the type once that is extended
+reset_rules
+add_rule 'version=2'
+add_rule 'type=@t:%..:number%'
+add_rule 'rule=:F %x:@t%'
+reset_rules usrdef_ext
+add_rule 'version=2' usrdef_ext
+add_rule 'rule=:F %x:number% bar' usrdef_ext
+add_rule 'type=@t:%..:word%' usrdef_ext
+
+echo 'F 5 bar' | $cmd -r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+assert_output_json_eq '{ "x": "5" }'
+
+echo 'F abc' | $cmd -r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+assert_output_json_eq '{ "x": "abc" }'
+
+echo 'F abc bar' | $cmd -r tmp.rulebase -r usrdef_ext.rulebase -e json > test.out
+assert_output_contains '"unparsed-data"'
+
+cleanup_tmp_files